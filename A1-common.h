@@ -5,6 +5,8 @@
 #include <stdbool.h>
 #include <stdint.h>
 
+#include "spi-context.h"
+
 /********** work queue */
 struct work_ent {
 	struct work *work;
@@ -31,11 +33,7 @@ struct work_queue {
 struct A1_chip {
 	int num_cores;
 	int last_queued_id;
-	struct work *work[4];
-	/* stats */
-	int hw_errors;
-	int stales;
-	int nonces_found;
+	/* stats, nonce counts are kept by the nonce pipeline */
 	int nonce_ranges_done;
 
 	/* systime in ms when chip was disabled */
@@ -60,6 +58,14 @@ struct A1_chain {
 	struct A1_chip *chips;
 	pthread_mutex_t lock;
 
+	/* jobs queued for the whole chain, written in one SPI batch */
+	struct spi_batch job_batch;
+	uint8_t *job_tx;
+	uint8_t *job_rx;
+	uint8_t job_chip[MAX_CHAIN_LENGTH];
+	struct work *job_work[MAX_CHAIN_LENGTH];
+	int num_jobs;
+
 	struct work_queue active_wq;
 
 	/* mark chain disabled, do not try to re-enable it */
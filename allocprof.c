@@ -0,0 +1,377 @@
+/*
+ * Copyright 2026 Andrew Smith
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 3 of the License, or (at your option)
+ * any later version.  See COPYING for more details.
+ */
+
+/* Allocation profiler.
+ *
+ * When turned on, cgmalloc, cgcalloc and cgrealloc record each allocation
+ * against their call site and the free() wrapper in miner.h looks the pointer
+ * up again, so live bytes and counts are kept per site. Pointers are kept in
+ * a side table rather than a header on each block since free() is used on
+ * cg allocated and plain malloc, strdup or jansson memory alike, and frees of
+ * pointers that aren't in the table are simply ignored. The table is split
+ * into shards by pointer hash, each an open addressed table under its own
+ * mutex, and sites live in a fixed table like lockprof.c's that is read
+ * without a lock with all site counters updated with atomics.
+ * A tracked pointer freed where free() isn't wrapped, such as inside a
+ * library, stays live until its address is handed out again.
+ * When it's off the cost is a test of opt_alloc_stats per allocation and
+ * free. Nothing here may use the cg allocators, the free() wrapper, the lock
+ * wrappers or applog while holding a shard lock. */
+
+#include "miner.h"
+#include "allocprof.h"
+
+#define ALLOCPROF_SITES 2048
+#define ALLOCPROF_SHARDS 64
+/* Starting table size of a shard, it doubles when half full */
+#define ALLOCPROF_PTRS 64
+
+bool opt_alloc_stats;
+int opt_alloc_stats_log = ALLOCPROF_LOG;
+
+struct allocprof_ptr {
+	void *ptr;		// NULL if the slot is empty
+	size_t size;
+	struct allocprof_site *site;
+};
+
+struct allocprof_shard {
+	pthread_mutex_t lock;
+	struct allocprof_ptr *ptrs;
+	size_t size;		// A power of 2, or 0 until first used
+	size_t count;
+};
+
+static struct allocprof_site allocprof_sites[ALLOCPROF_SITES];
+static pthread_mutex_t allocprof_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct allocprof_shard allocprof_shards[ALLOCPROF_SHARDS] = {
+	[0 ... ALLOCPROF_SHARDS - 1] = { .lock = PTHREAD_MUTEX_INITIALIZER }
+};
+static struct timeval allocprof_start, allocprof_logged;
+
+/* The low bits pick the shard and the rest the slot in it */
+static inline size_t allocprof_hash(const void *ptr)
+{
+	size_t h = (uintptr_t)ptr >> 3;
+
+	h ^= h >> 15;
+	return h * 2654435761U;
+}
+
+#define ALLOCPROF_SHARD(_h) (&allocprof_shards[(_h) & (ALLOCPROF_SHARDS - 1)])
+#define ALLOCPROF_HOME(_h, _shard) (((_h) >> 6) & ((_shard)->size - 1))
+
+/* Find or add the site, NULL if the table is full */
+static struct allocprof_site *allocprof_site(const char *file, const char *func, const int line)
+{
+	unsigned int h = ((uintptr_t)file >> 3) * 31 + line * 7;
+	struct allocprof_site *site;
+	const char *f;
+	int n;
+
+	for (n = 0; n < ALLOCPROF_SITES; n++) {
+		site = &allocprof_sites[(h + n) & (ALLOCPROF_SITES - 1)];
+		f = __atomic_load_n(&site->file, __ATOMIC_ACQUIRE);
+		if (!f)
+			break;
+		if (f == file && site->line == line)
+			return site;
+	}
+
+	pthread_mutex_lock(&allocprof_lock);
+	for (n = 0; n < ALLOCPROF_SITES; n++) {
+		site = &allocprof_sites[(h + n) & (ALLOCPROF_SITES - 1)];
+		if (!site->file) {
+			site->func = func;
+			site->line = line;
+			__atomic_store_n(&site->file, file, __ATOMIC_RELEASE);
+			break;
+		}
+		if (site->file == file && site->line == line)
+			break;
+	}
+	pthread_mutex_unlock(&allocprof_lock);
+
+	return n < ALLOCPROF_SITES ? site : NULL;
+}
+
+/* The slot holding ptr, or the empty slot it would go in */
+static size_t allocprof_slot(struct allocprof_shard *shard, const void *ptr, size_t h)
+{
+	size_t i = ALLOCPROF_HOME(h, shard);
+
+	while (shard->ptrs[i].ptr && shard->ptrs[i].ptr != ptr)
+		i = (i + 1) & (shard->size - 1);
+	return i;
+}
+
+/* Double the shard's table, or give it its first one, false if there's no
+ * memory for it */
+static bool allocprof_grow(struct allocprof_shard *shard)
+{
+	struct allocprof_ptr *old = shard->ptrs;
+	size_t i, oldsize = shard->size;
+
+	shard->size = oldsize ? oldsize * 2 : ALLOCPROF_PTRS;
+	shard->ptrs = calloc(shard->size, sizeof(*shard->ptrs));
+	if (unlikely(!shard->ptrs)) {
+		shard->ptrs = old;
+		shard->size = oldsize;
+		return false;
+	}
+	for (i = 0; i < oldsize; i++) {
+		if (old[i].ptr)
+			shard->ptrs[allocprof_slot(shard, old[i].ptr, allocprof_hash(old[i].ptr))] = old[i];
+	}
+	(free)(old);
+	return true;
+}
+
+/* Empty slot i, moving back any later entries that can then be found sooner
+ * so lookups never need tombstones */
+static void allocprof_remove(struct allocprof_shard *shard, size_t i)
+{
+	size_t mask = shard->size - 1, j = i, home;
+
+	while (42) {
+		j = (j + 1) & mask;
+		if (!shard->ptrs[j].ptr)
+			break;
+		home = ALLOCPROF_HOME(allocprof_hash(shard->ptrs[j].ptr), shard);
+		if (((j - home) & mask) >= ((j - i) & mask)) {
+			shard->ptrs[i] = shard->ptrs[j];
+			i = j;
+		}
+	}
+	shard->ptrs[i].ptr = NULL;
+	shard->count--;
+}
+
+static void allocprof_site_free(struct allocprof_site *site, size_t size)
+{
+	__atomic_add_fetch(&site->frees, 1, __ATOMIC_RELAXED);
+	__atomic_sub_fetch(&site->live_count, 1, __ATOMIC_RELAXED);
+	__atomic_sub_fetch(&site->live, size, __ATOMIC_RELAXED);
+}
+
+/* Called by the cg allocators with each new allocation */
+void allocprof_add(void *ptr, size_t size, const char *file, const char *func, const int line)
+{
+	struct allocprof_shard *shard;
+	struct allocprof_site *site;
+	struct allocprof_ptr *slot;
+	size_t h;
+	uint64_t live;
+
+	site = allocprof_site(file, func, line);
+	if (unlikely(!site))
+		return;
+
+	h = allocprof_hash(ptr);
+	shard = ALLOCPROF_SHARD(h);
+	pthread_mutex_lock(&shard->lock);
+	/* Checked again under the lock so nothing is added once
+	 * allocprof_enable(false) has emptied the shard */
+	if (unlikely(!opt_alloc_stats))
+		goto out;
+	if (unlikely((shard->count + 1) * 2 > shard->size) && !allocprof_grow(shard))
+		goto out;
+
+	slot = &shard->ptrs[allocprof_slot(shard, ptr, h)];
+	if (unlikely(slot->ptr)) {
+		/* Freed somewhere we couldn't see, and now reused */
+		allocprof_site_free(slot->site, slot->size);
+	} else
+		shard->count++;
+	slot->ptr = ptr;
+	slot->size = size;
+	slot->site = site;
+
+	__atomic_add_fetch(&site->allocs, 1, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&site->bytes, size, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&site->live_count, 1, __ATOMIC_RELAXED);
+	live = __atomic_add_fetch(&site->live, size, __ATOMIC_RELAXED);
+	atomic_max64(&site->live_max, live);
+out:
+	pthread_mutex_unlock(&shard->lock);
+}
+
+/* Called by the free() wrapper, and by cgrealloc before it reallocs, for
+ * every non NULL pointer */
+void allocprof_del(void *ptr)
+{
+	struct allocprof_shard *shard;
+	size_t h, i;
+
+	h = allocprof_hash(ptr);
+	shard = ALLOCPROF_SHARD(h);
+	pthread_mutex_lock(&shard->lock);
+	if (shard->count) {
+		i = allocprof_slot(shard, ptr, h);
+		if (shard->ptrs[i].ptr) {
+			allocprof_site_free(shard->ptrs[i].site, shard->ptrs[i].size);
+			allocprof_remove(shard, i);
+		}
+	}
+	pthread_mutex_unlock(&shard->lock);
+}
+
+static void allocprof_zero(struct allocprof_site *site, bool live)
+{
+	__atomic_store_n(&site->allocs, 0, __ATOMIC_RELAXED);
+	__atomic_store_n(&site->frees, 0, __ATOMIC_RELAXED);
+	__atomic_store_n(&site->bytes, 0, __ATOMIC_RELAXED);
+	site->log_allocs = 0;
+	if (live) {
+		__atomic_store_n(&site->live, 0, __ATOMIC_RELAXED);
+		__atomic_store_n(&site->live_count, 0, __ATOMIC_RELAXED);
+	}
+	__atomic_store_n(&site->live_max, __atomic_load_n(&site->live, __ATOMIC_RELAXED),
+			 __ATOMIC_RELAXED);
+	site->log_live = __atomic_load_n(&site->live, __ATOMIC_RELAXED);
+}
+
+/* Turning it off forgets every pointer, and all the stats, since frees won't
+ * be seen any more. Turning it on starts counting from empty. */
+void allocprof_enable(bool on)
+{
+	struct allocprof_shard *shard;
+	int i;
+
+	if (on) {
+		cgtime(&allocprof_start);
+		copy_time(&allocprof_logged, &allocprof_start);
+		opt_alloc_stats = true;
+		return;
+	}
+
+	opt_alloc_stats = false;
+	for (i = 0; i < ALLOCPROF_SHARDS; i++) {
+		shard = &allocprof_shards[i];
+		pthread_mutex_lock(&shard->lock);
+		(free)(shard->ptrs);
+		shard->ptrs = NULL;
+		shard->size = shard->count = 0;
+		pthread_mutex_unlock(&shard->lock);
+	}
+	for (i = 0; i < ALLOCPROF_SITES; i++)
+		allocprof_zero(&allocprof_sites[i], true);
+}
+
+/* Zero the counters but keep what's live, so it races harmlessly with
+ * updates */
+void allocprof_reset(void)
+{
+	int i;
+
+	for (i = 0; i < ALLOCPROF_SITES; i++)
+		allocprof_zero(&allocprof_sites[i], false);
+	cgtime(&allocprof_start);
+	copy_time(&allocprof_logged, &allocprof_start);
+}
+
+static int allocprof_cmp(const void *a, const void *b)
+{
+	const struct allocprof_site *sa = a, *sb = b;
+
+	if (sa->live != sb->live)
+		return sa->live < sb->live ? 1 : -1;
+	return sa->allocs < sb->allocs ? 1 : (sa->allocs > sb->allocs ? -1 : 0);
+}
+
+/* Copy every site with anything to show into *sites, which the caller frees,
+ * most live bytes first, and fill in totals. Returns how many there are. */
+int allocprof_snapshot(struct allocprof_site **sites, struct allocprof_totals *totals)
+{
+	struct allocprof_site *site, *copy;
+	struct timeval now;
+	int i, count = 0;
+
+	memset(totals, 0, sizeof(*totals));
+	/* Not cgcalloc, so the profiler doesn't show up in its own stats */
+	*sites = calloc(ALLOCPROF_SITES, sizeof(**sites));
+	if (unlikely(!*sites))
+		quit(1, "Failed to calloc allocprof snapshot");
+	for (i = 0; i < ALLOCPROF_SITES; i++) {
+		site = &allocprof_sites[i];
+		if (!__atomic_load_n(&site->file, __ATOMIC_ACQUIRE))
+			continue;
+
+		copy = &(*sites)[count];
+		copy->file = site->file;
+		copy->func = site->func;
+		copy->line = site->line;
+		copy->allocs = __atomic_load_n(&site->allocs, __ATOMIC_RELAXED);
+		copy->frees = __atomic_load_n(&site->frees, __ATOMIC_RELAXED);
+		copy->bytes = __atomic_load_n(&site->bytes, __ATOMIC_RELAXED);
+		copy->live = __atomic_load_n(&site->live, __ATOMIC_RELAXED);
+		copy->live_count = __atomic_load_n(&site->live_count, __ATOMIC_RELAXED);
+		copy->live_max = __atomic_load_n(&site->live_max, __ATOMIC_RELAXED);
+		copy->log_live = site->log_live;
+		copy->log_allocs = site->log_allocs;
+		if (!copy->allocs && !copy->live_count)
+			continue;
+
+		totals->live += copy->live;
+		totals->live_count += copy->live_count;
+		totals->allocs += copy->allocs;
+		totals->frees += copy->frees;
+		count++;
+	}
+	qsort(*sites, count, sizeof(**sites), allocprof_cmp);
+
+	totals->sites = count;
+	for (i = 0; i < ALLOCPROF_SHARDS; i++)
+		totals->table_bytes += (uint64_t)__atomic_load_n(&allocprof_shards[i].size, __ATOMIC_RELAXED) *
+				       sizeof(struct allocprof_ptr);
+	cgtime(&now);
+	totals->elapsed = tdiff(&now, &allocprof_start);
+
+	return count;
+}
+
+/* Called from the watchdog to log the sites holding most memory every
+ * --alloc-stats-log seconds, with their growth and allocation rate since the
+ * last log */
+void allocprof_log(struct timeval *now)
+{
+	struct allocprof_site *sites, *site, *real;
+	struct allocprof_totals totals;
+	double secs;
+	int i, count;
+
+	if (!opt_alloc_stats || opt_alloc_stats_log <= 0)
+		return;
+	secs = tdiff(now, &allocprof_logged);
+	if (secs < opt_alloc_stats_log)
+		return;
+	copy_time(&allocprof_logged, now);
+
+	count = allocprof_snapshot(&sites, &totals);
+	applog(LOG_NOTICE, "Alloc stats: %"PRIu64" bytes live in %"PRIu64" allocations from %d sites, "
+	       "%.1f allocs/s, table %"PRIu64" bytes", totals.live, totals.live_count, totals.sites,
+	       totals.elapsed > 0 ? (double)totals.allocs / totals.elapsed : 0, totals.table_bytes);
+	for (i = 0; i < count && i < ALLOCPROF_LOG_SITES; i++) {
+		site = &sites[i];
+		applog(LOG_NOTICE, " %s:%d %s() %"PRIu64" bytes live %+"PRId64" in %"PRIu64
+		       " allocations, %.1f allocs/s", site->file, site->line, site->func, site->live,
+		       (int64_t)(site->live - site->log_live), site->live_count,
+		       (double)(site->allocs - site->log_allocs) / secs);
+	}
+
+	/* Only this thread touches the log_ fields, except a reset zeroing them */
+	for (i = 0; i < count; i++) {
+		real = allocprof_site(sites[i].file, sites[i].func, sites[i].line);
+		if (likely(real)) {
+			real->log_live = sites[i].live;
+			real->log_allocs = sites[i].allocs;
+		}
+	}
+	free(sites);
+}
@@ -0,0 +1,52 @@
+/*
+ * Copyright 2026 Andrew Smith
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 3 of the License, or (at your option)
+ * any later version.  See COPYING for more details.
+ */
+
+#ifndef ALLOCPROF_H
+#define ALLOCPROF_H
+
+#include "miner.h"
+
+#define ALLOCPROF_LOG 600
+/* Sites in the periodic log */
+#define ALLOCPROF_LOG_SITES 10
+
+/* Stats for one cgmalloc/cgcalloc/cgrealloc call site */
+struct allocprof_site {
+	const char *file;	// NULL if the slot is free, published last
+	const char *func;
+	int line;
+	uint64_t allocs;	// Including reallocs
+	uint64_t frees;		// Including reallocs away from here
+	uint64_t bytes;
+	uint64_t live;		// Bytes allocated here not yet freed
+	uint64_t live_count;
+	uint64_t live_max;
+	uint64_t log_live;	// live and allocs at the last periodic log
+	uint64_t log_allocs;
+};
+
+/* Totals over all sites */
+struct allocprof_totals {
+	int sites;
+	uint64_t live;
+	uint64_t live_count;
+	uint64_t allocs;
+	uint64_t frees;
+	uint64_t table_bytes;	// The profiler's own pointer table
+	double elapsed;		// Seconds since turned on or reset
+};
+
+extern int opt_alloc_stats_log;
+
+extern void allocprof_enable(bool on);
+extern int allocprof_snapshot(struct allocprof_site **sites, struct allocprof_totals *totals);
+extern void allocprof_reset(void);
+extern void allocprof_log(struct timeval *now);
+
+#endif /* ALLOCPROF_H */
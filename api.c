@@ -25,6 +25,12 @@
 #include "miner.h"
 #include "util.h"
 #include "klist.h"
+#include "noncepipe.h"
+#include "jobslot.h"
+#include "lockprof.h"
+#include "allocprof.h"
+#include "history.h"
+#include "chipstat.h"
 
 #if defined(USE_BFLSC) || defined(USE_AVALON) || defined(USE_AVALON2) || defined(USE_AVALON4) || \
   defined(USE_HASHFAST) || defined(USE_BITFURY) || defined(USE_BITFURY16) || defined(USE_BLOCKERUPTER) || defined(USE_KLONDIKE) || \
@@ -141,7 +147,7 @@ static const char SEPARATOR = '|';
 #define JOIN_CMD "CMD="
 #define BETWEEN_JOIN SEPSTR
 
-static const char *APIVERSION = "3.7";
+static const char *APIVERSION = "3.8";
 static const char *DEAD = "Dead";
 #if defined(HAVE_AN_ASIC) || defined(HAVE_AN_FPGA)
 static const char *SICK = "Sick";
@@ -286,6 +292,10 @@ static const char *OSINFO =
 #define _SETCONFIG	"SETCONFIG"
 #define _USBSTATS	"USBSTATS"
 #define _LCD		"LCD"
+#define _LOCKSTATS	"LOCKSTATS"
+#define _HISTORY	"HISTORY"
+#define _CHIPS		"CHIPS"
+#define _ALLOCSTATS	"ALLOCSTATS"
 
 static const char ISJSON = '{';
 #define JSON0		"{"
@@ -330,6 +340,10 @@ static const char ISJSON = '{';
 #define JSON_SETCONFIG	JSON1 _SETCONFIG JSON2
 #define JSON_USBSTATS	JSON1 _USBSTATS JSON2
 #define JSON_LCD	JSON1 _LCD JSON2
+#define JSON_LOCKSTATS	JSON1 _LOCKSTATS JSON2
+#define JSON_HISTORY	JSON1 _HISTORY JSON2
+#define JSON_CHIPS	JSON1 _CHIPS JSON2
+#define JSON_ALLOCSTATS	JSON1 _ALLOCSTATS JSON2
 #define JSON_END	JSON4 JSON5
 #define JSON_END_TRUNCATED	JSON4_TRUNCATED JSON5
 #define JSON_BETWEEN_JOIN	","
@@ -463,6 +477,24 @@ static const char *JSON_PARAMETER = "parameter";
 
 #define MSG_DEPRECATED 127
 
+#define MSG_LOCKSET 128
+#define MSG_LOCKINV 129
+
+#define MSG_HPLGEVT 130
+#define MSG_INVHPLGEVT 131
+
+#define MSG_HISTORY 132
+#define MSG_HISTOFF 133
+#define MSG_INVHIST 134
+
+#define MSG_CHIPS 135
+#define MSG_INVCHIPS 136
+
+#define MSG_ALLOCOK 137
+#define MSG_ALLOCDIS 138
+#define MSG_ALLOCSET 139
+#define MSG_ALLOCINV 140
+
 enum code_severity {
 	SEVERITY_ERR,
 	SEVERITY_WARN,
@@ -629,8 +661,21 @@ struct CODES {
  { SEVERITY_ERR,   MSG_ASCSETERR, PARAM_BOTH,	"ASC %d set failed: %s" },
 #endif
  { SEVERITY_SUCC,  MSG_LCD,	PARAM_NONE,	"LCD" },
- { SEVERITY_SUCC,  MSG_LOCKOK,	PARAM_NONE,	"Lock stats created" },
+ { SEVERITY_SUCC,  MSG_LOCKOK,	PARAM_NONE,	"Lock stats" },
  { SEVERITY_WARN,  MSG_LOCKDIS,	PARAM_NONE,	"Lock stats not enabled" },
+ { SEVERITY_SUCC,  MSG_LOCKSET,	PARAM_STR,	"Lock stats %s" },
+ { SEVERITY_ERR,   MSG_LOCKINV,	PARAM_STR,	"Invalid lockstats option '%s' - use on, off or reset" },
+ { SEVERITY_SUCC,  MSG_HPLGEVT,	PARAM_STR,	"Hotplug event '%s' queued" },
+ { SEVERITY_ERR,   MSG_INVHPLGEVT, PARAM_STR,	"Invalid hotplug event '%s' - use arrive:BUS:ADDR or leave:BUS:ADDR for a device on the bus, with hotplug events in use" },
+ { SEVERITY_SUCC,  MSG_HISTORY,	PARAM_NONE,	"History" },
+ { SEVERITY_WARN,  MSG_HISTOFF,	PARAM_NONE,	"History not enabled" },
+ { SEVERITY_ERR,   MSG_INVHIST,	PARAM_STR,	"Invalid history parameter '%s' - use TIER[,SINCE] with TIER 0..2" },
+ { SEVERITY_SUCC,  MSG_CHIPS,	PARAM_NONE,	"Chips" },
+ { SEVERITY_ERR,   MSG_INVCHIPS,	PARAM_STR,	"Invalid chips parameter '%s' - use [N][,delta] with N a device number" },
+ { SEVERITY_SUCC,  MSG_ALLOCOK,	PARAM_NONE,	"Alloc stats" },
+ { SEVERITY_WARN,  MSG_ALLOCDIS,	PARAM_NONE,	"Alloc stats not enabled" },
+ { SEVERITY_SUCC,  MSG_ALLOCSET,	PARAM_STR,	"Alloc stats %s" },
+ { SEVERITY_ERR,   MSG_ALLOCINV,	PARAM_STR,	"Invalid allocstats option '%s' - use on, off or reset" },
  { SEVERITY_FAIL, 0, 0, NULL }
 };
 
@@ -1561,393 +1606,144 @@ static void message(struct io_data *io_data, int messageid, int paramid, char *p
 		io_add(io_data, JSON_CLOSE);
 }
 
-#if LOCK_TRACKING
-
-#define LOCK_FMT_FFL " - called from %s %s():%d"
-
-#define LOCKMSG(fmt, ...)	fprintf(stderr, "APILOCK: " fmt "\n", ##__VA_ARGS__)
-#define LOCKMSGMORE(fmt, ...)	fprintf(stderr, "          " fmt "\n", ##__VA_ARGS__)
-#define LOCKMSGFFL(fmt, ...) fprintf(stderr, "APILOCK: " fmt LOCK_FMT_FFL "\n", ##__VA_ARGS__, file, func, linenum)
-#define LOCKMSGFLUSH() fflush(stderr)
-
-typedef struct lockstat {
-	uint64_t lock_id;
-	const char *file;
-	const char *func;
-	int linenum;
-	struct timeval tv;
-} LOCKSTAT;
-
-typedef struct lockline {
-	struct lockline *prev;
-	struct lockstat *stat;
-	struct lockline *next;
-} LOCKLINE;
-
-typedef struct lockinfo {
-	void *lock;
-	enum cglock_typ typ;
-	const char *file;
-	const char *func;
-	int linenum;
-	uint64_t gets;
-	uint64_t gots;
-	uint64_t tries;
-	uint64_t dids;
-	uint64_t didnts; // should be tries - dids
-	uint64_t unlocks;
-	LOCKSTAT lastgot;
-	LOCKLINE *lockgets;
-	LOCKLINE *locktries;
-} LOCKINFO;
-
-typedef struct locklist {
-	LOCKINFO *info;
-	struct locklist *next;
-} LOCKLIST;
-
-static uint64_t lock_id = 1;
-
-static LOCKLIST *lockhead;
-
-static void lockmsgnow()
-{
-	struct timeval now;
-	struct tm *tm;
-	time_t dt;
-
-	cgtime(&now);
-
-	dt = now.tv_sec;
-	tm = localtime(&dt);
-
-	LOCKMSG("%d-%02d-%02d %02d:%02d:%02d",
-		tm->tm_year + 1900,
-		tm->tm_mon + 1,
-		tm->tm_mday,
-		tm->tm_hour,
-		tm->tm_min,
-		tm->tm_sec);
-}
-
-static LOCKLIST *newlock(void *lock, enum cglock_typ typ, const char *file, const char *func, const int linenum)
+static void lockstats(struct io_data *io_data, __maybe_unused SOCKETTYPE c, char *param, bool isjson, __maybe_unused char group)
 {
-	LOCKLIST *list;
-
-	list = cgcalloc(1, sizeof(*list));
-	list->info = cgcalloc(1, sizeof(*(list->info)));
-	list->next = lockhead;
-	lockhead = list;
-
-	list->info->lock = lock;
-	list->info->typ = typ;
-	list->info->file = file;
-	list->info->func = func;
-	list->info->linenum = linenum;
-
-	return list;
-}
-
-static LOCKINFO *findlock(void *lock, enum cglock_typ typ, const char *file, const char *func, const int linenum)
-{
-	LOCKLIST *look;
-
-	look = lockhead;
-	while (look) {
-		if (look->info->lock == lock)
-			break;
-		look = look->next;
+	struct api_data *root = NULL;
+	struct lockprof_site *sites, *site;
+	bool io_open = false;
+	char buf[256];
+	int i, b, count;
+
+	if (param && *param) {
+		if (strcasecmp(param, "on") == 0)
+			opt_lock_stats = true;
+		else if (strcasecmp(param, "off") == 0)
+			opt_lock_stats = false;
+		else if (strcasecmp(param, "reset") == 0)
+			lockprof_reset();
+		else {
+			message(io_data, MSG_LOCKINV, 0, param, isjson);
+			return;
+		}
+		message(io_data, MSG_LOCKSET, 0, param, isjson);
+		return;
 	}
 
-	if (!look)
-		look = newlock(lock, typ, file, func, linenum);
-
-	return look->info;
-}
-
-static void addgettry(LOCKINFO *info, uint64_t id, const char *file, const char *func, const int linenum, bool get)
-{
-	LOCKSTAT *stat;
-	LOCKLINE *line;
-
-	stat = cgcalloc(1, sizeof(*stat));
-	line = cgcalloc(1, sizeof(*line));
-
-	if (get)
-		info->gets++;
-	else
-		info->tries++;
-
-	stat->lock_id = id;
-	stat->file = file;
-	stat->func = func;
-	stat->linenum = linenum;
-	cgtime(&stat->tv);
+	message(io_data, opt_lock_stats ? MSG_LOCKOK : MSG_LOCKDIS, 0, NULL, isjson);
 
-	line->stat = stat;
+	if (isjson)
+		io_open = io_add(io_data, COMSTR JSON_LOCKSTATS);
+
+	count = lockprof_snapshot(&sites);
+	for (i = 0; i < count; i++) {
+		site = &sites[i];
+
+		root = api_add_int(root, "LOCKSTATS", &i, true);
+		snprintf(buf, sizeof(buf), "%s:%d", site->file, site->line);
+		root = api_add_string(root, "Site", buf, true);
+		root = api_add_string(root, "Func", (char *)(site->func), true);
+		root = api_add_const(root, "Type", lockprof_typ_str(site->typ), false);
+		snprintf(buf, sizeof(buf), "%p", site->lock);
+		root = api_add_string(root, "Lock", buf, true);
+		root = api_add_uint64(root, "Contended", &(site->contended), true);
+		root = api_add_uint64(root, "Try Fails", &(site->tryfails), true);
+		double wait_avg = site->contended ? (double)(site->wait_us) / (double)(site->contended) : 0;
+		root = api_add_double(root, "Wait Avg us", &wait_avg, true);
+		root = api_add_uint64(root, "Wait Max us", &(site->wait_max_us), true);
+		for (b = 0; b < LOCKPROF_BUCKETS; b++) {
+			snprintf(buf, sizeof(buf), "Wait %s", lockprof_bucket_str(b));
+			root = api_add_uint64(root, buf, &(site->wait_hist[b]), true);
+		}
+		root = api_add_uint64(root, "Holds", &(site->holds), true);
+		double hold_avg = site->holds ? (double)(site->hold_us) / (double)(site->holds) : 0;
+		root = api_add_double(root, "Hold Avg us", &hold_avg, true);
+		root = api_add_uint64(root, "Hold Max us", &(site->hold_max_us), true);
 
-	if (get) {
-		line->next = info->lockgets;
-		if (info->lockgets)
-			info->lockgets->prev = line;
-		info->lockgets = line;
-	} else {
-		line->next = info->locktries;
-		if (info->locktries)
-			info->locktries->prev = line;
-		info->locktries = line;
+		root = print_data(io_data, root, isjson, isjson && (i > 0));
 	}
+	free(sites);
+
+	if (isjson && io_open)
+		io_close(io_data);
 }
 
-static void markgotdid(LOCKINFO *info, uint64_t id, const char *file, const char *func, const int linenum, bool got, int ret)
+static void allocstats(struct io_data *io_data, __maybe_unused SOCKETTYPE c, char *param, bool isjson, __maybe_unused char group)
 {
-	LOCKLINE *line;
-
-	if (got)
-		info->gots++;
-	else {
-		if (ret == 0)
-			info->dids++;
-		else
-			info->didnts++;
-	}
-
-	if (got || ret == 0) {
-		info->lastgot.lock_id = id;
-		info->lastgot.file = file;
-		info->lastgot.func = func;
-		info->lastgot.linenum = linenum;
-		cgtime(&info->lastgot.tv);
-	}
-
-	if (got)
-		line = info->lockgets;
-	else
-		line = info->locktries;
-	while (line) {
-		if (line->stat->lock_id == id)
-			break;
-		line = line->next;
-	}
-
-	if (!line) {
-		lockmsgnow();
-		LOCKMSGFFL("ERROR attempt to mark a lock as '%s' that wasn't '%s' id=%"PRIu64,
-				got ? "got" : "did/didnt", got ? "get" : "try", id);
+	struct api_data *root = NULL;
+	struct allocprof_site *sites, *site;
+	struct allocprof_totals totals;
+	bool io_open = false;
+	char buf[256];
+	int i, count;
+
+	if (param && *param) {
+		if (strcasecmp(param, "on") == 0) {
+			if (!opt_alloc_stats)
+				allocprof_enable(true);
+		} else if (strcasecmp(param, "off") == 0) {
+			if (opt_alloc_stats)
+				allocprof_enable(false);
+		} else if (strcasecmp(param, "reset") == 0)
+			allocprof_reset();
+		else {
+			message(io_data, MSG_ALLOCINV, 0, param, isjson);
+			return;
+		}
+		message(io_data, MSG_ALLOCSET, 0, param, isjson);
+		return;
 	}
 
-	// Unlink it
-	if (line->prev)
-		line->prev->next = line->next;
-	if (line->next)
-		line->next->prev = line->prev;
-
-	if (got) {
-		if (info->lockgets == line)
-			info->lockgets = line->next;
-	} else {
-		if (info->locktries == line)
-			info->locktries = line->next;
+	if (!opt_alloc_stats) {
+		message(io_data, MSG_ALLOCDIS, 0, NULL, isjson);
+		return;
 	}
 
-	free(line->stat);
-	free(line);
-}
+	message(io_data, MSG_ALLOCOK, 0, NULL, isjson);
 
-// Yes this uses locks also ... ;/
-static void locklock()
-{
-	if (unlikely(pthread_mutex_lock(&lockstat_lock)))
-		quithere(1, "WTF MUTEX ERROR ON LOCK! errno=%d", errno);
-}
-
-static void lockunlock()
-{
-	if (unlikely(pthread_mutex_unlock(&lockstat_lock)))
-		quithere(1, "WTF MUTEX ERROR ON UNLOCK! errno=%d", errno);
-}
-
-uint64_t api_getlock(void *lock, const char *file, const char *func, const int linenum)
-{
-	LOCKINFO *info;
-	uint64_t id;
-
-	locklock();
-
-	info = findlock(lock, CGLOCK_UNKNOWN, file, func, linenum);
-	id = lock_id++;
-	addgettry(info, id, file, func, linenum, true);
-
-	lockunlock();
-
-	return id;
-}
-
-void api_gotlock(uint64_t id, void *lock, const char *file, const char *func, const int linenum)
-{
-	LOCKINFO *info;
-
-	locklock();
-
-	info = findlock(lock, CGLOCK_UNKNOWN, file, func, linenum);
-	markgotdid(info, id, file, func, linenum, true, 0);
-
-	lockunlock();
-}
-
-uint64_t api_trylock(void *lock, const char *file, const char *func, const int linenum)
-{
-	LOCKINFO *info;
-	uint64_t id;
-
-	locklock();
-
-	info = findlock(lock, CGLOCK_UNKNOWN, file, func, linenum);
-	id = lock_id++;
-	addgettry(info, id, file, func, linenum, false);
-
-	lockunlock();
-
-	return id;
-}
-
-void api_didlock(uint64_t id, int ret, void *lock, const char *file, const char *func, const int linenum)
-{
-	LOCKINFO *info;
-
-	locklock();
-
-	info = findlock(lock, CGLOCK_UNKNOWN, file, func, linenum);
-	markgotdid(info, id, file, func, linenum, false, ret);
-
-	lockunlock();
-}
-
-void api_gunlock(void *lock, const char *file, const char *func, const int linenum)
-{
-	LOCKINFO *info;
-
-	locklock();
-
-	info = findlock(lock, CGLOCK_UNKNOWN, file, func, linenum);
-	info->unlocks++;
-
-	lockunlock();
-}
-
-void api_initlock(void *lock, enum cglock_typ typ, const char *file, const char *func, const int linenum)
-{
-	locklock();
-
-	findlock(lock, typ, file, func, linenum);
-
-	lockunlock();
-}
-
-void dsp_det(char *msg, LOCKSTAT *stat)
-{
-	struct tm *tm;
-	time_t dt;
-
-	dt = stat->tv.tv_sec;
-	tm = localtime(&dt);
-
-	LOCKMSGMORE("%s id=%"PRIu64" by %s %s():%d at %d-%02d-%02d %02d:%02d:%02d",
-			msg,
-			stat->lock_id,
-			stat->file,
-			stat->func,
-			stat->linenum,
-			tm->tm_year + 1900,
-			tm->tm_mon + 1,
-			tm->tm_mday,
-			tm->tm_hour,
-			tm->tm_min,
-			tm->tm_sec);
-}
-
-void dsp_lock(LOCKINFO *info)
-{
-	LOCKLINE *line;
-	char *status;
-
-	LOCKMSG("Lock %p created by %s %s():%d",
-		info->lock,
-		info->file,
-		info->func,
-		info->linenum);
-	LOCKMSGMORE("gets:%"PRIu64" gots:%"PRIu64" tries:%"PRIu64
-		    " dids:%"PRIu64" didnts:%"PRIu64" unlocks:%"PRIu64,
-			info->gets,
-			info->gots,
-			info->tries,
-			info->dids,
-			info->didnts,
-			info->unlocks);
-
-	if (info->gots > 0 || info->dids > 0) {
-		if (info->unlocks < info->gots + info->dids)
-			status = "Last got/did still HELD";
-		else
-			status = "Last got/did (idle)";
-
-		dsp_det(status, &(info->lastgot));
-	} else
-		LOCKMSGMORE("... unused ...");
-
-	if (info->lockgets) {
-		LOCKMSGMORE("BLOCKED gets (%"PRIu64")", info->gets - info->gots);
-		line = info->lockgets;
-		while (line) {
-			dsp_det("", line->stat);
-			line = line->next;
-		}
-	} else
-		LOCKMSGMORE("no blocked gets");
-
-	if (info->locktries) {
-		LOCKMSGMORE("BLOCKED tries (%"PRIu64")", info->tries - info->dids - info->didnts);
-		line = info->lockgets;
-		while (line) {
-			dsp_det("", line->stat);
-			line = line->next;
-		}
-	} else
-		LOCKMSGMORE("no blocked tries");
-}
+	if (isjson)
+		io_open = io_add(io_data, COMSTR JSON_ALLOCSTATS);
 
-void show_locks()
-{
-	LOCKLIST *list;
+	count = allocprof_snapshot(&sites, &totals);
 
-	locklock();
+	i = 0;
+	root = api_add_int(root, "ALLOCSTATS", &i, true);
+	root = api_add_const(root, "Site", "All", false);
+	root = api_add_int(root, "Sites", &(totals.sites), true);
+	root = api_add_uint64(root, "Live", &(totals.live), true);
+	root = api_add_uint64(root, "Live Count", &(totals.live_count), true);
+	root = api_add_uint64(root, "Allocs", &(totals.allocs), true);
+	root = api_add_uint64(root, "Frees", &(totals.frees), true);
+	double rate = totals.elapsed > 0 ? (double)(totals.allocs) / totals.elapsed : 0;
+	root = api_add_double(root, "Alloc Rate", &rate, true);
+	root = api_add_uint64(root, "Table Bytes", &(totals.table_bytes), true);
+	root = api_add_elapsed(root, "Elapsed", &(totals.elapsed), true);
+	root = print_data(io_data, root, isjson, false);
 
-	lockmsgnow();
+	for (i = 0; i < count; i++) {
+		site = &sites[i];
+
+		int n = i + 1;
+		root = api_add_int(root, "ALLOCSTATS", &n, true);
+		snprintf(buf, sizeof(buf), "%s:%d", site->file, site->line);
+		root = api_add_string(root, "Site", buf, true);
+		root = api_add_string(root, "Func", (char *)(site->func), true);
+		root = api_add_uint64(root, "Live", &(site->live), true);
+		root = api_add_uint64(root, "Live Count", &(site->live_count), true);
+		root = api_add_uint64(root, "Live Max", &(site->live_max), true);
+		root = api_add_uint64(root, "Allocs", &(site->allocs), true);
+		root = api_add_uint64(root, "Frees", &(site->frees), true);
+		root = api_add_uint64(root, "Bytes", &(site->bytes), true);
+		rate = totals.elapsed > 0 ? (double)(site->allocs) / totals.elapsed : 0;
+		root = api_add_double(root, "Alloc Rate", &rate, true);
+		double avg = site->allocs ? (double)(site->bytes) / (double)(site->allocs) : 0;
+		root = api_add_double(root, "Avg Size", &avg, true);
 
-	list = lockhead;
-	if (!list)
-		LOCKMSG("no locks?!?\n");
-	else {
-		while (list) {
-			dsp_lock(list->info);
-			list = list->next;
-		}
+		root = print_data(io_data, root, isjson, isjson);
 	}
+	free(sites);
 
-	LOCKMSGFLUSH();
-
-	lockunlock();
-}
-#endif
-
-static void lockstats(struct io_data *io_data, __maybe_unused SOCKETTYPE c, __maybe_unused char *param, bool isjson, __maybe_unused char group)
-{
-#if LOCK_TRACKING
-	show_locks();
-	message(io_data, MSG_LOCKOK, 0, NULL, isjson);
-#else
-	message(io_data, MSG_LOCKDIS, 0, NULL, isjson);
-#endif
+	if (isjson && io_open)
+		io_close(io_data);
 }
 
 static void apiversion(struct io_data *io_data, __maybe_unused SOCKETTYPE c, __maybe_unused char *param, bool isjson, __maybe_unused char group)
@@ -1988,6 +1784,7 @@ static void minerconfig(struct io_data *io_data, __maybe_unused SOCKETTYPE c, __
 	root = api_add_int(root, "PGA Count", &pgacount, false);
 	root = api_add_int(root, "Pool Count", &total_pools, false);
 	root = api_add_const(root, "Strategy", strategies[pool_strategy].s, false);
+	root = api_add_int(root, "Standby Pools", &opt_standby_pools, false);
 	root = api_add_int(root, "Log Interval", &opt_log_interval, false);
 	root = api_add_const(root, "Device Code", DEVICECODE, false);
 	root = api_add_const(root, "OS", OSINFO, false);
@@ -1996,6 +1793,7 @@ static void minerconfig(struct io_data *io_data, __maybe_unused SOCKETTYPE c, __
 		root = api_add_const(root, "Hotplug", DISABLED, false);
 	else
 		root = api_add_int(root, "Hotplug", &hotplug_time, false);
+	root = api_add_bool(root, "Hotplug Events", &usb_hotplug_events, false);
 #else
 	root = api_add_const(root, "Hotplug", NONE, false);
 #endif
@@ -2084,6 +1882,8 @@ static void ascstatus(struct io_data *io_data, int asc, bool isjson, bool precom
 		root = api_add_bool(root, "No Device", &(cgpu->usbinfo.nodev), false);
 #endif
 		root = api_add_time(root, "Last Valid Work", &(cgpu->last_device_valid_work), false);
+		uint64_t dev_best = __atomic_load_n(&cgpu->best_diff, __ATOMIC_RELAXED);
+		root = api_add_uint64(root, "Best Share", &dev_best, true);
 		double hwp = (cgpu->hw_errors + cgpu->diff1) ?
 				(double)(cgpu->hw_errors) / (double)(cgpu->hw_errors + cgpu->diff1) : 0;
 		root = api_add_percent(root, "Device Hardware%", &hwp, false);
@@ -2172,6 +1972,8 @@ static void pgastatus(struct io_data *io_data, int pga, bool isjson, bool precom
 		root = api_add_bool(root, "No Device", &(cgpu->usbinfo.nodev), false);
 #endif
 		root = api_add_time(root, "Last Valid Work", &(cgpu->last_device_valid_work), false);
+		uint64_t dev_best = __atomic_load_n(&cgpu->best_diff, __ATOMIC_RELAXED);
+		root = api_add_uint64(root, "Best Share", &dev_best, true);
 		double hwp = (cgpu->hw_errors + cgpu->diff1) ?
 				(double)(cgpu->hw_errors) / (double)(cgpu->hw_errors + cgpu->diff1) : 0;
 		root = api_add_percent(root, "Device Hardware%", &hwp, false);
@@ -2523,6 +2325,7 @@ static void poolstatus(struct io_data *io_data, __maybe_unused SOCKETTYPE c, __m
 	struct api_data *root = NULL;
 	bool io_open = false;
 	char *status, *lp;
+	int64_t total_pool_diff1 = 0;
 	int i;
 	double sdiff0 = 0.0;
 
@@ -2536,6 +2339,9 @@ static void poolstatus(struct io_data *io_data, __maybe_unused SOCKETTYPE c, __m
 	if (isjson)
 		io_open = io_add(io_data, COMSTR JSON_POOLS);
 
+	for (i = 0; i < total_pools; i++)
+		total_pool_diff1 += pools[i]->diff1;
+
 	for (i = 0; i < total_pools; i++) {
 		struct pool *pool = pools[i];
 
@@ -2605,7 +2411,8 @@ static void poolstatus(struct io_data *io_data, __maybe_unused SOCKETTYPE c, __m
 		}
 		root = api_add_bool(root, "Has Vmask", &(pool->vmask), false);
 		root = api_add_bool(root, "Has GBT", &(pool->has_gbt), false);
-		root = api_add_uint64(root, "Best Share", &(pool->best_diff), true);
+		uint64_t pool_best = __atomic_load_n(&pool->best_diff, __ATOMIC_RELAXED);
+		root = api_add_uint64(root, "Best Share", &pool_best, true);
 		double rejp = (pool->diff_accepted + pool->diff_rejected + pool->diff_stale) ?
 				(double)(pool->diff_rejected) / (double)(pool->diff_accepted + pool->diff_rejected + pool->diff_stale) : 0;
 		root = api_add_percent(root, "Pool Rejected%", &rejp, false);
@@ -2616,6 +2423,28 @@ static void poolstatus(struct io_data *io_data, __maybe_unused SOCKETTYPE c, __m
 		root = api_add_uint32(root, "Current Block Height", &(pool->current_height), true);
 		uint32_t nversion = (uint32_t)strtoul(pool->bbversion, NULL, 16);
 		root = api_add_uint32(root, "Current Block Version", &nversion, true);
+		root = api_add_uint64(root, "GBT Refreshes", &(pool->gbt_refreshes), true);
+		root = api_add_double(root, "GBT Refresh Last", &(pool->gbt_refresh_last), true);
+		root = api_add_double(root, "GBT Refresh Max", &(pool->gbt_refresh_max), true);
+		double refresh_avg = pool->gbt_refreshes ?
+				pool->gbt_refresh_total / (double)(pool->gbt_refreshes) : 0;
+		root = api_add_double(root, "GBT Refresh Avg", &refresh_avg, true);
+		bool standby = pool_standby(pool);
+		root = api_add_bool(root, "Standby", &standby, true);
+		double weight_target = pool_weight_target(pool);
+		root = api_add_percent(root, "Weight Target%", &weight_target, true);
+		double weight_achieved = total_pool_diff1 ?
+				(double)(pool->diff1) / (double)total_pool_diff1 : 0;
+		root = api_add_percent(root, "Weight Achieved%", &weight_achieved, true);
+		int sq_depth = 0, sq_depth_max = 0;
+		uint64_t sq_waits = 0;
+		double sq_wait_avg = 0;
+		if (pool->stratum_q)
+			tq_stats(pool->stratum_q, &sq_depth, &sq_depth_max, &sq_waits, &sq_wait_avg);
+		root = api_add_int(root, "Submit Queue", &sq_depth, true);
+		root = api_add_int(root, "Submit Queue Max", &sq_depth_max, true);
+		root = api_add_uint64(root, "Submit Queue Waits", &sq_waits, true);
+		root = api_add_double(root, "Submit Queue Wait Avg", &sq_wait_avg, true);
 
 		root = print_data(io_data, root, isjson, isjson && (i > 0));
 	}
@@ -2665,7 +2494,8 @@ static void summary(struct io_data *io_data, __maybe_unused SOCKETTYPE c, __mayb
 	root = api_add_diff(root, "Difficulty Accepted", &(total_diff_accepted), true);
 	root = api_add_diff(root, "Difficulty Rejected", &(total_diff_rejected), true);
 	root = api_add_diff(root, "Difficulty Stale", &(total_diff_stale), true);
-	root = api_add_uint64(root, "Best Share", &(best_diff), true);
+	uint64_t best = __atomic_load_n(&best_diff, __ATOMIC_RELAXED);
+	root = api_add_uint64(root, "Best Share", &best, true);
 	double hwp = (hw_errors + total_diff1) ?
 			(double)(hw_errors) / (double)(hw_errors + total_diff1) : 0;
 	root = api_add_percent(root, "Device Hardware%", &hwp, false);
@@ -2679,6 +2509,11 @@ static void summary(struct io_data *io_data, __maybe_unused SOCKETTYPE c, __mayb
 			(double)(total_diff_stale) / (double)(total_diff_accepted + total_diff_rejected + total_diff_stale) : 0;
 	root = api_add_percent(root, "Pool Stale%", &stalep, false);
 	root = api_add_time(root, "Last getwork", &last_getwork, false);
+	root = api_add_uint64(root, "Failovers", &failovers, true);
+	root = api_add_double(root, "Failover Gap Last", &failover_gap_last, true);
+	root = api_add_double(root, "Failover Gap Max", &failover_gap_max, true);
+	double gap_avg = failovers ? failover_gap_total / (double)failovers : 0;
+	root = api_add_double(root, "Failover Gap Avg", &gap_avg, true);
 
 	mutex_unlock(&hash_lock);
 
@@ -3196,6 +3031,9 @@ static void devdetails(struct io_data *io_data, __maybe_unused SOCKETTYPE c, __m
 		root = api_add_const(root, "Kernel", cgpu->kname ? : BLANK, false);
 		root = api_add_const(root, "Model", cgpu->name ? : BLANK, false);
 		root = api_add_const(root, "Device Path", cgpu->device_path ? : BLANK, false);
+#ifdef USE_USBUTILS
+		root = api_add_double(root, "Detect ms", &(cgpu->usbinfo.detect_ms), false);
+#endif
 
 		root = print_data(io_data, root, isjson, isjson && (i > 0));
 	}
@@ -3275,6 +3113,8 @@ static int itemstats(struct io_data *io_data, int i, char *id, struct cgminer_st
 		root = api_add_extra(root, extra);
 
 	if (cgpu) {
+		root = nonce_pipe_api_stats(cgpu, root);
+		root = job_slots_api_stats(cgpu, root);
 #ifdef USE_USBUTILS
 		char details[256];
 
@@ -3721,6 +3561,176 @@ static void dozero(struct io_data *io_data, __maybe_unused SOCKETTYPE c, char *p
 		message(io_data, MSG_ZERNOSUM, 0, all ? "All" : "BestShare", isjson);
 }
 
+/* One field of every sample as a space separated list */
+static char *history_list(struct history_sample *samples, int count, size_t offset, const char *fmt)
+{
+	char *buf, *ptr;
+	int i;
+
+	buf = ptr = cgmalloc(count * 32 + 1);
+	*buf = '\0';
+	for (i = 0; i < count; i++) {
+		if (i)
+			*(ptr++) = ' ';
+		ptr += sprintf(ptr, fmt, *(double *)((char *)&samples[i] + offset));
+	}
+	return buf;
+}
+
+#define HISTORY_LIST(_name, _field, _fmt) do { \
+		char *_list = history_list(samples, count, \
+					   offsetof(struct history_sample, _field), _fmt); \
+		root = api_add_string(root, _name, _list, true); \
+		free(_list); \
+	} while (0)
+
+static struct api_data *history_section(struct api_data *root, struct history_sample *samples,
+					int count, int tier)
+{
+	int interval = history_tier_interval(tier);
+	time_t none = 0;
+
+	/* First and Last are when those samples ended */
+	root = api_add_int(root, "Interval", &interval, true);
+	root = api_add_int(root, "Count", &count, true);
+	root = api_add_time(root, "First", count ? &(samples[0].when) : &none, true);
+	root = api_add_time(root, "Last", count ? &(samples[count - 1].when) : &none, true);
+	return root;
+}
+
+/* All the history in a tier, or only what ended after SINCE, for each device
+ * and pool */
+static void dohistory(struct io_data *io_data, __maybe_unused SOCKETTYPE c, char *param, bool isjson, __maybe_unused char group)
+{
+	struct history_sample *samples;
+	struct api_data *root = NULL;
+	struct cgpu_info *cgpu;
+	struct pool *pool;
+	bool io_open = false;
+	long long since = 0;
+	int tier = 0, count, i, n = 0;
+	char end;
+
+	if (!opt_history_interval) {
+		message(io_data, MSG_HISTOFF, 0, NULL, isjson);
+		return;
+	}
+
+	if (param && *param) {
+		if (sscanf(param, "%d%c", &tier, &end) != 1 &&
+		    (sscanf(param, "%d,%lld%c", &tier, &since, &end) != 2 || since < 0))
+			tier = -1;
+		if (tier < 0 || tier >= HISTORY_TIERS) {
+			message(io_data, MSG_INVHIST, 0, param, isjson);
+			return;
+		}
+	}
+
+	message(io_data, MSG_HISTORY, 0, NULL, isjson);
+
+	if (isjson)
+		io_open = io_add(io_data, COMSTR JSON_HISTORY);
+
+	for (i = 0; i < total_devices; i++) {
+		cgpu = get_a_device(i);
+		count = history_read(&cgpu->history, tier, (time_t)since, &samples);
+
+		root = api_add_int(root, _HISTORY, &n, true);
+		root = api_add_int(root, "Device", &i, true);
+		root = api_add_string(root, "Name", cgpu->drv->name, false);
+		root = api_add_int(root, "ID", &(cgpu->device_id), false);
+		root = history_section(root, samples, count, tier);
+		HISTORY_LIST("MHashes", mhashes, "%.10g");
+		HISTORY_LIST("Diff1", diff1, "%.10g");
+		HISTORY_LIST("Diff Accepted", diff_accepted, "%.10g");
+		HISTORY_LIST("Diff Rejected", diff_rejected, "%.10g");
+		HISTORY_LIST("Hardware Errors", hw_errors, "%.10g");
+		HISTORY_LIST("Temperature", temp, "%.1f");
+		free(samples);
+
+		root = print_data(io_data, root, isjson, isjson && (n++ > 0));
+	}
+
+	for (i = 0; i < total_pools; i++) {
+		pool = pools[i];
+		count = history_read(&pool->history, tier, (time_t)since, &samples);
+
+		root = api_add_int(root, _HISTORY, &n, true);
+		root = api_add_int(root, "Pool", &i, true);
+		root = api_add_escape(root, "URL", pool->rpc_url, false);
+		root = history_section(root, samples, count, tier);
+		HISTORY_LIST("Diff1", diff1, "%.10g");
+		HISTORY_LIST("Diff Accepted", diff_accepted, "%.10g");
+		HISTORY_LIST("Diff Rejected", diff_rejected, "%.10g");
+		HISTORY_LIST("Diff Stale", diff_stale, "%.10g");
+		free(samples);
+
+		root = print_data(io_data, root, isjson, isjson && (n++ > 0));
+	}
+
+	if (isjson && io_open)
+		io_close(io_data);
+}
+
+/* Every per chip table of one or all devices, a column per item */
+static void chipstats(struct io_data *io_data, __maybe_unused SOCKETTYPE c, char *param, bool isjson, __maybe_unused char group)
+{
+	struct api_data *root = NULL;
+	struct cgpu_info *cgpu;
+	struct chip_stats *cs;
+	bool io_open = false, delta = false;
+	int dev = -1, i, col, n = 0;
+	char *list, *ptr, *tok, *save = NULL;
+
+	if (param && *param) {
+		ptr = strdup(param);
+		for (tok = strtok_r(ptr, ",", &save); tok; tok = strtok_r(NULL, ",", &save)) {
+			if (strcasecmp(tok, "delta") == 0)
+				delta = true;
+			else if (isdigit(*tok) && atoi(tok) < total_devices)
+				dev = atoi(tok);
+			else {
+				free(ptr);
+				message(io_data, MSG_INVCHIPS, 0, param, isjson);
+				return;
+			}
+		}
+		free(ptr);
+	}
+
+	message(io_data, MSG_CHIPS, 0, NULL, isjson);
+
+	if (isjson)
+		io_open = io_add(io_data, COMSTR JSON_CHIPS);
+
+	for (i = 0; i < total_devices; i++) {
+		if (dev >= 0 && i != dev)
+			continue;
+
+		cgpu = get_a_device(i);
+		cs = __atomic_load_n(&cgpu->chip_stats, __ATOMIC_ACQUIRE);
+		for (; cs; cs = __atomic_load_n(&cs->next, __ATOMIC_ACQUIRE)) {
+			root = api_add_int(root, _CHIPS, &n, true);
+			root = api_add_int(root, "Device", &i, true);
+			root = api_add_string(root, "Name", cgpu->drv->name, false);
+			root = api_add_int(root, "ID", &(cgpu->device_id), false);
+			root = api_add_const(root, "Table", cs->name, false);
+			root = api_add_int(root, "Chains", &(cs->chains), false);
+			root = api_add_int(root, "Chips", &(cs->chips), false);
+			for (col = 0; col < cs->cols; col++) {
+				list = chip_stats_column(cs, col, delta);
+				root = api_add_string(root, (char *)(cs->col[col].name), list, true);
+				free(list);
+			}
+
+			root = print_data(io_data, root, isjson, isjson && (n++ > 0));
+		}
+	}
+
+	if (isjson && io_open)
+		io_close(io_data);
+}
+
 static void dohotplug(struct io_data *io_data, __maybe_unused SOCKETTYPE c, __maybe_unused char *param, bool isjson, __maybe_unused char group)
 {
 #ifdef USE_USBUTILS
@@ -3731,6 +3741,20 @@ static void dohotplug(struct io_data *io_data, __maybe_unused SOCKETTYPE c, __ma
 		return;
 	}
 
+	/* Simulate a device arriving or leaving, for testing */
+	if (strncasecmp(param, "arrive:", 7) == 0 || strncasecmp(param, "leave:", 6) == 0) {
+		bool arrived = (tolower(*param) == 'a');
+		unsigned int bus, addr;
+		char end;
+
+		if (sscanf(strchr(param, ':') + 1, "%u:%u%c", &bus, &addr, &end) != 2 ||
+		    bus > 255 || addr > 255 || !usb_hotplug_inject(bus, addr, arrived))
+			message(io_data, MSG_INVHPLGEVT, 0, param, isjson);
+		else
+			message(io_data, MSG_HPLGEVT, 0, param, isjson);
+		return;
+	}
+
 	value = atoi(param);
 	if (value < 0 || value > 9999) {
 		message(io_data, MSG_INVHPLG, 0, param, isjson);
@@ -4024,6 +4048,7 @@ static void lcddata(struct io_data *io_data, __maybe_unused SOCKETTYPE c, __mayb
 	float temp = 0.0;
 	time_t last_share_time = 0;
 	time_t last_device_valid_work = 0;
+	uint64_t best = __atomic_load_n(&best_diff, __ATOMIC_RELAXED);
 	struct pool *pool = NULL;
 	char *rpc_url = "none", *rpc_user = "";
 	int i;
@@ -4077,7 +4102,7 @@ static void lcddata(struct io_data *io_data, __maybe_unused SOCKETTYPE c, __mayb
 	root = api_add_temp(root, "Temperature", &temp, false);
 	root = api_add_diff(root, "Last Share Difficulty", &last_share_diff, false);
 	root = api_add_time(root, "Last Share Time", &last_share_time, false);
-	root = api_add_uint64(root, "Best Share", &best_diff, true);
+	root = api_add_uint64(root, "Best Share", &best, true);
 	root = api_add_time(root, "Last Valid Work", &last_device_valid_work, false);
 	root = api_add_uint(root, "Found Blocks", &found_blocks, true);
 	root = api_add_escape(root, "Current Pool", rpc_url, true);
@@ -4146,6 +4171,9 @@ struct CMDS {
 	{ "asccount",		asccount,	false,	true },
 	{ "lcd",		lcddata,	false,	true },
 	{ "lockstats",		lockstats,	true,	true },
+	{ "history",		dohistory,	false,	true },
+	{ "chips",		chipstats,	false,	true },
+	{ "allocstats",		allocstats,	true,	true },
 	{ NULL,			NULL,		false,	false }
 };
 
@@ -4904,6 +4932,38 @@ void reCalculateAVG()
 }
 #endif
 
+#ifdef CGMINER_BENCH
+/* Render the full reply to cmd as the API thread would just before sending
+ * it, for cgminer-bench. The buffer is reused by the next call. */
+const char *api_bench_reply(const char *cmd, char *param, bool isjson)
+{
+	static struct io_data *io_data;
+	int i;
+
+	if (!io_data) {
+		strbufs = k_new_list("StrBufs", sizeof(SBITEM), ALLOC_SBITEMS, LIMIT_SBITEMS, false);
+		io_data = sock_io_new();
+	}
+
+	io_reinit(io_data);
+	for (i = 0; cmds[i].name != NULL; i++) {
+		if (strcmp(cmd, cmds[i].name) == 0)
+			break;
+	}
+	if (cmds[i].name)
+		(cmds[i].func)(io_data, INVSOCK, param, isjson, PRIVGROUP);
+	else
+		message(io_data, MSG_INVCMD, 0, NULL, isjson);
+
+	if (io_data->close)
+		strcat(io_data->ptr, JSON_CLOSE);
+	if (isjson)
+		strcat(io_data->ptr, JSON_END);
+
+	return io_data->ptr;
+}
+#endif
+
 void api(int api_thr_id)
 {
 	struct io_data *io_data;
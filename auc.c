@@ -0,0 +1,126 @@
+/*
+ * Copyright 2026 Andrew Smith
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 3 of the License, or (at your option)
+ * any later version.  See COPYING for more details.
+ */
+
+/* Pipelined transfers through an Avalon USB to IIC converter (AUC).
+ *
+ * Normally each IIC transaction is written to the AUC and its reply read
+ * back before the next is sent, so polling several modules costs a full
+ * round trip each. Here several transactions are queued in the AUC before
+ * any reply is read, so the round trips overlap. Each request carries its
+ * module's address as the transaction id in byte 1 of the AUC header, and
+ * replies are matched on it, so a late reply left over from an earlier poll
+ * is dropped rather than credited to the wrong module.
+ *
+ * Not every AUC firmware echoes the id, and without the echo the replies
+ * can't be matched, so drivers check with auc_echo_probe once at init and
+ * only pipeline if it passes. */
+
+#include "miner.h"
+#include "auc.h"
+
+#define AUC_ECHO_TAG 0x5a
+
+/* Send an INFO request with a transaction id and check it comes back in the
+ * reply header */
+bool auc_echo_probe(struct cgpu_info *cgpu, int delay_ms, enum usb_cmds wcmd, enum usb_cmds rcmd)
+{
+	int err, wcnt, rcnt, rlen = AUC_INFO_SIZE + 4;
+	uint8_t wbuf[AUC_P_SIZE];
+	uint8_t rbuf[AUC_P_SIZE];
+
+	if (unlikely(cgpu->usbinfo.nodev))
+		return false;
+
+	memset(wbuf, 0, AUC_P_SIZE);
+	wbuf[0] = 4;
+	wbuf[1] = AUC_ECHO_TAG;
+	wbuf[3] = AUC_IIC_INFO;
+
+	usb_buffer_clear(cgpu);
+	err = usb_write(cgpu, (char *)wbuf, AUC_P_SIZE, &wcnt, wcmd);
+	if (err || wcnt != AUC_P_SIZE)
+		return false;
+
+	cgsleep_ms(delay_ms);
+
+	err = usb_read(cgpu, (char *)rbuf, rlen, &rcnt, rcmd);
+	if (err || rcnt != rlen || rcnt != rbuf[0])
+		return false;
+
+	applog(LOG_DEBUG, "%s-%d: AUC transaction id %s", cgpu->drv->name, cgpu->device_id,
+	       rbuf[1] == AUC_ECHO_TAG ? "echoed" : "not echoed");
+	return rbuf[1] == AUC_ECHO_TAG;
+}
+
+/* Write a pkg_len byte request from pkgs to each of count module addrs, then
+ * read back up to count replies into rets, setting got[i] for each reply read
+ * into rets[i], and return how many there were. With pkgs NULL nothing is sent
+ * to the modules, each transaction only reads back a reply they still have,
+ * which is how polls that weren't answered in time are retried without
+ * sending them twice. */
+int auc_xfer_pkgs(struct cgpu_info *cgpu, const int *addrs, const void *pkgs, void *rets,
+		  int pkg_len, bool *got, int count, int delay_ms,
+		  enum usb_cmds wcmd, enum usb_cmds rcmd)
+{
+	int i, j, reads, n = 0, err, wcnt, rcnt, rlen = pkg_len + 4;
+	uint8_t wbuf[AUC_P_SIZE];
+	uint8_t rbuf[AUC_P_SIZE];
+
+	memset(got, 0, sizeof(*got) * count);
+	if (unlikely(cgpu->usbinfo.nodev))
+		return 0;
+
+	usb_buffer_clear(cgpu);
+	for (i = 0; i < count; i++) {
+		memset(wbuf, 0, AUC_P_SIZE);
+		wbuf[0] = 8;
+		wbuf[1] = addrs[i];
+		wbuf[3] = AUC_IIC_XFER;
+		wbuf[5] = pkg_len;
+		wbuf[7] = addrs[i];
+		if (pkgs) {
+			wbuf[0] += pkg_len;
+			wbuf[4] = pkg_len;
+			memcpy(wbuf + 8, (const uint8_t *)pkgs + i * pkg_len, pkg_len);
+		}
+		err = usb_write(cgpu, (char *)wbuf, wbuf[0], &wcnt, wcmd);
+		if (err || wcnt != wbuf[0]) {
+			applog(LOG_DEBUG, "%s-%d: AUC pipelined xfer %d, w(%d-%d)!",
+			       cgpu->drv->name, cgpu->device_id, err, wbuf[0], wcnt);
+			usb_nodev(cgpu);
+			return 0;
+		}
+	}
+
+	cgsleep_ms(delay_ms);
+
+	/* Allow as many stale replies as requests before giving up */
+	for (reads = 0; n < count && reads < count * 2; reads++) {
+		err = usb_read(cgpu, (char *)rbuf, rlen, &rcnt, rcmd);
+		if (err || rcnt != rlen || rcnt != rbuf[0]) {
+			applog(LOG_DEBUG, "%s-%d: AUC pipelined xfer %d, r(%d-%d-%d)!",
+			       cgpu->drv->name, cgpu->device_id, err, pkg_len, rcnt, rbuf[0]);
+			break;
+		}
+		for (j = 0; j < count; j++) {
+			if (!got[j] && addrs[j] == rbuf[1])
+				break;
+		}
+		if (j == count) {
+			applog(LOG_DEBUG, "%s-%d: AUC pipelined xfer dropped stale reply for %d",
+			       cgpu->drv->name, cgpu->device_id, rbuf[1]);
+			continue;
+		}
+		memcpy((uint8_t *)rets + j * pkg_len, rbuf + 4, pkg_len);
+		got[j] = true;
+		n++;
+	}
+
+	return n;
+}
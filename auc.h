@@ -0,0 +1,29 @@
+/*
+ * Copyright 2026 Andrew Smith
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 3 of the License, or (at your option)
+ * any later version.  See COPYING for more details.
+ */
+
+#ifndef AUC_H
+#define AUC_H
+
+#include "miner.h"
+#include "usbutils.h"
+
+/* The Avalon USB to IIC converter's packet size and the header ops used here,
+ * common to every driver that talks to modules through one */
+#define AUC_P_SIZE	64
+#define AUC_IIC_XFER	0xa5
+#define AUC_IIC_INFO	0xa6
+#define AUC_INFO_SIZE	7
+
+extern bool auc_echo_probe(struct cgpu_info *cgpu, int delay_ms,
+			   enum usb_cmds wcmd, enum usb_cmds rcmd);
+extern int auc_xfer_pkgs(struct cgpu_info *cgpu, const int *addrs, const void *pkgs, void *rets,
+			 int pkg_len, bool *got, int count, int delay_ms,
+			 enum usb_cmds wcmd, enum usb_cmds rcmd);
+
+#endif
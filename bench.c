@@ -0,0 +1,1200 @@
+/*
+ * Copyright 2026 Andrew Smith
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 3 of the License, or (at your option)
+ * any later version.  See COPYING for more details.
+ */
+
+/* cgminer-bench, repeatable benchmarks of the core mining pipeline.
+ *
+ * This is built from the same sources as cgminer with CGMINER_BENCH defined,
+ * which renames cgminer's main() and exports a few of its static functions,
+ * so what is measured is exactly the code that mines. No pool or device is
+ * needed: a stratum pool is set up from a canned nonce1 and notify with a
+ * realistic coinbase and merkle branch count, and the API is given a set of
+ * fake devices to report on.
+ *
+ * Each benchmark runs a fixed number of operations. Operations too quick to
+ * time one at a time are timed in batches and each batch gives one latency
+ * sample of the batch time divided by its size. Multi threaded benchmarks
+ * split their operations over -t threads started together. The
+ * results are printed as JSON on stdout so they can be kept and compared
+ * between releases. A self-check of the u256 target and difficulty arithmetic
+ * runs first and stops the run if it fails. */
+
+#include "miner.h"
+#include "sha2.h"
+#include "uint256.h"
+
+#include <math.h>
+#include <time.h>
+
+#if defined(USE_BITMINE_A1) || defined(USE_DRAGONMINT_T1)
+#define BENCH_SPI
+#include "spi-context.h"
+
+#include <fcntl.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#endif
+
+#define BENCH_MERKLES 12
+#define BENCH_CB1_LEN 90
+#define BENCH_CB2_LEN 150
+#define BENCH_DEVICES 16
+#define BENCH_CHIPS 64
+#define BENCH_GBT_TXNS 3000
+#define BENCH_GBT_TXN_LEN 250
+#define BENCH_STAGED 32
+#define BENCH_DIFFS 1024
+#define BENCH_SPI_CHIPS 64
+#define BENCH_SPI_JOB_LEN 60
+
+struct bench {
+	const char *name;
+	int ops;		// At --scale 1
+	int batch;		// Ops timed together
+	bool threaded;		// Spread over -t threads
+	void (*setup)(int ops);
+	void (*prep)(int i);	// Untimed, before each op, only with batch 1
+	void (*op)(int i);
+	void (*teardown)(void);
+};
+
+struct bench_thr {
+	const struct bench *b;
+	pthread_t pth;
+	int tid;
+	int first;
+	int ops;
+	double *lat;
+	int nlat;
+};
+
+static int bench_threads = 4;
+static double bench_scale = 1.0;
+static pthread_barrier_t bench_barrier;
+
+static struct pool *bench_pool;
+static struct work *bench_work;
+static char *bench_notify;
+static struct cgpu_info bench_cgpus[BENCH_DEVICES];
+
+static uint64_t bench_rand_state = 0x853c49e6748fea9bULL;
+
+static uint64_t bench_rand(void)
+{
+	uint64_t x = bench_rand_state;
+
+	x ^= x << 13;
+	x ^= x >> 7;
+	x ^= x << 17;
+	return bench_rand_state = x;
+}
+
+static void bench_rand_hex(char *hex, size_t len)
+{
+	unsigned char *bin = cgmalloc(len);
+	size_t i;
+
+	for (i = 0; i < len; i++)
+		bin[i] = bench_rand();
+	__bin2hex(hex, bin, len);
+	free(bin);
+}
+
+static int64_t bench_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (int64_t)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/* A mining.notify as a pool would send it, coinbase halves either side of a
+ * 4 byte nonce1 and 8 byte nonce2, with enough merkle branches for a block of
+ * a few thousand transactions */
+static char *bench_make_notify(void)
+{
+	char prev_hash[65], cb1[BENCH_CB1_LEN * 2 + 1], cb2[BENCH_CB2_LEN * 2 + 1];
+	char merkle[65], *buf;
+	size_t siz, len;
+	int i;
+
+	bench_rand_hex(prev_hash, 32);
+	bench_rand_hex(cb1, BENCH_CB1_LEN);
+	bench_rand_hex(cb2, BENCH_CB2_LEN);
+
+	siz = 1024 + sizeof(cb1) + sizeof(cb2) + BENCH_MERKLES * 68;
+	buf = cgmalloc(siz);
+	len = snprintf(buf, siz, "{\"id\":null,\"method\":\"mining.notify\",\"params\":"
+		       "[\"6a3f\",\"%s\",\"%s\",\"%s\",[", prev_hash, cb1, cb2);
+	for (i = 0; i < BENCH_MERKLES; i++) {
+		bench_rand_hex(merkle, 32);
+		len += snprintf(buf + len, siz - len, "%s\"%s\"", i ? "," : "", merkle);
+	}
+	snprintf(buf + len, siz - len, "],\"20000000\",\"17034219\",\"5e1b3f7a\",true]}");
+
+	return buf;
+}
+
+static void bench_setup_pool(void)
+{
+	bench_pool = add_pool();
+	bench_pool->rpc_url = strdup("stratum+tcp://bench:3333");
+	bench_pool->has_stratum = true;
+	bench_pool->nonce1 = strdup("f8002c90");
+	bench_pool->n1_len = strlen(bench_pool->nonce1) / 2;
+	bench_pool->nonce1bin = cgcalloc(bench_pool->n1_len, 1);
+	hex2bin(bench_pool->nonce1bin, bench_pool->nonce1, bench_pool->n1_len);
+	bench_pool->n2size = 8;
+	bench_pool->sdiff = 65536;
+
+	bench_notify = bench_make_notify();
+	if (unlikely(!parse_method(bench_pool, bench_notify)))
+		quit(1, "Failed to parse the benchmark notify");
+
+	bench_work = bench_make_work();
+	bench_gen_stratum_work(bench_pool, bench_work);
+}
+
+static void op_calc_midstate(int __maybe_unused i)
+{
+	bench_calc_midstate(bench_pool, bench_work);
+}
+
+static void op_gen_stratum_work(int __maybe_unused i)
+{
+	struct work *work = bench_make_work();
+
+	bench_gen_stratum_work(bench_pool, work);
+	free_work(work);
+}
+
+static void op_parse_notify(int __maybe_unused i)
+{
+	parse_method(bench_pool, bench_notify);
+}
+
+static void op_test_nonce(int i)
+{
+	test_nonce(bench_work, i);
+}
+
+static void op_test_nonce_value(int i)
+{
+	test_nonce_value(bench_work, i);
+}
+
+static void op_copy_work(int __maybe_unused i)
+{
+	struct work *work = copy_work(bench_work);
+
+	free_work(work);
+}
+
+/* Hashes as they come from a device, the top 32 bits zero, and targets from
+ * a spread of pool difficulties */
+static unsigned char (*bench_hashes)[32];
+static unsigned char (*bench_targets)[32];
+static double *bench_diffs;
+
+static void setup_hashes(int __maybe_unused ops)
+{
+	int i, j;
+
+	bench_hashes = cgcalloc(BENCH_DIFFS, 32);
+	bench_targets = cgcalloc(BENCH_DIFFS, 32);
+	bench_diffs = cgcalloc(BENCH_DIFFS, sizeof(double));
+	for (i = 0; i < BENCH_DIFFS; i++) {
+		for (j = 0; j < 28; j++)
+			bench_hashes[i][j] = bench_rand();
+		bench_diffs[i] = (i & 1) ? (double)(1ULL << (bench_rand() % 40)) :
+					    (double)(bench_rand() % 10000000) / 1000.0 + 0.001;
+		set_target(bench_targets[i], bench_diffs[i]);
+	}
+}
+
+static void teardown_hashes(void)
+{
+	free(bench_hashes);
+	free(bench_targets);
+	free(bench_diffs);
+}
+
+static void op_fulltest(int i)
+{
+	fulltest(bench_hashes[i % BENCH_DIFFS], bench_targets[(i >> 10) % BENCH_DIFFS]);
+}
+
+static void op_target_from_diff(int i)
+{
+	u256 target;
+
+	u256_target_from_diff(&target, bench_diffs[i % BENCH_DIFFS]);
+}
+
+static void op_le256_diff(int i)
+{
+	le256_diff(bench_hashes[i % BENCH_DIFFS]);
+}
+
+/* Self-check of the u256 target and difficulty arithmetic, run before the
+ * benchmarks. The double based functions it replaced are kept here as they
+ * were to compare against, and each target is also checked to be exactly
+ * floor(diffone / diff) with 320 bit arithmetic in 32 bit limbs. */
+#define CHECK_LIMBS 10
+#define CHECK_RANDOM 20000
+/* The old functions' rounding, a few ulps at most */
+#define CHECK_REL 1e-13
+
+static const double old_truediffone = 26959535291011309493156476344723991336010898738574164086137773096960.0;
+static const double old_bits192 = 6277101735386680763835789423207666416102355444464034512896.0;
+static const double old_bits128 = 340282366920938463463374607431768211456.0;
+static const double old_bits64 = 18446744073709551616.0;
+
+static int check_cases;
+
+static double old_le256todouble(const void *target)
+{
+	const uint64_t *data64 = (const uint64_t *)target;
+
+	return le64toh(data64[3]) * old_bits192 + le64toh(data64[2]) * old_bits128 +
+	       le64toh(data64[1]) * old_bits64 + le64toh(data64[0]);
+}
+
+static double old_diff_from_target(const void *target)
+{
+	double dcut64 = old_le256todouble(target);
+
+	if (unlikely(!dcut64))
+		dcut64 = 1;
+	return old_truediffone / dcut64;
+}
+
+/* Only for diffs whose target fits in 256 bits */
+static void old_set_target(unsigned char *target, double diff)
+{
+	uint64_t *data64 = (uint64_t *)target, h64;
+	double d64 = old_truediffone / diff;
+
+	h64 = d64 / old_bits192;
+	data64[3] = htole64(h64);
+	d64 -= h64 * old_bits192;
+	h64 = d64 / old_bits128;
+	data64[2] = htole64(h64);
+	d64 -= h64 * old_bits128;
+	h64 = d64 / old_bits64;
+	data64[1] = htole64(h64);
+	d64 -= h64 * old_bits64;
+	h64 = d64;
+	data64[0] = htole64(h64);
+}
+
+static bool old_fulltest(const unsigned char *hash, const unsigned char *target)
+{
+	const uint32_t *hash32 = (const uint32_t *)hash, *target32 = (const uint32_t *)target;
+	int i;
+
+	for (i = 7; i >= 0; i--) {
+		if (le32toh(hash32[i]) > le32toh(target32[i]))
+			return false;
+		if (le32toh(hash32[i]) < le32toh(target32[i]))
+			return true;
+	}
+	return true;
+}
+
+static void check_fail(const char *what, double diff, const u256 *a)
+{
+	quit(1, "u256 self-check failed: %s for diff %.17g at %016"PRIx64"%016"PRIx64"%016"PRIx64"%016"PRIx64,
+	     what, diff, a->w[3], a->w[2], a->w[1], a->w[0]);
+}
+
+static void check_rel(const char *what, double diff, const u256 *a, double got, double want)
+{
+	check_cases++;
+	if (fabs(got - want) > fabs(want) * CHECK_REL)
+		check_fail(what, diff, a);
+}
+
+static void limbs_from_u256(uint32_t *l, const u256 *a)
+{
+	int i;
+
+	memset(l, 0, CHECK_LIMBS * sizeof(*l));
+	for (i = 0; i < 8; i++)
+		l[i] = a->w[i / 2] >> (i % 2 * 32);
+}
+
+/* l = l * 2^s, or l / 2^-s for negative s */
+static void limbs_shift(uint32_t *l, int s)
+{
+	uint32_t r[CHECK_LIMBS] = {0};
+	int i, j;
+
+	for (i = 0; i < CHECK_LIMBS * 32; i++) {
+		j = i - s;
+		if (j >= 0 && j < CHECK_LIMBS * 32 && (l[j / 32] >> (j % 32) & 1))
+			r[i / 32] |= 1U << (i % 32);
+	}
+	memcpy(l, r, sizeof(r));
+}
+
+static void limbs_mul(uint32_t *l, uint64_t m)
+{
+	uint32_t r[CHECK_LIMBS] = {0};
+	uint64_t carry;
+	int i, j, k;
+
+	for (k = 0; k < 2; k++) {
+		uint32_t half = m >> (k * 32);
+
+		carry = 0;
+		for (i = 0, j = k; j < CHECK_LIMBS; i++, j++) {
+			carry += (uint64_t)(i < CHECK_LIMBS ? l[i] : 0) * half + r[j];
+			r[j] = carry;
+			carry >>= 32;
+		}
+	}
+	memcpy(l, r, sizeof(r));
+}
+
+static void limbs_add(uint32_t *l, const uint32_t *a)
+{
+	uint64_t carry = 0;
+	int i;
+
+	for (i = 0; i < CHECK_LIMBS; i++) {
+		carry += (uint64_t)l[i] + a[i];
+		l[i] = carry;
+		carry >>= 32;
+	}
+}
+
+static int limbs_cmp(const uint32_t *a, const uint32_t *b)
+{
+	int i;
+
+	for (i = CHECK_LIMBS - 1; i >= 0; i--) {
+		if (a[i] != b[i])
+			return a[i] < b[i] ? -1 : 1;
+	}
+	return 0;
+}
+
+/* diff == m * 2^e, the target t must have t * m <= floor(diffone * 2^-e) <
+ * (t + 1) * m, or be all ones when diffone / diff is 2^256 or more */
+static void check_target(double diff)
+{
+	uint32_t n[CHECK_LIMBS], lo[CHECK_LIMBS], hi[CHECK_LIMBS], ml[CHECK_LIMBS];
+	u256 target, diffone = {{ 0, 0, 0, U256_DIFFONE_TOP }}, one = {{ 1, 0, 0, 0 }};
+	unsigned char le[32], old[32];
+	bool saturated;
+	uint64_t m;
+	int exp, e;
+
+	u256_target_from_diff(&target, diff);
+	saturated = !(~target.w[0] | ~target.w[1] | ~target.w[2] | ~target.w[3]);
+	check_cases++;
+
+	m = (uint64_t)ldexp(frexp(diff, &exp), 53);
+	e = exp - 53;
+	while (!(m & 1)) {
+		m >>= 1;
+		e++;
+	}
+	/* Too small for diffone << -e to fit, and far below 2^-32 */
+	if (-e > CHECK_LIMBS * 32 - 224) {
+		if (!saturated)
+			check_fail("target not saturated", diff, &target);
+		return;
+	}
+	limbs_from_u256(n, &diffone);
+	limbs_shift(n, -e);
+
+	limbs_from_u256(lo, &target);
+	limbs_mul(lo, m);
+	limbs_from_u256(ml, &one);
+	limbs_mul(ml, m);
+	memcpy(hi, lo, sizeof(hi));
+	limbs_add(hi, ml);
+	if (limbs_cmp(lo, n) > 0 || (limbs_cmp(n, hi) >= 0 && !saturated))
+		check_fail("target not floor(diffone / diff)", diff, &target);
+
+	/* The old cut up double had to agree, to its own precision, where it
+	 * fitted and wasn't just truncation of a few low bits */
+	if (saturated || diff < ldexp(1, -31) || !(target.w[3] | target.w[2] | target.w[1]))
+		return;
+	u256_to_le(le, &target);
+	old_set_target(old, diff);
+	check_rel("target differs from set_target", diff, &target,
+		  u256_to_double(&target), old_le256todouble(old));
+	check_rel("diff differs from diff_from_target", diff, &target,
+		  le256_diff(le), old_diff_from_target(le));
+}
+
+/* Both ways round the old and new compares, and at the target's edges */
+static void check_compare(const u256 *hash, const u256 *target)
+{
+	unsigned char h[32], t[32];
+
+	u256_to_le(h, hash);
+	u256_to_le(t, target);
+	check_cases += 2;
+	if (le256_le(h, t) != old_fulltest(h, t) || le256_le(t, h) != old_fulltest(t, h))
+		check_fail("compare differs from fulltest", 0, hash);
+}
+
+static u256 check_random(void)
+{
+	u256 a;
+	int i, zeros = bench_rand() % 257;
+
+	for (i = 0; i < 4; i++)
+		a.w[i] = bench_rand();
+	for (i = 3; i >= 0 && zeros > 0; i--, zeros -= 64) {
+		if (zeros >= 64)
+			a.w[i] = 0;
+		else
+			a.w[i] >>= zeros;
+	}
+	return a;
+}
+
+static void check_u256(void)
+{
+	u256 a, b, target, ones;
+	unsigned char le[32], hash[32];
+	double diff;
+	int i, k;
+
+	/* Diff 1 is exactly the diff 1 target and back */
+	u256_target_from_diff(&target, 1.0);
+	u256_to_le(le, &target);
+	check_cases++;
+	if (target.w[0] || target.w[1] || target.w[2] || target.w[3] != U256_DIFFONE_TOP ||
+	    le256_diff(le) != 1.0)
+		check_fail("diff 1", 1.0, &target);
+
+	/* The max target, and the tiny diffs that saturate to it */
+	memset(&ones, 0xff, sizeof(ones));
+	u256_to_le(le, &ones);
+	check_rel("max target diff", 0, &ones, le256_diff(le), old_diff_from_target(le));
+	for (diff = 1e-6; diff > 1e-300; diff /= 7.3)
+		check_target(diff);
+	check_target(ldexp(1, -32));
+	check_target(nextafter(ldexp(1, -32), 0));
+	check_target(nextafter(ldexp(1, -32), 1));
+
+	/* Powers of 2 and the doubles either side, with a hash on the target
+	 * meeting it and one above not */
+	for (k = -31; k <= 220; k++) {
+		diff = ldexp(1, k);
+		check_target(diff);
+		check_target(nextafter(diff, 0));
+		check_target(nextafter(diff, INFINITY));
+		u256_target_from_diff(&target, diff);
+		b = target;
+		for (i = 0; i < 4 && !++b.w[i]; i++)
+			;
+		check_compare(&target, &b);
+		u256_to_le(le, &target);
+		u256_to_le(hash, &b);
+		check_cases += 2;
+		if (!le256_le(le, le) || le256_le(hash, le))
+			check_fail("hash at the target", diff, &target);
+	}
+
+	/* Random integer, fractional and full range diffs */
+	for (i = 0; i < CHECK_RANDOM; i++) {
+		check_target((double)(bench_rand() % 100000000) + 1);
+		check_target((double)(bench_rand() % 1000000000) / 1000.0 + 0.001);
+		check_target(ldexp((double)(bench_rand() >> 11) + 1, (int)(bench_rand() % 220) - 85));
+	}
+
+	/* Random targets, and hashes on, above and below them */
+	for (i = 0; i < CHECK_RANDOM; i++) {
+		a = check_random();
+		b = check_random();
+		u256_to_le(le, &a);
+		check_rel("diff differs from diff_from_target", 0, &a, le256_diff(le), old_diff_from_target(le));
+		check_compare(&a, &b);
+		check_compare(&a, &a);
+		b = a;
+		b.w[0]++;
+		check_compare(&a, &b);
+		b = a;
+		b.w[3] ^= 1ULL << (bench_rand() % 64);
+		check_compare(&a, &b);
+	}
+
+	applog(LOG_NOTICE, "u256 self-check passed %d cases", check_cases);
+}
+
+static char bench_header_hex[161];
+static unsigned char bench_header_bin[80];
+
+static void setup_hex(int __maybe_unused ops)
+{
+	bench_rand_hex(bench_header_hex, 80);
+}
+
+static void op_hex2bin(int __maybe_unused i)
+{
+	hex2bin(bench_header_bin, bench_header_hex, 80);
+}
+
+static void op_bin2hex(int __maybe_unused i)
+{
+	free(bin2hex(bench_header_bin, 80));
+}
+
+static void op_cgtime(int __maybe_unused i)
+{
+	struct timeval tv;
+
+	cgtime(&tv);
+}
+
+static void op_cgtime_coarse(int __maybe_unused i)
+{
+	struct timeval tv;
+
+	cgtime_coarse(&tv);
+}
+
+static pthread_mutex_t bench_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static void op_mutex(int __maybe_unused i)
+{
+	mutex_lock(&bench_mutex);
+	mutex_unlock(&bench_mutex);
+}
+
+/* Unique nonces spread over 16 jobs. The whole run falls inside the one
+ * second window, so each check scans every nonce checked before it */
+static struct cgpu_info bench_dup_cgpu;
+static struct work *bench_dup_works[16];
+
+static void setup_dupnonce(int __maybe_unused ops)
+{
+	int i;
+
+	bench_dup_cgpu.drv = bench_cgpus[0].drv;
+	dupalloc(&bench_dup_cgpu, 1);
+	for (i = 0; i < 16; i++)
+		bench_dup_works[i] = bench_make_work();
+}
+
+static void op_isdupnonce(int i)
+{
+	isdupnonce(&bench_dup_cgpu, bench_dup_works[i & 15], i);
+}
+
+static void teardown_dupnonce(void)
+{
+	int i;
+
+	for (i = 0; i < 16; i++)
+		free_work(bench_dup_works[i]);
+}
+
+/* Every thread reports shares of its own work against the same pool best */
+static struct work **bench_share_works;
+
+static void setup_share_diff(int __maybe_unused ops)
+{
+	int i;
+
+	setup_hashes(ops);
+	bench_share_works = cgcalloc(bench_threads, sizeof(struct work *));
+	for (i = 0; i < bench_threads; i++)
+		bench_share_works[i] = copy_work(bench_work);
+}
+
+static __thread int bench_tid;
+
+static void op_share_diff(int i)
+{
+	struct work *work = bench_share_works[bench_tid];
+
+	memcpy(work->hash, bench_hashes[i % BENCH_DIFFS], 32);
+	share_diff(work);
+}
+
+static void teardown_share_diff(void)
+{
+	int i;
+
+	for (i = 0; i < bench_threads; i++)
+		free_work(bench_share_works[i]);
+	free(bench_share_works);
+	teardown_hashes();
+}
+
+/* One producer keeps up to BENCH_STAGED items queued, as the getwork thread
+ * does, while the timed threads are the consumers waiting on it */
+static struct work **bench_qworks;
+static int bench_qops, bench_popped;
+static bool (*bench_qpush)(struct work *work);
+static pthread_t bench_producer;
+
+static void *bench_producer_thread(void __maybe_unused *userdata)
+{
+	int i;
+
+	for (i = 0; i < bench_qops; i++) {
+		while (i - __atomic_load_n(&bench_popped, __ATOMIC_ACQUIRE) >= BENCH_STAGED)
+			sched_yield();
+		bench_qpush(bench_qworks[i]);
+	}
+	return NULL;
+}
+
+static void setup_queue(int ops)
+{
+	int i;
+
+	bench_qworks = cgcalloc(ops, sizeof(struct work *));
+	for (i = 0; i < ops; i++)
+		bench_qworks[i] = bench_make_work();
+	bench_qops = ops;
+	bench_popped = 0;
+	if (unlikely(pthread_create(&bench_producer, NULL, bench_producer_thread, NULL)))
+		quit(1, "Failed to create benchmark producer thread");
+}
+
+static void teardown_queue(void)
+{
+	int i;
+
+	pthread_join(bench_producer, NULL);
+	for (i = 0; i < bench_qops; i++)
+		free_work(bench_qworks[i]);
+	free(bench_qworks);
+}
+
+static void setup_hash_queue(int ops)
+{
+	bench_qpush = bench_hash_push;
+	setup_queue(ops);
+}
+
+static void op_hash_pop(int __maybe_unused i)
+{
+	bench_hash_pop(true);
+	__atomic_add_fetch(&bench_popped, 1, __ATOMIC_RELEASE);
+}
+
+static struct thread_q *bench_tq;
+
+static bool bench_tq_push(struct work *work)
+{
+	return tq_push(bench_tq, work);
+}
+
+static void setup_tq(int ops)
+{
+	bench_tq = tq_new();
+	bench_qpush = bench_tq_push;
+	setup_queue(ops);
+}
+
+static void op_tq_pop(int __maybe_unused i)
+{
+	while (!tq_pop(bench_tq))
+		;
+	__atomic_add_fetch(&bench_popped, 1, __ATOMIC_RELEASE);
+}
+
+static void teardown_tq(void)
+{
+	teardown_queue();
+	tq_free(bench_tq);
+}
+
+/* A GBT response of BENCH_GBT_TXNS transactions, copied afresh before each
+ * decode since decoding blanks the array in place */
+static char *bench_gbt, *bench_gbt_buf;
+static size_t bench_gbt_len;
+
+static void setup_gbt(int __maybe_unused ops)
+{
+	size_t siz, len;
+	char txid[65], hash[65], *data;
+	int i;
+
+	data = cgmalloc(BENCH_GBT_TXN_LEN * 2 + 1);
+	siz = 256 + BENCH_GBT_TXNS * (BENCH_GBT_TXN_LEN * 2 + 256);
+	bench_gbt = cgmalloc(siz);
+	len = snprintf(bench_gbt, siz, "{\"result\":{\"version\":536870912,\"transactions\":[");
+	for (i = 0; i < BENCH_GBT_TXNS; i++) {
+		bench_rand_hex(data, BENCH_GBT_TXN_LEN);
+		bench_rand_hex(txid, 32);
+		bench_rand_hex(hash, 32);
+		len += snprintf(bench_gbt + len, siz - len,
+				"%s{\"data\":\"%s\",\"txid\":\"%s\",\"hash\":\"%s\","
+				"\"depends\":[],\"fee\":%d,\"sigops\":4,\"weight\":%d}",
+				i ? "," : "", data, txid, hash, 1000 + i, BENCH_GBT_TXN_LEN * 4);
+	}
+	len += snprintf(bench_gbt + len, siz - len, "],\"height\":840000}"
+			",\"error\":null,\"id\":0}");
+	bench_gbt_len = len;
+	bench_gbt_buf = cgmalloc(len + 1);
+	free(data);
+}
+
+static void prep_gbt(int __maybe_unused i)
+{
+	memcpy(bench_gbt_buf, bench_gbt, bench_gbt_len + 1);
+}
+
+static void op_gbt_decode(int __maybe_unused i)
+{
+	struct gbt_txns txns;
+
+	if (unlikely(!gbt_stream_txns(bench_gbt_buf, &txns)))
+		quit(1, "Failed to decode the benchmark GBT");
+	gbt_txns_free(&txns);
+}
+
+static void teardown_gbt(void)
+{
+	free(bench_gbt);
+	free(bench_gbt_buf);
+}
+
+#ifdef BENCH_SPI
+/* A chain job refill as the A1 driver does it, every chip's job write then a
+ * poll for its ACK, one SPI_IOC_MESSAGE per transfer or batched. The loopback
+ * simulator stands in for the chain, and writes each message to /dev/null as
+ * one writev so every message still costs the one syscall the ioctl would. */
+static struct spi_ctx *bench_spi;
+static struct spi_batch bench_spi_batch;
+static uint8_t *bench_spi_tx, *bench_spi_rx;
+static int bench_spi_null;
+
+static bool bench_spi_sim(struct spi_ctx *ctx, struct spi_ioc_transfer *xfrs, int count)
+{
+	struct iovec iov[SPI_BATCH_MAX_XFERS];
+	int i, n = 0;
+
+	for (i = 0; i < count; i++) {
+		if (!xfrs[i].tx_buf)
+			continue;
+		iov[n].iov_base = (void *)(unsigned long)xfrs[i].tx_buf;
+		iov[n++].iov_len = xfrs[i].len;
+	}
+	if (unlikely(writev(bench_spi_null, iov, n) < 0))
+		return false;
+	return spi_loopback_sim(ctx, xfrs, count);
+}
+
+static int bench_spi_poll_len(int chip)
+{
+	return 4 * (chip + 1) - 2;
+}
+
+static void setup_spi(int __maybe_unused ops)
+{
+	struct spi_config config = default_spi_config;
+	size_t len = 0;
+	int chip;
+
+	for (chip = 0; chip < BENCH_SPI_CHIPS; chip++)
+		len += BENCH_SPI_JOB_LEN + bench_spi_poll_len(chip);
+	bench_spi_tx = cgcalloc(1, len);
+	bench_spi_rx = cgcalloc(1, len);
+	for (chip = 0; chip < BENCH_SPI_CHIPS * BENCH_SPI_JOB_LEN; chip++)
+		bench_spi_tx[chip] = bench_rand();
+
+	bench_spi_null = open("/dev/null", O_WRONLY);
+	if (unlikely(bench_spi_null < 0))
+		quit(1, "Failed to open /dev/null for the SPI benchmark");
+	bench_spi = spi_init_sim(&config, bench_spi_sim, NULL);
+	spi_batch_init(&bench_spi_batch, bench_spi);
+}
+
+static void op_spi_chain_single(int __maybe_unused i)
+{
+	uint8_t *tx = bench_spi_tx, *rx = bench_spi_rx;
+	int chip;
+
+	for (chip = 0; chip < BENCH_SPI_CHIPS; chip++, tx += BENCH_SPI_JOB_LEN, rx += BENCH_SPI_JOB_LEN)
+		spi_transfer(bench_spi, tx, rx, BENCH_SPI_JOB_LEN);
+	for (chip = 0; chip < BENCH_SPI_CHIPS; rx += bench_spi_poll_len(chip++))
+		spi_transfer(bench_spi, NULL, rx, bench_spi_poll_len(chip));
+}
+
+static void op_spi_chain_batch(int __maybe_unused i)
+{
+	uint8_t *tx = bench_spi_tx, *rx = bench_spi_rx, *poll;
+	int chip;
+
+	poll = rx + BENCH_SPI_CHIPS * BENCH_SPI_JOB_LEN;
+	for (chip = 0; chip < BENCH_SPI_CHIPS; chip++, tx += BENCH_SPI_JOB_LEN, rx += BENCH_SPI_JOB_LEN) {
+		spi_batch_add(&bench_spi_batch, tx, rx, BENCH_SPI_JOB_LEN, true, 0);
+		spi_batch_add(&bench_spi_batch, NULL, poll, bench_spi_poll_len(chip), true, 0);
+		poll += bench_spi_poll_len(chip);
+	}
+	if (unlikely(!spi_batch_submit(&bench_spi_batch)))
+		quit(1, "SPI benchmark batch failed");
+}
+
+/* Every job must have looped back intact, however it was split into
+ * messages */
+static void teardown_spi(void)
+{
+	if (unlikely(memcmp(bench_spi_tx, bench_spi_rx, BENCH_SPI_CHIPS * BENCH_SPI_JOB_LEN)))
+		quit(1, "SPI benchmark jobs did not loop back intact");
+	applog(LOG_NOTICE, "SPI %"PRIu64" messages of %"PRIu64" transfers, %"PRIu64" bytes",
+	       bench_spi->messages, bench_spi->transfers, bench_spi->bytes);
+	spi_batch_free(&bench_spi_batch);
+	spi_exit(bench_spi);
+	close(bench_spi_null);
+	free(bench_spi_tx);
+	free(bench_spi_rx);
+}
+#endif /* BENCH_SPI */
+
+#ifdef HAVE_LIBCURL
+/* The GBT txid and witness merkle trees of templates of 1k to 10k random
+ * transactions, built on -t threads. Teardown checks the last build against
+ * a plain serial build of both roots. */
+static struct gbt_txns bench_merkle_txns;
+static unsigned char bench_merkle_cb[32], bench_merkle_root[32], bench_merkle_wroot[32];
+
+static void bench_dsha(const unsigned char *data, int len, unsigned char *hash)
+{
+	unsigned char hash1[32];
+
+	sha256(data, len, hash1);
+	sha256(hash1, 32, hash);
+}
+
+/* The root of leaves entries, with room in level for an odd one's copy */
+static void bench_merkle_ref(unsigned char *level, int leaves, unsigned char *root)
+{
+	int i;
+
+	while (leaves > 1) {
+		if (leaves % 2) {
+			memcpy(level + leaves * 32, level + (leaves - 1) * 32, 32);
+			leaves++;
+		}
+		for (i = 0; i < leaves; i += 2)
+			bench_dsha(level + i * 32, 64, level + i / 2 * 32);
+		leaves /= 2;
+	}
+	memcpy(root, level, 32);
+}
+
+static void setup_merkle(int txns)
+{
+	int i;
+
+	memset(&bench_merkle_txns, 0, sizeof(bench_merkle_txns));
+	bench_merkle_txns.count = txns;
+	bench_merkle_txns.txids = cgmalloc(txns * 32);
+	bench_merkle_txns.hashes = cgmalloc(txns * 32);
+	bench_merkle_txns.have_hashes = true;
+	for (i = 0; i < txns * 32; i++) {
+		bench_merkle_txns.txids[i] = bench_rand();
+		bench_merkle_txns.hashes[i] = bench_rand();
+	}
+	for (i = 0; i < 32; i++)
+		bench_merkle_cb[i] = bench_rand();
+}
+
+static void setup_merkle_1k(int __maybe_unused ops)
+{
+	setup_merkle(1000);
+}
+
+static void setup_merkle_4k(int __maybe_unused ops)
+{
+	setup_merkle(4000);
+}
+
+static void setup_merkle_10k(int __maybe_unused ops)
+{
+	setup_merkle(10000);
+}
+
+static void op_merkle(int __maybe_unused i)
+{
+	memcpy(bench_merkle_root, bench_merkle_cb, 32);
+	bench_gbt_merkle(bench_pool, &bench_merkle_txns, bench_merkle_root,
+			 bench_merkle_wroot, bench_threads);
+}
+
+static void teardown_merkle(void)
+{
+	int txns = bench_merkle_txns.count;
+	unsigned char *level, root[32], wroot[32], wsha[64];
+
+	level = cgcalloc(txns + 2, 32);
+	memcpy(level, bench_merkle_cb, 32);
+	memcpy(level + 32, bench_merkle_txns.txids, txns * 32);
+	bench_merkle_ref(level, txns + 1, root);
+
+	/* The coinbase wtxid is all zeroes, and the witness nonce too */
+	memset(level, 0, 32);
+	memcpy(level + 32, bench_merkle_txns.hashes, txns * 32);
+	bench_merkle_ref(level, txns + 1, wsha);
+	memset(wsha + 32, 0, 32);
+	bench_dsha(wsha, 64, wroot);
+	free(level);
+
+	if (unlikely(memcmp(root, bench_merkle_root, 32) || memcmp(wroot, bench_merkle_wroot, 32)))
+		quit(1, "Merkle benchmark roots differ from a serial build");
+
+	free(bench_merkle_txns.txids);
+	free(bench_merkle_txns.hashes);
+	free(bench_merkle_txns.data);
+}
+#endif /* HAVE_LIBCURL */
+
+/* Devices with a typical amount of driver specific stats each */
+static struct api_data *bench_api_stats(struct cgpu_info *cgpu)
+{
+	struct api_data *root = NULL;
+	char buf[32];
+	double freq;
+	int i, n;
+
+	root = api_add_int(root, "Chips", &(cgpu->device_id), false);
+	for (i = 0; i < BENCH_CHIPS; i++) {
+		n = i * 997 + cgpu->device_id;
+		freq = 600 + (i % 8) * 6.25;
+		snprintf(buf, sizeof(buf), "Chip %d Nonces", i);
+		root = api_add_int(root, buf, &n, true);
+		snprintf(buf, sizeof(buf), "Chip %d Freq", i);
+		root = api_add_freq(root, buf, &freq, true);
+	}
+
+	return root;
+}
+
+static struct device_drv bench_drv = {
+	.dname = "bench",
+	.name = "BEN",
+	.get_api_stats = bench_api_stats,
+};
+
+static void setup_devices(void)
+{
+	int i;
+
+	for (i = 0; i < BENCH_DEVICES; i++) {
+		bench_cgpus[i].drv = &bench_drv;
+		bench_cgpus[i].deven = DEV_ENABLED;
+		bench_cgpus[i].threads = 1;
+		add_cgpu(&bench_cgpus[i]);
+	}
+}
+
+static void op_api_stats(int __maybe_unused i)
+{
+	api_bench_reply("stats", NULL, true);
+}
+
+static const struct bench benches[] = {
+	{ "calc_midstate",	1000000, 16, false, NULL, NULL, op_calc_midstate, NULL },
+	{ "gen_stratum_work",	200000,	1, false, NULL, NULL, op_gen_stratum_work, NULL },
+	{ "parse_notify",	50000,	1, false, NULL, NULL, op_parse_notify, NULL },
+	{ "test_nonce",		1000000, 16, false, NULL, NULL, op_test_nonce, NULL },
+	{ "test_nonce_value",	1000000, 16, false, NULL, NULL, op_test_nonce_value, NULL },
+	{ "copy_work",		1000000, 16, false, NULL, NULL, op_copy_work, NULL },
+	{ "fulltest",		10000000, 256, false, setup_hashes, NULL, op_fulltest, teardown_hashes },
+	{ "target_from_diff",	2000000, 64, false, setup_hashes, NULL, op_target_from_diff, teardown_hashes },
+	{ "le256_diff",		10000000, 256, false, setup_hashes, NULL, op_le256_diff, teardown_hashes },
+	{ "hex2bin",		2000000, 64, false, setup_hex, NULL, op_hex2bin, NULL },
+	{ "bin2hex",		2000000, 64, false, setup_hex, NULL, op_bin2hex, NULL },
+	{ "cgtime",		10000000, 256, false, NULL, NULL, op_cgtime, NULL },
+	{ "cgtime_coarse",	10000000, 256, false, NULL, NULL, op_cgtime_coarse, NULL },
+	{ "mutex_lock",		10000000, 256, false, NULL, NULL, op_mutex, NULL },
+	{ "isdupnonce",		20000,	16, false, setup_dupnonce, NULL, op_isdupnonce, teardown_dupnonce },
+	{ "share_diff",		4000000, 64, true, setup_share_diff, NULL, op_share_diff, teardown_share_diff },
+	{ "hash_push_pop",	200000,	1, true, setup_hash_queue, NULL, op_hash_pop, teardown_queue },
+	{ "tq_push_pop",	200000,	1, true, setup_tq, NULL, op_tq_pop, teardown_tq },
+	{ "gbt_decode",		200,	1, false, setup_gbt, prep_gbt, op_gbt_decode, teardown_gbt },
+	{ "api_stats",		20000,	1, false, NULL, NULL, op_api_stats, NULL },
+#ifdef HAVE_LIBCURL
+	{ "merkle_1k",		2000,	1, false, setup_merkle_1k, NULL, op_merkle, teardown_merkle },
+	{ "merkle_4k",		500,	1, false, setup_merkle_4k, NULL, op_merkle, teardown_merkle },
+	{ "merkle_10k",		200,	1, false, setup_merkle_10k, NULL, op_merkle, teardown_merkle },
+#endif
+#ifdef BENCH_SPI
+	{ "spi_chain_single",	20000,	1, false, setup_spi, NULL, op_spi_chain_single, teardown_spi },
+	{ "spi_chain_batch",	20000,	1, false, setup_spi, NULL, op_spi_chain_batch, teardown_spi },
+#endif
+	{ NULL, 0, 0, false, NULL, NULL, NULL, NULL }
+};
+
+static void *bench_thread(void *userdata)
+{
+	struct bench_thr *bt = (struct bench_thr *)userdata;
+	const struct bench *b = bt->b;
+	int i, j, n, end = bt->first + bt->ops;
+	int64_t start;
+
+	bench_tid = bt->tid;
+	pthread_barrier_wait(&bench_barrier);
+
+	for (i = bt->first; i < end; i += n) {
+		n = MIN(b->batch, end - i);
+		if (b->prep)
+			b->prep(i);
+		start = bench_ns();
+		for (j = 0; j < n; j++)
+			b->op(i + j);
+		bt->lat[bt->nlat++] = (double)(bench_ns() - start) / n;
+	}
+
+	return NULL;
+}
+
+static int bench_cmp(const void *a, const void *b)
+{
+	double da = *(const double *)a, db = *(const double *)b;
+
+	return da < db ? -1 : (da > db ? 1 : 0);
+}
+
+static double bench_pct(const double *lat, int n, int pct)
+{
+	return lat[(int)((int64_t)(n - 1) * pct / 100)];
+}
+
+static json_t *bench_run(const struct bench *b)
+{
+	int i, nthr = b->threaded ? bench_threads : 1, ops, nlat = 0;
+	struct bench_thr *thr;
+	int64_t start, ns;
+	double *lat;
+	json_t *res;
+
+	ops = MAX((int)(b->ops * bench_scale), nthr);
+	ops -= ops % nthr;
+
+	if (b->setup)
+		b->setup(ops);
+
+	thr = cgcalloc(nthr, sizeof(*thr));
+	pthread_barrier_init(&bench_barrier, NULL, nthr + 1);
+	for (i = 0; i < nthr; i++) {
+		thr[i].b = b;
+		thr[i].tid = i;
+		thr[i].first = i * (ops / nthr);
+		thr[i].ops = ops / nthr;
+		thr[i].lat = cgcalloc(thr[i].ops / b->batch + 1, sizeof(double));
+		if (unlikely(pthread_create(&thr[i].pth, NULL, bench_thread, &thr[i])))
+			quit(1, "Failed to create benchmark thread");
+	}
+	pthread_barrier_wait(&bench_barrier);
+	start = bench_ns();
+	for (i = 0; i < nthr; i++)
+		pthread_join(thr[i].pth, NULL);
+	ns = bench_ns() - start;
+	pthread_barrier_destroy(&bench_barrier);
+
+	if (b->teardown)
+		b->teardown();
+
+	for (i = 0; i < nthr; i++)
+		nlat += thr[i].nlat;
+	lat = cgcalloc(nlat, sizeof(double));
+	for (nlat = 0, i = 0; i < nthr; i++) {
+		memcpy(lat + nlat, thr[i].lat, thr[i].nlat * sizeof(double));
+		nlat += thr[i].nlat;
+		free(thr[i].lat);
+	}
+	free(thr);
+	qsort(lat, nlat, sizeof(double), bench_cmp);
+
+	res = json_pack("{s:s,s:i,s:i,s:i,s:f,s:f,s:f,s:f,s:f,s:f}",
+			"name", b->name,
+			"ops", ops,
+			"threads", nthr,
+			"batch", b->batch,
+			"seconds", ns / 1e9,
+			"ops_per_sec", ns ? ops / (ns / 1e9) : 0.0,
+			"p50_ns", bench_pct(lat, nlat, 50),
+			"p90_ns", bench_pct(lat, nlat, 90),
+			"p99_ns", bench_pct(lat, nlat, 99),
+			"max_ns", lat[nlat - 1]);
+	free(lat);
+
+	return res;
+}
+
+static bool bench_wanted(const char *name, int argc, char **argv, int first)
+{
+	int i;
+
+	if (first >= argc)
+		return true;
+	for (i = first; i < argc; i++) {
+		if (strstr(name, argv[i]))
+			return true;
+	}
+	return false;
+}
+
+static void bench_usage(const char *prog)
+{
+	int i;
+
+	fprintf(stderr, "Usage: %s [-s scale] [-t threads] [name ...]\n"
+		"  -s scale    Multiply every benchmark's op count by scale (default %.1f)\n"
+		"  -t threads  Threads for the multi threaded benchmarks and merkle trees (default %d)\n"
+		"  name        Only run benchmarks whose name contains one of these\n"
+		"Benchmarks:", prog, bench_scale, bench_threads);
+	for (i = 0; benches[i].name; i++)
+		fprintf(stderr, " %s", benches[i].name);
+	fprintf(stderr, "\n");
+	exit(1);
+}
+
+int main(int argc, char *argv[])
+{
+	json_t *root, *results;
+	int i, first;
+	char *out;
+
+	for (i = 1; i < argc && argv[i][0] == '-'; i++) {
+		if (!strcmp(argv[i], "-s") && i + 1 < argc)
+			bench_scale = atof(argv[++i]);
+		else if (!strcmp(argv[i], "-t") && i + 1 < argc)
+			bench_threads = atoi(argv[++i]);
+		else
+			bench_usage(argv[0]);
+	}
+	if (bench_scale <= 0 || bench_threads < 1)
+		bench_usage(argv[0]);
+	first = i;
+
+	bench_init_core();
+	check_u256();
+	bench_setup_pool();
+	setup_devices();
+
+	results = json_array();
+	for (i = 0; benches[i].name; i++) {
+		if (!bench_wanted(benches[i].name, argc, argv, first))
+			continue;
+		json_array_append_new(results, bench_run(&benches[i]));
+	}
+	root = json_pack("{s:s,s:f,s:i,s:o}", "version", PACKAGE " " VERSION, "scale", bench_scale,
+			 "threads", bench_threads, "results", results);
+	out = json_dumps(root, JSON_INDENT(1) | JSON_PRESERVE_ORDER | JSON_REAL_PRECISION(9));
+	printf("%s\n", out);
+	free(out);
+	json_decref(root);
+
+	return 0;
+}
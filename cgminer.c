@@ -67,6 +67,11 @@ char *curly = ":D";
 #include "compat.h"
 #include "miner.h"
 #include "bench_block.h"
+#include "uint256.h"
+#include "history.h"
+#include "allocprof.h"
+#include "stratrec.h"
+#include "stratsrv.h"
 #ifdef USE_USBUTILS
 #include "usbutils.h"
 #endif
@@ -157,6 +162,7 @@ struct strategies strategies[] = {
 	{ "Rotate" },
 	{ "Load Balance" },
 	{ "Balance" },
+	{ "Weighted" },
 };
 
 static char packagename[256];
@@ -451,6 +457,7 @@ static int watchpool_thr_id;
 static int watchdog_thr_id;
 #ifdef HAVE_CURSES
 static int input_thr_id;
+static int curses_thr_id;
 #endif
 int gpur_thr_id;
 static int api_thr_id;
@@ -464,10 +471,6 @@ static int new_devices;
 static int new_threads;
 int hotplug_time = 5;
 
-#if LOCK_TRACKING
-pthread_mutex_t lockstat_lock;
-#endif
-
 pthread_mutex_t hash_lock;
 static pthread_mutex_t *stgd_lock;
 pthread_mutex_t console_lock;
@@ -517,6 +520,8 @@ pthread_mutex_t stats_lock;
 int hw_errors;
 int64_t total_accepted, total_rejected, total_diff1;
 int64_t total_getworks, total_stale, total_discarded;
+uint64_t failovers;
+double failover_gap_last, failover_gap_max, failover_gap_total;
 double total_diff_accepted, total_diff_rejected, total_diff_stale;
 static int staged_rollable;
 unsigned int new_blocks;
@@ -532,6 +537,7 @@ static struct pool *currentpool = NULL;
 int total_pools, enabled_pools;
 enum pool_strategy pool_strategy = POOL_FAILOVER;
 int opt_rotate_period;
+int opt_standby_pools;
 static int total_urls, total_users, total_passes, total_userpasses;
 
 static
@@ -548,7 +554,6 @@ static char current_block[32];
 static char datestamp[40];
 static char blocktime[32];
 struct timeval block_timeval;
-static char best_share[8] = "0";
 double current_diff = 0xFFFFFFFFFFFFFFFFULL;
 static char block_diff[8];
 uint64_t best_diff = 0;
@@ -1081,6 +1086,12 @@ static char *set_loadbalance(enum pool_strategy *strategy)
 	return NULL;
 }
 
+static char *set_weighted(enum pool_strategy *strategy)
+{
+	*strategy = POOL_WEIGHTED;
+	return NULL;
+}
+
 static char *set_rotate(const char *arg, char __maybe_unused *i)
 {
 	pool_strategy = POOL_ROTATE;
@@ -1238,6 +1249,12 @@ static char *set_userpass(const char *arg)
 	return NULL;
 }
 
+static char *enable_alloc_stats(__maybe_unused bool *flag)
+{
+	allocprof_enable(true);
+	return NULL;
+}
+
 static char *enable_debug(bool *flag)
 {
 	*flag = true;
@@ -1399,6 +1416,12 @@ static char *set_version_path(const char *arg)
 
 /* These options are available from config file or commandline */
 static struct opt_table opt_config_table[] = {
+	OPT_WITHOUT_ARG("--alloc-stats",
+			enable_alloc_stats, &opt_alloc_stats,
+			"Profile memory allocations per call site for the API allocstats command"),
+	OPT_WITH_ARG("--alloc-stats-log",
+		     set_int_0_to_9999, opt_show_intval, &opt_alloc_stats_log,
+		     "Log the call sites holding most memory every N seconds with --alloc-stats, 0 never"),
 #ifdef USE_ICARUS
 	OPT_WITH_ARG("--anu-freq",
 		     set_float_125_to_500, &opt_show_floatval, &opt_anu_freq,
@@ -1593,6 +1616,9 @@ static struct opt_table opt_config_table[] = {
 	OPT_WITH_ARG("--avalon7-polling-delay",
 		     set_int_1_to_65535, opt_show_intval, &opt_avalon7_polling_delay,
 		     "Set Avalon7 polling delay value (ms)"),
+	OPT_WITH_ARG("--avalon7-polling-depth",
+		     set_int_1_to_10, opt_show_intval, &opt_avalon7_polling_depth,
+		     "Set Avalon7 number of module polls kept outstanding in the AUC at once"),
 	OPT_WITH_ARG("--avalon7-aucspeed",
 		     opt_set_intval, opt_show_intval, &opt_avalon7_aucspeed,
 		     "Set AUC3 IIC bus speed"),
@@ -1649,6 +1675,9 @@ static struct opt_table opt_config_table[] = {
 	OPT_WITH_ARG("--avalon8-polling-delay",
 		     set_int_1_to_65535, opt_show_intval, &opt_avalon8_polling_delay,
 		     "Set Avalon8 polling delay value (ms)"),
+	OPT_WITH_ARG("--avalon8-polling-depth",
+		     set_int_1_to_10, opt_show_intval, &opt_avalon8_polling_depth,
+		     "Set Avalon8 number of module polls kept outstanding in the AUC at once"),
 	OPT_WITH_ARG("--avalon8-aucspeed",
 		     opt_set_intval, opt_show_intval, &opt_avalon8_aucspeed,
 		     "Set AUC3 IIC bus speed"),
@@ -2250,6 +2279,9 @@ static struct opt_table opt_config_table[] = {
 		     set_int_0_to_200, opt_show_intval, &opt_hfa_target,
 		     "Set the hashfast target temperature (0 to disable)"),
 #endif
+	OPT_WITH_ARG("--history-interval",
+		     set_int_0_to_9999, opt_show_intval, &opt_history_interval,
+		     "Seconds per sample of device and pool history (0 to disable)"),
 #ifdef USE_HASHRATIO
 	OPT_WITH_CBARG("--hro-freq",
 		       set_hashratio_freq, NULL, &opt_hashratio_freq,
@@ -2356,12 +2388,18 @@ static struct opt_table opt_config_table[] = {
 	OPT_WITHOUT_ARG("--net-delay",
 			opt_set_bool, &opt_delaynet,
 			"Impose small delays in networking to not overload slow routers"),
+	OPT_WITHOUT_ARG("--no-lock-stats",
+			opt_set_invbool, &opt_lock_stats,
+			"Don't collect lock contention stats for the API lockstats command"),
 	OPT_WITHOUT_ARG("--no-pool-disable",
 			opt_set_invbool, &opt_disable_pool,
 			opt_hidden),
 	OPT_WITHOUT_ARG("--no-submit-stale",
 			opt_set_invbool, &opt_submit_stale,
 		        "Don't submit shares if they are detected as stale"),
+	OPT_WITH_ARG("--nonce-threads",
+		     set_int_0_to_255, opt_show_intval, &opt_nonce_threads,
+		     "Number of threads verifying nonces for drivers using the nonce pipeline, 0 verifies on the device thread"),
 #ifdef USE_BITFURY
 	OPT_WITH_ARG("--osm-led-mode",
 		     set_int_0_to_4, opt_show_intval, &opt_osm_led_mode,
@@ -2430,6 +2468,30 @@ static struct opt_table opt_config_table[] = {
 	OPT_WITH_ARG("--socks-proxy",
 		     opt_set_charp, NULL, &opt_socks_proxy,
 		     "Set socks4 proxy (host:port)"),
+	OPT_WITH_ARG("--standby-pools",
+		     set_int_0_to_9999, opt_show_intval, &opt_standby_pools,
+		     "Keep N backup stratum pools connected and authorised for fast failover"),
+	OPT_WITH_ARG("--stratum-record",
+		     opt_set_charp, NULL, &opt_stratum_record,
+		     "Record all stratum traffic to a capture file"),
+	OPT_WITH_ARG("--stratum-replay",
+		     opt_set_charp, NULL, &opt_stratum_replay,
+		     "Serve a --stratum-record capture as a local stratum pool"),
+	OPT_WITH_ARG("--stratum-replay-port",
+		     set_int_1_to_65535, opt_show_intval, &opt_stratum_replay_port,
+		     "Port for --stratum-replay to listen on 127.0.0.1"),
+	OPT_WITH_ARG("--stratum-replay-speed",
+		     set_float_0_to_500, opt_show_floatval, &opt_stratum_replay_speed,
+		     "Speed up --stratum-replay by this factor, 0 sends without delays"),
+	OPT_WITH_ARG("--stratum-server",
+		     set_int_0_to_65535, NULL, &opt_stratum_server,
+		     "Serve the current pool's work to other miners as a stratum server on this port"),
+	OPT_WITH_ARG("--stratum-server-diff",
+		     set_int_1_to_65535, opt_show_intval, &opt_stratum_server_diff,
+		     "Starting and lowest difficulty for --stratum-server miners"),
+	OPT_WITH_ARG("--stratum-server-rate",
+		     set_int_1_to_255, opt_show_intval, &opt_stratum_server_rate,
+		     "Shares per minute --stratum-server aims for from each miner"),
 	OPT_WITH_ARG("--suggest-diff",
 		     opt_set_intval, NULL, &opt_suggest_diff,
 		     "Suggest miner difficulty for pool to user (default: none)"),
@@ -2458,6 +2520,9 @@ static struct opt_table opt_config_table[] = {
 	OPT_WITH_ARG("--usb",
 		     opt_set_charp, NULL, &opt_usb_select,
 		     "USB device selection"),
+	OPT_WITH_ARG("--usb-detect-threads",
+		     set_int_1_to_255, opt_show_intval, &opt_usb_detect_threads,
+		     "Number of USB devices to probe at once during detection"),
 	OPT_WITH_ARG("--usb-dump",
 		     set_int_0_to_10, opt_show_intval, &opt_usbdump,
 		     opt_hidden),
@@ -2474,6 +2539,9 @@ static struct opt_table opt_config_table[] = {
 	OPT_WITHOUT_ARG("--verbose",
 			opt_set_bool, &opt_log_output,
 			"Log verbose output to stderr as well as status output"),
+	OPT_WITHOUT_ARG("--weighted-balance",
+		     set_weighted, &pool_strategy,
+		     "Change multipool strategy from failover to quota weighted difficulty balance"),
 	OPT_WITHOUT_ARG("--widescreen",
 			opt_set_bool, &opt_widescreen,
 			"Use extra wide display without toggling"),
@@ -2788,22 +2856,22 @@ static void calc_midstate(struct pool *pool, struct work *work)
 		flip64(data32, work->data);
 		sha256_init(&ctx);
 		sha256_update(&ctx, data, 64);
-		cg_memcpy(work->midstate1, ctx.h, 32);
-		endian_flip32(work->midstate1, work->midstate1);
+		cg_memcpy(work_midstate(work, 1), ctx.h, 32);
+		endian_flip32(work_midstate(work, 1), work_midstate(work, 1));
 
 		memcpy(work->data, &(pool->vmask_001[4]), 4);
 		flip64(data32, work->data);
 		sha256_init(&ctx);
 		sha256_update(&ctx, data, 64);
-		cg_memcpy(work->midstate2, ctx.h, 32);
-		endian_flip32(work->midstate2, work->midstate2);
+		cg_memcpy(work_midstate(work, 2), ctx.h, 32);
+		endian_flip32(work_midstate(work, 2), work_midstate(work, 2));
 
 		memcpy(work->data, &(pool->vmask_001[8]), 4);
 		flip64(data32, work->data);
 		sha256_init(&ctx);
 		sha256_update(&ctx, data, 64);
-		cg_memcpy(work->midstate3, ctx.h, 32);
-		endian_flip32(work->midstate3, work->midstate3);
+		cg_memcpy(work_midstate(work, 3), ctx.h, 32);
+		endian_flip32(work_midstate(work, 3), work_midstate(work, 3));
 
 		memcpy(work->data, &(pool->vmask_001[0]), 4);
 	}
@@ -2834,14 +2902,22 @@ static struct work *make_work(void)
 	return work;
 }
 
-/* This is the central place all work that is about to be retired should be
- * cleaned to remove any dynamically allocated arrays within the struct */
-void clean_work(struct work *work)
+/* Keep the hot part of struct work within its cache lines */
+typedef char work_hot_size_check[offsetof(struct work, vmidstate) <= WORK_HOT_BYTES ? 1 : -1];
+
+static void free_work_strings(struct work *work)
 {
 	free(work->job_id);
 	free(work->ntime);
 	free(work->coinbase);
 	free(work->nonce1);
+}
+
+/* This is the central place all work that is about to be retired should be
+ * cleaned to remove any dynamically allocated arrays within the struct */
+void clean_work(struct work *work)
+{
+	free_work_strings(work);
 	memset(work, 0, sizeof(struct work));
 }
 
@@ -2858,7 +2934,8 @@ void _free_work(struct work **workptr, const char *file, const char *func, const
 		return;
 	}
 
-	clean_work(work);
+	/* No need to clear what's about to be freed */
+	free_work_strings(work);
 	free(work);
 	*workptr = NULL;
 }
@@ -2868,18 +2945,39 @@ static void calc_diff(struct work *work, double known);
 char *workpadding = "000000800000000000000000000000000000000000000000000000000000000000000000000000000000000080020000";
 
 #ifdef HAVE_LIBCURL
+/* How old a GBT template may get before it is refreshed */
+#define GBT_REFRESH_SECS 60
+
+/* The transaction set of a GBT template is decoded into a standby copy
+ * outside of gbt_lock and only swapped into the pool once complete, so work
+ * generation never waits on the (potentially large) transaction decode. */
+struct gbt_standby {
+	char *txn_data;
+	int transactions;
+	int merkles;
+	unsigned char *merklebin;
+};
+
 /* Process transactions with GBT by storing the binary value of the first
  * transaction, and the hashes of the remaining transactions since these
- * remain constant with an altered coinbase when generating work. Must be
- * entered under gbt_lock */
-static void gbt_merkle_bins(struct pool *pool, json_t *transaction_arr);
+ * remain constant with an altered coinbase when generating work. */
+static bool gbt_merkle_bins(struct pool *pool, struct gbt_txns *txns, struct gbt_standby *sb,
+			    unsigned char *witness_root);
 
-static void __build_gbt_txns(struct pool *pool, json_t *res_val)
+/* Swap a completed standby transaction set into the pool. The previous
+ * txn_data and merklebin are handed back in sb to be freed outside the lock.
+ * Must be entered under gbt_lock */
+static void __gbt_swap_standby(struct pool *pool, struct gbt_standby *sb)
 {
-	json_t *txn_array;
+	unsigned char *merklebin = pool->merklebin;
+	char *txn_data = pool->txn_data;
 
-	txn_array = json_object_get(res_val, "transactions");
-	gbt_merkle_bins(pool, txn_array);
+	pool->txn_data = sb->txn_data;
+	sb->txn_data = txn_data;
+	pool->merklebin = sb->merklebin;
+	sb->merklebin = merklebin;
+	pool->transactions = sb->transactions;
+	pool->merkles = sb->merkles;
 }
 
 static void __gbt_merkleroot(struct pool *pool, unsigned char *merkle_root)
@@ -2896,10 +2994,28 @@ static void __gbt_merkleroot(struct pool *pool, unsigned char *merkle_root)
 	}
 }
 
-static bool work_decode(struct pool *pool, struct work *work, json_t *val);
+static bool work_decode(struct pool *pool, struct work *work, json_t *val, struct gbt_txns *txns);
+
+/* Nudge the pool's template refresh thread without waiting on it. Only post
+ * once per refresh so a stale template doesn't fill the semaphore from every
+ * call to generate work. gbt_refresh_wanted is shared with the refresh thread
+ * and set by any thread generating work, so only the caller that flips it
+ * posts. */
+static bool gbt_refresh_request(struct pool *pool)
+{
+	bool wanted = false;
+
+	if (unlikely(!pool->gbt_refresh_started))
+		return false;
+	if (__atomic_compare_exchange_n(&pool->gbt_refresh_wanted, &wanted, true, false,
+					__ATOMIC_ACQ_REL, __ATOMIC_RELAXED))
+		cgsem_post(&pool->gbt_refresh_sem);
+	return true;
+}
 
 static void update_gbt(struct pool *pool)
 {
+	struct gbt_txns txns;
 	int rolltime;
 	json_t *val;
 	CURL *curl;
@@ -2908,12 +3024,12 @@ static void update_gbt(struct pool *pool)
 	if (unlikely(!curl))
 		quit (1, "CURL initialisation failed in update_gbt");
 
-	val = json_rpc_call(curl, pool->rpc_url, pool->rpc_userpass,
-			    pool->rpc_req, true, false, &rolltime, pool, false);
+	val = json_rpc_call_gbt(curl, pool->rpc_url, pool->rpc_userpass,
+				pool->rpc_req, true, false, &rolltime, pool, &txns);
 
 	if (val) {
 		struct work *work = make_work();
-		bool rc = work_decode(pool, work, val);
+		bool rc = work_decode(pool, work, val, &txns);
 
 		total_getworks++;
 		pool->getwork_requested++;
@@ -2927,6 +3043,7 @@ static void update_gbt(struct pool *pool)
 			       pool->pool_no, pool->rpc_url);
 		}
 		json_decref(val);
+		gbt_txns_free(&txns);
 		free_work(work);
 	} else {
 		applog(LOG_DEBUG, "FAILED to update GBT from pool %u %s",
@@ -2942,7 +3059,8 @@ static void gen_gbt_work(struct pool *pool, struct work *work)
 	uint64_t nonce2le;
 
 	cgtime(&now);
-	if (now.tv_sec - pool->tv_lastwork.tv_sec > 60)
+	if (now.tv_sec - pool->tv_lastwork.tv_sec > GBT_REFRESH_SECS &&
+	    !gbt_refresh_request(pool))
 		update_gbt(pool);
 
 	cg_wlock(&pool->gbt_lock);
@@ -2994,7 +3112,7 @@ static void gen_gbt_work(struct pool *pool, struct work *work)
 	cgtime(&work->tv_staged);
 }
 
-static bool gbt_decode(struct pool *pool, json_t *res_val)
+static bool gbt_decode(struct pool *pool, json_t *res_val, struct gbt_txns *txns)
 {
 	const char *previousblockhash;
 	const char *target;
@@ -3009,6 +3127,7 @@ static bool gbt_decode(struct pool *pool, json_t *res_val)
 	const char *workid;
 	int cbt_len, orig_len;
 	uint8_t *extra_len;
+	struct gbt_standby sb;
 	size_t cal_len;
 
 	previousblockhash = json_string_value(json_object_get(res_val, "previousblockhash"));
@@ -3040,6 +3159,12 @@ static bool gbt_decode(struct pool *pool, json_t *res_val)
 	if (workid)
 		applog(LOG_DEBUG, "workid: %s", workid);
 
+	if (unlikely(!gbt_merkle_bins(pool, txns, &sb, NULL))) {
+		free(sb.txn_data);
+		free(sb.merklebin);
+		return false;
+	}
+
 	cg_wlock(&pool->gbt_lock);
 	free(pool->coinbasetxn);
 	pool->coinbasetxn = strdup(coinbasetxn);
@@ -3080,181 +3205,265 @@ static bool gbt_decode(struct pool *pool, json_t *res_val)
 
 	hex2bin((unsigned char *)&pool->gbt_bits, bits, 4);
 
-	__build_gbt_txns(pool, res_val);
+	__gbt_swap_standby(pool, &sb);
 	if (pool->transactions < 3)
 		pool->bad_work++;
 	cg_wunlock(&pool->gbt_lock);
 
+	free(sb.txn_data);
+	free(sb.merklebin);
+
 	return true;
 }
 
-static void gbt_merkle_bins(struct pool *pool, json_t *transaction_arr)
-{
-	unsigned char *hashbin;
-	json_t *arr_val;
-	int i, j, binleft, binlen;
-
-	free(pool->txn_data);
-	pool->txn_data = NULL;
-	pool->transactions = 0;
-	pool->merkles = 0;
-	pool->transactions = json_array_size(transaction_arr);
-	binlen = pool->transactions * 32 + 32;
-	hashbin = alloca(binlen + 32);
-	memset(hashbin, 0, 32);
-	binleft = binlen / 32;
-	if (pool->transactions) {
-		int len = 0, ofs = 0;
-		const char *txn;
-
-		for (i = 0; i < pool->transactions; i++) {
-			arr_val = json_array_get(transaction_arr, i);
-			txn = json_string_value(json_object_get(arr_val, "data"));
-			if (!txn) {
-				applog(LOG_ERR, "Pool %d json_string_value fail - cannot find transaction data",
-					pool->pool_no);
-				return;
-			}
-			len += strlen(txn);
-		}
-
-		pool->txn_data = cgmalloc(len + 1);
-		pool->txn_data[len] = '\0';
-
-		for (i = 0; i < pool->transactions; i++) {
-			unsigned char binswap[32];
-			const char *hash;
-			const char *txid;
-
-			arr_val = json_array_get(transaction_arr, i);
-			txid = json_string_value(json_object_get(arr_val, "txid"));
-			hash = json_string_value(json_object_get(arr_val, "hash"));
-			if(!txid)
-				txid = hash;
-			txn = json_string_value(json_object_get(arr_val, "data"));
-			len = strlen(txn);
-			cg_memcpy(pool->txn_data + ofs, txn, len);
-			ofs += len;
-#if 0
-			// This logic no longer works post-segwit. The txids will always need to be sent,
-			// as the full txns will also contain witness data that must be omitted in these
-			// hashes.
-			if (!hash) {
-				unsigned char *txn_bin;
-				int txn_len;
-
-				txn_len = len / 2;
-				txn_bin = cgmalloc(txn_len);
-				hex2bin(txn_bin, txn, txn_len);
-				/* This is needed for pooled mining since only
-				 * transaction data and not hashes are sent */
-				gen_hash(txn_bin, hashbin + 32 + 32 * i, txn_len);
-				continue;
-			}
+static const unsigned char witness_nonce[32] = {0};
+static const int witness_nonce_size = sizeof(witness_nonce);
+static const unsigned char witness_header[] = {0xaa, 0x21, 0xa9, 0xed};
+static const int witness_header_size = sizeof(witness_header);
+
+/* Levels with at least this many pairs are split into merkle_threads parts,
+ * below it handing the parts out costs more than they save */
+#define MERKLE_THREAD_PAIRS 512
+#define MERKLE_THREADS 4
+
+/* 0 until first used, then the CPUs online up to MERKLE_THREADS */
+static int merkle_threads;
+
+/* The parts of a large level are hashed by the caller alongside a fixed set of
+ * worker threads, which are started the first time they're needed and then
+ * wait for the next level. merkle_lock lets one level be split at a time,
+ * merkle_qlock protects merkle_level. */
+static pthread_mutex_t merkle_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t merkle_qlock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t merkle_qcond = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t merkle_dcond = PTHREAD_COND_INITIALIZER;
+static int merkle_workers;
+
+static struct {
+	unsigned char *src;
+	unsigned char *dst;
+	int start;
+	int pairs;
+	int parts;
+	int next;	// Next part to hand out
+	int done;	// Parts finished
+} merkle_level;
+
+/* Take and hash parts of the current level until none are left, with
+ * merkle_qlock held */
+static void merkle_hash_parts(void)
+{
+	while (merkle_level.next < merkle_level.parts) {
+		unsigned char *src = merkle_level.src, *dst = merkle_level.dst;
+		int part = merkle_level.next++;
+		int span = merkle_level.pairs - merkle_level.start;
+		int first = merkle_level.start + (int)((int64_t)span * part / merkle_level.parts);
+		int last = merkle_level.start + (int)((int64_t)span * (part + 1) / merkle_level.parts);
+		int i;
+
+		mutex_unlock(&merkle_qlock);
+		for (i = first; i < last; i++)
+			gen_hash(src + i * 64, dst + i * 32, 64);
+		mutex_lock(&merkle_qlock);
+		if (++merkle_level.done == merkle_level.parts)
+			pthread_cond_signal(&merkle_dcond);
+	}
+}
+
+static void *merkle_worker(void __maybe_unused *userdata)
+{
+	pthread_detach(pthread_self());
+	RenameThread("Merkle");
+
+	mutex_lock(&merkle_qlock);
+	while (42) {
+		while (merkle_level.next >= merkle_level.parts)
+			pthread_cond_wait(&merkle_qcond, &merkle_qlock);
+		merkle_hash_parts();
+	}
+	return NULL;
+}
+
+/* Hash one level of a merkle tree of leaves entries from src into dst,
+ * skipping the pairs before start. An odd last entry is paired with itself so
+ * src needs room for one more entry. Returns the number of entries in the
+ * next level up. Each pair only writes its own entry in dst, so large levels
+ * are hashed on several threads at once. */
+static int merkle_hash_level(unsigned char *src, unsigned char *dst, int leaves, int start)
+{
+	int i, pairs, nthr;
+
+	if (leaves % 2) {
+		cg_memcpy(src + leaves * 32, src + (leaves - 1) * 32, 32);
+		leaves++;
+	}
+	pairs = leaves / 2;
+
+	if (unlikely(!merkle_threads)) {
+		nthr = 1;
+#ifdef _SC_NPROCESSORS_ONLN
+		nthr = sysconf(_SC_NPROCESSORS_ONLN);
 #endif
-			if (!txid) {
-				applog(LOG_ERR, "missing txid in gbt_merkle_bins");
-				return;
-			}
-			if (!hex2bin(binswap, txid, 32)) {
-				applog(LOG_ERR, "Failed to hex2bin txid in gbt_merkle_bins");
-				return;
-			}
-			swab256(hashbin + 32 + 32 * i, binswap);
-		}
+		merkle_threads = MAX(MIN(nthr, MERKLE_THREADS), 1);
 	}
-	if (binleft > 1) {
-		while (42) {
-			if (binleft == 1)
-				break;
-			cg_memcpy(pool->merklebin + (pool->merkles * 32), hashbin + 32, 32);
-			pool->merkles++;
-			if (binleft % 2) {
-				cg_memcpy(hashbin + binlen, hashbin + binlen - 32, 32);
-				binlen += 32;
-				binleft++;
-			}
-			for (i = 32, j = 64; j < binlen; i += 32, j += 64) {
-				gen_hash(hashbin + j, hashbin + i, 64);
-			}
-			binleft /= 2;
-			binlen = binleft * 32;
-		}
+	nthr = 1;
+	if (pairs - start >= MERKLE_THREAD_PAIRS)
+		nthr = merkle_threads;
+
+	if (nthr == 1) {
+		for (i = start; i < pairs; i++)
+			gen_hash(src + i * 64, dst + i * 32, 64);
+		return pairs;
+	}
+
+	mutex_lock(&merkle_lock);
+	/* If a worker can't be started the others, or this thread, take its part */
+	while (merkle_workers < nthr - 1) {
+		pthread_t pth;
+
+		if (unlikely(pthread_create(&pth, NULL, merkle_worker, NULL)))
+			break;
+		merkle_workers++;
+	}
+
+	mutex_lock(&merkle_qlock);
+	merkle_level.src = src;
+	merkle_level.dst = dst;
+	merkle_level.start = start;
+	merkle_level.pairs = pairs;
+	merkle_level.parts = nthr;
+	merkle_level.next = 0;
+	merkle_level.done = 0;
+	pthread_cond_broadcast(&merkle_qcond);
+	merkle_hash_parts();
+	while (merkle_level.done < merkle_level.parts)
+		pthread_cond_wait(&merkle_dcond, &merkle_qlock);
+	mutex_unlock(&merkle_qlock);
+	mutex_unlock(&merkle_lock);
+
+	return pairs;
+}
+
+/* Build the merkle branches of the coinbase position in the txid tree, and
+ * when wanted the witness root from the wtxids, walking both trees over the
+ * same levels. Storage is on the heap so there's no limit on the number of
+ * transactions or branches. Each tree hashes between two buffers, swapping
+ * them at each level. */
+static bool gbt_merkle_bins(struct pool *pool, struct gbt_txns *txns, struct gbt_standby *sb,
+			    unsigned char *witness_root)
+{
+	unsigned char *txbin, *txnext, *wbin = NULL, *wnext = NULL, *tmp;
+	int i, leaves, size;
+
+	/* The standby takes over the transaction data arena */
+	sb->txn_data = txns->data;
+	txns->data = NULL;
+	sb->transactions = txns->count;
+	sb->merkles = 0;
+	sb->merklebin = NULL;
+
+	if (witness_root && txns->count && unlikely(!txns->have_hashes)) {
+		applog(LOG_ERR, "Hash missing for transaction");
+		return false;
 	}
+
+	/* Leaf 0 is the coinbase, plus room to duplicate an odd last leaf */
+	leaves = txns->count + 1;
+	size = (leaves + 1) * 32;
+	txbin = cgcalloc(size, 1);
+	txnext = cgcalloc(size, 1);
+	if (txns->count)
+		cg_memcpy(txbin + 32, txns->txids, txns->count * 32);
+	if (witness_root) {
+		/* The coinbase wtxid is defined as all zeroes */
+		wbin = cgcalloc(size, 1);
+		wnext = cgcalloc(size, 1);
+		if (txns->count)
+			cg_memcpy(wbin + 32, txns->hashes, txns->count * 32);
+	}
+
+	/* Depth of the tree is the number of branches */
+	for (i = leaves - 1; i; i >>= 1)
+		sb->merkles++;
+	if (sb->merkles)
+		sb->merklebin = cgmalloc(sb->merkles * 32);
+
+	for (i = 0; leaves > 1; i++) {
+		int next;
+
+		/* The coinbase hash isn't known yet so its pair is left as the
+		 * branch for gen_*_work to hash with */
+		cg_memcpy(sb->merklebin + i * 32, txbin + 32, 32);
+		next = merkle_hash_level(txbin, txnext, leaves, 1);
+		tmp = txbin;
+		txbin = txnext;
+		txnext = tmp;
+		if (wbin) {
+			merkle_hash_level(wbin, wnext, leaves, 0);
+			tmp = wbin;
+			wbin = wnext;
+			wnext = tmp;
+		}
+		leaves = next;
+	}
+
+	if (witness_root) {
+		cg_memcpy(wbin + 32, witness_nonce, witness_nonce_size);
+		gen_hash(wbin, witness_root, 32 + witness_nonce_size);
+		free(wbin);
+		free(wnext);
+	}
+	free(txbin);
+	free(txnext);
+
 	if (opt_debug) {
 		char hashhex[68];
 
-		for (i = 0; i < pool->merkles; i++) {
-			__bin2hex(hashhex, pool->merklebin + i * 32, 32);
+		for (i = 0; i < sb->merkles; i++) {
+			__bin2hex(hashhex, sb->merklebin + i * 32, 32);
 			applog(LOG_DEBUG, "MH%d %s",i, hashhex);
 		}
 	}
-	applog(LOG_INFO, "Stored %d transactions from pool %d", pool->transactions,
+	applog(LOG_INFO, "Stored %d transactions from pool %d", sb->transactions,
 		pool->pool_no);
+	return true;
 }
 
-static const unsigned char witness_nonce[32] = {0};
-static const int witness_nonce_size = sizeof(witness_nonce);
-static const unsigned char witness_header[] = {0xaa, 0x21, 0xa9, 0xed};
-static const int witness_header_size = sizeof(witness_header);
-
-static bool gbt_witness_data(json_t *transaction_arr, unsigned char* witnessdata, int avail_size)
+#ifdef CGMINER_BENCH
+/* Build the merkle branches and witness root of txns on threads threads,
+ * leaving txns as it was. merkle_root holds the coinbase hash on entry and
+ * the merkle root on return. */
+void bench_gbt_merkle(struct pool *pool, struct gbt_txns *txns, unsigned char *merkle_root,
+		      unsigned char *witness_root, int threads)
 {
-	int i, binlen, txncount = json_array_size(transaction_arr);
-	unsigned char *hashbin;
-	const char *hash;
-	json_t *arr_val;
-
-	binlen = txncount * 32 + 32;
-	hashbin = alloca(binlen + 32);
-	memset(hashbin, 0, 32);
-
-	if (avail_size < witness_header_size + 32)
-		return false;
+	struct gbt_standby sb;
+	int i;
 
-	for (i = 0; i < txncount; i++) {
-		unsigned char binswap[32];
+	merkle_threads = MAX(MIN(threads, MERKLE_THREADS), 1);
+	if (unlikely(!gbt_merkle_bins(pool, txns, &sb, witness_root)))
+		quit(1, "Failed to build the benchmark merkle trees");
+	txns->data = sb.txn_data;
 
-		arr_val = json_array_get(transaction_arr, i);
-		hash = json_string_value(json_object_get(arr_val, "hash"));
-		if (unlikely(!hash)) {
-			applog(LOG_ERR, "Hash missing for transaction");
-			return false;
-		}
-		if (!hex2bin(binswap, hash, 32)) {
-			applog(LOG_ERR, "Failed to hex2bin hash in gbt_witness_data");
-			return false;
-		}
-		swab256(hashbin + 32 + 32 * i, binswap);
-	}
+	/* Hash the branches up from the coinbase as gen_gbt_work does */
+	for (i = 0; i < sb.merkles; i++) {
+		unsigned char merkle_sha[64];
 
-	// Build merkle root (copied from libblkmaker)
-	for (txncount++ ; txncount > 1 ; txncount /= 2) {
-		if (txncount % 2) {
-			// Odd number, duplicate the last
-			memcpy(hashbin + 32 * txncount, hashbin + 32 * (txncount - 1), 32);
-			txncount++;
-		}
-		for (i = 0; i < txncount; i += 2) {
-			// We overlap input and output here, on the first pair
-			gen_hash(hashbin + 32 * i, hashbin + 32 * (i / 2), 64);
-		}
+		cg_memcpy(merkle_sha, merkle_root, 32);
+		cg_memcpy(merkle_sha + 32, sb.merklebin + i * 32, 32);
+		gen_hash(merkle_sha, merkle_root, 64);
 	}
-
-	memcpy(witnessdata, witness_header, witness_header_size);
-	memcpy(hashbin + 32, &witness_nonce, witness_nonce_size);
-	gen_hash(hashbin, witnessdata + witness_header_size, 32 + witness_nonce_size);
-	return true;
+	free(sb.merklebin);
 }
+#endif
 
 static double diff_from_target(void *target);
 
 static const char scriptsig_header[] = "01000000010000000000000000000000000000000000000000000000000000000000000000ffffffff";
 static unsigned char scriptsig_header_bin[41];
 
-static bool gbt_solo_decode(struct pool *pool, json_t *res_val)
+static bool gbt_solo_decode(struct pool *pool, json_t *res_val, struct gbt_txns *txns)
 {
-	json_t *transaction_arr, *rules_arr, *coinbase_aux;
+	json_t *rules_arr, *coinbase_aux;
 	const char *previousblockhash;
 	unsigned char hash_swap[32];
 	struct timeval now;
@@ -3274,10 +3483,10 @@ static bool gbt_solo_decode(struct pool *pool, json_t *res_val)
 	bool insert_witness = false;
 	unsigned char witnessdata[36] = {};
 	const char *default_witness_commitment;
+	struct gbt_standby sb;
 
 	previousblockhash = json_string_value(json_object_get(res_val, "previousblockhash"));
 	target = json_string_value(json_object_get(res_val, "target"));
-	transaction_arr = json_object_get(res_val, "transactions");
 	rules_arr = json_object_get(res_val, "rules");
 	version = json_integer_value(json_object_get(res_val, "version"));
 	curtime = json_integer_value(json_object_get(res_val, "curtime"));
@@ -3320,6 +3529,32 @@ static bool gbt_solo_decode(struct pool *pool, json_t *res_val)
 	applog(LOG_DEBUG, "height: %d", height);
 	applog(LOG_DEBUG, "flags: %s", flags);
 
+	if (unlikely(!gbt_merkle_bins(pool, txns, &sb, insert_witness ?
+					  witnessdata + witness_header_size : NULL))) {
+		if (insert_witness)
+			applog(LOG_ERR, "error calculating witness data");
+		free(sb.txn_data);
+		free(sb.merklebin);
+		return false;
+	}
+
+	if (insert_witness) {
+		char witness_str[sizeof(witnessdata) * 2];
+
+		witnessdata_size = sizeof(witnessdata);
+		cg_memcpy(witnessdata, witness_header, witness_header_size);
+		__bin2hex(witness_str, witnessdata, witnessdata_size);
+		applog(LOG_DEBUG, "calculated witness data: %s", witness_str);
+		if (default_witness_commitment) {
+			if (strncmp(witness_str, default_witness_commitment + 4, witnessdata_size * 2) != 0) {
+				applog(LOG_ERR, "bad witness data. %s != %s", default_witness_commitment + 4, witness_str);
+				free(sb.txn_data);
+				free(sb.merklebin);
+				return false;
+			}
+		}
+	}
+
 	cg_wlock(&pool->gbt_lock);
 	hex2bin(hash_swap, previousblockhash, 32);
 	swap256(pool->previousblockhash, hash_swap);
@@ -3336,25 +3571,7 @@ static bool gbt_solo_decode(struct pool *pool, json_t *res_val)
 	snprintf(pool->nbit, 9, "%s", bits);
 	pool->nValue = coinbasevalue;
 	hex2bin((unsigned char *)&pool->gbt_bits, bits, 4);
-	gbt_merkle_bins(pool, transaction_arr);
-
-	if (insert_witness) {
-		char witness_str[sizeof(witnessdata) * 2];
-
-		witnessdata_size = sizeof(witnessdata);
-		if (!gbt_witness_data(transaction_arr, witnessdata, witnessdata_size)) {
-			applog(LOG_ERR, "error calculating witness data");
-			return false;
-		}
-		__bin2hex(witness_str, witnessdata, witnessdata_size);
-		applog(LOG_DEBUG, "calculated witness data: %s", witness_str);
-		if (default_witness_commitment) {
-			if (strncmp(witness_str, default_witness_commitment + 4, witnessdata_size * 2) != 0) {
-				applog(LOG_ERR, "bad witness data. %s != %s", default_witness_commitment + 4, witness_str);
-				return false;
-			}
-		}
-	}
+	__gbt_swap_standby(pool, &sb);
 
 	if (pool->transactions < 3)
 		pool->bad_work++;
@@ -3441,6 +3658,9 @@ static bool gbt_solo_decode(struct pool *pool, json_t *res_val)
 	pool->coinbase_len = 41 + ofs + 4 + 1 + 8 + 1 + 25 + witness_txout_len + 4;
 	cg_wunlock(&pool->gbt_lock);
 
+	free(sb.txn_data);
+	free(sb.merklebin);
+
 	snprintf(header, 257, "%s%s%s%s%s%s%s",
 		 pool->bbversion,
 		 pool->prev_hash,
@@ -3455,7 +3675,7 @@ static bool gbt_solo_decode(struct pool *pool, json_t *res_val)
 	return true;
 }
 
-static bool work_decode(struct pool *pool, struct work *work, json_t *val)
+static bool work_decode(struct pool *pool, struct work *work, json_t *val, struct gbt_txns *txns)
 {
 	json_t *res_val = json_object_get(val, "result");
 	bool ret = false;
@@ -3467,11 +3687,11 @@ static bool work_decode(struct pool *pool, struct work *work, json_t *val)
 	}
 
 	if (pool->gbt_solo) {
-		if (unlikely(!gbt_solo_decode(pool, res_val)))
+		if (unlikely(!gbt_solo_decode(pool, res_val, txns)))
 			goto out;
 		goto out_true;
 	}
-	if (unlikely(!gbt_decode(pool, res_val)))
+	if (unlikely(!gbt_decode(pool, res_val, txns)))
 		goto out;
 	work->gbt = true;
 	memset(work->hash, 0, sizeof(work->hash));
@@ -3484,7 +3704,8 @@ out:
 }
 #else /* HAVE_LIBCURL */
 #define json_rpc_call(curl, url, userpass, rpc_req, probe, longpoll, rolltime, pool, share) (NULL)
-#define work_decode(pool, work, val) (false)
+#define json_rpc_call_gbt(curl, url, userpass, rpc_req, probe, longpoll, rolltime, pool, txns) (NULL)
+#define work_decode(pool, work, val, txns) (false)
 #define gen_gbt_work(pool, work) {}
 #endif /* HAVE_LIBCURL */
 
@@ -3680,7 +3901,8 @@ static void get_statline(char *buf, size_t bufsiz, struct cgpu_info *cgpu)
 
 static bool shared_strategy(void)
 {
-	return (pool_strategy == POOL_LOADBALANCE || pool_strategy == POOL_BALANCE);
+	return (pool_strategy == POOL_LOADBALANCE || pool_strategy == POOL_BALANCE ||
+		pool_strategy == POOL_WEIGHTED);
 }
 
 #ifdef HAVE_CURSES
@@ -3696,54 +3918,60 @@ static bool shared_strategy(void)
 	wprintw(win, "%s", tmp42); \
 } while (0)
 
-/* Must be called with curses mutex lock held and curses_active */
-static void curses_print_status(void)
+/* The status window is rendered by curses_thread() from text built without
+ * holding the curses lock. The status lines are rows 0 to CURSES_STATUS_ROWS - 1
+ * and device count is row devcursor + count, line CURSES_STATUS_ROWS + count */
+#define CURSES_STATUS_ROWS 6
+
+/* Append to a screen line, anything past the end is cut off */
+static void curses_line_add(char *line, const char *fmt, ...)
+{
+	size_t len = strlen(line);
+	va_list ap;
+
+	if (len >= CURBUFSIZ - 1)
+		return;
+	va_start(ap, fmt);
+	vsnprintf(line + len, CURBUFSIZ - len, fmt, ap);
+	va_end(ap);
+}
+
+static void curses_status_lines(char (*lines)[CURBUFSIZ])
 {
 	struct pool *pool = current_pool();
-	int linewidth = opt_widescreen ? 100 : 80;
+	char best_share[8];
 
-	wattron(statuswin, A_BOLD);
-	cg_mvwprintw(statuswin, 0, 0, " " PACKAGE " version " VERSION " - Started: %s", datestamp);
-	wattroff(statuswin, A_BOLD);
-	mvwhline(statuswin, 1, 0, '-', linewidth);
-	cg_mvwprintw(statuswin, 2, 0, " %s", statusline);
-	wclrtoeol(statuswin);
+	snprintf(lines[0], CURBUFSIZ, " " PACKAGE " version " VERSION " - Started: %s", datestamp);
+	lines[1][0] = '\0';
+	snprintf(lines[2], CURBUFSIZ, " %s", statusline);
 	if (opt_widescreen) {
-		cg_mvwprintw(statuswin, 3, 0, " A:%.0f  R:%.0f  HW:%d  WU:%.1f/m |"
-			     " ST: %d  SS: %"PRId64"  NB: %d  LW: %d  GF: %d  RF: %d",
-			     total_diff_accepted, total_diff_rejected, hw_errors,
-			     total_diff1 / total_secs * 60,
-			     total_staged(), total_stale, new_blocks, local_work, total_go, total_ro);
+		snprintf(lines[3], CURBUFSIZ, " A:%.0f  R:%.0f  HW:%d  WU:%.1f/m |"
+			 " ST: %d  SS: %"PRId64"  NB: %d  LW: %d  GF: %d  RF: %d",
+			 total_diff_accepted, total_diff_rejected, hw_errors,
+			 total_diff1 / total_secs * 60,
+			 total_staged(), total_stale, new_blocks, local_work, total_go, total_ro);
 	} else if (alt_status) {
-		cg_mvwprintw(statuswin, 3, 0, " ST: %d  SS: %"PRId64"  NB: %d  LW: %d  GF: %d  RF: %d",
-			     total_staged(), total_stale, new_blocks, local_work, total_go, total_ro);
+		snprintf(lines[3], CURBUFSIZ, " ST: %d  SS: %"PRId64"  NB: %d  LW: %d  GF: %d  RF: %d",
+			 total_staged(), total_stale, new_blocks, local_work, total_go, total_ro);
 	} else {
-		cg_mvwprintw(statuswin, 3, 0, " A:%.0f  R:%.0f  HW:%d  WU:%.1f/m",
-			     total_diff_accepted, total_diff_rejected, hw_errors,
-			     total_diff1 / total_secs * 60);
+		snprintf(lines[3], CURBUFSIZ, " A:%.0f  R:%.0f  HW:%d  WU:%.1f/m",
+			 total_diff_accepted, total_diff_rejected, hw_errors,
+			 total_diff1 / total_secs * 60);
 	}
-	wclrtoeol(statuswin);
 	if (shared_strategy() && total_pools > 1) {
-		cg_mvwprintw(statuswin, 4, 0, " Connected to multiple pools with%s block change notify",
-			have_longpoll ? "": "out");
+		snprintf(lines[4], CURBUFSIZ, " Connected to multiple pools with%s block change notify",
+			 have_longpoll ? "": "out");
 	} else if (pool->has_stratum) {
-		cg_mvwprintw(statuswin, 4, 0, " Connected to %s diff %s with stratum as user %s",
-			pool->sockaddr_url, pool->diff, pool->rpc_user);
+		snprintf(lines[4], CURBUFSIZ, " Connected to %s diff %s with stratum as user %s",
+			 pool->sockaddr_url, pool->diff, pool->rpc_user);
 	} else {
-		cg_mvwprintw(statuswin, 4, 0, " Connected to %s diff %s with%s %s as user %s",
-			pool->sockaddr_url, pool->diff, have_longpoll ? "": "out",
-			pool->has_gbt ? "GBT" : "LP", pool->rpc_user);
+		snprintf(lines[4], CURBUFSIZ, " Connected to %s diff %s with%s %s as user %s",
+			 pool->sockaddr_url, pool->diff, have_longpoll ? "": "out",
+			 pool->has_gbt ? "GBT" : "LP", pool->rpc_user);
 	}
-	wclrtoeol(statuswin);
-	cg_mvwprintw(statuswin, 5, 0, " Block: %s...  Diff:%s  Started: %s  Best share: %s   ",
-		     prev_block, block_diff, blocktime, best_share);
-	mvwhline(statuswin, 6, 0, '-', linewidth);
-	mvwhline(statuswin, statusy - 1, 0, '-', linewidth);
-#ifdef USE_USBUTILS
-	cg_mvwprintw(statuswin, devcursor - 1, 1, "[U]SB management [P]ool management [S]ettings [D]isplay options [Q]uit");
-#else
-	cg_mvwprintw(statuswin, devcursor - 1, 1, "[P]ool management [S]ettings [D]isplay options [Q]uit");
-#endif
+	best_share_str(best_share, sizeof(best_share));
+	snprintf(lines[5], CURBUFSIZ, " Block: %s...  Diff:%s  Started: %s  Best share: %s   ",
+		 prev_block, block_diff, blocktime, best_share);
 }
 
 static void adj_width(int var, int *length)
@@ -3761,7 +3989,8 @@ static void adj_fwidth(float var, int *length)
 #define STATBEFORELEN 23
 const char blanks[] = "                                        ";
 
-static void curses_print_devstatus(struct cgpu_info *cgpu, int devno, int count)
+/* Only called by curses_thread() so the widths need no lock */
+static void curses_devstatus_line(struct cgpu_info *cgpu, int devno, char *line)
 {
 	static int devno_width = 1, dawidth = 1, drwidth = 1, hwwidth = 1, wuwidth = 1;
 	char logline[256], unique_id[12];
@@ -3769,15 +3998,6 @@ static void curses_print_devstatus(struct cgpu_info *cgpu, int devno, int count)
 	double dev_runtime, wu;
 	unsigned int devstatlen;
 
-	if (opt_compact)
-		return;
-
-	if (devcursor + count > LINES - 2)
-		return;
-
-	if (count >= most_devices)
-		return;
-
 	if (cgpu->dev_start_tv.tv_sec == 0)
 		dev_runtime = total_secs;
 	else {
@@ -3791,7 +4011,6 @@ static void curses_print_devstatus(struct cgpu_info *cgpu, int devno, int count)
 	cgpu->utility = cgpu->accepted / dev_runtime * 60;
 	wu = cgpu->diff1 / dev_runtime * 60;
 
-	wmove(statuswin,devcursor + count, 0);
 	adj_width(devno, &devno_width);
 	if (cgpu->unique_id) {
 		unique_id[8] = '\0';
@@ -3799,29 +4018,29 @@ static void curses_print_devstatus(struct cgpu_info *cgpu, int devno, int count)
 		strncpy(unique_id, cgpu->unique_id, 8);
 	} else
 		sprintf(unique_id, "%-8d", cgpu->device_id);
-	cg_wprintw(statuswin, " %*d: %s %-8s: ", devno_width, devno, cgpu->drv->name,
-		   unique_id);
+	snprintf(line, CURBUFSIZ, " %*d: %s %-8s: ", devno_width, devno, cgpu->drv->name,
+		 unique_id);
 	logline[0] = '\0';
 	cgpu->drv->get_statline_before(logline, sizeof(logline), cgpu);
 	devstatlen = strlen(logline);
 	if (devstatlen < STATBEFORELEN)
 		strncat(logline, blanks, STATBEFORELEN - devstatlen);
-	cg_wprintw(statuswin, "%s | ", logline);
+	curses_line_add(line, "%s | ", logline);
 
 
 #ifdef USE_USBUTILS
 	if (cgpu->usbinfo.nodev)
-		cg_wprintw(statuswin, "ZOMBIE");
+		curses_line_add(line, "ZOMBIE");
 	else
 #endif
 	if (cgpu->status == LIFE_DEAD)
-		cg_wprintw(statuswin, "DEAD  ");
+		curses_line_add(line, "DEAD  ");
 	else if (cgpu->status == LIFE_SICK)
-		cg_wprintw(statuswin, "SICK  ");
+		curses_line_add(line, "SICK  ");
 	else if (cgpu->deven == DEV_DISABLED)
-		cg_wprintw(statuswin, "OFF   ");
+		curses_line_add(line, "OFF   ");
 	else if (cgpu->deven == DEV_RECOVER)
-		cg_wprintw(statuswin, "REST  ");
+		curses_line_add(line, "REST  ");
 	else if (opt_widescreen) {
 		char displayed_hashes[16], displayed_rolling[16];
 		uint64_t d64;
@@ -3834,7 +4053,7 @@ static void curses_print_devstatus(struct cgpu_info *cgpu, int devno, int count)
 		adj_fwidth(cgpu->diff_accepted, &dawidth);
 		adj_fwidth(cgpu->diff_rejected, &drwidth);
 		adj_width(cgpu->hw_errors, &hwwidth);
-		cg_wprintw(statuswin, "%6s / %6sh/s WU:%*.1f/m "
+		curses_line_add(line, "%6s / %6sh/s WU:%*.1f/m "
 				"A:%*.0f R:%*.0f HW:%*d",
 				displayed_rolling,
 				displayed_hashes, wuwidth + 2, wu,
@@ -3850,13 +4069,13 @@ static void curses_print_devstatus(struct cgpu_info *cgpu, int devno, int count)
 		d64 = (double)cgpu->rolling * 1000000ull;
 		suffix_string(d64, displayed_rolling, sizeof(displayed_rolling), 4);
 		adj_width(wu, &wuwidth);
-		cg_wprintw(statuswin, "%6s / %6sh/s WU:%*.1f/m", displayed_rolling,
-			   displayed_hashes, wuwidth + 2, wu);
+		curses_line_add(line, "%6s / %6sh/s WU:%*.1f/m", displayed_rolling,
+				displayed_hashes, wuwidth + 2, wu);
 	} else {
 		adj_fwidth(cgpu->diff_accepted, &dawidth);
 		adj_fwidth(cgpu->diff_rejected, &drwidth);
 		adj_width(cgpu->hw_errors, &hwwidth);
-		cg_wprintw(statuswin, "A:%*.0f R:%*.0f HW:%*d",
+		curses_line_add(line, "A:%*.0f R:%*.0f HW:%*d",
 				dawidth, cgpu->diff_accepted,
 				drwidth, cgpu->diff_rejected,
 				hwwidth, cgpu->hw_errors);
@@ -3864,13 +4083,37 @@ static void curses_print_devstatus(struct cgpu_info *cgpu, int devno, int count)
 
 	logline[0] = '\0';
 	cgpu->drv->get_statline(logline, sizeof(logline), cgpu);
-	cg_wprintw(statuswin, "%s", logline);
-
-	wclrtoeol(statuswin);
+	curses_line_add(line, "%s", logline);
 }
 #endif
 
 #ifdef HAVE_CURSES
+/* Log lines are only written to logwin by the logging threads and put on the
+ * screen by curses_thread(), at most once per CURSES_FRAME_MS however many
+ * arrive, and it redraws the status window every CURSES_STATUS_MS. Each status
+ * and device line is built into a buffer with the curses lock released, so
+ * slow driver statline functions don't hold up logging, and only the lines
+ * that differ from what was last drawn are written to statuswin. */
+#define CURSES_FRAME_MS 100
+#define CURSES_STATUS_MS 2000
+
+static pthread_mutex_t curses_render_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t curses_render_cond = PTHREAD_COND_INITIALIZER;
+static bool curses_log_dirty, curses_redraw;
+
+/* Ask curses_thread() to put the log on the screen, or with full to also
+ * redraw all of the status window */
+static void curses_wake(bool full)
+{
+	if (full)
+		__atomic_store_n(&curses_redraw, true, __ATOMIC_RELAXED);
+	if (__atomic_exchange_n(&curses_log_dirty, true, __ATOMIC_RELAXED))
+		return;
+	mutex_lock(&curses_render_lock);
+	pthread_cond_signal(&curses_render_cond);
+	mutex_unlock(&curses_render_lock);
+}
+
 /* Check for window resize. Called with curses mutex locked */
 static inline void change_logwinsize(void)
 {
@@ -3917,6 +4160,7 @@ static void check_winsizes(void)
 		wresize(logwin, y, x);
 		mvwin(logwin, logcursor, 0);
 		unlock_curses();
+		curses_wake(true);
 	}
 }
 
@@ -3970,14 +4214,11 @@ bool log_curses_only(int prio, const char *datetime, const char *str)
 	high_prio = (prio == LOG_WARNING || prio == LOG_ERR);
 
 	if (curses_active_locked()) {
-		if (!opt_loginput || high_prio) {
+		if (!opt_loginput || high_prio)
 			wprintw(logwin, "%s%s\n", datetime, str);
-			if (high_prio) {
-				touchwin(logwin);
-				wrefresh(logwin);
-			}
-		}
 		unlock_curses();
+		if (!opt_loginput || high_prio)
+			curses_wake(false);
 		return true;
 	}
 	return false;
@@ -4000,6 +4241,110 @@ void logwin_update(void)
 		unlock_curses();
 	}
 }
+
+/* What is on screen, line CURSES_STATUS_ROWS + n is device line n */
+static char (*curses_drawn)[CURBUFSIZ];
+static int curses_drawn_lines;
+
+static void curses_draw_line(int row, int line, char (*lines)[CURBUFSIZ], bool full)
+{
+	if (!full && !strcmp(curses_drawn[line], lines[line]))
+		return;
+	if (line == 0)
+		wattron(statuswin, A_BOLD);
+	mvwprintw(statuswin, row, 0, "%s", lines[line]);
+	if (line == 0)
+		wattroff(statuswin, A_BOLD);
+	wclrtoeol(statuswin);
+	strcpy(curses_drawn[line], lines[line]);
+}
+
+static void curses_render_status(void)
+{
+	static int last_statusy, last_devcursor, last_linewidth, last_lines, last_cols;
+	int linewidth = opt_widescreen ? 100 : 80;
+	int i, n, count, devs, max;
+	struct cgpu_info *cgpu;
+	char (*lines)[CURBUFSIZ];
+	bool full;
+
+	/* Devices that fit on screen, zombies last */
+	max = opt_compact ? 0 : MIN(most_devices, LINES - 1 - devcursor);
+	if (max < 0)
+		max = 0;
+	devs = total_devices;
+	n = CURSES_STATUS_ROWS + MIN(max, devs);
+	lines = cgcalloc(n, CURBUFSIZ);
+
+	curses_status_lines(lines);
+	count = 0;
+	for (i = 0; i < devs && count < max; i++) {
+		cgpu = get_a_device(i);
+#ifndef USE_USBUTILS
+		if (cgpu)
+#else
+		if (cgpu && !cgpu->usbinfo.nodev)
+#endif
+			curses_devstatus_line(cgpu, i, lines[CURSES_STATUS_ROWS + count++]);
+	}
+#ifdef USE_USBUTILS
+	for (i = 0; i < devs && count < max; i++) {
+		cgpu = get_a_device(i);
+		if (cgpu && cgpu->usbinfo.nodev)
+			curses_devstatus_line(cgpu, i, lines[CURSES_STATUS_ROWS + count++]);
+	}
+#endif
+
+	if (!curses_active_locked()) {
+		free(lines);
+		return;
+	}
+
+	change_logwinsize();
+	full = __atomic_exchange_n(&curses_redraw, false, __ATOMIC_RELAXED);
+	if (statusy != last_statusy || devcursor != last_devcursor || linewidth != last_linewidth ||
+	    LINES != last_lines || COLS != last_cols)
+		full = true;
+	if (n > curses_drawn_lines) {
+		curses_drawn = cgrealloc(curses_drawn, n * CURBUFSIZ);
+		curses_drawn_lines = n;
+		full = true;
+	}
+
+	if (full) {
+		mvwhline(statuswin, 1, 0, '-', linewidth);
+		mvwhline(statuswin, 6, 0, '-', linewidth);
+		mvwhline(statuswin, statusy - 1, 0, '-', linewidth);
+#ifdef USE_USBUTILS
+		cg_mvwprintw(statuswin, devcursor - 1, 1, "[U]SB management [P]ool management [S]ettings [D]isplay options [Q]uit");
+#else
+		cg_mvwprintw(statuswin, devcursor - 1, 1, "[P]ool management [S]ettings [D]isplay options [Q]uit");
+#endif
+		last_statusy = statusy;
+		last_devcursor = devcursor;
+		last_linewidth = linewidth;
+		last_lines = LINES;
+		last_cols = COLS;
+	}
+
+	for (i = 0; i < CURSES_STATUS_ROWS; i++) {
+		if (i != 1)
+			curses_draw_line(i, i, lines, full);
+	}
+	for (i = 0; i < count && devcursor + i <= LINES - 2; i++)
+		curses_draw_line(devcursor + i, CURSES_STATUS_ROWS + i, lines, full);
+
+	if (full) {
+		touchwin(statuswin);
+		touchwin(logwin);
+	}
+	wnoutrefresh(statuswin);
+	wnoutrefresh(logwin);
+	doupdate();
+	unlock_curses();
+
+	free(lines);
+}
 #endif
 
 static void enable_pool(struct pool *pool)
@@ -4403,6 +4748,102 @@ static struct pool *select_balanced(struct pool *cp)
 
 static struct pool *priority_pool(int choice);
 
+/* How much work, in seconds of the current diff1 rate, the weighted balance
+ * strategy keeps handing to the one pool before choosing again, and the
+ * longest it holds a pool regardless */
+#define WEIGHTED_QUANTUM_SECS 1
+#define WEIGHTED_HOLD_SECS 5
+
+static bool weighted_usable(struct pool *pool)
+{
+	return pool->quota > 0 && !pool_unusable(pool);
+}
+
+/* Fraction of the diff1 that weighted balance aims to give pool */
+double pool_weight_target(struct pool *pool)
+{
+	int i, total_quota = 0;
+
+	if (!weighted_usable(pool))
+		return 0;
+	for (i = 0; i < total_pools; i++) {
+		if (weighted_usable(pools[i]))
+			total_quota += pools[i]->quota;
+	}
+	return (double)pool->quota / (double)total_quota;
+}
+
+/* Smooth weighted round robin over the diff1 actually done for each pool.
+ * Each choice charges every pool for the diff1 it has done since the last
+ * choice and credits it its quota share of the total, then picks the pool
+ * with the most credit. The chosen pool is then kept until it has done a
+ * quantum of diff1, so almost every call returns without looking at the
+ * other pools. */
+static struct pool *select_weighted(struct pool *cp)
+{
+	static struct pool *held;
+	static struct timeval tv_held;
+	struct pool *ret = NULL;
+	int64_t quantum, done = 0;
+	struct timeval now;
+	int i, total_quota = 0;
+
+	cgtime(&now);
+	quantum = total_diff1 / total_secs * WEIGHTED_QUANTUM_SECS;
+	if (quantum < 1)
+		quantum = 1;
+	if (held && weighted_usable(held) && held->diff1 - held->sw_diff1 < quantum &&
+	    tdiff(&now, &tv_held) < WEIGHTED_HOLD_SECS)
+		return held;
+
+	for (i = 0; i < total_pools; i++) {
+		struct pool *pool = pools[i];
+		int64_t delta = pool->diff1 - pool->sw_diff1;
+
+		/* diff1 goes backwards when the stats are zeroed */
+		if (delta < 0)
+			delta = 0;
+		pool->sw_diff1 = pool->diff1;
+		if (!weighted_usable(pool)) {
+			pool->sw_current = 0;
+			continue;
+		}
+		pool->sw_current -= delta;
+		done += delta;
+		total_quota += pool->quota;
+	}
+
+	for (i = 0; i < total_pools; i++) {
+		struct pool *pool = pools[i];
+
+		if (!weighted_usable(pool))
+			continue;
+		pool->sw_current += (double)done * pool->quota / total_quota;
+		if (!ret || pool->sw_current > ret->sw_current)
+			ret = pool;
+	}
+
+	/* No alive pools with quota so choose according to priority */
+	if (!ret) {
+		for (i = 0; i < total_pools; i++) {
+			struct pool *tp = priority_pool(i);
+
+			if (!pool_unusable(tp)) {
+				ret = tp;
+				break;
+			}
+		}
+		if (!ret)
+			ret = cp;
+		held = NULL;
+		return ret;
+	}
+
+	held = ret;
+	copy_time(&tv_held, &now);
+	return ret;
+}
+
 /* Select any active pool in a rotating fashion when loadbalance is chosen if
  * it has any quota left. */
 static inline struct pool *select_pool(void)
@@ -4419,6 +4860,11 @@ static inline struct pool *select_pool(void)
 		goto out;
 	}
 
+	if (pool_strategy == POOL_WEIGHTED) {
+		pool = select_weighted(cp);
+		goto out;
+	}
+
 	if (pool_strategy != POOL_LOADBALANCE) {
 		pool = cp;
 		goto out;
@@ -4476,44 +4922,11 @@ out:
 	return pool;
 }
 
-/* truediffone == 0x00000000FFFF0000000000000000000000000000000000000000000000000000
- * Generate a 256 bit binary LE target by cutting up diff into 64 bit sized
- * portions or vice versa. */
-static const double truediffone = 26959535291011309493156476344723991336010898738574164086137773096960.0;
-static const double bits192 = 6277101735386680763835789423207666416102355444464034512896.0;
-static const double bits128 = 340282366920938463463374607431768211456.0;
-static const double bits64 = 18446744073709551616.0;
-
-/* Converts a little endian 256 bit value to a double */
-static double le256todouble(const void *target)
-{
-	uint64_t *data64;
-	double dcut64;
-
-	data64 = (uint64_t *)(target + 24);
-	dcut64 = le64toh(*data64) * bits192;
-
-	data64 = (uint64_t *)(target + 16);
-	dcut64 += le64toh(*data64) * bits128;
-
-	data64 = (uint64_t *)(target + 8);
-	dcut64 += le64toh(*data64) * bits64;
-
-	data64 = (uint64_t *)(target);
-	dcut64 += le64toh(*data64);
-
-	return dcut64;
-}
-
+/* Targets and difficulties are converted exactly with the 256 bit helpers in
+ * uint256.c */
 static double diff_from_target(void *target)
 {
-	double d64, dcut64;
-
-	d64 = truediffone;
-	dcut64 = le256todouble(target);
-	if (unlikely(!dcut64))
-		dcut64 = 1;
-	return d64 / dcut64;
+	return le256_diff(target);
 }
 
 /*
@@ -4877,6 +5290,7 @@ static void __kill_work(void)
 	kill_timeout(thr);
 #endif
 
+	stratrec_close();
 }
 
 /* This should be the common exit path */
@@ -5011,7 +5425,7 @@ struct work *make_clone(struct work *work)
 	struct work *work_clone = copy_work(work);
 
 	work_clone->clone = true;
-	cgtime((struct timeval *)&(work_clone->tv_cloned));
+	cgtime_coarse((struct timeval *)&(work_clone->tv_cloned));
 	work_clone->longpoll = false;
 	work_clone->mandatory = false;
 	/* Make cloned work appear slightly older to bias towards keeping the
@@ -5086,7 +5500,7 @@ static inline bool should_roll(struct work *work)
 	struct timeval now;
 	time_t expiry;
 
-	if (work->pool != current_pool() && pool_strategy != POOL_LOADBALANCE && pool_strategy != POOL_BALANCE)
+	if (work->pool != current_pool() && !shared_strategy())
 		return false;
 
 	if (work->rolltime > max_scantime)
@@ -5097,7 +5511,7 @@ static inline bool should_roll(struct work *work)
 
 	/* We shouldn't roll if we're unlikely to get one shares' duration
 	 * work out of doing so */
-	cgtime(&now);
+	cgtime_coarse(&now);
 	if (now.tv_sec - work->tv_staged.tv_sec > expiry)
 		return false;
 
@@ -5213,12 +5627,12 @@ static char *offset_ntime(const char *ntime, int noffset)
 }
 
 /* Duplicates any dynamically allocated arrays within the work struct to
- * prevent a copied work struct from freeing ram belonging to another struct */
+ * prevent a copied work struct from freeing ram belonging to another struct.
+ * work must not own any of its own yet and is overwritten in one pass. */
 static void _copy_work(struct work *work, const struct work *base_work, int noffset)
 {
 	uint32_t id = work->id;
 
-	clean_work(work);
 	cg_memcpy(work, base_work, sizeof(struct work));
 	/* Keep the unique new id assigned during make_work to prevent copied
 	 * work from having the same id. */
@@ -5270,8 +5684,10 @@ void set_work_ntime(struct work *work, int ntime)
  * The macro copy_work() calls this function with an noffset of 0. */
 struct work *copy_work_noffset(struct work *base_work, int noffset)
 {
-	struct work *work = make_work();
+	struct work *work = cgmalloc(sizeof(struct work));
 
+	/* Everything is about to be overwritten so skip make_work's calloc */
+	work->id = total_work_inc();
 	_copy_work(work, base_work, noffset);
 
 	return work;
@@ -5337,7 +5753,7 @@ static bool stale_work(struct work *work, bool share)
 	if (unlikely(work_expiry < 5))
 		work_expiry = 5;
 
-	cgtime(&now);
+	cgtime_coarse(&now);
 	if ((now.tv_sec - work->tv_staged.tv_sec) >= work_expiry) {
 		applog(LOG_DEBUG, "Work stale due to expiry");
 		return true;
@@ -5346,31 +5762,25 @@ static bool stale_work(struct work *work, bool share)
 	return false;
 }
 
+/* Format the best share diff so far. The best diffs are only ever raised with
+ * atomic_max64 so readers do the formatting instead of the nonce path. */
+void best_share_str(char *buf, size_t siz)
+{
+	suffix_string(__atomic_load_n(&best_diff, __ATOMIC_RELAXED), buf, siz, 0);
+}
+
 uint64_t share_diff(const struct work *work)
 {
-	bool new_best = false;
-	double d64, s64;
+	char best_share[8];
 	uint64_t ret;
 
-	d64 = truediffone;
-	s64 = le256todouble(work->hash);
-	if (unlikely(!s64))
-		s64 = 0;
-
-	ret = round(d64 / s64);
+	ret = round(le256_diff(work->hash));
 
-	cg_wlock(&control_lock);
-	if (unlikely(ret > best_diff)) {
-		new_best = true;
-		best_diff = ret;
-		suffix_string(best_diff, best_share, sizeof(best_share), 0);
-	}
-	if (unlikely(ret > work->pool->best_diff))
-		work->pool->best_diff = ret;
-	cg_wunlock(&control_lock);
-
-	if (unlikely(new_best))
+	atomic_max64(&work->pool->best_diff, ret);
+	if (unlikely(atomic_max64(&best_diff, ret))) {
+		suffix_string(ret, best_share, sizeof(best_share), 0);
 		applog(LOG_INFO, "New best share: %s", best_share);
+	}
 
 	return ret;
 }
@@ -5437,6 +5847,7 @@ void switch_pools(struct pool *selected)
 		case POOL_BALANCE:
 		case POOL_FAILOVER:
 		case POOL_LOADBALANCE:
+		case POOL_WEIGHTED:
 			for (i = 0; i < total_pools; i++) {
 				pool = priority_pool(i);
 				if (pool_unusable(pool))
@@ -5473,7 +5884,7 @@ void switch_pools(struct pool *selected)
 	pool = currentpool;
 	cg_wunlock(&control_lock);
 
-	if (pool != last_pool && pool_strategy != POOL_LOADBALANCE && pool_strategy != POOL_BALANCE) {
+	if (pool != last_pool && !shared_strategy()) {
 		applog(LOG_WARNING, "Switching to pool %d %s", pool->pool_no, pool->rpc_url);
 		clear_pool_work(last_pool);
 	}
@@ -6062,6 +6473,8 @@ void write_config(FILE *fcfg)
 		fputs(",\n\"balance\" : true", fcfg);
 	if (pool_strategy == POOL_LOADBALANCE)
 		fputs(",\n\"load-balance\" : true", fcfg);
+	if (pool_strategy == POOL_WEIGHTED)
+		fputs(",\n\"weighted-balance\" : true", fcfg);
 	if (pool_strategy == POOL_ROUNDROBIN)
 		fputs(",\n\"round-robin\" : true", fcfg);
 	if (pool_strategy == POOL_ROTATE)
@@ -6075,13 +6488,16 @@ void zero_bestshare(void)
 {
 	int i;
 
-	best_diff = 0;
-	memset(best_share, 0, 8);
-	suffix_string(best_diff, best_share, sizeof(best_share), 0);
+	__atomic_store_n(&best_diff, 0, __ATOMIC_RELAXED);
 
 	for (i = 0; i < total_pools; i++) {
 		struct pool *pool = pools[i];
-		pool->best_diff = 0;
+		__atomic_store_n(&pool->best_diff, 0, __ATOMIC_RELAXED);
+	}
+
+	for (i = 0; i < total_devices; i++) {
+		struct cgpu_info *cgpu = get_a_device(i);
+		__atomic_store_n(&cgpu->best_diff, 0, __ATOMIC_RELAXED);
 	}
 }
 
@@ -6749,6 +7165,57 @@ retry:
 }
 #endif
 
+static void *curses_thread(void __maybe_unused *userdata)
+{
+	struct timeval now, last_frame, last_status;
+	struct timespec abstime, tdiff;
+	int ms;
+
+	pthread_setcanceltype(PTHREAD_CANCEL_ASYNCHRONOUS, NULL);
+
+	RenameThread("Curses");
+
+	if (!curses_active)
+		return NULL;
+
+	set_lowprio();
+	memset(&last_frame, 0, sizeof(last_frame));
+	memset(&last_status, 0, sizeof(last_status));
+
+	while (42) {
+		cgcond_time(&abstime);
+		ms_to_timespec(&tdiff, CURSES_STATUS_MS);
+		timeraddspec(&abstime, &tdiff);
+
+		mutex_lock(&curses_render_lock);
+		if (!__atomic_load_n(&curses_log_dirty, __ATOMIC_RELAXED))
+			pthread_cond_timedwait(&curses_render_cond, &curses_render_lock, &abstime);
+		mutex_unlock(&curses_render_lock);
+
+		/* Anything logged while waiting out the frame joins this frame */
+		cgtime(&now);
+		ms = ms_tdiff(&now, &last_frame);
+		if (ms < CURSES_FRAME_MS) {
+			cgsleep_ms(CURSES_FRAME_MS - ms);
+			cgtime(&now);
+		}
+		copy_time(&last_frame, &now);
+		__atomic_store_n(&curses_log_dirty, false, __ATOMIC_RELAXED);
+
+		if (ms_tdiff(&now, &last_status) >= CURSES_STATUS_MS ||
+		    __atomic_load_n(&curses_redraw, __ATOMIC_RELAXED)) {
+			copy_time(&last_status, &now);
+			curses_render_status();
+		} else if (curses_active_locked()) {
+			wnoutrefresh(logwin);
+			doupdate();
+			unlock_curses();
+		}
+	}
+
+	return NULL;
+}
+
 static void *input_thread(void __maybe_unused *userdata)
 {
 	pthread_setcanceltype(PTHREAD_CANCEL_ASYNCHRONOUS, NULL);
@@ -6809,7 +7276,7 @@ static void *api_thread(void *userdata)
 static void thread_reportin(struct thr_info *thr)
 {
 	thr->getwork = false;
-	cgtime(&thr->last);
+	cgtime_coarse(&thr->last);
 	thr->cgpu->status = LIFE_WELL;
 	thr->cgpu->device_last_well = time(NULL);
 }
@@ -6819,7 +7286,7 @@ static void thread_reportin(struct thr_info *thr)
 static void thread_reportout(struct thr_info *thr)
 {
 	thr->getwork = true;
-	cgtime(&thr->last);
+	cgtime_coarse(&thr->last);
 	thr->cgpu->status = LIFE_WELL;
 	thr->cgpu->device_last_well = time(NULL);
 }
@@ -6846,6 +7313,7 @@ static void hashmeter(int thr_id, uint64_t hashes_done)
 #endif
 
 	cgtime(&total_tv_end);
+	history_update(&total_tv_end);
 	tv_tdiff = tdiff(&total_tv_end, &tv_hashmeter);
 	now_t = total_tv_end.tv_sec;
 	diff_t = now_t - hashdisplay_t;
@@ -7126,6 +7594,35 @@ static int cp_prio(void)
 	return prio;
 }
 
+/* With --standby-pools N the N highest priority alive backup pools are kept
+ * subscribed and authorised with live notify state, so a failover to them can
+ * generate work immediately instead of waiting on a new stratum handshake. */
+bool pool_standby(struct pool *pool)
+{
+	struct pool *cp;
+	int i, ahead = 0;
+
+	if (!opt_standby_pools || !pool->has_stratum || pool->enabled != POOL_ENABLED)
+		return false;
+	if (shared_strategy())
+		return false;
+
+	cp = current_pool();
+	if (cp == pool)
+		return false;
+
+	for (i = 0; i < total_pools; i++) {
+		struct pool *other = pools[i];
+
+		if (other == pool || other == cp || other->removed || other->idle ||
+		    other->enabled != POOL_ENABLED)
+			continue;
+		if (other->prio < pool->prio)
+			ahead++;
+	}
+	return ahead < opt_standby_pools;
+}
+
 /* We only need to maintain a secondary pool connection when we need the
  * capacity to get work from the backup pools while still on the primary */
 static bool cnx_needed(struct pool *pool)
@@ -7136,9 +7633,7 @@ static bool cnx_needed(struct pool *pool)
 		return false;
 
 	/* Balance strategies need all pools online */
-	if (pool_strategy == POOL_BALANCE)
-		return true;
-	if (pool_strategy == POOL_LOADBALANCE)
+	if (shared_strategy())
 		return true;
 
 	/* Idle stratum pool needs something to kick it alive again */
@@ -7160,6 +7655,9 @@ static bool cnx_needed(struct pool *pool)
 	/* We've run out of work, bring anything back to life. */
 	if (no_work)
 		return true;
+	/* Hot standby for failover */
+	if (pool_standby(pool))
+		return true;
 	return false;
 }
 
@@ -7547,6 +8045,24 @@ static bool setup_gbt_solo(CURL __maybe_unused *curl, struct pool __maybe_unused
 }
 #endif
 
+#ifdef HAVE_LIBCURL
+static void *gbt_refresh_thread(void *userdata);
+
+/* Each GBT and solo pool gets its own thread to fetch and decode templates so
+ * that gen_gbt_work and gen_solo_work never block on network I/O */
+static void pool_start_gbt_refresh(struct pool *pool)
+{
+	if (pool->gbt_refresh_started || (!pool->has_gbt && !pool->gbt_solo))
+		return;
+	cgsem_init(&pool->gbt_refresh_sem);
+	pool->gbt_refresh_started = true;
+	if (unlikely(pthread_create(&pool->gbt_refresh_thread, NULL, gbt_refresh_thread, (void *)pool)))
+		quit(1, "Failed to create pool GBT refresh thread");
+}
+#else
+#define pool_start_gbt_refresh(pool) {}
+#endif
+
 static void pool_start_lp(struct pool *pool)
 {
 	if (!pool->lp_started) {
@@ -7554,11 +8070,13 @@ static void pool_start_lp(struct pool *pool)
 		if (unlikely(pthread_create(&pool->longpoll_thread, NULL, longpoll_thread, (void *)pool)))
 			quit(1, "Failed to create pool longpoll thread");
 	}
+	pool_start_gbt_refresh(pool);
 }
 
 static bool pool_active(struct pool *pool, bool pinging)
 {
 	struct timeval tv_getwork, tv_getwork_reply;
+	struct gbt_txns txns = {};
 	json_t *val = NULL;
 	bool ret = false;
 	CURL *curl;
@@ -7681,8 +8199,8 @@ retry_stratum:
 	}
 
 	cgtime(&tv_getwork);
-	val = json_rpc_call(curl, pool->rpc_url, pool->rpc_userpass,
-			    pool->rpc_req, true, false, &rolltime, pool, false);
+	val = json_rpc_call_gbt(curl, pool->rpc_url, pool->rpc_userpass,
+				pool->rpc_req, true, false, &rolltime, pool, &txns);
 	cgtime(&tv_getwork_reply);
 
 	/* Detect if a http pool has an X-Stratum header at startup,
@@ -7693,19 +8211,21 @@ retry_stratum:
 			pool->rpc_url = strdup(pool->stratum_url);
 		pool->has_stratum = true;
 		curl_easy_cleanup(curl);
+		gbt_txns_free(&txns);
 
 		goto retry_stratum;
 	}
 
 	if (!pool->has_stratum && !pool->gbt_solo && !pool->has_gbt) {
 		applog(LOG_WARNING, "No Stratum, GBT or Solo support in pool %d %s unable to use", pool->pool_no, pool->rpc_url);
+		gbt_txns_free(&txns);
 		return false;
 	}
 	if (val) {
 		struct work *work = make_work();
 		bool rc;
 
-		rc = work_decode(pool, work, val);
+		rc = work_decode(pool, work, val, &txns);
 		if (rc) {
 			applog(LOG_DEBUG, "Successfully retrieved and deciphered work from pool %u %s",
 			       pool->pool_no, pool->rpc_url);
@@ -7770,6 +8290,7 @@ retry_stratum:
 out:
 	if (val)
 		json_decref(val);
+	gbt_txns_free(&txns);
 	curl_easy_cleanup(curl);
 	return ret;
 }
@@ -7859,8 +8380,7 @@ static void gen_hash(unsigned char *data, unsigned char *hash, int len)
 void set_target(unsigned char *dest_target, double diff)
 {
 	unsigned char target[32];
-	uint64_t *data64, h64;
-	double d64, dcut64;
+	u256 t256;
 
 	if (unlikely(diff == 0.0)) {
 		/* This shouldn't happen but best we check to prevent a crash */
@@ -7868,36 +8388,8 @@ void set_target(unsigned char *dest_target, double diff)
 		diff = 1.0;
 	}
 
-	d64 = truediffone;
-	d64 /= diff;
-
-	dcut64 = d64 / bits192;
-	h64 = dcut64;
-	data64 = (uint64_t *)(target + 24);
-	*data64 = htole64(h64);
-	dcut64 = h64;
-	dcut64 *= bits192;
-	d64 -= dcut64;
-
-	dcut64 = d64 / bits128;
-	h64 = dcut64;
-	data64 = (uint64_t *)(target + 16);
-	*data64 = htole64(h64);
-	dcut64 = h64;
-	dcut64 *= bits128;
-	d64 -= dcut64;
-
-	dcut64 = d64 / bits64;
-	h64 = dcut64;
-	data64 = (uint64_t *)(target + 8);
-	*data64 = htole64(h64);
-	dcut64 = h64;
-	dcut64 *= bits64;
-	d64 -= dcut64;
-
-	h64 = d64;
-	data64 = (uint64_t *)(target);
-	*data64 = htole64(h64);
+	u256_target_from_diff(&t256, diff);
+	u256_to_le(target, &t256);
 
 	if (opt_debug) {
 		char *htarget = bin2hex(target, 32);
@@ -7908,9 +8400,208 @@ void set_target(unsigned char *dest_target, double diff)
 	cg_memcpy(dest_target, target, 32);
 }
 
+/* An immutable snapshot of a pool's stratum job that drivers which generate
+ * their own work on the device can pin, and then rebuild the work for any
+ * nonce2 they report from without touching the pool. The coinbase is hashed up
+ * to nonce2 once when the snapshot is taken so only its tail is hashed per
+ * nonce. */
+struct stratum_job {
+	int refs;
+	struct pool *pool;
+	char *job_id;
+	char *nonce1;
+	char *ntime;
+	double sdiff;
+	unsigned char header_bin[128];
+	int merkles;
+	unsigned char *merkle_bin;
+	unsigned char *coinbase;
+	size_t coinbase_len;
+	int nonce2_offset;
+	int n2size;
+	bool clean;
+	sha256_ctx cb_ctx;
+};
+
+/* Must be called with pool->data_lock write held */
+static struct stratum_job *__stratum_job_new(struct pool *pool)
+{
+	struct stratum_job *job = cgcalloc(sizeof(*job), 1);
+	int i;
+
+	job->refs = 1;
+	job->pool = pool;
+	job->job_id = strdup(pool->swork.job_id);
+	job->nonce1 = strdup(pool->nonce1);
+	job->ntime = strdup(pool->ntime);
+	job->sdiff = pool->sdiff;
+	cg_memcpy(job->header_bin, pool->header_bin, 128);
+	job->merkles = pool->merkles;
+	if (job->merkles) {
+		job->merkle_bin = cgmalloc(job->merkles * 32);
+		for (i = 0; i < job->merkles; i++)
+			cg_memcpy(job->merkle_bin + i * 32, pool->swork.merkle_bin[i], 32);
+	}
+	job->coinbase_len = pool->coinbase_len;
+	job->coinbase = cgmalloc(job->coinbase_len);
+	cg_memcpy(job->coinbase, pool->coinbase, job->coinbase_len);
+	job->nonce2_offset = pool->nonce2_offset;
+	job->n2size = pool->n2size;
+	job->clean = pool->swork.clean;
+	sha256_init(&job->cb_ctx);
+	sha256_update(&job->cb_ctx, job->coinbase, job->nonce2_offset);
+
+	return job;
+}
+
+/* Returns a reference to a snapshot of the pool's current stratum job, or NULL
+ * if it has none, to be released with stratum_job_put */
+struct stratum_job *stratum_job_get(struct pool *pool)
+{
+	struct stratum_job *job;
+
+	cg_rlock(&pool->data_lock);
+	job = pool->sjob;
+	if (likely(job))
+		__atomic_add_fetch(&job->refs, 1, __ATOMIC_RELAXED);
+	cg_runlock(&pool->data_lock);
+	if (likely(job))
+		return job;
+
+	/* First use since the job changed */
+	cg_wlock(&pool->data_lock);
+	if (!pool->sjob && pool->swork.job_id && pool->nonce1 && pool->coinbase)
+		pool->sjob = __stratum_job_new(pool);
+	job = pool->sjob;
+	if (job)
+		__atomic_add_fetch(&job->refs, 1, __ATOMIC_RELAXED);
+	cg_wunlock(&pool->data_lock);
+
+	return job;
+}
+
+void stratum_job_put(struct stratum_job *job)
+{
+	if (!job)
+		return;
+	/* Release so the last put sees every other holder's reads finished */
+	if (__atomic_sub_fetch(&job->refs, 1, __ATOMIC_ACQ_REL))
+		return;
+
+	free(job->job_id);
+	free(job->nonce1);
+	free(job->ntime);
+	free(job->merkle_bin);
+	free(job->coinbase);
+	free(job);
+}
+
+const char *stratum_job_id(const struct stratum_job *job)
+{
+	return job->job_id;
+}
+
+/* Drop the pool's snapshot whenever its job changes, with pool->data_lock
+ * write held. Pinned snapshots stay valid until they're put. */
+void __stratum_job_clear(struct pool *pool)
+{
+	stratum_job_put(pool->sjob);
+	pool->sjob = NULL;
+}
+
+/* Reentrant equivalent of gen_stratum_work for a given nonce2 that only reads
+ * the snapshot, so it can run on any number of threads at once */
+void stratum_job_work(struct stratum_job *job, struct work *work, uint64_t nonce2)
+{
+	unsigned char merkle_root[32], merkle_sha[64], hash1[32];
+	uint32_t *data32, *swap32;
+	uint64_t nonce2le;
+	sha256_ctx ctx;
+	int i;
+
+	nonce2le = htole64(nonce2);
+	cg_memcpy(&ctx, &job->cb_ctx, sizeof(ctx));
+	sha256_update(&ctx, (unsigned char *)&nonce2le, job->n2size);
+	sha256_update(&ctx, job->coinbase + job->nonce2_offset + job->n2size,
+		      job->coinbase_len - job->nonce2_offset - job->n2size);
+	sha256_final(&ctx, hash1);
+	sha256(hash1, 32, merkle_root);
+
+	cg_memcpy(merkle_sha, merkle_root, 32);
+	for (i = 0; i < job->merkles; i++) {
+		cg_memcpy(merkle_sha + 32, job->merkle_bin + i * 32, 32);
+		gen_hash(merkle_sha, merkle_root, 64);
+		cg_memcpy(merkle_sha, merkle_root, 32);
+	}
+	data32 = (uint32_t *)merkle_sha;
+	swap32 = (uint32_t *)merkle_root;
+	flip32(swap32, data32);
+
+	cg_memcpy(work->data, job->header_bin, 112);
+	cg_memcpy(work->data + 36, merkle_root, 32);
+
+	work->nonce2 = nonce2;
+	work->nonce2_len = job->n2size;
+	work->sdiff = job->sdiff;
+	work->job_id = strdup(job->job_id);
+	work->nonce1 = strdup(job->nonce1);
+	work->ntime = strdup(job->ntime);
+
+	calc_midstate(job->pool, work);
+	set_target(work->target, work->sdiff);
+
+	work->pool = job->pool;
+	work->stratum = true;
+	work->nonce = 0;
+	work->longpoll = false;
+	work->getwork_mode = GETWORK_MODE_STRATUM;
+	work->work_block = work_block;
+	work->drv_rolllimit = 60;
+	calc_diff(work, work->sdiff);
+
+	cgtime_coarse(&work->tv_staged);
+}
+
+/* New work for nonce2 of a snapshot, to test a nonce found elsewhere against */
+struct work *stratum_job_new_work(struct stratum_job *job, uint64_t nonce2)
+{
+	struct work *work = make_work();
+
+	stratum_job_work(job, work, nonce2);
+	return work;
+}
+
+/* The mining.notify params of a snapshot under job_id, for a stratum server
+ * passing the job on to clients whose nonce1 starts with the pool's nonce1 */
+json_t *stratum_job_notify(struct stratum_job *job, const char *job_id)
+{
+	int i, n1_len = strlen(job->nonce1) / 2;
+	char *coinbase1, *coinbase2, version[9], prev_hash[65], nbit[9], hex[65];
+	json_t *params, *merkles;
+
+	merkles = json_array();
+	for (i = 0; i < job->merkles; i++) {
+		__bin2hex(hex, job->merkle_bin + i * 32, 32);
+		json_array_append_new(merkles, json_string(hex));
+	}
+	__bin2hex(version, job->header_bin, 4);
+	__bin2hex(prev_hash, job->header_bin + 4, 32);
+	__bin2hex(nbit, job->header_bin + 72, 4);
+	coinbase1 = bin2hex(job->coinbase, job->nonce2_offset - n1_len);
+	coinbase2 = bin2hex(job->coinbase + job->nonce2_offset + job->n2size,
+			    job->coinbase_len - job->nonce2_offset - job->n2size);
+
+	params = json_pack("[s,s,s,s,o,s,s,s,b]", job_id, prev_hash, coinbase1, coinbase2,
+			   merkles, version, nbit, job->ntime, job->clean);
+	free(coinbase1);
+	free(coinbase2);
+	return params;
+}
+
 #if defined (USE_AVALON2) || defined (USE_AVALON4) || defined (USE_AVALON7) || defined (USE_AVALON8) || defined (USE_AVALON_MINER) || defined (USE_HASHRATIO)
-bool submit_nonce2_nonce(struct thr_info *thr, struct pool *pool, struct pool *real_pool,
-			 uint32_t nonce2, uint32_t nonce,  uint32_t ntime)
+/* Submit a nonce found by a device against a pinned stratum job */
+bool submit_job_nonce(struct thr_info *thr, struct stratum_job *job, struct pool *real_pool,
+		      uint32_t nonce2, uint32_t nonce, uint32_t ntime)
 {
 	const int thr_id = thr->id;
 	struct cgpu_info *cgpu = thr->cgpu;
@@ -7918,17 +8609,10 @@ bool submit_nonce2_nonce(struct thr_info *thr, struct pool *pool, struct pool *r
 	struct work *work = make_work();
 	bool ret;
 
-	cg_wlock(&pool->data_lock);
-	pool->nonce2 = nonce2;
-	cg_wunlock(&pool->data_lock);
-
-	gen_stratum_work(pool, work);
+	stratum_job_work(job, work, nonce2);
 	roll_work_ntime(work, ntime);
 
 	work->pool = real_pool;
-	/* Inherit the sdiff from the original stratum */
-	work->sdiff = pool->sdiff;
-
 	work->thr_id = thr_id;
 	work->work_block = work_block;
 	work->pool->works++;
@@ -7941,6 +8625,19 @@ bool submit_nonce2_nonce(struct thr_info *thr, struct pool *pool, struct pool *r
 	free_work(work);
 	return ret;
 }
+
+bool submit_nonce2_nonce(struct thr_info *thr, struct pool *pool, struct pool *real_pool,
+			 uint32_t nonce2, uint32_t nonce,  uint32_t ntime)
+{
+	struct stratum_job *job = stratum_job_get(pool);
+	bool ret;
+
+	if (unlikely(!job))
+		return false;
+	ret = submit_job_nonce(thr, job, real_pool, nonce2, nonce, ntime);
+	stratum_job_put(job);
+	return ret;
+}
 #endif
 
 #ifdef USE_BITMAIN_SOC
@@ -7951,22 +8648,23 @@ void get_work_by_nonce2(struct thr_info *thr,
 						uint64_t nonce2,
 						uint32_t version)
 {
+	struct stratum_job *job = stratum_job_get(pool);
+
+	if (unlikely(!job)) {
+		*work = NULL;
+		return;
+	}
 	*work = make_work();
-	const int thr_id = thr->id;
-	struct cgpu_info *cgpu = thr->cgpu;
-	struct device_drv *drv = cgpu->drv;
-	cg_wlock(&pool->data_lock);
-	pool->nonce2 = nonce2;
-	//if(pool->support_vil) // comment as default
 	version = Swap32(version);
-	cg_memcpy(pool->header_bin, &version, 4);
-	cg_wunlock(&pool->data_lock);
-
-	gen_stratum_work(pool, *work);
+	stratum_job_work(job, *work, nonce2);
+	stratum_job_put(job);
+	/* The chip rolled the version so redo the midstate for it */
+	cg_memcpy((*work)->data, &version, 4);
+	calc_midstate(pool, *work);
 
 	(*work)->pool = real_pool;
 
-	(*work)->thr_id = thr_id;
+	(*work)->thr_id = thr->id;
 	(*work)->work_block = work_block;
 	(*work)->pool->works++;
 
@@ -7994,7 +8692,7 @@ static void gen_stratum_work(struct pool *pool, struct work *work)
 	unsigned char merkle_root[32], merkle_sha[64];
 	uint32_t *data32, *swap32;
 #if STRATUM_WORK_TIMING
-	struct timeval stt;
+	struct timeval stt, ste;
 	double usec;
 #endif
 	uint64_t nonce2le;
@@ -8007,11 +8705,12 @@ static void gen_stratum_work(struct pool *pool, struct work *work)
 	cg_wlock(&pool->data_lock);
 
 	/* Update coinbase. Always use an LE encoded nonce2 to fill in values
-	 * from left to right and prevent overflow errors with small n2sizes */
-	nonce2le = htole64(pool->nonce2);
-	cg_memcpy(pool->coinbase + pool->nonce2_offset, &nonce2le, pool->n2size);
-	work->nonce2 = pool->nonce2++;
+	 * from left to right and prevent overflow errors with small n2sizes.
+	 * The stratum server owns the low bytes when it's running. */
+	work->nonce2 = stratsrv_nonce2(pool, pool->nonce2++);
 	work->nonce2_len = pool->n2size;
+	nonce2le = htole64(work->nonce2);
+	cg_memcpy(pool->coinbase + pool->nonce2_offset, &nonce2le, pool->n2size);
 
 	/* Downgrade to a read lock to read off the pool variables */
 	cg_dwlock(&pool->data_lock);
@@ -8069,10 +8768,11 @@ static void gen_stratum_work(struct pool *pool, struct work *work)
 	work->drv_rolllimit = 60;
 	calc_diff(work, work->sdiff);
 
-	cgtime(&work->tv_staged);
+	cgtime_coarse(&work->tv_staged);
 
 #if STRATUM_WORK_TIMING
-	usec = us_tdiff(&work->tv_staged, &stt);
+	cgtime(&ste);
+	usec = us_tdiff(&ste, &stt);
 	cg_wlock(&swt_lock);
 	stratum_work_count++;
 	stratum_work_time += usec;
@@ -8122,6 +8822,7 @@ static inline void release_gbt_curl(struct pool *pool)
 static void update_gbt_solo(struct pool *pool)
 {
 	struct work *work = make_work();
+	struct gbt_txns txns;
 	int rolltime;
 	json_t *val;
 
@@ -8129,11 +8830,11 @@ static void update_gbt_solo(struct pool *pool)
 retry:
 	/* Bitcoind doesn't like many open RPC connections. */
 	curl_easy_setopt(pool->gbt_curl, CURLOPT_FORBID_REUSE, 1);
-	val = json_rpc_call(pool->gbt_curl, pool->rpc_url, pool->rpc_userpass, pool->rpc_req,
-			    true, false, &rolltime, pool, false);
+	val = json_rpc_call_gbt(pool->gbt_curl, pool->rpc_url, pool->rpc_userpass, pool->rpc_req,
+				true, false, &rolltime, pool, &txns);
 
 	if (likely(val)) {
-		bool rc = work_decode(pool, work, val);
+		bool rc = work_decode(pool, work, val, &txns);
 
 		if (rc) {
 			__setup_gbt_solo(pool);
@@ -8142,6 +8843,7 @@ retry:
 		} else
 			free_work(work);
 		json_decref(val);
+		gbt_txns_free(&txns);
 	} else {
 		applog(LOG_DEBUG, "Pool %d json_rpc_call failed on get gbt, retrying in 5s",
 		       pool->pool_no);
@@ -8156,6 +8858,73 @@ out:
 	release_gbt_curl(pool);
 }
 
+/* Fetch a fresh template off the work generation path, waking up just before
+ * the current one goes stale, or when gen_gbt_work/gen_solo_work find it has
+ * already done so. The new template is decoded into standby storage and only
+ * swapped in under gbt_lock once complete. */
+static void *gbt_refresh_thread(void *userdata)
+{
+	struct pool *pool = (struct pool *)userdata;
+	char threadname[16];
+
+	pthread_detach(pthread_self());
+
+	snprintf(threadname, sizeof(threadname), "%d/GBTRefresh", pool->pool_no);
+	RenameThread(threadname);
+
+	while (42) {
+		struct timeval now, start, end;
+		double refresh_ms;
+		int age_ms;
+
+		cgtime(&now);
+		age_ms = ms_tdiff(&now, &pool->tv_lastwork);
+		if (age_ms < (GBT_REFRESH_SECS - 1) * 1000 &&
+		    !__atomic_load_n(&pool->gbt_refresh_wanted, __ATOMIC_ACQUIRE)) {
+			cgsem_mswait(&pool->gbt_refresh_sem, (GBT_REFRESH_SECS - 1) * 1000 - age_ms);
+			continue;
+		}
+
+		if (unlikely(pool->removed))
+			break;
+
+		if (pool->idle || pool->enabled != POOL_ENABLED) {
+			__atomic_store_n(&pool->gbt_refresh_wanted, false, __ATOMIC_RELEASE);
+			cgsem_mswait(&pool->gbt_refresh_sem, 5000);
+			continue;
+		}
+
+		cgtime(&start);
+		if (pool->gbt_solo)
+			update_gbt_solo(pool);
+		else
+			update_gbt(pool);
+		cgtime(&end);
+
+		/* Drop any requests that came in while we were refreshing */
+		__atomic_store_n(&pool->gbt_refresh_wanted, false, __ATOMIC_RELEASE);
+		cgsem_reset(&pool->gbt_refresh_sem);
+
+		refresh_ms = us_tdiff(&end, &start) / 1000.0;
+		cg_wlock(&pool->gbt_lock);
+		pool->gbt_refreshes++;
+		pool->gbt_refresh_last = refresh_ms;
+		pool->gbt_refresh_total += refresh_ms;
+		if (refresh_ms > pool->gbt_refresh_max)
+			pool->gbt_refresh_max = refresh_ms;
+		cg_wunlock(&pool->gbt_lock);
+
+		applog(LOG_DEBUG, "Pool %d GBT template refresh took %.1fms",
+		       pool->pool_no, refresh_ms);
+
+		/* Don't spin on a pool that isn't updating tv_lastwork */
+		if (ms_tdiff(&end, &pool->tv_lastwork) >= (GBT_REFRESH_SECS - 1) * 1000)
+			cgsem_mswait(&pool->gbt_refresh_sem, 5000);
+	}
+
+	return NULL;
+}
+
 static void gen_solo_work(struct pool *pool, struct work *work)
 {
 	unsigned char merkle_root[32], merkle_sha[64];
@@ -8165,7 +8934,8 @@ static void gen_solo_work(struct pool *pool, struct work *work)
 	int i;
 
 	cgtime(&now);
-	if (now.tv_sec - pool->tv_lastwork.tv_sec > 60)
+	if (now.tv_sec - pool->tv_lastwork.tv_sec > GBT_REFRESH_SECS &&
+	    !gbt_refresh_request(pool))
 		update_gbt_solo(pool);
 
 	cg_wlock(&pool->gbt_lock);
@@ -8233,7 +9003,7 @@ static void gen_solo_work(struct pool *pool, struct work *work)
 	work->drv_rolllimit = 60;
 	calc_diff(work, work->sdiff);
 
-	cgtime(&work->tv_staged);
+	cgtime_coarse(&work->tv_staged);
 }
 #endif
 
@@ -8394,30 +9164,25 @@ bool test_nonce(struct work *work, uint32_t nonce)
 /* For testing a nonce against an arbitrary diff */
 bool test_nonce_diff(struct work *work, uint32_t nonce, double diff)
 {
-	uint64_t *hash64 = (uint64_t *)(work->hash + 24), diff64;
+	u256 hash, target;
 
 	rebuild_nonce(work, nonce);
-	diff64 = 0x00000000ffff0000ULL;
-	diff64 /= diff;
+	u256_target_from_diff(&target, diff);
+	u256_from_le(&hash, work->hash);
 
-	return (le64toh(*hash64) <= diff64);
+	return u256_le(&hash, &target);
 }
 
 /* testing a nonce and return the diff - 0 means invalid */
 double test_nonce_value(struct work *work, uint32_t nonce)
 {
 	uint32_t *hash_32 = (uint32_t *)(work->hash + 28);
-	double d64, s64, ds;
 
 	rebuild_nonce(work, nonce);
 	if (*hash_32 != 0)
 		return 0.0;
 
-	d64 = truediffone;
-	s64 = le256todouble(work->hash);
-	ds = d64 / s64;
-
-	return ds;
+	return le256_diff(work->hash);
 }
 
 static void update_work_stats(struct thr_info *thr, struct work *work)
@@ -8425,6 +9190,7 @@ static void update_work_stats(struct thr_info *thr, struct work *work)
 	double test_diff = current_diff;
 
 	work->share_diff = share_diff(work);
+	atomic_max64(&thr->cgpu->best_diff, work->share_diff);
 
 	if (unlikely(work->share_diff >= test_diff)) {
 		work->block = true;
@@ -8450,7 +9216,7 @@ bool submit_tested_work(struct thr_info *thr, struct work *work)
 	update_work_stats(thr, work);
 
 	// dev testing logging the difficulty of all nonces
-	//double diff = truediffone / le256todouble(work->hash);
+	//double diff = le256_diff(work->hash);
 	//applog(LOG_ERR, "%s() %s %d: diff=%.1f", __func__,
 	//	thr->cgpu->drv->name, thr->cgpu->device_id, diff);
 
@@ -8503,10 +9269,9 @@ bool submit_nonce(struct thr_info *thr, struct work *work, uint32_t nonce)
 bool submit_noffset_nonce(struct thr_info *thr, struct work *work_in, uint32_t nonce,
 			  int noffset)
 {
-	struct work *work = make_work();
+	struct work *work = copy_work_noffset(work_in, noffset);
 	bool ret = false;
 
-	_copy_work(work, work_in, noffset);
 	if (!test_nonce(work, nonce)) {
 		free_work(work);
 		inc_hw_errors(thr);
@@ -8887,7 +9652,7 @@ int age_queued_work(struct cgpu_info *cgpu, double secs)
 	struct timeval tv_now;
 	int aged = 0;
 
-	cgtime(&tv_now);
+	cgtime_coarse(&tv_now);
 
 	wr_lock(&cgpu->qlock);
 	HASH_ITER(hh, cgpu->queued_work, work, tmp) {
@@ -8981,7 +9746,8 @@ void hash_queued_work(struct thr_info *mythr)
 		}
 
 		hashes_done += hashes;
-		cgtime(&tv_end);
+		/* hashmeter() takes its own precise time for the rates */
+		cgtime_coarse(&tv_end);
 		timersub(&tv_end, &tv_start, &diff);
 		/* Update the hashmeter at most 5 times per second */
 		if ((hashes_done && (diff.tv_sec > 0 || diff.tv_usec > 200000)) ||
@@ -9032,7 +9798,8 @@ void hash_driver_work(struct thr_info *mythr)
 		}
 
 		hashes_done += hashes;
-		cgtime(&tv_end);
+		/* hashmeter() takes its own precise time for the rates */
+		cgtime_coarse(&tv_end);
 		timersub(&tv_end, &tv_start, &diff);
 		/* Update the hashmeter at most 5 times per second */
 		if ((hashes_done && (diff.tv_sec > 0 || diff.tv_usec > 200000)) ||
@@ -9088,14 +9855,15 @@ enum {
 
 #ifdef HAVE_LIBCURL
 /* Stage another work item from the work returned in a longpoll */
-static void convert_to_work(json_t *val, int rolltime, struct pool *pool, struct timeval *tv_lp, struct timeval *tv_lp_reply)
+static void convert_to_work(json_t *val, struct gbt_txns *txns, int rolltime, struct pool *pool,
+			    struct timeval *tv_lp, struct timeval *tv_lp_reply)
 {
 	struct work *work;
 	bool rc;
 
 	work = make_work();
 
-	rc = work_decode(pool, work, val);
+	rc = work_decode(pool, work, val, txns);
 	if (unlikely(!rc)) {
 		applog(LOG_ERR, "Could not convert longpoll data to work");
 		free_work(work);
@@ -9156,8 +9924,7 @@ static struct pool *select_longpoll_pool(struct pool *cp)
 static void wait_lpcurrent(struct pool *pool)
 {
 	while (!cnx_needed(pool) && (pool->enabled == POOL_DISABLED ||
-	       (pool != current_pool() && pool_strategy != POOL_LOADBALANCE &&
-	       pool_strategy != POOL_BALANCE))) {
+	       (pool != current_pool() && !shared_strategy()))) {
 		mutex_lock(&lp_lock);
 		pthread_cond_wait(&lp_cond, &lp_lock);
 		mutex_unlock(&lp_lock);
@@ -9280,6 +10047,7 @@ retry_pool:
 	applog(LOG_WARNING, "GBT longpoll ID activated for %s", lp_url);
 
 	while (42) {
+		struct gbt_txns txns;
 		json_t *val, *soval;
 
 		wait_lpcurrent(cp);
@@ -9302,8 +10070,8 @@ retry_pool:
 		 * so always establish a fresh connection instead of relying on
 		 * a persistent one. */
 		curl_easy_setopt(curl, CURLOPT_FRESH_CONNECT, 1);
-		val = json_rpc_call(curl, lp_url, pool->rpc_userpass,
-				    lpreq, false, true, &rolltime, pool, false);
+		val = json_rpc_call_gbt(curl, lp_url, pool->rpc_userpass,
+					lpreq, false, true, &rolltime, pool, &txns);
 
 		cgtime(&reply);
 
@@ -9313,9 +10081,10 @@ retry_pool:
 				pool->submit_old = json_is_true(soval);
 			else
 				pool->submit_old = false;
-			convert_to_work(val, rolltime, pool, &start, &reply);
+			convert_to_work(val, &txns, rolltime, pool, &start, &reply);
 			failures = 0;
 			json_decref(val);
+			gbt_txns_free(&txns);
 		} else {
 			/* Some pools regularly drop the longpoll request so
 			 * only see this as longpoll failure if it happens
@@ -9553,39 +10322,8 @@ static void *watchdog_thread(void __maybe_unused *userdata)
 
 		hashmeter(-1, 0);
 
-#ifdef HAVE_CURSES
-		if (curses_active_locked()) {
-			struct cgpu_info *cgpu;
-			int count;
-
-			change_logwinsize();
-			curses_print_status();
-			count = 0;
-			for (i = 0; i < total_devices; i++) {
-				cgpu = get_a_device(i);
-#ifndef USE_USBUTILS
-				if (cgpu)
-#else
-				if (cgpu && !cgpu->usbinfo.nodev)
-#endif
-					curses_print_devstatus(cgpu, i, count++);
-			}
-#ifdef USE_USBUTILS
-			for (i = 0; i < total_devices; i++) {
-				cgpu = get_a_device(i);
-				if (cgpu && cgpu->usbinfo.nodev)
-					curses_print_devstatus(cgpu, i, count++);
-			}
-#endif
-			touchwin(statuswin);
-			wrefresh(statuswin);
-			touchwin(logwin);
-			wrefresh(logwin);
-			unlock_curses();
-		}
-#endif
-
 		cgtime(&now);
+		allocprof_log(&now);
 
 #if USE_LIBSYSTEMD
 		if (notify_usec && !time_more(&notify_tv, &now)) {
@@ -9703,6 +10441,7 @@ void print_summary(void)
 	struct timeval diff;
 	int hours, mins, secs, i;
 	double utility, displayed_hashes, work_util;
+	char best_share[8];
 
 	timersub(&total_tv_end, &total_tv_start, &diff);
 	hours = diff.tv_sec / 3600;
@@ -9721,6 +10460,7 @@ void print_summary(void)
 
 	applog(LOG_WARNING, "Average hashrate: %.1f Mhash/s", displayed_hashes);
 	applog(LOG_WARNING, "Solved blocks: %d", found_blocks);
+	best_share_str(best_share, sizeof(best_share));
 	applog(LOG_WARNING, "Best share difficulty: %s", best_share);
 	applog(LOG_WARNING, "Share submissions: %"PRId64, total_accepted + total_rejected);
 	applog(LOG_WARNING, "Accepted shares: %"PRId64, total_accepted);
@@ -10224,6 +10964,12 @@ void fill_device_drv(struct device_drv *drv)
 		drv->max_diff = 1;
 	if (!drv->genwork)
 		opt_gen_stratum_work = true;
+	/* Its nonce2 would overlap the stratum server miners' prefixes */
+	if (drv->rollnonce2 && opt_stratum_server) {
+		applog(LOG_WARNING, "%s devices roll nonce2 themselves, not detecting them with --stratum-server",
+		       drv->dname);
+		drv->drv_detect = &noop_detect;
+	}
 }
 
 void null_device_drv(struct device_drv *drv)
@@ -10290,25 +11036,15 @@ static void adjust_mostdevs(void)
 		most_devices = total_devices - zombie_devs;
 }
 
-#ifdef USE_ICARUS
-bool icarus_get_device_id(struct cgpu_info *cgpu)
-{
-	static struct _cgpu_devid_counter *devids = NULL;
-	struct _cgpu_devid_counter *d;
-
-	HASH_FIND_STR(devids, cgpu->drv->name, d);
-	if (d)
-		return (d->lastid + 1);
-	else
-		return 0;
-}
-#endif
-
 bool add_cgpu(struct cgpu_info *cgpu)
 {
 	static struct _cgpu_devid_counter *devids = NULL;
 	struct _cgpu_devid_counter *d;
 
+#ifdef USE_USBUTILS
+	/* USB probes run at once, so wait for the earlier ones to be added */
+	usb_detect_turn();
+#endif
 	HASH_FIND_STR(devids, cgpu->drv->name, d);
 	if (d)
 		cgpu->device_id = ++d->lastid;
@@ -10436,32 +11172,54 @@ static void reinit_usb(void)
 	usb_reinit = false;
 }
 
+/* With libusb hotplug events only the devices that arrive are probed, and
+ * those that leave are released as soon as they go. Otherwise, or after
+ * hotplug has been disabled, every device is checked again. */
 static void *hotplug_thread(void __maybe_unused *userdata)
 {
+	bool events, full = true;
+
 	pthread_setcanceltype(PTHREAD_CANCEL_ASYNCHRONOUS, NULL);
 
 	RenameThread("Hotplug");
 
 	hotplug_mode = true;
 
+	/* Register first so the first full check can't miss an arrival */
+	events = usb_hotplug_register();
+
 	cgsleep_ms(5000);
 
 	while (0x2a) {
-// Version 0.1 just add the devices on - worry about using nodev later
+		if (hotplug_time == 0) {
+			if (events) {
+				usb_hotplug_wait(5000, false);
+				full = true;
+			} else
+				cgsleep_ms(5000);
+			continue;
+		}
 
-		if (hotplug_time == 0)
-			cgsleep_ms(5000);
-		else {
-			new_devices = 0;
-			new_threads = 0;
+		if (!full && !usb_hotplug_wait(5000, true))
+			continue;
 
-			/* Use the DRIVER_PARSE_COMMANDS macro to detect all
-			 * devices */
-			DRIVER_PARSE_COMMANDS(DRIVER_DRV_DETECT_HOTPLUG)
+		new_devices = 0;
+		new_threads = 0;
 
-			if (new_devices)
-				hotplug_process();
+		/* Use the DRIVER_PARSE_COMMANDS macro to detect all
+		 * devices */
+		usb_detect_begin();
+		DRIVER_PARSE_COMMANDS(DRIVER_DRV_DETECT_HOTPLUG)
+		if (full)
+			usb_detect_end();
+		else
+			usb_hotplug_end();
+		full = !events;
+
+		if (new_devices)
+			hotplug_process();
 
+		if (!events) {
 			/* If we have no active devices, libusb may need to
 			 * be re-initialised to work properly */
 			if (total_devices == zombie_devs)
@@ -10564,45 +11322,41 @@ void setStartTimePoint()
 }
 #endif
 
-int main(int argc, char *argv[])
+/* Time from the last work generated from one pool to the first generated
+ * from the pool we failed over to. Switching away from a pool that's still
+ * working, such as back to a recovered higher priority pool or a user's
+ * switch, isn't a failover. Called only from the getwork scheduler. */
+static void failover_gap(struct pool *pool)
 {
-	struct sigaction handler;
-	struct work *work = NULL;
-	bool pool_msg = false;
-	struct thr_info *thr;
-	struct block *block;
-	int i, j, slept = 0;
-	unsigned int k;
-	char *s;
-
-	/* This dangerous functions tramples random dynamically allocated
-	 * variables so do it before anything at all */
-	if (unlikely(curl_global_init(CURL_GLOBAL_ALL)))
-		early_quit(1, "Failed to curl_global_init");
-
-#ifdef USE_LIBSYSTEMD
-	sd_notify(false, "STATUS=Starting up...");
-#endif
+	static struct pool *last_pool;
+	static struct timeval tv_last;
+	struct timeval now;
 
-# ifdef __linux
-	/* If we're on a small lowspec platform with only one CPU, we should
-	 * yield after dropping a lock to allow a thread waiting for it to be
-	 * able to get CPU time to grab the lock. */
-	if (sysconf(_SC_NPROCESSORS_ONLN) == 1)
-		selective_yield = &sched_yield;
-#endif
+	cgtime(&now);
+	if (last_pool && pool != last_pool && !shared_strategy() &&
+	    (last_pool->idle || (last_pool->has_stratum && !last_pool->stratum_active))) {
+		double gap = us_tdiff(&now, &tv_last) / 1000.0;
 
-#if LOCK_TRACKING
-	// Must be first
-	if (unlikely(pthread_mutex_init(&lockstat_lock, NULL)))
-		quithere(1, "Failed to pthread_mutex_init lockstat_lock errno=%d", errno);
-#endif
+		mutex_lock(&hash_lock);
+		failovers++;
+		failover_gap_last = gap;
+		failover_gap_total += gap;
+		if (gap > failover_gap_max)
+			failover_gap_max = gap;
+		mutex_unlock(&hash_lock);
 
-	initial_args = cgmalloc(sizeof(char *) * (argc + 1));
-	for  (i = 0; i < argc; i++)
-		initial_args[i] = strdup(argv[i]);
-	initial_args[argc] = NULL;
+		applog(LOG_NOTICE, "Failover from pool %d to pool %d took %.0fms%s",
+		       last_pool->pool_no, pool->pool_no, gap,
+		       (pool->has_stratum && !pool->stratum_active) ? " (pool was not on standby)" : "");
+	}
+	last_pool = pool;
+	copy_time(&tv_last, &now);
+}
 
+/* The global locks and the staged work queue, everything the work paths need
+ * before any pool or device is set up */
+static void init_core(void)
+{
 	mutex_init(&hash_lock);
 	mutex_init(&console_lock);
 	cglock_init(&control_lock);
@@ -10635,6 +11389,79 @@ int main(int argc, char *argv[])
 		early_quit(1, "Failed to create getq");
 	/* We use the getq mutex as the staged lock */
 	stgd_lock = &getq->mutex;
+}
+
+#ifdef CGMINER_BENCH
+/* cgminer-bench links everything here but main() and drives these static
+ * parts of the work path directly */
+void bench_init_core(void)
+{
+	init_core();
+	snprintf(packagename, sizeof(packagename), "%s %s", PACKAGE, VERSION);
+}
+
+struct work *bench_make_work(void)
+{
+	return make_work();
+}
+
+void bench_calc_midstate(struct pool *pool, struct work *work)
+{
+	calc_midstate(pool, work);
+}
+
+void bench_gen_stratum_work(struct pool *pool, struct work *work)
+{
+	gen_stratum_work(pool, work);
+}
+
+bool bench_hash_push(struct work *work)
+{
+	return hash_push(work);
+}
+
+struct work *bench_hash_pop(bool blocking)
+{
+	return hash_pop(blocking);
+}
+
+#define main cgminer_main
+#endif
+
+int main(int argc, char *argv[])
+{
+	struct sigaction handler;
+	struct work *work = NULL;
+	bool pool_msg = false;
+	struct thr_info *thr;
+	struct block *block;
+	int i, j, slept = 0;
+	unsigned int k;
+	char *s;
+
+	/* This dangerous functions tramples random dynamically allocated
+	 * variables so do it before anything at all */
+	if (unlikely(curl_global_init(CURL_GLOBAL_ALL)))
+		early_quit(1, "Failed to curl_global_init");
+
+#ifdef USE_LIBSYSTEMD
+	sd_notify(false, "STATUS=Starting up...");
+#endif
+
+# ifdef __linux
+	/* If we're on a small lowspec platform with only one CPU, we should
+	 * yield after dropping a lock to allow a thread waiting for it to be
+	 * able to get CPU time to grab the lock. */
+	if (sysconf(_SC_NPROCESSORS_ONLN) == 1)
+		selective_yield = &sched_yield;
+#endif
+
+	initial_args = cgmalloc(sizeof(char *) * (argc + 1));
+	for  (i = 0; i < argc; i++)
+		initial_args[i] = strdup(argv[i]);
+	initial_args[argc] = NULL;
+
+	init_core();
 
 	initialise_usb();
 
@@ -10726,7 +11553,7 @@ ASSERTbc(sizeof(test_work.hash) == (BC_MAX_BITS / HEX_BYTE));
 
 			// Of course MUST use the same calculation as all diff value tests
 			//  use to decide when to submit shares
-			test = truediffone / le256todouble(test_work.hash);
+			test = le256_diff(test_work.hash);
 
 			delta = diff - test;
 			ratio = delta / diff;
@@ -10905,7 +11732,7 @@ ASSERTbc(sizeof(test_work.hash) == (BC_MAX_BITS / HEX_BYTE));
 		setlogmask(LOG_UPTO(LOG_NOTICE));
 #endif
 
-	total_control_threads = 8;
+	total_control_threads = 9;
 	control_thr = cgcalloc(total_control_threads, sizeof(*thr));
 
 	gwsched_thr_id = 0;
@@ -10925,6 +11752,18 @@ ASSERTbc(sizeof(test_work.hash) == (BC_MAX_BITS / HEX_BYTE));
 	/* Use the DRIVER_PARSE_COMMANDS macro to fill all the device_drvs */
 	DRIVER_PARSE_COMMANDS(DRIVER_FILL_DEVICE_DRV)
 
+	stratrec_open();
+	stratum_replay_start();
+	if (opt_stratum_replay && !total_pools) {
+		struct pool *pool = add_url();
+		char *url = cgmalloc(64);
+
+		snprintf(url, 64, "stratum+tcp://127.0.0.1:%d", opt_stratum_replay_port);
+		setup_url(pool, url);
+		pool->rpc_user = strdup("replay");
+		pool->rpc_pass = strdup("x");
+	}
+
 	if (!total_pools) {
 		applog(LOG_WARNING, "Need to specify at least one pool server.");
 #ifdef HAVE_CURSES
@@ -11009,8 +11848,15 @@ ASSERTbc(sizeof(test_work.hash) == (BC_MAX_BITS / HEX_BYTE));
 	};
 
 begin_bench:
-	/* Use the DRIVER_PARSE_COMMANDS macro to detect all devices */
+	/* Use the DRIVER_PARSE_COMMANDS macro to detect all devices, with USB
+	 * devices probed together once every driver has asked for its own */
+#ifdef USE_USBUTILS
+	usb_detect_begin();
+#endif
 	DRIVER_PARSE_COMMANDS(DRIVER_DRV_DETECT_ALL)
+#ifdef USE_USBUTILS
+	usb_detect_end();
+#endif
 
 	if (opt_display_devs) {
 		applog(LOG_ERR, "Devices detected:");
@@ -11157,11 +12003,18 @@ begin_bench:
 	if (thr_info_create(thr, NULL, input_thread, thr))
 		early_quit(1, "input thread create failed");
 	pthread_detach(thr->pth);
+
+	/* Create the curses thread that draws the screen */
+	curses_thr_id = 8;
+	thr = &control_thr[curses_thr_id];
+	if (thr_info_create(thr, NULL, curses_thread, thr))
+		early_quit(1, "curses thread create failed");
+	pthread_detach(thr->pth);
 #endif
 
 	/* Just to be sure */
-	if (total_control_threads != 8)
-		early_quit(1, "incorrect total_control_threads (%d) should be 8", total_control_threads);
+	if (total_control_threads != 9)
+		early_quit(1, "incorrect total_control_threads (%d) should be 9", total_control_threads);
 
 #ifdef USE_GEKKO
 	set_lowprio();
@@ -11217,6 +12070,7 @@ begin_bench:
 			if (pool_unusable(pool))
 				cgsleep_ms(5);
 		};
+		failover_gap(pool);
 		if (pool->has_stratum) {
 			if (opt_gen_stratum_work) {
 				gen_stratum_work(pool, work);
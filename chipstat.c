@@ -0,0 +1,109 @@
+/*
+ * Copyright 2026 Andrew Smith
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 3 of the License, or (at your option)
+ * any later version.  See COPYING for more details.
+ */
+
+/* Per chip telemetry.
+ *
+ * A driver with many chips registers one or more tables of per chip values
+ * on its device, laid out a column at a time so each column is one flat
+ * array of chains * chips values. Drivers update them with relaxed atomics
+ * and no lock, and the 'chips' API command prints each column as a single
+ * list, instead of the driver adding an API item per chip per value to its
+ * 'stats'. Tables are added to the device's list as it is set up and are
+ * only freed along with the device. The previous values kept for deltas
+ * are only touched by the API thread. */
+
+#include "miner.h"
+#include "chipstat.h"
+
+/* Add a table to cgpu, or return the one it already has with that name, so
+ * a driver that sets a device up again keeps its counts */
+struct chip_stats *chip_stats_new(struct cgpu_info *cgpu, const char *name, int chains, int chips,
+				  const struct chip_stat_col *col, int cols)
+{
+	struct chip_stats *cs, **tail;
+	int c;
+
+	if (chains < 1)
+		chains = 1;
+	if (chips < 1)
+		chips = 1;
+
+	for (tail = &cgpu->chip_stats; (cs = *tail); tail = &cs->next) {
+		if (strcmp(cs->name, name) == 0) {
+			if (unlikely(cs->chains != chains || cs->chips != chips || cs->cols != cols))
+				quit(1, "%s%d: chip stats '%s' changed shape",
+				     cgpu->drv->name, cgpu->device_id, name);
+			return cs;
+		}
+	}
+
+	if (unlikely(cols > CHIP_STAT_COLS))
+		quit(1, "%s%d: chip stats '%s' has %d columns, the most is %d",
+		     cgpu->drv->name, cgpu->device_id, name, cols, CHIP_STAT_COLS);
+
+	cs = cgcalloc(1, sizeof(*cs));
+	cs->name = name;
+	cs->chains = chains;
+	cs->chips = chips;
+	cs->cols = cols;
+	cs->col = col;
+	for (c = 0; c < cols; c++)
+		cs->val[c] = cgcalloc(chains * chips, sizeof(uint64_t));
+
+	__atomic_store_n(tail, cs, __ATOMIC_RELEASE);
+	return cs;
+}
+
+/* Only once nothing can use cgpu */
+void chip_stats_free(struct cgpu_info *cgpu)
+{
+	struct chip_stats *cs;
+	int c;
+
+	while ((cs = cgpu->chip_stats)) {
+		cgpu->chip_stats = cs->next;
+		for (c = 0; c < cs->cols; c++) {
+			free(cs->val[c]);
+			free(cs->last[c]);
+		}
+		free(cs);
+	}
+}
+
+/* A column as one space separated list, chain by chain, which the caller
+ * frees. With delta, counters are the change since the last delta. */
+char *chip_stats_column(struct chip_stats *cs, int col, bool delta)
+{
+	int i, n = cs->chains * cs->chips;
+	uint64_t val, *last = NULL;
+	char *buf, *ptr;
+
+	if (delta && cs->col[col].kind == CHIP_COUNTER) {
+		if (!cs->last[col])
+			cs->last[col] = cgcalloc(n, sizeof(uint64_t));
+		last = cs->last[col];
+	}
+
+	buf = ptr = cgmalloc(n * 21 + 1);
+	*buf = '\0';
+	for (i = 0; i < n; i++) {
+		val = __atomic_load_n(&cs->val[col][i], __ATOMIC_RELAXED);
+		if (last) {
+			uint64_t now = val;
+
+			val -= last[i];
+			last[i] = now;
+		}
+		if (i)
+			*(ptr++) = ' ';
+		ptr += sprintf(ptr, "%"PRIu64, val);
+	}
+
+	return buf;
+}
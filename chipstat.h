@@ -0,0 +1,75 @@
+/*
+ * Copyright 2026 Andrew Smith
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 3 of the License, or (at your option)
+ * any later version.  See COPYING for more details.
+ */
+
+#ifndef CHIPSTAT_H
+#define CHIPSTAT_H
+
+#include "miner.h"
+
+#define CHIP_STAT_COLS 10
+
+/* A counter only goes up and is reported as a delta by 'chips|N,delta', a
+ * gauge is a current value such as a clock or temperature */
+enum chip_stat_kind {
+	CHIP_COUNTER,
+	CHIP_GAUGE,
+};
+
+struct chip_stat_col {
+	const char *name;
+	enum chip_stat_kind kind;
+};
+
+/* One table of per chip values for a device, a column at a time, indexed by
+ * chain * chips + chip */
+struct chip_stats {
+	struct chip_stats *next;
+	const char *name;
+	int chains;
+	int chips;		// Per chain
+	int cols;
+	const struct chip_stat_col *col;
+	uint64_t *val[CHIP_STAT_COLS];
+	uint64_t *last[CHIP_STAT_COLS];	// At the last API delta
+};
+
+extern struct chip_stats *chip_stats_new(struct cgpu_info *cgpu, const char *name, int chains, int chips,
+					 const struct chip_stat_col *col, int cols);
+extern void chip_stats_free(struct cgpu_info *cgpu);
+extern char *chip_stats_column(struct chip_stats *cs, int col, bool delta);
+
+/* Anything outside the table is counted against chain 0 chip 0 */
+static inline uint64_t *chip_stat_ptr(struct chip_stats *cs, int col, int chain, int chip)
+{
+	if (unlikely(chain < 0 || chain >= cs->chains || chip < 0 || chip >= cs->chips))
+		chain = chip = 0;
+	return &cs->val[col][chain * cs->chips + chip];
+}
+
+static inline void chip_stat_inc(struct chip_stats *cs, int col, int chain, int chip)
+{
+	__atomic_add_fetch(chip_stat_ptr(cs, col, chain, chip), 1, __ATOMIC_RELAXED);
+}
+
+static inline void chip_stat_add(struct chip_stats *cs, int col, int chain, int chip, uint64_t n)
+{
+	__atomic_add_fetch(chip_stat_ptr(cs, col, chain, chip), n, __ATOMIC_RELAXED);
+}
+
+static inline void chip_stat_set(struct chip_stats *cs, int col, int chain, int chip, uint64_t val)
+{
+	__atomic_store_n(chip_stat_ptr(cs, col, chain, chip), val, __ATOMIC_RELAXED);
+}
+
+static inline uint64_t chip_stat_get(struct chip_stats *cs, int col, int chain, int chip)
+{
+	return __atomic_load_n(chip_stat_ptr(cs, col, chain, chip), __ATOMIC_RELAXED);
+}
+
+#endif /* CHIPSTAT_H */
@@ -168,6 +168,7 @@ void init_mcompat_cmd(void)
 			s_cmd_ops_p->cmd_read_write_reg0d = spi_cmd_read_write_reg0d;
 			s_cmd_ops_p->cmd_read_result      = spi_cmd_read_result;
 			s_cmd_ops_p->cmd_write_job        = spi_cmd_write_job;
+			s_cmd_ops_p->cmd_write_jobs       = spi_cmd_write_jobs;
 			break;
 		case PLATFORM_ZYNQ_HUB_G9:
 		case PLATFORM_ZYNQ_HUB_G19:
@@ -263,6 +264,10 @@ void register_mcompat_cmd(MCOMPAT_CMD_T * ops)
 	{
 		s_cmd_ops_p->cmd_write_job = ops->cmd_write_job;
 	}
+	if (ops->cmd_write_jobs != NULL)
+	{
+		s_cmd_ops_p->cmd_write_jobs = ops->cmd_write_jobs;
+	}
 }
 
 bool mcompat_set_spi_speed(unsigned char chain_id, int index)
@@ -369,6 +374,31 @@ bool mcompat_cmd_write_job(unsigned char chain_id, unsigned char chip_id, unsign
 }
 
 
+/* Write a job of len bytes to each of num chips, jobs being consecutive in
+ * one buffer. Platforms without a batched write get them one at a time. */
+bool mcompat_cmd_write_jobs(unsigned char chain_id, unsigned char *chip_ids, unsigned char *jobs, int len, int num, bool *written)
+{
+	bool ret = true;
+	int i;
+
+	if (s_cmd_ops_p->cmd_write_jobs != NULL)
+	{
+		return s_cmd_ops_p->cmd_write_jobs(chain_id, chip_ids, jobs, len, num, written);
+	}
+
+	for (i = 0; i < num; i++)
+	{
+		written[i] = mcompat_cmd_write_job(chain_id, chip_ids[i], jobs + i * len, len);
+		if (!written[i])
+		{
+			ret = false;
+		}
+	}
+
+	return ret;
+}
+
+
 bool mcompat_cmd_read_result(unsigned char chain_id, unsigned char chip_id, unsigned char *res, int len)
 {
 	if (s_cmd_ops_p->cmd_read_result == NULL)
@@ -1852,6 +1882,15 @@ void zynq_spi_init(ZYNQ_SPI_T *spi, int bus)
 	spi->fd = fd;
 	pthread_mutex_init(&(spi->lock), NULL);
 
+	memset(&spi->ctx, 0, sizeof(spi->ctx));
+	spi->ctx.fd = fd;
+	spi->ctx.config.bus = bus;
+	spi->ctx.config.cs_line = MCOMPAT_CONFIG_SPI_DEFAULT_CS_LINE;
+	spi->ctx.config.mode = mode;
+	spi->ctx.config.speed = speed;
+	spi->ctx.config.bits = bits;
+	spi_batch_init(&spi->batch, &spi->ctx);
+
 	applog(LOG_DEBUG, "SPI '%s': mode=%hhu, bits=%hhu, speed=%u ",
 		    dev_fname, MCOMPAT_CONFIG_SPI_DEFAULT_MODE, MCOMPAT_CONFIG_SPI_DEFAULT_BITS_PER_WORD, MCOMPAT_CONFIG_SPI_DEFAULT_SPEED);
 	return;
@@ -1865,6 +1904,7 @@ void zynq_spi_exit(ZYNQ_SPI_T *spi)
 	}
 
 	close(spi->fd);
+	spi_batch_free(&spi->batch);
 
 	return;
 }
@@ -5368,6 +5408,38 @@ bool spi_cmd_write_job(unsigned char chain_id, unsigned char chip_id, unsigned c
 	return true;
 }
 
+/* Each job is its own chip select framed segment of one SPI message, so the
+ * chain sees exactly what num calls to spi_cmd_write_job would send */
+bool spi_cmd_write_jobs(unsigned char chain_id, unsigned char *chip_ids, unsigned char *jobs, int len, int num, bool *written)
+{
+	ZYNQ_SPI_T *spi = &s_spi[chain_id];
+	bool ret;
+	int i;
+
+	applog(LOG_DEBUG, "%s,%d: %s(%d, %p, %p, %d, %d)", __FILE__, __LINE__, __FUNCTION__, chain_id, chip_ids, jobs, len, num);
+
+	if (jobs == NULL)
+	{
+		applog(LOG_ERR, "%s para error !", __FUNCTION__);
+		return false;
+	}
+
+	pthread_mutex_lock(&(spi->lock));
+	for (i = 0; i < num; i++)
+	{
+		spi_batch_add(&spi->batch, jobs + i * len, NULL, len, true, 0);
+	}
+	ret = spi_batch_submit(&spi->batch);
+	pthread_mutex_unlock(&spi->lock);
+
+	for (i = 0; i < num; i++)
+	{
+		written[i] = ret;
+	}
+
+	return ret;
+}
+
 const unsigned short wCRCTalbeAbs[] =
 {
 	0x0000, 0xCC01, 0xD801, 0x1400,
@@ -5667,12 +5739,12 @@ void delay(unsigned int howLong)
 static int opi_spi_fd = 0;
 static pthread_mutex_t opi_spi_lock;
 static struct spi_config opi_spi_config = {
-	.bus		= DEFAULT_SPI_BUS,
-	.cs_line	= DEFAULT_SPI_CS_LINE,
-	.mode		= DEFAULT_SPI_MODE,
-	.speed		= DEFAULT_SPI_SPEED,
-	.bits		= DEFAULT_SPI_BITS_PER_WORD,
-	.delay		= DEFAULT_SPI_DELAY_USECS,
+	.bus		= OPI_SPI_BUS,
+	.cs_line	= OPI_SPI_CS_LINE,
+	.mode		= OPI_SPI_MODE,
+	.speed		= OPI_SPI_SPEED,
+	.bits		= OPI_SPI_BITS_PER_WORD,
+	.delay		= OPI_SPI_DELAY_USECS,
 };
 
 
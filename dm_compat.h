@@ -21,6 +21,8 @@
 #include <linux/spi/spidev.h>
 #include <linux/types.h>
 
+#include "spi-context.h"
+
 
 #define NUMARGS(...)  ((int)(sizeof((int[]){(int)__VA_ARGS__})/sizeof(int)))
 
@@ -175,6 +177,8 @@ typedef struct MCOMPAT_CMD_TAG{
 	//
 	bool (*cmd_write_job)(unsigned char, unsigned char, unsigned char *, int);
 	//
+	bool (*cmd_write_jobs)(unsigned char, unsigned char *, unsigned char *, int, int, bool *);
+	//
 	bool (*cmd_read_result)(unsigned char, unsigned char, unsigned char *, int);
 	//
 	bool (*cmd_auto_nonce)(unsigned char, int, int);
@@ -385,6 +389,7 @@ extern bool mcompat_cmd_read_write_reg0d(unsigned char chain_id, unsigned char c
 extern bool mcompat_cmd_read_result(unsigned char chain_id, unsigned char chip_id, unsigned char *res, int len);
 
 extern bool mcompat_cmd_write_job(unsigned char chain_id, unsigned char chip_id, unsigned char *job, int len);
+extern bool mcompat_cmd_write_jobs(unsigned char chain_id, unsigned char *chip_ids, unsigned char *jobs, int len, int num, bool *written);
 
 extern bool mcompat_cmd_auto_nonce(unsigned char chain_id, int mode, int len);
 
@@ -555,6 +560,8 @@ extern int zynq_gpio_g19_vid_set(int chain_id, int level);
 typedef struct ZYNQ_SPI_TAG{
 	int             fd;
 	pthread_mutex_t lock;
+	struct spi_ctx  ctx;
+	struct spi_batch batch;
 }ZYNQ_SPI_T;
 
 void zynq_spi_init(ZYNQ_SPI_T *spi, int bus);
@@ -1571,6 +1578,7 @@ bool spi_cmd_read_write_reg0d(unsigned char chain_id, unsigned char chip_id, uns
 bool spi_cmd_read_result(unsigned char chain_id, unsigned char chip_id, unsigned char *res, int len);
 
 bool spi_cmd_write_job(unsigned char chain_id, unsigned char chip_id, unsigned char *job, int len);
+bool spi_cmd_write_jobs(unsigned char chain_id, unsigned char *chip_ids, unsigned char *jobs, int len, int num, bool *written);
 
 
 /* UTIL */
@@ -1721,34 +1729,13 @@ void delay(unsigned int howLong);
 #define PIN_SPI_E1		_22
 
 
-#define SPI_DEVICE_TEMPLATE		"/dev/spidev%d.%d"
-#define DEFAULT_SPI_BUS			1
-#define DEFAULT_SPI_CS_LINE		0
-#define DEFAULT_SPI_MODE		SPI_MODE_1
-#define DEFAULT_SPI_BITS_PER_WORD	16
-#define DEFAULT_SPI_SPEED		1500000
-#define DEFAULT_SPI_DELAY_USECS		0
-
-
-struct spi_config {
-	int bus;
-	int cs_line;
-	uint8_t mode;
-	uint32_t speed;
-	uint8_t bits;
-	uint16_t delay;
-};
-
-struct spi_ctx {
-	int fd;
-	int power_en;
-	int start_en;
-	int reset;
-	int led;
-	int plug;
-	int id;
-	struct spi_config config;
-};
+/* struct spi_config and SPI_DEVICE_TEMPLATE come from spi-context.h */
+#define OPI_SPI_BUS			1
+#define OPI_SPI_CS_LINE			0
+#define OPI_SPI_MODE			SPI_MODE_1
+#define OPI_SPI_BITS_PER_WORD		16
+#define OPI_SPI_SPEED			1500000
+#define OPI_SPI_DELAY_USECS		0
 
 
 void opi_spi_init(void);
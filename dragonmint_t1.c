@@ -890,9 +890,9 @@ uint8_t *create_job(uint8_t chip_id, uint8_t job_id, struct work *work)
 	job[0] = (job_id << 4) | CMD_WRITE_JOB_T1;		// fixed by duanhao
 	job[1] = chip_id;
 
-	swab256(job + 2, work->midstate3);
-	swab256(job + 34, work->midstate2);
-	swab256(job + 66, work->midstate1);
+	swab256(job + 2, work_midstate(work, 3));
+	swab256(job + 34, work_midstate(work, 2));
+	swab256(job + 66, work_midstate(work, 1));
 	swab256(job + 98, work->midstate);
 	p1 = (uint32_t *) &job[130];
 	p2 = (uint32_t *) (work->data + 64);
@@ -1035,6 +1035,55 @@ bool set_work(struct T1_chain *t1, uint8_t chip_id, struct work *work, uint8_t q
 	return retval;
 }
 
+/* Set work for num chips with all of their jobs written to the chain in one
+ * batch, returning how many nonce ranges were finished */
+int set_works(struct T1_chain *t1, uint8_t *chip_ids, struct work **works, int num)
+{
+	int cid = t1->chain_id;
+	bool written[MAX_CHIP_NUM];
+	uint8_t *jobs;
+	int i, done = 0;
+
+	if (num <= 0)
+		return 0;
+
+	jobs = cgmalloc(num * JOB_LENGTH);
+	for (i = 0; i < num; i++) {
+		struct T1_chip *chip = &t1->chips[chip_ids[i] - 1];
+		int job_id = chip->last_queued_id + 1;
+
+		if (chip->work[chip->last_queued_id] != NULL) {
+			free_work(chip->work[chip->last_queued_id]);
+			chip->work[chip->last_queued_id] = NULL;
+			chip->nonce_ranges_done++;
+			done++;
+		}
+		/* create_job reuses one buffer so copy each job out */
+		memcpy(jobs + i * JOB_LENGTH, create_job(chip_ids[i], job_id, works[i]), JOB_LENGTH);
+	}
+
+	mcompat_cmd_write_jobs(cid, chip_ids, jobs, JOB_LENGTH, num, written);
+
+	for (i = 0; i < num; i++) {
+		struct T1_chip *chip = &t1->chips[chip_ids[i] - 1];
+
+		if (!written[i]) {
+			/* give back work */
+			free_work(works[i]);
+			applog(LOG_ERR, "%d: failed to set work for chip %d.%d",
+			       cid, chip_ids[i], chip->last_queued_id + 1);
+			disable_chip(t1, chip_ids[i]);
+		} else {
+			chip->work[chip->last_queued_id] = works[i];
+			chip->last_queued_id++;
+			chip->last_queued_id &= 3;
+		}
+	}
+	free(jobs);
+
+	return done;
+}
+
 bool get_nonce(struct T1_chain *t1, uint8_t *nonce, uint8_t *chip_id, uint8_t *job_id, uint8_t *micro_job_id)
 {
 	uint8_t buffer[10];
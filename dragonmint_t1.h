@@ -219,6 +219,7 @@ void disable_chip(struct T1_chain *t1, uint8_t chip_id);
 
 bool get_nonce(struct T1_chain *t1, uint8_t *nonce, uint8_t *chip_id, uint8_t *job_id, uint8_t *micro_job_id);
 bool set_work(struct T1_chain *t1, uint8_t chip_id, struct work *work, uint8_t queue_states);
+int set_works(struct T1_chain *t1, uint8_t *chip_ids, struct work **works, int num);
 uint8_t *create_job(uint8_t chip_id, uint8_t job_id, struct work *work);
 void test_bench_pll_config(struct T1_chain *t1,uint32_t uiPll);
 
@@ -20,6 +20,8 @@
 #include "logging.h"
 #include "miner.h"
 #include "util.h"
+#include "noncepipe.h"
+#include "jobslot.h"
 
 #include "A1-common.h"
 #include "A1-board-selector.h"
@@ -243,37 +245,6 @@ static uint8_t *cmd_READ_REG(struct A1_chain *a1, uint8_t chip)
 	return ret;
 }
 
-static uint8_t *cmd_WRITE_JOB(struct A1_chain *a1, uint8_t chip_id,
-			      uint8_t *job)
-{
-	/* ensure we push the SPI command to the last chip in chain */
-	int tx_len = WRITE_JOB_LENGTH + 2;
-	memcpy(a1->spi_tx, job, WRITE_JOB_LENGTH);
-	memset(a1->spi_tx + WRITE_JOB_LENGTH, 0, tx_len - WRITE_JOB_LENGTH);
-
-	assert(spi_transfer(a1->spi_ctx, a1->spi_tx, a1->spi_rx, tx_len));
-	hexdump("send: TX", a1->spi_tx, tx_len);
-	hexdump("send: RX", a1->spi_rx, tx_len);
-
-	int poll_len = 4 * chip_id - 2;
-
-	assert(spi_transfer(a1->spi_ctx, NULL, a1->spi_rx + tx_len, poll_len));
-	hexdump("poll: RX", a1->spi_rx + tx_len, poll_len);
-
-	int ack_len = tx_len;
-	int ack_pos = tx_len + poll_len - ack_len;
-	hexdump("poll: ACK", a1->spi_rx + ack_pos, tx_len);
-
-	uint8_t *ret = a1->spi_rx + ack_pos;
-	if (ret[0] != a1->spi_tx[0] || ret[1] != a1->spi_tx[1]){
-		applog(LOG_ERR, "%d: cmd_WRITE_JOB failed: "
-			"0x%02x%02x/0x%02x%02x", a1->chain_id,
-			ret[0], ret[1], a1->spi_tx[0], a1->spi_tx[1]);
-		return NULL;
-	}
-	return ret;
-}
-
 /********** A1 low level functions */
 #define MAX_PLL_WAIT_CYCLES 25
 #define PLL_CYCLE_WAIT_TIME 40
@@ -592,13 +563,20 @@ static uint8_t *create_job(uint8_t chip_id, uint8_t job_id, struct work *work)
 	return job;
 }
 
-/* set work for given chip, returns true if a nonce range was finished */
-static bool set_work(struct A1_chain *a1, uint8_t chip_id, struct work *work,
-		     uint8_t queue_states)
+#define JOB_TX_LENGTH	(WRITE_JOB_LENGTH + 2)
+
+/* each chip has job ids 1..4, mapped to consecutive job slots */
+#define A1_JOB_SLOT(chip_id, job_id)	(((chip_id) - 1) * 4 + (job_id) - 1)
+
+/* queue work for given chip, written out by set_queued_work */
+static void queue_work(struct A1_chain *a1, uint8_t chip_id, struct work *work,
+		       uint8_t queue_states)
 {
 	int cid = a1->chain_id;
 	struct A1_chip *chip = &a1->chips[chip_id - 1];
-	bool retval = false;
+	int slot = a1->num_jobs++;
+	uint8_t *tx = a1->job_tx + slot * JOB_TX_LENGTH;
+	uint8_t *rx = a1->job_rx + slot * MAX_CMD_LENGTH;
 
 	int job_id = chip->last_queued_id + 1;
 
@@ -608,25 +586,69 @@ static bool set_work(struct A1_chain *a1, uint8_t chip_id, struct work *work,
 		applog(LOG_WARNING, "%d: job overlap: %d, 0x%02x",
 		       cid, job_id, queue_states);
 
-	if (chip->work[chip->last_queued_id] != NULL) {
-		work_completed(a1->cgpu, chip->work[chip->last_queued_id]);
-		chip->work[chip->last_queued_id] = NULL;
-		retval = true;
-	}
-	uint8_t *jobdata = create_job(chip_id, job_id, work);
-	if (!cmd_WRITE_JOB(a1, chip_id, jobdata)) {
-		/* give back work */
-		work_completed(a1->cgpu, work);
-
-		applog(LOG_ERR, "%d: failed to set work for chip %d.%d",
-		       cid, chip_id, job_id);
-		disable_chip(a1, chip_id);
-	} else {
-		chip->work[chip->last_queued_id] = work;
-		chip->last_queued_id++;
-		chip->last_queued_id &= 3;
+	/* push the command to the last chip in chain, then poll its ACK back */
+	memcpy(tx, create_job(chip_id, job_id, work), WRITE_JOB_LENGTH);
+	memset(tx + WRITE_JOB_LENGTH, 0, JOB_TX_LENGTH - WRITE_JOB_LENGTH);
+	spi_batch_add(&a1->job_batch, tx, rx, JOB_TX_LENGTH, true, 0);
+	spi_batch_add(&a1->job_batch, NULL, rx + JOB_TX_LENGTH,
+		      4 * chip_id - 2, true, 0);
+
+	a1->job_chip[slot] = chip_id;
+	a1->job_work[slot] = work;
+}
+
+/* write all queued work, returns number of nonce ranges finished */
+static int set_queued_work(struct A1_chain *a1)
+{
+	int cid = a1->chain_id;
+	int i, done = 0;
+
+	if (a1->num_jobs == 0)
+		return 0;
+
+	if (!spi_batch_submit(&a1->job_batch))
+		applog(LOG_ERR, "%d: failed to write %d jobs", cid, a1->num_jobs);
+
+	for (i = 0; i < a1->num_jobs; i++) {
+		uint8_t chip_id = a1->job_chip[i];
+		struct A1_chip *chip = &a1->chips[chip_id - 1];
+		struct work *work = a1->job_work[i];
+		uint8_t *tx = a1->job_tx + i * JOB_TX_LENGTH;
+		/* the ACK is the last tx length bytes of the poll */
+		uint8_t *ret = a1->job_rx + i * MAX_CMD_LENGTH + 4 * chip_id - 2;
+		int job_id = chip->last_queued_id + 1;
+		int slot = A1_JOB_SLOT(chip_id, job_id);
+		struct np_chip_stats stats;
+
+		if (ret[0] != tx[0] || ret[1] != tx[1]) {
+			applog(LOG_ERR, "%d: WRITE_JOB failed: "
+				"0x%02x%02x/0x%02x%02x", cid,
+				ret[0], ret[1], tx[0], tx[1]);
+			if (job_slots_clear(a1->cgpu, slot)) {
+				chip->nonce_ranges_done++;
+				done++;
+			}
+			/* give back work */
+			work_completed(a1->cgpu, work);
+
+			applog(LOG_ERR, "%d: failed to set work for chip %d.%d",
+			       cid, chip_id, job_id);
+			disable_chip(a1, chip_id);
+		} else {
+			if (job_slots_set(a1->cgpu, slot, work)) {
+				chip->nonce_ranges_done++;
+				done++;
+			}
+			chip->last_queued_id++;
+			chip->last_queued_id &= 3;
+		}
+		nonce_pipe_chip_stats(a1->cgpu, chip_id - 1, &stats);
+		applog(LOG_DEBUG, "%d: chip %d: job done: %d/%"PRIu64"/%"PRIu64"/%"PRIu64,
+		       cid, chip_id, chip->nonce_ranges_done,
+		       stats.good, stats.bad, stats.stale);
 	}
-	return retval;
+	a1->num_jobs = 0;
+	return done;
 }
 
 static bool get_nonce(struct A1_chain *a1, uint8_t *nonce,
@@ -652,6 +674,25 @@ static bool abort_work(struct A1_chain *a1)
 	return cmd_RESET_BCAST(a1, 0xed);
 }
 
+static struct work *A1_lookup(struct cgpu_info *cgpu, const struct np_result *res)
+{
+	if (res->job_id < 1 || res->job_id > 4)
+		return NULL;
+	return job_slots_get(cgpu, A1_JOB_SLOT(res->chip + 1, res->job_id), NULL);
+}
+
+static struct work *A1_recover(struct cgpu_info *cgpu, const struct np_result *res)
+{
+	if (res->job_id < 1 || res->job_id > 4)
+		return NULL;
+	return job_slots_recover(cgpu, A1_JOB_SLOT(res->chip + 1, res->job_id), res->nonce);
+}
+
+static const struct nonce_pipe_ops A1_nonce_ops = {
+	.lookup = A1_lookup,
+	.recover = A1_recover,
+};
+
 /********** driver interface */
 void exit_A1_chain(struct A1_chain *a1)
 {
@@ -659,6 +700,9 @@ void exit_A1_chain(struct A1_chain *a1)
 		return;
 	free(a1->chips);
 	a1->chips = NULL;
+	spi_batch_free(&a1->job_batch);
+	free(a1->job_tx);
+	free(a1->job_rx);
 	a1->spi_ctx = NULL;
 	free(a1);
 }
@@ -698,6 +742,11 @@ struct A1_chain *init_A1_chain(struct spi_ctx *ctx, int chain_id)
 	a1->chips = calloc(a1->num_active_chips, sizeof(struct A1_chip));
 	assert (a1->chips != NULL);
 
+	spi_batch_init(&a1->job_batch, a1->spi_ctx);
+	a1->job_tx = calloc(a1->num_active_chips, JOB_TX_LENGTH);
+	a1->job_rx = calloc(a1->num_active_chips, MAX_CMD_LENGTH);
+	assert(a1->job_tx != NULL && a1->job_rx != NULL);
+
 	if (!cmd_BIST_FIX_BCAST(a1))
 		goto failure;
 
@@ -736,6 +785,8 @@ static bool detect_single_chain(void)
 	cgpu->device_data = a1;
 
 	a1->cgpu = cgpu;
+	nonce_pipe_alloc(cgpu, &A1_nonce_ops, a1->num_chips);
+	job_slots_alloc(cgpu, a1->num_chips * 4, true);
 	add_cgpu(cgpu);
 	applog(LOG_WARNING, "Detected single A1 chain with %d chips / %d cores",
 	       a1->num_active_chips, a1->num_cores);
@@ -782,6 +833,8 @@ bool detect_coincraft_desk(void)
 		cgpu->device_data = a1;
 
 		a1->cgpu = cgpu;
+		nonce_pipe_alloc(cgpu, &A1_nonce_ops, a1->num_chips);
+		job_slots_alloc(cgpu, a1->num_chips * 4, true);
 		add_cgpu(cgpu);
 		boards_detected++;
 	}
@@ -838,6 +891,8 @@ bool detect_coincraft_rig_v3(void)
 		cgpu->device_data = a1;
 
 		a1->cgpu = cgpu;
+		nonce_pipe_alloc(cgpu, &A1_nonce_ops, a1->num_chips);
+		job_slots_alloc(cgpu, a1->num_chips * 4, true);
 		add_cgpu(cgpu);
 		chains_detected++;
 	}
@@ -951,26 +1006,13 @@ static int64_t A1_scanwork(struct thr_info *thr)
 			continue;
 		}
 
-		struct A1_chip *chip = &a1->chips[chip_id - 1];
-		struct work *work = chip->work[job_id - 1];
-		if (work == NULL) {
-			/* already been flushed => stale */
-			applog(LOG_WARNING, "%d: chip %d: stale nonce 0x%08x",
-			       cid, chip_id, nonce);
-			chip->stales++;
-			continue;
-		}
-		if (!submit_nonce(thr, work, nonce)) {
-			applog(LOG_WARNING, "%d: chip %d: invalid nonce 0x%08x",
-			       cid, chip_id, nonce);
-			chip->hw_errors++;
-			/* add a penalty of a full nonce range on HW errors */
-			nonce_ranges_processed--;
-			continue;
-		}
-		applog(LOG_DEBUG, "YEAH: %d: chip %d / job_id %d: nonce 0x%08x",
-		       cid, chip_id, job_id, nonce);
-		chip->nonces_found++;
+		struct np_result res = {
+			.chip = chip_id - 1,
+			.job_id = job_id,
+			.nonce = nonce,
+		};
+		/* verified off this thread, flushed work counts as stale */
+		nonce_pipe_push(cgpu, &res);
 	}
 
 	/* check for completed works */
@@ -985,7 +1027,6 @@ static int64_t A1_scanwork(struct thr_info *thr)
 		uint8_t qstate = a1->spi_rx[5] & 3;
 		uint8_t qbuff = a1->spi_rx[6];
 		struct work *work;
-		struct A1_chip *chip = &a1->chips[i - 1];
 		switch(qstate) {
 		case 3:
 			continue;
@@ -1004,17 +1045,11 @@ static int64_t A1_scanwork(struct thr_info *thr)
 				       cid, c);
 				break;
 			}
-			if (set_work(a1, c, work, qbuff)) {
-				chip->nonce_ranges_done++;
-				nonce_ranges_processed++;
-			}
-			applog(LOG_DEBUG, "%d: chip %d: job done: %d/%d/%d/%d",
-			       cid, c,
-			       chip->nonce_ranges_done, chip->nonces_found,
-			       chip->hw_errors, chip->stales);
+			queue_work(a1, c, work, qbuff);
 			break;
 		}
 	}
+	nonce_ranges_processed += set_queued_work(a1);
 	check_disabled_chips(a1);
 	mutex_unlock(&a1->lock);
 
@@ -1074,14 +1109,10 @@ static void A1_flush_work(struct cgpu_info *cgpu)
 	for (i = 0; i < a1->num_active_chips; i++) {
 		int j;
 		struct A1_chip *chip = &a1->chips[i];
-		for (j = 0; j < 4; j++) {
-			struct work *work = chip->work[j];
-			if (work == NULL)
-				continue;
-			applog(LOG_DEBUG, "%d: flushing chip %d, work %d: 0x%p",
-			       cid, i, j + 1, work);
-			work_completed(cgpu, work);
-			chip->work[j] = NULL;
+		for (j = 1; j <= 4; j++) {
+			if (job_slots_clear(cgpu, A1_JOB_SLOT(i + 1, j)))
+				applog(LOG_DEBUG, "%d: flushing chip %d, work %d",
+				       cid, i, j);
 		}
 		chip->last_queued_id = 0;
 	}
@@ -1097,6 +1128,15 @@ static void A1_flush_work(struct cgpu_info *cgpu)
 	board_selector->release();
 }
 
+static void A1_shutdown(struct thr_info *thr)
+{
+	struct cgpu_info *cgpu = thr->cgpu;
+
+	/* Results still on the nonce pipe look their work up in the job slots */
+	nonce_pipe_free(cgpu);
+	job_slots_free(cgpu);
+}
+
 static void A1_get_statline_before(char *buf, size_t len,
 				   struct cgpu_info *cgpu)
 {
@@ -1120,4 +1160,5 @@ struct device_drv bitmineA1_drv = {
 	.queue_full = A1_queue_full,
 	.flush_work = A1_flush_work,
 	.get_statline_before = A1_get_statline_before,
+	.thread_shutdown = A1_shutdown,
 };
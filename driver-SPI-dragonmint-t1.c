@@ -1299,11 +1299,13 @@ static int64_t T1_scanwork(struct thr_info *thr)
 
 		/* qstate will always be 0x0 when work_restart is set */
 		if (qstate != 0x03) {
+			uint8_t chip_ids[MAX_CHIP_NUM];
+			struct work *works[MAX_CHIP_NUM];
+			int num = 0;
+
 			if (qstate == 0x0) {
 				for (i = t1->num_active_chips; i > 0; i--) {
-					struct T1_chip *chip = &t1->chips[i - 1];
 					struct work *work = wq_dequeue(t1, true);
-					uint8_t c = i;
 
 					if (unlikely(!work)) {
 						reset_tune(t1);
@@ -1311,16 +1313,16 @@ static int64_t T1_scanwork(struct thr_info *thr)
 						cgsleep_ms(10);
 						break;
 					}
-					if (set_work(t1, c, work, 0))
-						chip->nonce_ranges_done++;
+					chip_ids[num] = i;
+					works[num++] = work;
 				}
+				set_works(t1, chip_ids, works, num);
+				num = 0;
 			}
 
 			//applog(LOG_NOTICE, "qstate is not 0x0,the number of work is %d. \t", t1->active_wq.num_elems);
 			for (i = t1->num_active_chips; i > 0; i--) {
-				struct T1_chip *chip = &t1->chips[i - 1];
 				struct work *work = wq_dequeue(t1, true);
-				uint8_t c = i;
 
 				if (unlikely(!work)) {
 					/* Demote this message since it's the
@@ -1328,9 +1330,10 @@ static int64_t T1_scanwork(struct thr_info *thr)
 					applog(LOG_INFO, "T1 %d backup work underrun", cid);
 					break;
 				}
-				if (set_work(t1, c, work, 0))
-					chip->nonce_ranges_done++;
+				chip_ids[num] = i;
+				works[num++] = work;
 			}
+			set_works(t1, chip_ids, works, num);
 		}
 	} else {
 		g_cmd_fails[cid]++;
@@ -787,7 +787,7 @@ static struct cgpu_info *avalon_detect_one(libusb_device *dev, struct usb_find_d
 	if (!usb_init(avalon, dev, found))
 		goto shin;
 
-	this_option_offset = usb_ident(avalon) == IDENT_BBF ? ++bbf_option_offset : ++option_offset;
+	this_option_offset = usb_detect_option(usb_ident(avalon) == IDENT_BBF ? &bbf_option_offset : &option_offset);
 	configured = get_options(this_option_offset, &baud, &miner_count,
 				 &asic_count, &timeout, &frequency, &asic,
 				 (usb_ident(avalon) == IDENT_BBF && opt_bitburner_fury_options != NULL) ? opt_bitburner_fury_options : opt_avalon_options);
@@ -788,6 +788,7 @@ static void copy_pool_stratum(struct avalon2_info *info, struct pool *pool)
 		return;
 
 	cg_wlock(&pool_stratum->data_lock);
+	__stratum_job_clear(pool_stratum);
 	free(pool_stratum->swork.job_id);
 	free(pool_stratum->nonce1);
 	free(pool_stratum->coinbase);
@@ -1085,4 +1086,5 @@ struct device_drv avalon2_drv = {
 	.update_work = avalon2_update,
 	.scanwork = avalon2_scanhash,
 	.thread_shutdown = avalon2_shutdown,
+	.rollnonce2 = true,
 };
@@ -1604,6 +1604,7 @@ static void copy_pool_stratum(struct pool *pool_stratum, struct pool *pool)
 	}
 
 	cg_wlock(&pool_stratum->data_lock);
+	__stratum_job_clear(pool_stratum);
 	free(pool_stratum->swork.job_id);
 	free(pool_stratum->nonce1);
 	free(pool_stratum->coinbase);
@@ -3155,4 +3156,5 @@ struct device_drv avalon4_drv = {
 	.update_work = avalon4_update,
 	.scanwork = avalon4_scanhash,
 	.max_diff = AVA4_DRV_DIFFMAX,
+	.rollnonce2 = true,
 };
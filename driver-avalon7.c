@@ -13,6 +13,7 @@
 #include "miner.h"
 #include "driver-avalon7.h"
 #include "crc.h"
+#include "auc.h"
 #include "sha2.h"
 #include "hexdump.c"
 
@@ -36,6 +37,7 @@ int opt_avalon7_freq[AVA7_DEFAULT_PLL_CNT] = {AVA7_DEFAULT_FREQUENCY_0,
 int opt_avalon7_freq_sel = AVA7_DEFAULT_FREQUENCY_SEL;
 
 int opt_avalon7_polling_delay = AVA7_DEFAULT_POLLING_DELAY;
+int opt_avalon7_polling_depth = AVA7_DEFAULT_POLLING_DEPTH;
 
 int opt_avalon7_aucspeed = AVA7_AUC_SPEED;
 int opt_avalon7_aucxdelay = AVA7_AUC_XDELAY;
@@ -433,7 +435,7 @@ static int avalon7_init_pkg(struct avalon7_pkg *pkg, uint8_t type, uint8_t idx,
 	return 0;
 }
 
-static int job_idcmp(uint8_t *job_id, char *pool_job_id)
+static int job_idcmp(uint8_t *job_id, const char *pool_job_id)
 {
 	int job_id_len;
 	unsigned short crc, crc_expect;
@@ -541,10 +543,8 @@ out:
 static int decode_pkg(struct cgpu_info *avalon7, struct avalon7_ret *ar, int modular_id)
 {
 	struct avalon7_info *info = avalon7->device_data;
-	struct pool *pool, *real_pool;
-	struct pool *pool_stratum0 = &info->pool0;
-	struct pool *pool_stratum1 = &info->pool1;
-	struct pool *pool_stratum2 = &info->pool2;
+	struct pool *real_pool;
+	struct stratum_job *job;
 	struct thr_info *thr = NULL;
 
 	unsigned short expected_crc;
@@ -612,40 +612,36 @@ static int decode_pkg(struct cgpu_info *avalon7, struct avalon7_ret *ar, int mod
 		       info->chip_matching_work[modular_id][miner][2],
 		       info->chip_matching_work[modular_id][miner][3]);
 
-		real_pool = pool = pools[pool_no];
-		if (job_idcmp(job_id, pool->swork.job_id)) {
-			if (!job_idcmp(job_id, pool_stratum0->swork.job_id)) {
-				applog(LOG_DEBUG, "%s-%d-%d: Match to previous stratum0! (%s)",
-						avalon7->drv->name, avalon7->device_id, modular_id,
-						pool_stratum0->swork.job_id);
-				pool = pool_stratum0;
-			} else if (!job_idcmp(job_id, pool_stratum1->swork.job_id)) {
-				applog(LOG_DEBUG, "%s-%d-%d: Match to previous stratum1! (%s)",
-						avalon7->drv->name, avalon7->device_id, modular_id,
-						pool_stratum1->swork.job_id);
-				pool = pool_stratum1;
-			} else if (!job_idcmp(job_id, pool_stratum2->swork.job_id)) {
-				applog(LOG_DEBUG, "%s-%d-%d: Match to previous stratum2! (%s)",
-						avalon7->drv->name, avalon7->device_id, modular_id,
-						pool_stratum2->swork.job_id);
-				pool = pool_stratum2;
-			} else {
-				applog(LOG_ERR, "%s-%d-%d: Cannot match to any stratum! (%s)",
-						avalon7->drv->name, avalon7->device_id, modular_id,
-						pool->swork.job_id);
-				if (likely(thr))
-					inc_hw_errors(thr);
-				info->hw_works_i[modular_id][miner]++;
+		/* Match against the jobs pinned when they were sent, under
+		 * the update_lock polling holds */
+		real_pool = pools[pool_no];
+		job = NULL;
+		for (i = 0; i < AVA7_STRATUM_JOBS; i++) {
+			if (info->sjob[i] && !job_idcmp(job_id, stratum_job_id(info->sjob[i]))) {
+				job = info->sjob[i];
 				break;
 			}
 		}
+		if (!job) {
+			applog(LOG_ERR, "%s-%d-%d: Cannot match to any stratum! (%02x%02x)",
+					avalon7->drv->name, avalon7->device_id, modular_id,
+					job_id[0], job_id[1]);
+			if (likely(thr))
+				inc_hw_errors(thr);
+			info->hw_works_i[modular_id][miner]++;
+			break;
+		}
+		if (i)
+			applog(LOG_DEBUG, "%s-%d-%d: Match to previous stratum%u! (%s)",
+					avalon7->drv->name, avalon7->device_id, modular_id,
+					i, stratum_job_id(job));
 
 		/* Can happen during init sequence before add_cgpu */
 		if (unlikely(!thr))
 			break;
 
 		last_diff1 = avalon7->diff1;
-		if (!submit_nonce2_nonce(thr, pool, real_pool, nonce2, nonce, ntime))
+		if (!submit_job_nonce(thr, job, real_pool, nonce2, nonce, ntime))
 			info->hw_works_i[modular_id][miner]++;
 		else {
 			info->diff1[modular_id] += (avalon7->diff1 - last_diff1);
@@ -1322,6 +1318,10 @@ static struct cgpu_info *avalon7_auc_detect(struct libusb_device *dev, struct us
 		info->enable[i] = 0;
 
 	info->connecter = AVA7_CONNECTER_AUC;
+	info->auc_echo = auc_echo_probe(avalon7, opt_avalon7_aucxdelay / 4800 + 1, C_AVA7_WRITE, C_AVA7_READ);
+	if (!info->auc_echo && opt_avalon7_polling_depth > 1)
+		applog(LOG_WARNING, "%s-%d: AUC doesn't echo transaction ids, polling one module at a time",
+		       avalon7->drv->name, avalon7->device_id);
 
 	detect_modules(avalon7);
 	for (i = 0; i < AVA7_DEFAULT_MODULARS; i++)
@@ -1368,9 +1368,6 @@ static bool avalon7_prepare(struct thr_info *thr)
 	cgtime(&info->last_detect);
 
 	cglock_init(&info->update_lock);
-	cglock_init(&info->pool0.data_lock);
-	cglock_init(&info->pool1.data_lock);
-	cglock_init(&info->pool2.data_lock);
 
 	return true;
 }
@@ -1502,6 +1499,9 @@ static void detect_modules(struct cgpu_info *avalon7)
 		}
 		info->error_code[i][j] = 0;
 		info->error_polling_cnt[i] = 0;
+		info->poll_delay[i] = opt_avalon7_polling_delay;
+		info->poll_latency[i] = 0;
+		info->nonce_backlog[i] = 0;
 		info->power_good[i] = 0;
 		memset(info->pmu_version[i], 0, sizeof(char) * 5 * AVA7_DEFAULT_PMU_CNT);
 		info->diff1[i] = 0;
@@ -1529,128 +1529,187 @@ static void detach_module(struct cgpu_info *avalon7, int addr)
 		avalon7->drv->name, avalon7->device_id, addr);
 }
 
-static int polling(struct cgpu_info *avalon7)
+/* Fold one poll's round trip into the module's moving average and work out how
+ * long to wait before polling it again. A module that answered with a nonce
+ * probably has more queued up so it is polled again immediately, otherwise the
+ * time spent on the poll itself counts towards the polling delay. */
+static void avalon7_poll_schedule(struct avalon7_info *info, int addr, bool nonce, double latency)
 {
-	struct avalon7_info *info = avalon7->device_data;
-	struct avalon7_pkg send_pkg;
-	struct avalon7_ret ar;
-	int i, tmp, ret, decode_err = 0;
-	struct timeval current_fan;
-	int do_adjust_fan = 0;
-	uint32_t fan_pwm;
-	double device_tdiff;
-
-	cgtime(&current_fan);
-	device_tdiff = tdiff(&current_fan, &(info->last_fan_adj));
-	if (device_tdiff > 2.0 || device_tdiff < 0) {
-		cgtime(&info->last_fan_adj);
-		do_adjust_fan = 1;
-	}
+	int delay;
 
-	for (i = 1; i < AVA7_DEFAULT_MODULARS; i++) {
-		if (!info->enable[i])
-			continue;
+	if (info->poll_latency[addr] > 0)
+		info->poll_latency[addr] = (info->poll_latency[addr] * 7 + latency) / 8;
+	else
+		info->poll_latency[addr] = latency;
 
-		cgsleep_ms(opt_avalon7_polling_delay);
+	if (nonce)
+		info->nonce_backlog[addr]++;
+	else
+		info->nonce_backlog[addr] = 0;
 
-		memset(send_pkg.data, 0, AVA7_P_DATA_LEN);
-		/* Red LED */
-		tmp = be32toh(info->led_indicator[i]);
-		memcpy(send_pkg.data, &tmp, 4);
-
-		/* Adjust fan every 2 seconds*/
-		if (do_adjust_fan) {
-			fan_pwm = adjust_fan(info, i);
-			fan_pwm |= 0x80000000;
-			tmp = be32toh(fan_pwm);
-			memcpy(send_pkg.data + 4, &tmp, 4);
-		}
+	if (info->nonce_backlog[addr])
+		delay = 0;
+	else {
+		delay = opt_avalon7_polling_delay - (int)info->poll_latency[addr];
+		if (delay < 0)
+			delay = 0;
+	}
+	info->poll_delay[addr] = delay;
+}
 
-		if (info->reboot[i]) {
-			info->reboot[i] = false;
-			send_pkg.data[8] = 0x1;
-		}
+static void polling_pkg(struct avalon7_info *info, int addr, int do_adjust_fan, struct avalon7_pkg *send_pkg)
+{
+	uint32_t fan_pwm;
+	int tmp;
 
-		avalon7_init_pkg(&send_pkg, AVA7_P_POLLING, 1, 1);
-		ret = avalon7_iic_xfer_pkg(avalon7, i, &send_pkg, &ar);
-		if (ret == AVA7_SEND_OK)
-			decode_err = decode_pkg(avalon7, &ar, i);
-
-		if (ret != AVA7_SEND_OK || decode_err) {
-			info->error_polling_cnt[i]++;
-			memset(send_pkg.data, 0, AVA7_P_DATA_LEN);
-			avalon7_init_pkg(&send_pkg, AVA7_P_RSTMMTX, 1, 1);
-			avalon7_iic_xfer_pkg(avalon7, i, &send_pkg, NULL);
-			if (info->error_polling_cnt[i] >= 10)
-				detach_module(avalon7, i);
-		}
+	memset(send_pkg->data, 0, AVA7_P_DATA_LEN);
+	/* Red LED */
+	tmp = be32toh(info->led_indicator[addr]);
+	memcpy(send_pkg->data, &tmp, 4);
 
-		if (ret == AVA7_SEND_OK && !decode_err) {
-			info->error_polling_cnt[i] = 0;
+	/* Adjust fan every 2 seconds*/
+	if (do_adjust_fan) {
+		fan_pwm = adjust_fan(info, addr);
+		fan_pwm |= 0x80000000;
+		tmp = be32toh(fan_pwm);
+		memcpy(send_pkg->data + 4, &tmp, 4);
+	}
 
-			if ((ar.opt == AVA7_P_STATUS) &&
-				(info->mm_dna[i][AVA7_MM_DNA_LEN - 1] != ar.opt)) {
-				applog(LOG_ERR, "%s-%d-%d: Dup address found %d-%d",
-						avalon7->drv->name, avalon7->device_id, i,
-						info->mm_dna[i][AVA7_MM_DNA_LEN - 1], ar.opt);
-				hexdump((uint8_t *)&ar, sizeof(ar));
-				detach_module(avalon7, i);
-			}
-		}
+	if (info->reboot[addr]) {
+		info->reboot[addr] = false;
+		send_pkg->data[8] = 0x1;
 	}
 
-	return 0;
+	avalon7_init_pkg(send_pkg, AVA7_P_POLLING, 1, 1);
 }
 
-static void copy_pool_stratum(struct pool *pool_stratum, struct pool *pool)
+static void polling_result(struct cgpu_info *avalon7, int i, int ret, struct avalon7_ret *ar, double latency)
 {
-	int i;
-	int merkles = pool->merkles, job_id_len;
-	size_t coinbase_len = pool->coinbase_len;
-	unsigned short crc;
+	struct avalon7_info *info = avalon7->device_data;
+	struct avalon7_pkg send_pkg;
+	int decode_err = 0;
 
-	if (!pool->swork.job_id)
-		return;
+	if (ret == AVA7_SEND_OK)
+		decode_err = decode_pkg(avalon7, ar, i);
 
-	if (pool_stratum->swork.job_id) {
-		job_id_len = strlen(pool->swork.job_id);
-		crc = crc16((unsigned char *)pool->swork.job_id, job_id_len);
-		job_id_len = strlen(pool_stratum->swork.job_id);
+	if (ret != AVA7_SEND_OK || decode_err) {
+		info->error_polling_cnt[i]++;
+		memset(send_pkg.data, 0, AVA7_P_DATA_LEN);
+		avalon7_init_pkg(&send_pkg, AVA7_P_RSTMMTX, 1, 1);
+		avalon7_iic_xfer_pkg(avalon7, i, &send_pkg, NULL);
+		if (info->error_polling_cnt[i] >= 10)
+			detach_module(avalon7, i);
+		info->nonce_backlog[i] = 0;
+		info->poll_delay[i] = opt_avalon7_polling_delay;
+	}
 
-		if (crc16((unsigned char *)pool_stratum->swork.job_id, job_id_len) == crc)
-			return;
+	if (ret == AVA7_SEND_OK && !decode_err) {
+		info->error_polling_cnt[i] = 0;
+		avalon7_poll_schedule(info, i, ar->type == AVA7_P_NONCE, latency);
+
+		if ((ar->opt == AVA7_P_STATUS) &&
+			(info->mm_dna[i][AVA7_MM_DNA_LEN - 1] != ar->opt)) {
+			applog(LOG_ERR, "%s-%d-%d: Dup address found %d-%d",
+					avalon7->drv->name, avalon7->device_id, i,
+					info->mm_dna[i][AVA7_MM_DNA_LEN - 1], ar->opt);
+			hexdump((uint8_t *)ar, sizeof(*ar));
+			detach_module(avalon7, i);
+		}
 	}
+}
 
-	cg_wlock(&pool_stratum->data_lock);
-	free(pool_stratum->swork.job_id);
-	free(pool_stratum->nonce1);
-	free(pool_stratum->coinbase);
+/* With --avalon7-polling-depth 1, the default, each module is polled in turn
+ * after the fixed polling delay as always. Deeper, modules are polled in
+ * groups of up to that many, each group kept outstanding in the AUC at once,
+ * and the wait before a group is the shortest of its modules' scheduled
+ * delays so no module is polled later than it asked to be. Modules that don't
+ * answer in time get one more chance to return their reply before being
+ * treated as failed polls. */
+static int polling(struct cgpu_info *avalon7)
+{
+	struct avalon7_info *info = avalon7->device_data;
+	struct avalon7_pkg send_pkg[AVA7_DEFAULT_MODULARS];
+	struct avalon7_ret ar[AVA7_DEFAULT_MODULARS], rear[AVA7_DEFAULT_MODULARS];
+	int addrs[AVA7_DEFAULT_MODULARS], retry[AVA7_DEFAULT_MODULARS], readdrs[AVA7_DEFAULT_MODULARS];
+	bool got[AVA7_DEFAULT_MODULARS], regot[AVA7_DEFAULT_MODULARS];
+	int i, j, n, ret, count = 0, group, done, missed, delay, depth;
+	struct timeval current_fan, tv_start, tv_end;
+	int do_adjust_fan = 0;
+	double device_tdiff, latency;
 
-	pool_stratum->coinbase = cgcalloc(coinbase_len, 1);
-	memcpy(pool_stratum->coinbase, pool->coinbase, coinbase_len);
+	cgtime(&current_fan);
+	device_tdiff = tdiff(&current_fan, &(info->last_fan_adj));
+	if (device_tdiff > 2.0 || device_tdiff < 0) {
+		cgtime(&info->last_fan_adj);
+		do_adjust_fan = 1;
+	}
 
-	for (i = 0; i < pool_stratum->merkles; i++)
-		free(pool_stratum->swork.merkle_bin[i]);
-	if (merkles) {
-		pool_stratum->swork.merkle_bin = cgrealloc(pool_stratum->swork.merkle_bin,
-							   sizeof(char *) * merkles + 1);
-		for (i = 0; i < merkles; i++) {
-			pool_stratum->swork.merkle_bin[i] = cgmalloc(32);
-			memcpy(pool_stratum->swork.merkle_bin[i], pool->swork.merkle_bin[i], 32);
+	for (i = 1; i < AVA7_DEFAULT_MODULARS; i++) {
+		if (info->enable[i])
+			addrs[count++] = i;
+	}
+
+	depth = 1;
+	if (info->connecter == AVA7_CONNECTER_AUC && info->auc_echo)
+		depth = MIN(opt_avalon7_polling_depth, AVA7_DEFAULT_MODULARS - 1);
+
+	if (depth == 1) {
+		for (n = 0; n < count; n++) {
+			i = addrs[n];
+			cgsleep_ms(opt_avalon7_polling_delay);
+			polling_pkg(info, i, do_adjust_fan, &send_pkg[0]);
+			cgtime(&tv_start);
+			ret = avalon7_iic_xfer_pkg(avalon7, i, &send_pkg[0], &ar[0]);
+			cgtime(&tv_end);
+			polling_result(avalon7, i, ret, &ar[0], ms_tdiff(&tv_end, &tv_start));
 		}
+		return 0;
 	}
 
-	pool_stratum->sdiff = pool->sdiff;
-	pool_stratum->coinbase_len = pool->coinbase_len;
-	pool_stratum->nonce2_offset = pool->nonce2_offset;
-	pool_stratum->n2size = pool->n2size;
-	pool_stratum->merkles = pool->merkles;
-	pool_stratum->swork.job_id = strdup(pool->swork.job_id);
-	pool_stratum->nonce1 = strdup(pool->nonce1);
+	for (n = 0; n < count; n += group) {
+		group = MIN(depth, count - n);
+
+		delay = info->poll_delay[addrs[n]];
+		for (j = 1; j < group; j++)
+			delay = MIN(delay, info->poll_delay[addrs[n + j]]);
+		if (delay)
+			cgsleep_ms(delay);
+
+		for (j = 0; j < group; j++)
+			polling_pkg(info, addrs[n + j], do_adjust_fan, &send_pkg[j]);
 
-	memcpy(pool_stratum->ntime, pool->ntime, sizeof(pool_stratum->ntime));
-	memcpy(pool_stratum->header_bin, pool->header_bin, sizeof(pool_stratum->header_bin));
-	cg_wunlock(&pool_stratum->data_lock);
+		cgtime(&tv_start);
+		done = auc_xfer_pkgs(avalon7, &addrs[n], send_pkg, ar, AVA7_READ_SIZE, got, group,
+				     opt_avalon7_aucxdelay / 4800 + 1, C_AVA7_WRITE, C_AVA7_READ);
+		cgtime(&tv_end);
+		latency = ms_tdiff(&tv_end, &tv_start) / (double)group;
+
+		/* Only read back the replies that were missing, re-sending the polls
+		 * would repeat any fan or reboot request in them */
+		if (done < group) {
+			for (j = missed = 0; j < group; j++) {
+				if (!got[j])
+					retry[missed++] = j;
+			}
+			for (j = 0; j < missed; j++)
+				readdrs[j] = addrs[n + retry[j]];
+			auc_xfer_pkgs(avalon7, readdrs, NULL, rear, AVA7_READ_SIZE, regot, missed,
+				      opt_avalon7_aucxdelay / 4800 + 1, C_AVA7_WRITE, C_AVA7_READ);
+			for (j = 0; j < missed; j++) {
+				if (regot[j]) {
+					ar[retry[j]] = rear[j];
+					got[retry[j]] = true;
+				}
+			}
+		}
+
+		for (j = 0; j < group; j++) {
+			polling_result(avalon7, addrs[n + j], got[j] ? AVA7_SEND_OK : AVA7_SEND_ERROR,
+				       &ar[j], latency);
+		}
+	}
+
+	return 0;
 }
 
 static void avalon7_init_setting(struct cgpu_info *avalon7, int addr)
@@ -1839,6 +1898,7 @@ static void avalon7_sswork_update(struct cgpu_info *avalon7)
 {
 	struct avalon7_info *info = avalon7->device_data;
 	struct thr_info *thr = avalon7->thr[0];
+	struct stratum_job *job;
 	struct pool *pool;
 	int coinbase_len_posthash, coinbase_len_prehash;
 
@@ -1876,13 +1936,24 @@ static void avalon7_sswork_update(struct cgpu_info *avalon7)
 	}
 	cg_wlock(&info->update_lock);
 
-	/* Step 2: Send out stratum pkgs */
-	cg_rlock(&pool->data_lock);
+	/* Step 2: Pin the job and send out stratum pkgs. Building the pin may
+	 * need the pool's write lock, so retry if a notify lands in between */
+	while (42) {
+		job = stratum_job_get(pool);
+		cg_rlock(&pool->data_lock);
+		if (pool->sjob == job)
+			break;
+		cg_runlock(&pool->data_lock);
+		stratum_job_put(job);
+	}
 	cgtime(&info->last_stratum);
 	info->pool_no = pool->pool_no;
-	copy_pool_stratum(&info->pool2, &info->pool1);
-	copy_pool_stratum(&info->pool1, &info->pool0);
-	copy_pool_stratum(&info->pool0, pool);
+	if (job && job != info->sjob[0]) {
+		stratum_job_put(info->sjob[AVA7_STRATUM_JOBS - 1]);
+		memmove(&info->sjob[1], &info->sjob[0], sizeof(info->sjob[0]) * (AVA7_STRATUM_JOBS - 1));
+		info->sjob[0] = job;
+	} else
+		stratum_job_put(job);
 
 	avalon7_stratum_pkgs(avalon7, pool);
 	cg_runlock(&pool->data_lock);
@@ -2077,6 +2148,10 @@ static struct api_data *avalon7_api_stats(struct cgpu_info *avalon7)
 		sprintf(buf, " Elapsed[%.0f]", tdiff(&current, &(info->elapsed[i])));
 		strcat(statbuf, buf);
 
+		sprintf(buf, " PollLat[%.1f] PollDelay[%d] Backlog[%d]",
+			info->poll_latency[i], info->poll_delay[i], info->nonce_backlog[i]);
+		strcat(statbuf, buf);
+
 		strcat(statbuf, " MW[");
 		info->local_works[i] = 0;
 		for (j = 0; j < info->miner_count[i]; j++) {
@@ -2653,4 +2728,5 @@ struct device_drv avalon7_drv = {
 	.scanwork = avalon7_scanhash,
 	.max_diff = AVA7_DRV_DIFFMAX,
 	.genwork = true,
+	.rollnonce2 = true,
 };
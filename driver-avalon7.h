@@ -59,6 +59,7 @@
 #define AVA7_DEFAULT_PMU_CNT	2
 
 #define AVA7_DEFAULT_POLLING_DELAY	20 /* ms */
+#define AVA7_DEFAULT_POLLING_DEPTH	1
 
 #define AVA7_DEFAULT_SMARTSPEED_OFF 0
 #define AVA7_DEFAULT_SMARTSPEED_MODE1 1
@@ -97,6 +98,8 @@
 #define AVA7_P_COINBASE_SIZE	(6 * 1024 + 64)
 #define AVA7_P_MERKLES_COUNT	30
 
+#define AVA7_STRATUM_JOBS	3	/* Jobs the MM may still report nonces for */
+
 #define AVA7_P_COUNT	40
 #define AVA7_P_DATA_LEN 32
 
@@ -202,9 +205,8 @@ struct avalon7_info {
 
 	cglock_t update_lock;
 
-	struct pool pool0;
-	struct pool pool1;
-	struct pool pool2;
+	/* Pinned when sent, newest first, protected by update_lock */
+	struct stratum_job *sjob[AVA7_STRATUM_JOBS];
 
 	bool work_restart;
 
@@ -220,6 +222,7 @@ struct avalon7_info {
 	struct i2c_ctx *i2c_slaves[AVA7_DEFAULT_MODULARS];
 
 	uint8_t connecter; /* AUC or IIC */
+	bool auc_echo; /* AUC echoes transaction ids so polls can be pipelined */
 
 	/* For modulars */
 	bool enable[AVA7_DEFAULT_MODULARS];
@@ -270,6 +273,9 @@ struct avalon7_info {
 	uint32_t error_code[AVA7_DEFAULT_MODULARS][AVA7_DEFAULT_MINER_CNT + 1];
 	uint32_t error_crc[AVA7_DEFAULT_MODULARS][AVA7_DEFAULT_MINER_CNT];
 	uint8_t error_polling_cnt[AVA7_DEFAULT_MODULARS];
+	int poll_delay[AVA7_DEFAULT_MODULARS];		/* ms until next poll */
+	double poll_latency[AVA7_DEFAULT_MODULARS];	/* ms per poll, moving average */
+	int nonce_backlog[AVA7_DEFAULT_MODULARS];	/* consecutive nonce replies */
 
 	uint8_t power_good[AVA7_DEFAULT_MODULARS];
 	char pmu_version[AVA7_DEFAULT_MODULARS][AVA7_DEFAULT_PMU_CNT][5];
@@ -312,6 +318,7 @@ extern char *set_avalon7_voltage_level(char *arg);
 extern char *set_avalon7_voltage_offset(char *arg);
 extern int opt_avalon7_temp_target;
 extern int opt_avalon7_polling_delay;
+extern int opt_avalon7_polling_depth;
 extern int opt_avalon7_aucspeed;
 extern int opt_avalon7_aucxdelay;
 extern int opt_avalon7_smart_speed;
@@ -14,6 +14,7 @@
 #include "miner.h"
 #include "driver-avalon8.h"
 #include "crc.h"
+#include "auc.h"
 #include "sha2.h"
 #include "hexdump.c"
 
@@ -41,6 +42,7 @@ int opt_avalon8_freq[AVA8_DEFAULT_PLL_CNT] =
 int opt_avalon8_freq_sel = AVA8_DEFAULT_FREQUENCY_SEL;
 
 int opt_avalon8_polling_delay = AVA8_DEFAULT_POLLING_DELAY;
+int opt_avalon8_polling_depth = AVA8_DEFAULT_POLLING_DEPTH;
 
 int opt_avalon8_aucspeed = AVA8_AUC_SPEED;
 int opt_avalon8_aucxdelay = AVA8_AUC_XDELAY;
@@ -1366,6 +1368,10 @@ static struct cgpu_info *avalon8_auc_detect(struct libusb_device *dev, struct us
 		info->enable[i] = 0;
 
 	info->connecter = AVA8_CONNECTER_AUC;
+	info->auc_echo = auc_echo_probe(avalon8, opt_avalon8_aucxdelay / 4800 + 1, C_AVA8_WRITE, C_AVA8_READ);
+	if (!info->auc_echo && opt_avalon8_polling_depth > 1)
+		applog(LOG_WARNING, "%s-%d: AUC doesn't echo transaction ids, polling one module at a time",
+		       avalon8->drv->name, avalon8->device_id);
 
 	detect_modules(avalon8);
 	for (i = 0; i < AVA8_DEFAULT_MODULARS; i++)
@@ -1562,6 +1568,9 @@ static void detect_modules(struct cgpu_info *avalon8)
 		}
 		info->error_code[i][j] = 0;
 		info->error_polling_cnt[i] = 0;
+		info->poll_delay[i] = opt_avalon8_polling_delay;
+		info->poll_latency[i] = 0;
+		info->nonce_backlog[i] = 0;
 		info->power_good[i] = 0;
 		memset(info->pmu_version[i], 0, sizeof(char) * 5 * AVA8_DEFAULT_PMU_CNT);
 		info->diff1[i] = 0;
@@ -1589,16 +1598,113 @@ static void detach_module(struct cgpu_info *avalon8, int addr)
 		avalon8->drv->name, avalon8->device_id, addr);
 }
 
-static int polling(struct cgpu_info *avalon8)
+/* Fold one poll's round trip into the module's moving average and work out how
+ * long to wait before polling it again. A module that answered with a nonce
+ * probably has more queued up so it is polled again immediately, otherwise the
+ * time spent on the poll itself counts towards the polling delay. */
+static void avalon8_poll_schedule(struct avalon8_info *info, int addr, bool nonce, double latency)
+{
+	int delay;
+
+	if (info->poll_latency[addr] > 0)
+		info->poll_latency[addr] = (info->poll_latency[addr] * 7 + latency) / 8;
+	else
+		info->poll_latency[addr] = latency;
+
+	if (nonce)
+		info->nonce_backlog[addr]++;
+	else
+		info->nonce_backlog[addr] = 0;
+
+	if (info->nonce_backlog[addr])
+		delay = 0;
+	else {
+		delay = opt_avalon8_polling_delay - (int)info->poll_latency[addr];
+		if (delay < 0)
+			delay = 0;
+	}
+	info->poll_delay[addr] = delay;
+}
+
+static void polling_pkg(struct avalon8_info *info, int addr, int do_adjust_fan, struct avalon8_pkg *send_pkg)
+{
+	uint32_t fan_pwm;
+	int tmp;
+
+	memset(send_pkg->data, 0, AVA8_P_DATA_LEN);
+	/* Red LED */
+	tmp = be32toh(info->led_indicator[addr]);
+	memcpy(send_pkg->data, &tmp, 4);
+
+	/* Adjust fan every 2 seconds*/
+	if (do_adjust_fan) {
+		fan_pwm = adjust_fan(info, addr);
+		fan_pwm |= 0x80000000;
+		tmp = be32toh(fan_pwm);
+		memcpy(send_pkg->data + 4, &tmp, 4);
+	}
+
+	if (info->reboot[addr]) {
+		info->reboot[addr] = false;
+		send_pkg->data[8] = 0x1;
+	}
+
+	avalon8_init_pkg(send_pkg, AVA8_P_POLLING, 1, 1);
+}
+
+static void polling_result(struct cgpu_info *avalon8, int i, int ret, struct avalon8_ret *ar, double latency)
 {
 	struct avalon8_info *info = avalon8->device_data;
 	struct avalon8_pkg send_pkg;
-	struct avalon8_ret ar;
-	int i, tmp, ret, decode_err = 0;
-	struct timeval current_fan;
+	int decode_err = 0;
+
+	if (ret == AVA8_SEND_OK)
+		decode_err = decode_pkg(avalon8, ar, i);
+
+	if (ret != AVA8_SEND_OK || decode_err) {
+		info->error_polling_cnt[i]++;
+		memset(send_pkg.data, 0, AVA8_P_DATA_LEN);
+		avalon8_init_pkg(&send_pkg, AVA8_P_RSTMMTX, 1, 1);
+		avalon8_iic_xfer_pkg(avalon8, i, &send_pkg, NULL);
+		if (info->error_polling_cnt[i] >= 10)
+			detach_module(avalon8, i);
+		info->nonce_backlog[i] = 0;
+		info->poll_delay[i] = opt_avalon8_polling_delay;
+	}
+
+	if (ret == AVA8_SEND_OK && !decode_err) {
+		info->error_polling_cnt[i] = 0;
+		avalon8_poll_schedule(info, i, ar->type == AVA8_P_NONCE, latency);
+
+		if ((ar->opt == AVA8_P_STATUS) &&
+			(info->mm_dna[i][AVA8_MM_DNA_LEN - 1] != ar->opt)) {
+			applog(LOG_ERR, "%s-%d-%d: Dup address found %d-%d",
+					avalon8->drv->name, avalon8->device_id, i,
+					info->mm_dna[i][AVA8_MM_DNA_LEN - 1], ar->opt);
+			hexdump((uint8_t *)ar, sizeof(*ar));
+			detach_module(avalon8, i);
+		}
+	}
+}
+
+/* With --avalon8-polling-depth 1, the default, each module is polled in turn
+ * after the fixed polling delay as always. Deeper, modules are polled in
+ * groups of up to that many, each group kept outstanding in the AUC at once,
+ * and the wait before a group is the shortest of its modules' scheduled
+ * delays so no module is polled later than it asked to be. Modules that don't
+ * answer in time get one more chance to return their reply before being
+ * treated as failed polls. */
+static int polling(struct cgpu_info *avalon8)
+{
+	struct avalon8_info *info = avalon8->device_data;
+	struct avalon8_pkg send_pkg[AVA8_DEFAULT_MODULARS];
+	struct avalon8_ret ar[AVA8_DEFAULT_MODULARS], rear[AVA8_DEFAULT_MODULARS];
+	int addrs[AVA8_DEFAULT_MODULARS], retry[AVA8_DEFAULT_MODULARS], readdrs[AVA8_DEFAULT_MODULARS];
+	bool got[AVA8_DEFAULT_MODULARS], regot[AVA8_DEFAULT_MODULARS];
+	int i, j, n, ret, count = 0, group, done, missed, delay, depth;
+	struct timeval current_fan, tv_start, tv_end;
 	int do_adjust_fan = 0;
-	uint32_t fan_pwm;
-	double device_tdiff;
+	double device_tdiff, latency;
 
 	cgtime(&current_fan);
 	device_tdiff = tdiff(&current_fan, &(info->last_fan_adj));
@@ -1608,55 +1714,68 @@ static int polling(struct cgpu_info *avalon8)
 	}
 
 	for (i = 1; i < AVA8_DEFAULT_MODULARS; i++) {
-		if (!info->enable[i])
-			continue;
+		if (info->enable[i])
+			addrs[count++] = i;
+	}
 
-		cgsleep_ms(opt_avalon8_polling_delay);
+	depth = 1;
+	if (info->connecter == AVA8_CONNECTER_AUC && info->auc_echo)
+		depth = MIN(opt_avalon8_polling_depth, AVA8_DEFAULT_MODULARS - 1);
 
-		memset(send_pkg.data, 0, AVA8_P_DATA_LEN);
-		/* Red LED */
-		tmp = be32toh(info->led_indicator[i]);
-		memcpy(send_pkg.data, &tmp, 4);
-
-		/* Adjust fan every 2 seconds*/
-		if (do_adjust_fan) {
-			fan_pwm = adjust_fan(info, i);
-			fan_pwm |= 0x80000000;
-			tmp = be32toh(fan_pwm);
-			memcpy(send_pkg.data + 4, &tmp, 4);
-		}
-
-		if (info->reboot[i]) {
-			info->reboot[i] = false;
-			send_pkg.data[8] = 0x1;
-		}
-
-		avalon8_init_pkg(&send_pkg, AVA8_P_POLLING, 1, 1);
-		ret = avalon8_iic_xfer_pkg(avalon8, i, &send_pkg, &ar);
-		if (ret == AVA8_SEND_OK)
-			decode_err = decode_pkg(avalon8, &ar, i);
-
-		if (ret != AVA8_SEND_OK || decode_err) {
-			info->error_polling_cnt[i]++;
-			memset(send_pkg.data, 0, AVA8_P_DATA_LEN);
-			avalon8_init_pkg(&send_pkg, AVA8_P_RSTMMTX, 1, 1);
-			avalon8_iic_xfer_pkg(avalon8, i, &send_pkg, NULL);
-			if (info->error_polling_cnt[i] >= 10)
-				detach_module(avalon8, i);
-		}
-
-		if (ret == AVA8_SEND_OK && !decode_err) {
-			info->error_polling_cnt[i] = 0;
-
-			if ((ar.opt == AVA8_P_STATUS) &&
-				(info->mm_dna[i][AVA8_MM_DNA_LEN - 1] != ar.opt)) {
-				applog(LOG_ERR, "%s-%d-%d: Dup address found %d-%d",
-						avalon8->drv->name, avalon8->device_id, i,
-						info->mm_dna[i][AVA8_MM_DNA_LEN - 1], ar.opt);
-				hexdump((uint8_t *)&ar, sizeof(ar));
-				detach_module(avalon8, i);
+	if (depth == 1) {
+		for (n = 0; n < count; n++) {
+			i = addrs[n];
+			cgsleep_ms(opt_avalon8_polling_delay);
+			polling_pkg(info, i, do_adjust_fan, &send_pkg[0]);
+			cgtime(&tv_start);
+			ret = avalon8_iic_xfer_pkg(avalon8, i, &send_pkg[0], &ar[0]);
+			cgtime(&tv_end);
+			polling_result(avalon8, i, ret, &ar[0], ms_tdiff(&tv_end, &tv_start));
+		}
+		return 0;
+	}
+
+	for (n = 0; n < count; n += group) {
+		group = MIN(depth, count - n);
+
+		delay = info->poll_delay[addrs[n]];
+		for (j = 1; j < group; j++)
+			delay = MIN(delay, info->poll_delay[addrs[n + j]]);
+		if (delay)
+			cgsleep_ms(delay);
+
+		for (j = 0; j < group; j++)
+			polling_pkg(info, addrs[n + j], do_adjust_fan, &send_pkg[j]);
+
+		cgtime(&tv_start);
+		done = auc_xfer_pkgs(avalon8, &addrs[n], send_pkg, ar, AVA8_READ_SIZE, got, group,
+				     opt_avalon8_aucxdelay / 4800 + 1, C_AVA8_WRITE, C_AVA8_READ);
+		cgtime(&tv_end);
+		latency = ms_tdiff(&tv_end, &tv_start) / (double)group;
+
+		/* Only read back the replies that were missing, re-sending the polls
+		 * would repeat any fan or reboot request in them */
+		if (done < group) {
+			for (j = missed = 0; j < group; j++) {
+				if (!got[j])
+					retry[missed++] = j;
+			}
+			for (j = 0; j < missed; j++)
+				readdrs[j] = addrs[n + retry[j]];
+			auc_xfer_pkgs(avalon8, readdrs, NULL, rear, AVA8_READ_SIZE, regot, missed,
+				      opt_avalon8_aucxdelay / 4800 + 1, C_AVA8_WRITE, C_AVA8_READ);
+			for (j = 0; j < missed; j++) {
+				if (regot[j]) {
+					ar[retry[j]] = rear[j];
+					got[retry[j]] = true;
+				}
 			}
 		}
+
+		for (j = 0; j < group; j++) {
+			polling_result(avalon8, addrs[n + j], got[j] ? AVA8_SEND_OK : AVA8_SEND_ERROR,
+				       &ar[j], latency);
+		}
 	}
 
 	return 0;
@@ -1682,6 +1801,7 @@ static void copy_pool_stratum(struct pool *pool_stratum, struct pool *pool)
 	}
 
 	cg_wlock(&pool_stratum->data_lock);
+	__stratum_job_clear(pool_stratum);
 	free(pool_stratum->swork.job_id);
 	free(pool_stratum->nonce1);
 	free(pool_stratum->coinbase);
@@ -2272,6 +2392,10 @@ static struct api_data *avalon8_api_stats(struct cgpu_info *avalon8)
 		sprintf(buf, " Elapsed[%.0f]", tdiff(&current, &(info->elapsed[i])));
 		strcat(statbuf, buf);
 
+		sprintf(buf, " PollLat[%.1f] PollDelay[%d] Backlog[%d]",
+			info->poll_latency[i], info->poll_delay[i], info->nonce_backlog[i]);
+		strcat(statbuf, buf);
+
 		strcat(statbuf, " MW[");
 		info->local_works[i] = 0;
 		for (j = 0; j < info->miner_count[i]; j++) {
@@ -2965,4 +3089,5 @@ struct device_drv avalon8_drv = {
 	.scanwork = avalon8_scanhash,
 	.max_diff = AVA8_DRV_DIFFMAX,
 	.genwork = true,
+	.rollnonce2 = true,
 };
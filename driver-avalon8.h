@@ -63,6 +63,7 @@
 #define AVA8_DEFAULT_CORE_VOLT_CNT	8
 
 #define AVA8_DEFAULT_POLLING_DELAY	20 /* ms */
+#define AVA8_DEFAULT_POLLING_DEPTH	1
 #define AVA8_DEFAULT_NTIME_OFFSET	2
 
 #define AVA8_DEFAULT_SMARTSPEED_OFF 0
@@ -262,6 +263,7 @@ struct avalon8_info {
 	struct i2c_ctx *i2c_slaves[AVA8_DEFAULT_MODULARS];
 
 	uint8_t connecter; /* AUC or IIC */
+	bool auc_echo; /* AUC echoes transaction ids so polls can be pipelined */
 
 	/* For modulars */
 	bool enable[AVA8_DEFAULT_MODULARS];
@@ -327,6 +329,9 @@ struct avalon8_info {
 	uint32_t error_code[AVA8_DEFAULT_MODULARS][AVA8_DEFAULT_MINER_CNT + 1];
 	uint32_t error_crc[AVA8_DEFAULT_MODULARS][AVA8_DEFAULT_MINER_CNT];
 	uint8_t error_polling_cnt[AVA8_DEFAULT_MODULARS];
+	int poll_delay[AVA8_DEFAULT_MODULARS];		/* ms until next poll */
+	double poll_latency[AVA8_DEFAULT_MODULARS];	/* ms per poll, moving average */
+	int nonce_backlog[AVA8_DEFAULT_MODULARS];	/* consecutive nonce replies */
 
 	uint8_t power_good[AVA8_DEFAULT_MODULARS];
 	char pmu_version[AVA8_DEFAULT_MODULARS][AVA8_DEFAULT_PMU_CNT][5];
@@ -371,6 +376,7 @@ extern char *set_avalon8_voltage_level_offset(char *arg);
 extern char *set_avalon8_asic_otp(char *arg);
 extern int opt_avalon8_temp_target;
 extern int opt_avalon8_polling_delay;
+extern int opt_avalon8_polling_depth;
 extern int opt_avalon8_aucspeed;
 extern int opt_avalon8_aucxdelay;
 extern int opt_avalon8_smart_speed;
@@ -2,6 +2,7 @@
 
 #include "math.h"
 #include "miner.h"
+#include "chipstat.h"
 
 #include "bf16-communication.h"
 #include "bf16-ctrldevice.h"
@@ -474,13 +475,34 @@ static int8_t change_renonce_chip_address(struct cgpu_info *bitfury, bf_chip_add
 	}
 }
 
+static const struct chip_stat_col bf16_chip_cols[BF16_CHIP_COLS] = {
+	{ "Good", CHIP_COUNTER },
+	{ "Bad", CHIP_COUNTER },
+	{ "Renonce", CHIP_COUNTER },
+	{ "Renonce Good", CHIP_COUNTER },
+	{ "Renonce Bad", CHIP_COUNTER },
+	{ "Total", CHIP_COUNTER },
+	{ "Task Switch", CHIP_COUNTER },
+	{ "Status", CHIP_COUNTER },
+	{ "Status None", CHIP_COUNTER },
+};
+
+/* Per chip counters only live in the chip stats table, a chain per BCM250,
+ * the board and device totals are still dx counters the statistics thread
+ * resets */
+static void bf16_chip_stat(struct bitfury16_info *info, int col, bf_chip_address_t chip_address)
+{
+	chip_stat_inc(info->chip_stats, col,
+		      chip_address.board_id * BCM250_NUM + chip_address.bcm250_id,
+		      chip_address.chip_id);
+}
+
 static void increase_good_nonces(struct bitfury16_info *info, bf_chip_address_t chip_address)
 {
 	uint8_t board_id  = chip_address.board_id;
 	uint8_t bcm250_id = chip_address.bcm250_id;
-	uint8_t chip_id   = chip_address.chip_id;
 
-	info->chipboard[board_id].bcm250[bcm250_id].chips[chip_id].nonces_good_dx++;
+	bf16_chip_stat(info, BF16_CHIP_GOOD, chip_address);
 	info->chipboard[board_id].bcm250[bcm250_id].nonces_good_dx++;
 	info->chipboard[board_id].nonces_good_dx++;
 	info->nonces_good_dx++;
@@ -490,9 +512,8 @@ static void increase_bad_nonces(struct bitfury16_info *info, bf_chip_address_t c
 {
 	uint8_t board_id  = chip_address.board_id;
 	uint8_t bcm250_id = chip_address.bcm250_id;
-	uint8_t chip_id   = chip_address.chip_id;
 
-	info->chipboard[board_id].bcm250[bcm250_id].chips[chip_id].nonces_bad_dx++;
+	bf16_chip_stat(info, BF16_CHIP_BAD, chip_address);
 	info->chipboard[board_id].bcm250[bcm250_id].nonces_bad_dx++;
 	info->chipboard[board_id].nonces_bad_dx++;
 	info->nonces_bad_dx++;
@@ -502,9 +523,8 @@ static void increase_re_nonces(struct bitfury16_info *info, bf_chip_address_t ch
 {
 	uint8_t board_id  = chip_address.board_id;
 	uint8_t bcm250_id = chip_address.bcm250_id;
-	uint8_t chip_id   = chip_address.chip_id;
 
-	info->chipboard[board_id].bcm250[bcm250_id].chips[chip_id].nonces_re_dx++;
+	bf16_chip_stat(info, BF16_CHIP_RE, chip_address);
 	info->chipboard[board_id].bcm250[bcm250_id].nonces_re_dx++;
 	info->chipboard[board_id].nonces_re_dx++;
 	info->nonces_re_dx++;
@@ -514,9 +534,8 @@ static void increase_re_good_nonces(struct bitfury16_info *info, bf_chip_address
 {
 	uint8_t board_id  = chip_address.board_id;
 	uint8_t bcm250_id = chip_address.bcm250_id;
-	uint8_t chip_id   = chip_address.chip_id;
 
-	info->chipboard[board_id].bcm250[bcm250_id].chips[chip_id].nonces_re_good_dx++;
+	bf16_chip_stat(info, BF16_CHIP_RE_GOOD, chip_address);
 
 	if (renonce_chip(chip_address) == 0) {
 		info->chipboard[board_id].bcm250[bcm250_id].nonces_re_good_dx++;
@@ -529,9 +548,8 @@ static void increase_re_bad_nonces(struct bitfury16_info *info, bf_chip_address_
 {
 	uint8_t board_id  = chip_address.board_id;
 	uint8_t bcm250_id = chip_address.bcm250_id;
-	uint8_t chip_id   = chip_address.chip_id;
 
-	info->chipboard[board_id].bcm250[bcm250_id].chips[chip_id].nonces_re_bad_dx++;
+	bf16_chip_stat(info, BF16_CHIP_RE_BAD, chip_address);
 
 	if (renonce_chip(chip_address) == 0) {
 		info->chipboard[board_id].bcm250[bcm250_id].nonces_re_bad_dx++;
@@ -544,9 +562,8 @@ static void increase_total_nonces(struct bitfury16_info *info, bf_chip_address_t
 {
 	uint8_t board_id  = chip_address.board_id;
 	uint8_t bcm250_id = chip_address.bcm250_id;
-	uint8_t chip_id   = chip_address.chip_id;
 
-	info->chipboard[board_id].bcm250[bcm250_id].chips[chip_id].nonces_dx++;
+	bf16_chip_stat(info, BF16_CHIP_TOTAL, chip_address);
 
 	if ((renonce_chip(chip_address) == 0) ||
 		(opt_bf16_renonce == RENONCE_DISABLED)) {
@@ -560,9 +577,8 @@ static void increase_task_switch(struct bitfury16_info *info, bf_chip_address_t
 {
 	uint8_t board_id  = chip_address.board_id;
 	uint8_t bcm250_id = chip_address.bcm250_id;
-	uint8_t chip_id   = chip_address.chip_id;
 
-	info->chipboard[board_id].bcm250[bcm250_id].chips[chip_id].task_switch_dx++;
+	bf16_chip_stat(info, BF16_CHIP_TASK_SWITCH, chip_address);
 	info->chipboard[board_id].bcm250[bcm250_id].task_switch_dx++;
 	info->chipboard[board_id].task_switch_dx++;
 	info->task_switch_dx++;
@@ -1212,7 +1228,7 @@ static void bitfury16_detect(bool hotplug)
 	if (hotplug)
 		return;
 
-	bitfury = cgmalloc(sizeof(struct cgpu_info));
+	bitfury = cgcalloc(1, sizeof(struct cgpu_info));
 	if (unlikely(!bitfury))
 		quit(1, "%s: %s() failed to malloc bitfury",
 				bitfury->drv->name, __func__);
@@ -1535,6 +1551,9 @@ static void bitfury16_detect(bool hotplug)
 
 	mutex_init(&info->nonces_good_lock);
 
+	info->chip_stats = chip_stats_new(bitfury, "BF16", CHIPBOARD_NUM * BCM250_NUM, BF16_NUM,
+					  bf16_chip_cols, BF16_CHIP_COLS);
+
 	if (!add_cgpu(bitfury))
 		quit(1, "%s: %s() failed to add_cgpu",
 				bitfury->drv->name, __func__);
@@ -2055,7 +2074,7 @@ static uint8_t update_chip_status(struct cgpu_info *bitfury, bf_cmd_status_t cmd
 			uint8_t new_buff = ((cmd_status.status & 0x0f) == 0x0f) ? 1 : 0;
 
 			/* status cmd counter */
-			info->chipboard[board_id].bcm250[bcm250_id].chips[chip_id].status_cmd_dx++;
+			bf16_chip_stat(info, BF16_CHIP_STATUS, cmd_status.chip_address);
 			info->chipboard[board_id].bcm250[bcm250_id].status_cmd_dx++;
 			info->chipboard[board_id].status_cmd_dx++;
 			info->status_cmd_dx++;
@@ -2071,7 +2090,7 @@ static uint8_t update_chip_status(struct cgpu_info *bitfury, bf_cmd_status_t cmd
 
 			} else {
 				/* task not switched  */
-				info->chipboard[board_id].bcm250[bcm250_id].chips[chip_id].status_cmd_none_dx++;
+				bf16_chip_stat(info, BF16_CHIP_STATUS_NONE, cmd_status.chip_address);
 				info->chipboard[board_id].bcm250[bcm250_id].status_cmd_none_dx++;
 				info->chipboard[board_id].status_cmd_none_dx++;
 				info->status_cmd_none_dx++;
@@ -3675,61 +3694,45 @@ static void *bitfury_statistics(void *userdata)
 							}
 
 							if (opt_bf16_stats_enabled) {
-								get_average(&info->chipboard[board_id].bcm250[bcm250_id].chips[chip_id].task_switch,
-										   (float)info->chipboard[board_id].bcm250[bcm250_id].chips[chip_id].task_switch_dx,
+								bf_chip_t *chip = &info->chipboard[board_id].bcm250[bcm250_id].chips[chip_id];
+								int chain = board_id * BCM250_NUM + bcm250_id;
+								uint32_t dx[BF16_CHIP_COLS];
+								int col;
+
+								for (col = 0; col < BF16_CHIP_COLS; col++) {
+									uint64_t val = chip_stat_get(info->chip_stats, col, chain, chip_id);
+
+									dx[col] = val - chip->stat_last[col];
+									chip->stat_last[col] = val;
+								}
+
+								get_average(&chip->task_switch, (float)dx[BF16_CHIP_TASK_SWITCH],
 										   (float)(time2 - time1), AVG_TIME_INTERVAL);
-								get_average(&info->chipboard[board_id].bcm250[bcm250_id].chips[chip_id].status_cmd,
-										   (float)info->chipboard[board_id].bcm250[bcm250_id].chips[chip_id].status_cmd_dx,
+								get_average(&chip->status_cmd, (float)dx[BF16_CHIP_STATUS],
 										   (float)(time2 - time1), AVG_TIME_INTERVAL);
-								get_average(&info->chipboard[board_id].bcm250[bcm250_id].chips[chip_id].status_cmd_none,
-										   (float)info->chipboard[board_id].bcm250[bcm250_id].chips[chip_id].status_cmd_none_dx,
+								get_average(&chip->status_cmd_none, (float)dx[BF16_CHIP_STATUS_NONE],
 										   (float)(time2 - time1), AVG_TIME_INTERVAL);
 
-								get_average(&info->chipboard[board_id].bcm250[bcm250_id].chips[chip_id].nonces,
-										   (float)info->chipboard[board_id].bcm250[bcm250_id].chips[chip_id].nonces_dx,
+								get_average(&chip->nonces, (float)dx[BF16_CHIP_TOTAL],
 										   (float)(time2 - time1), AVG_TIME_INTERVAL);
 
-								get_average(&info->chipboard[board_id].bcm250[bcm250_id].chips[chip_id].hashrate,
-										   (float)info->chipboard[board_id].bcm250[bcm250_id].chips[chip_id].nonces_dx,
-										   (float)(time2 - time1), AVG_TIME_INTERVAL);
-								get_average(&info->chipboard[board_id].bcm250[bcm250_id].chips[chip_id].hashrate_good,
-										   (float)info->chipboard[board_id].bcm250[bcm250_id].chips[chip_id].nonces_good_dx,
+								get_average(&chip->hashrate, (float)dx[BF16_CHIP_TOTAL],
 										   (float)(time2 - time1), AVG_TIME_INTERVAL);
-								get_average(&info->chipboard[board_id].bcm250[bcm250_id].chips[chip_id].hashrate_diff,
-										   (float)info->chipboard[board_id].bcm250[bcm250_id].chips[chip_id].nonces_diff_dx,
+								get_average(&chip->hashrate_good, (float)dx[BF16_CHIP_GOOD],
 										   (float)(time2 - time1), AVG_TIME_INTERVAL);
-								get_average(&info->chipboard[board_id].bcm250[bcm250_id].chips[chip_id].hashrate_bad,
-										   (float)info->chipboard[board_id].bcm250[bcm250_id].chips[chip_id].nonces_bad_dx,
+								get_average(&chip->hashrate_bad, (float)dx[BF16_CHIP_BAD],
 										   (float)(time2 - time1), AVG_TIME_INTERVAL);
 
 								if (opt_bf16_renonce != RENONCE_DISABLED) {
-									get_average(&info->chipboard[board_id].bcm250[bcm250_id].chips[chip_id].hashrate_re,
-											   (float)info->chipboard[board_id].bcm250[bcm250_id].chips[chip_id].nonces_re_dx,
+									get_average(&chip->hashrate_re, (float)dx[BF16_CHIP_RE],
 											   (float)(time2 - time1), AVG_TIME_INTERVAL);
-									get_average(&info->chipboard[board_id].bcm250[bcm250_id].chips[chip_id].hashrate_re_good,
-											   (float)info->chipboard[board_id].bcm250[bcm250_id].chips[chip_id].nonces_re_good_dx,
+									get_average(&chip->hashrate_re_good, (float)dx[BF16_CHIP_RE_GOOD],
 											   (float)(time2 - time1), AVG_TIME_INTERVAL);
-									get_average(&info->chipboard[board_id].bcm250[bcm250_id].chips[chip_id].hashrate_re_bad,
-											   (float)info->chipboard[board_id].bcm250[bcm250_id].chips[chip_id].nonces_re_bad_dx,
+									get_average(&chip->hashrate_re_bad, (float)dx[BF16_CHIP_RE_BAD],
 											   (float)(time2 - time1), AVG_TIME_INTERVAL);
 								}
 							}
 
-							info->chipboard[board_id].bcm250[bcm250_id].chips[chip_id].task_switch_dx     = 0;
-							info->chipboard[board_id].bcm250[bcm250_id].chips[chip_id].status_cmd_dx      = 0;
-							info->chipboard[board_id].bcm250[bcm250_id].chips[chip_id].status_cmd_none_dx = 0;
-
-							info->chipboard[board_id].bcm250[bcm250_id].chips[chip_id].nonces_dx      = 0;
-							info->chipboard[board_id].bcm250[bcm250_id].chips[chip_id].nonces_good_dx = 0;
-							info->chipboard[board_id].bcm250[bcm250_id].chips[chip_id].nonces_diff_dx = 0;
-							info->chipboard[board_id].bcm250[bcm250_id].chips[chip_id].nonces_bad_dx  = 0;
-
-							if (opt_bf16_renonce != RENONCE_DISABLED) {
-								info->chipboard[board_id].bcm250[bcm250_id].chips[chip_id].nonces_re_dx      = 0;
-								info->chipboard[board_id].bcm250[bcm250_id].chips[chip_id].nonces_re_good_dx = 0;
-								info->chipboard[board_id].bcm250[bcm250_id].chips[chip_id].nonces_re_bad_dx  = 0;
-							}
-
 							if (opt_bf16_stats_enabled) {
 								if (opt_bf16_renonce != RENONCE_DISABLED)
 									applog(LOG_NOTICE, "STATS: chp [%d:%d:%2d], tsk/s [%4.0f], "
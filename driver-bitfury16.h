@@ -41,6 +41,20 @@ enum bf_opt_renonce {
 	RENONCE_CHIP_PER_BOARD
 };
 
+/* per chip counters, kept in the device's 'BF16' chip stats table */
+enum bf16_chip_col {
+	BF16_CHIP_GOOD,
+	BF16_CHIP_BAD,
+	BF16_CHIP_RE,
+	BF16_CHIP_RE_GOOD,
+	BF16_CHIP_RE_BAD,
+	BF16_CHIP_TOTAL,
+	BF16_CHIP_TASK_SWITCH,
+	BF16_CHIP_STATUS,
+	BF16_CHIP_STATUS_NONE,
+	BF16_CHIP_COLS
+};
+
 /* chip structure */
 typedef struct {
 	uint8_t             clock;
@@ -57,21 +71,11 @@ typedef struct {
 	float               status_cmd;
 	float               status_cmd_none;
 
-	uint32_t            nonces_dx;
-	uint32_t            nonces_good_dx;
-	uint32_t            nonces_diff_dx;
-	uint32_t            nonces_bad_dx;
-	uint32_t            nonces_re_dx;
-	uint32_t            nonces_re_good_dx;
-	uint32_t            nonces_re_bad_dx;
-
-	uint32_t            task_switch_dx;
-	uint32_t            status_cmd_dx;
-	uint32_t            status_cmd_none_dx;
+	/* chip stats table counters at the last statistics interval */
+	uint64_t            stat_last[BF16_CHIP_COLS];
 
 	float               hashrate;
 	float               hashrate_good;
-	float               hashrate_diff;
 	float               hashrate_bad;
 	float               hashrate_re;
 	float               hashrate_re_good;
@@ -337,6 +341,8 @@ struct bitfury16_info {
 	float           hashrate_re_good;
 	float           hashrate_re_bad;
 
+	struct chip_stats *chip_stats;
+
 	pthread_mutex_t nonces_good_lock;
 	uint32_t        nonces_good_cg;
 
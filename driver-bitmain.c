@@ -2331,10 +2331,10 @@ static struct cgpu_info *bitmain_detect_one(libusb_device *dev, struct usb_find_
 		goto shin;
 
 #ifdef USE_ANT_S1
-	configured = get_options(++option_offset, &baud, &chain_num,
+	configured = get_options(usb_detect_option(&option_offset), &baud, &chain_num,
 				 &asic_num, &timeout, &frequency, reg_data);
 #else
-	configured = get_options(++option_offset, &baud, &chain_num, &asic_num);
+	configured = get_options(usb_detect_option(&option_offset), &baud, &chain_num, &asic_num);
 #endif
 
 	/* Even though this is an FTDI type chip, we want to do the parsing
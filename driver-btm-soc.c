@@ -11155,6 +11155,7 @@ void set_pic_iic_flash_addr_pointer(unsigned char chain, unsigned char addr_H, u
         }
 
         cg_wlock(&pool_stratum->data_lock);
+        __stratum_job_clear(pool_stratum);
         free(pool_stratum->swork.job_id);
         free(pool_stratum->nonce1);
         free(pool_stratum->coinbase);
@@ -11504,6 +11505,11 @@ void set_pic_iic_flash_addr_pointer(unsigned char chain, unsigned char addr_H, u
             }
             c_pool = pools[pool->pool_no];
             get_work_by_nonce2(thr,&work,pool,c_pool,nonce2,version);
+            if(work == NULL)
+            {
+                applog(LOG_DEBUG,"%s: no stratum job for pool %d ...\n", __FUNCTION__,pool->pool_no);
+                continue;
+            }
             h += hashtest_submit(thr,work,nonce3,midstate,pool,nonce2,chain_id);
             free_work(work);
         }
@@ -12079,5 +12085,6 @@ void set_pic_iic_flash_addr_pointer(unsigned char chain, unsigned char addr_H, u
         .reinit_device = bitmain_soc_reinit_device,
         .get_statline_before = get_bitmain_statline_before,
         .thread_shutdown = bitmain_soc_shutdown,
+        .rollnonce2 = true,
     };
 
@@ -3322,11 +3322,11 @@ static void init_task(struct COMPAC_INFO *info)
 			if (!opt_gekko_noboost && info->vmask)
 			{
 				if (info->midstates > 1)
-					stuff_reverse(info->task + 20 + 32, work->midstate1, 32);
+					stuff_reverse(info->task + 20 + 32, work_midstate(work, 1), 32);
 				if (info->midstates > 2)
-					stuff_reverse(info->task + 20 + 32 + 32, work->midstate2, 32);
+					stuff_reverse(info->task + 20 + 32 + 32, work_midstate(work, 2), 32);
 				if (info->midstates > 3)
-					stuff_reverse(info->task + 20 + 32 + 32 + 32, work->midstate3, 32);
+					stuff_reverse(info->task + 20 + 32 + 32 + 32, work_midstate(work, 3), 32);
 			}
 		}
 		else
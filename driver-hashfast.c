@@ -710,7 +710,7 @@ static void hfa_set_clock(struct cgpu_info *hashfast, struct hashfast_info *info
  * to be added in the future. */
 static void hfa_check_options(struct hashfast_info *info)
 {
-	char *p, *options, *found = NULL, *marker;
+	char *p, *options, *found = NULL, *marker, *save;
 	int maxlen, option = 0;
 
 	if (!opt_hfa_options)
@@ -722,7 +722,7 @@ static void hfa_check_options(struct hashfast_info *info)
 	maxlen = strlen(info->op_name);
 
 	options = strdup(opt_hfa_options);
-	for (p = strtok(options, ","); p; p = strtok(NULL, ",")) {
+	for (p = strtok_r(options, ",", &save); p; p = strtok_r(NULL, ",", &save)) {
 		int cmplen = strlen(p);
 
 		if (maxlen < cmplen)
@@ -738,7 +738,7 @@ static void hfa_check_options(struct hashfast_info *info)
 	if (!found)
 		return;
 
-	for (p = strtok(found, ":"); p; p = strtok(NULL, ":")) {
+	for (p = strtok_r(found, ":", &save); p; p = strtok_r(NULL, ":", &save)) {
 		long lval;
 
 		/* Parse each option in order, leaving room to add more */
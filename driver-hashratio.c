@@ -650,6 +650,7 @@ static void copy_pool_stratum(struct hashratio_info *info, struct pool *pool)
 		return;
 
 	cg_wlock(&(pool_stratum->data_lock));
+	__stratum_job_clear(pool_stratum);
 	free(pool_stratum->swork.job_id);
 	free(pool_stratum->nonce1);
 	free(pool_stratum->coinbase);
@@ -851,4 +852,5 @@ struct device_drv hashratio_drv = {
 	.flush_work      = hashratio_update_work,
 	.update_work     = hashratio_update_work,
 	.thread_shutdown = hashratio_shutdown,
+	.rollnonce2      = true,
 };
@@ -1171,7 +1171,7 @@ static void icarus_clear(struct cgpu_info *icarus, struct ICARUS_INFO *info)
 
 static struct cgpu_info *icarus_detect_one(struct libusb_device *dev, struct usb_find_devices *found)
 {
-	int this_option_offset = ++option_offset;
+	int this_option_offset = usb_detect_option(&option_offset);
 	struct ICARUS_INFO *info;
 	struct timeval tv_start, tv_finish;
 
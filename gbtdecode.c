@@ -0,0 +1,383 @@
+/*
+ * Copyright 2026 Andrew Smith
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 3 of the License, or (at your option)
+ * any later version.  See COPYING for more details.
+ */
+
+/* Streaming decoder for the transactions of a getblocktemplate response.
+ *
+ * A full block template is several MB of JSON, almost all of it in the
+ * "transactions" array. Building a jansson tree for it means an object, three
+ * strings and a handful of numbers per transaction, all of which are then
+ * strlen'd and copied again. Instead the response text is scanned in place:
+ * txids and wtxids are hex decoded straight into binary arrays, the raw
+ * transaction hex is copied into a single arena, and the array is then
+ * blanked out so that jansson only has to parse the small remainder of the
+ * template. */
+
+#include "miner.h"
+
+#include <ctype.h>
+
+#define GBT_TXNS_START 1024
+
+static inline const char *skip_ws(const char *p)
+{
+	while (*p == ' ' || *p == '\t' || *p == '\n' || *p == '\r')
+		p++;
+	return p;
+}
+
+/* Scan a string starting at its opening quote, returning the position after
+ * the closing quote or NULL if it's unterminated. *escaped is set if there
+ * were any escape sequences in it, since those can't be used as raw hex. */
+static const char *scan_string(const char *p, const char **start, size_t *len, bool *escaped)
+{
+	const char *s;
+
+	*escaped = false;
+	s = ++p;
+	while (*p != '"') {
+		if (unlikely(!*p))
+			return NULL;
+		if (*p == '\\') {
+			*escaped = true;
+			if (unlikely(!*++p))
+				return NULL;
+		}
+		p++;
+	}
+	*start = s;
+	*len = p - s;
+	return p + 1;
+}
+
+/* Skip over any JSON value without interpreting it */
+static const char *skip_value(const char *p)
+{
+	const char *s;
+	size_t len;
+	bool esc;
+	int depth = 0;
+
+	do {
+		p = skip_ws(p);
+		switch (*p) {
+			case '"':
+				p = scan_string(p, &s, &len, &esc);
+				if (unlikely(!p))
+					return NULL;
+				break;
+			case '{':
+			case '[':
+				depth++;
+				p++;
+				break;
+			case '}':
+			case ']':
+				if (unlikely(!depth))
+					return NULL;
+				depth--;
+				p++;
+				break;
+			case ',':
+			case ':':
+				if (unlikely(!depth))
+					return NULL;
+				p++;
+				break;
+			case '\0':
+				return NULL;
+			default:
+				/* Number or literal */
+				if (unlikely(!isalnum((unsigned char)*p) && *p != '-'))
+					return NULL;
+				while (isalnum((unsigned char)*p) || *p == '-' || *p == '+' || *p == '.')
+					p++;
+				break;
+		}
+	} while (depth);
+
+	return p;
+}
+
+/* Position p after the value of key in the object starting at p, returning
+ * the start of that value or NULL if the object doesn't contain it */
+static const char *find_key(const char *p, const char *key)
+{
+	size_t keylen = strlen(key), len;
+	const char *s;
+	bool esc;
+
+	p = skip_ws(p);
+	if (*p != '{')
+		return NULL;
+	p = skip_ws(p + 1);
+	if (*p == '}')
+		return NULL;
+
+	while (42) {
+		if (*p != '"')
+			return NULL;
+		p = scan_string(p, &s, &len, &esc);
+		if (unlikely(!p))
+			return NULL;
+		p = skip_ws(p);
+		if (*p != ':')
+			return NULL;
+		p = skip_ws(p + 1);
+		if (len == keylen && !memcmp(s, key, len))
+			return p;
+		p = skip_value(p);
+		if (unlikely(!p))
+			return NULL;
+		p = skip_ws(p);
+		if (*p != ',')
+			return NULL;
+		p = skip_ws(p + 1);
+	}
+}
+
+static bool hash_hex2bin(unsigned char *dest, const char *hex, size_t len)
+{
+	unsigned char binswap[32];
+	char hexbuf[65];
+
+	if (unlikely(len != 64))
+		return false;
+	cg_memcpy(hexbuf, hex, 64);
+	hexbuf[64] = '\0';
+	if (unlikely(!hex2bin(binswap, hexbuf, 32)))
+		return false;
+	swab256(dest, binswap);
+	return true;
+}
+
+static void gbt_txns_grow(struct gbt_txns *txns)
+{
+	txns->size = txns->size ? txns->size * 2 : GBT_TXNS_START;
+	txns->txids = cgrealloc(txns->txids, txns->size * 32);
+	txns->hashes = cgrealloc(txns->hashes, txns->size * 32);
+}
+
+/* Decode one transaction object, p pointing at its opening brace */
+static const char *stream_txn(const char *p, struct gbt_txns *txns)
+{
+	const char *data = NULL, *txid = NULL, *hash = NULL;
+	size_t data_len = 0, txid_len = 0, hash_len = 0, len;
+	unsigned char *txid_bin, *hash_bin;
+	const char *s;
+	bool esc;
+
+	p = skip_ws(p + 1);
+	if (*p != '}') while (42) {
+		if (*p != '"')
+			return NULL;
+		p = scan_string(p, &s, &len, &esc);
+		if (unlikely(!p))
+			return NULL;
+		p = skip_ws(p);
+		if (*p != ':')
+			return NULL;
+		p = skip_ws(p + 1);
+
+		if ((len == 4 && !memcmp(s, "data", 4)) ||
+		    (len == 4 && !memcmp(s, "txid", 4)) ||
+		    (len == 4 && !memcmp(s, "hash", 4))) {
+			const char *vs;
+			size_t vlen;
+
+			if (*p != '"')
+				return NULL;
+			p = scan_string(p, &vs, &vlen, &esc);
+			if (unlikely(!p || esc))
+				return NULL;
+			if (s[0] == 'd') {
+				data = vs;
+				data_len = vlen;
+			} else if (s[0] == 't') {
+				txid = vs;
+				txid_len = vlen;
+			} else {
+				hash = vs;
+				hash_len = vlen;
+			}
+		} else {
+			p = skip_value(p);
+			if (unlikely(!p))
+				return NULL;
+		}
+
+		p = skip_ws(p);
+		if (*p == '}')
+			break;
+		if (*p != ',')
+			return NULL;
+		p = skip_ws(p + 1);
+	}
+
+	if (unlikely(!data)) {
+		applog(LOG_ERR, "Cannot find transaction data in GBT");
+		return NULL;
+	}
+	if (!txid) {
+		txid = hash;
+		txid_len = hash_len;
+	}
+	if (unlikely(!txid)) {
+		applog(LOG_ERR, "Missing txid in GBT transaction");
+		return NULL;
+	}
+
+	if (txns->count >= txns->size)
+		gbt_txns_grow(txns);
+	txid_bin = txns->txids + txns->count * 32;
+	hash_bin = txns->hashes + txns->count * 32;
+	if (unlikely(!hash_hex2bin(txid_bin, txid, txid_len))) {
+		applog(LOG_ERR, "Failed to hex2bin txid in GBT transaction");
+		return NULL;
+	}
+	if (hash) {
+		if (unlikely(!hash_hex2bin(hash_bin, hash, hash_len))) {
+			applog(LOG_ERR, "Failed to hex2bin hash in GBT transaction");
+			return NULL;
+		}
+	} else
+		txns->have_hashes = false;
+
+	cg_memcpy(txns->data + txns->data_len, data, data_len);
+	txns->data_len += data_len;
+	txns->count++;
+
+	return p + 1;
+}
+
+/* Extract the result.transactions array from the raw text of a GBT response
+ * in buf into txns, then overwrite the array contents with spaces in place so
+ * a subsequent JSON parse of buf sees an empty array. A response with no
+ * transactions array decodes as zero transactions. Returns false, leaving buf
+ * untouched, if the text isn't laid out as expected so the caller can fall
+ * back to gbt_json_txns. */
+bool gbt_stream_txns(char *buf, struct gbt_txns *txns)
+{
+	const char *p, *arr, *end;
+
+	memset(txns, 0, sizeof(*txns));
+	txns->have_hashes = true;
+
+	p = find_key(buf, "result");
+	if (!p)
+		return false;
+	arr = find_key(p, "transactions");
+	if (!arr) {
+		/* Only valid if the result object simply has no transactions */
+		return skip_value(p) != NULL;
+	}
+	if (*arr != '[')
+		return false;
+	end = skip_value(arr);
+	if (unlikely(!end))
+		return false;
+
+	/* The hex of every transaction is shorter than the array holding it */
+	txns->data = cgmalloc(end - arr + 1);
+
+	p = skip_ws(arr + 1);
+	if (*p != ']') while (42) {
+		if (*p != '{')
+			goto out_fail;
+		p = stream_txn(p, txns);
+		if (unlikely(!p))
+			goto out_fail;
+		p = skip_ws(p);
+		if (*p == ']')
+			break;
+		if (*p != ',')
+			goto out_fail;
+		p = skip_ws(p + 1);
+	}
+	txns->data[txns->data_len] = '\0';
+
+	/* Leave the brackets so the template still parses as an empty array */
+	memset(buf + (arr - buf) + 1, ' ', end - arr - 2);
+	if (!txns->count)
+		txns->have_hashes = false;
+	return true;
+
+out_fail:
+	gbt_txns_free(txns);
+	return false;
+}
+
+/* Slow path equivalent of gbt_stream_txns from an already parsed tree */
+bool gbt_json_txns(json_t *transaction_arr, struct gbt_txns *txns)
+{
+	int i, count = json_array_size(transaction_arr);
+	size_t len = 0;
+
+	memset(txns, 0, sizeof(*txns));
+	txns->have_hashes = count > 0;
+	if (!count)
+		return true;
+
+	for (i = 0; i < count; i++) {
+		const char *txn = json_string_value(json_object_get(json_array_get(transaction_arr, i), "data"));
+
+		if (unlikely(!txn)) {
+			applog(LOG_ERR, "Cannot find transaction data in GBT");
+			return false;
+		}
+		len += strlen(txn);
+	}
+	txns->data = cgmalloc(len + 1);
+	txns->size = count;
+	txns->txids = cgmalloc(count * 32);
+	txns->hashes = cgmalloc(count * 32);
+
+	for (i = 0; i < count; i++) {
+		json_t *arr_val = json_array_get(transaction_arr, i);
+		const char *txn, *txid, *hash;
+
+		txn = json_string_value(json_object_get(arr_val, "data"));
+		txid = json_string_value(json_object_get(arr_val, "txid"));
+		hash = json_string_value(json_object_get(arr_val, "hash"));
+		if (!txid)
+			txid = hash;
+		if (unlikely(!txid)) {
+			applog(LOG_ERR, "Missing txid in GBT transaction");
+			goto out_fail;
+		}
+		if (unlikely(!hash_hex2bin(txns->txids + i * 32, txid, strlen(txid)))) {
+			applog(LOG_ERR, "Failed to hex2bin txid in GBT transaction");
+			goto out_fail;
+		}
+		if (hash) {
+			if (unlikely(!hash_hex2bin(txns->hashes + i * 32, hash, strlen(hash)))) {
+				applog(LOG_ERR, "Failed to hex2bin hash in GBT transaction");
+				goto out_fail;
+			}
+		} else
+			txns->have_hashes = false;
+		len = strlen(txn);
+		cg_memcpy(txns->data + txns->data_len, txn, len);
+		txns->data_len += len;
+		txns->count++;
+	}
+	txns->data[txns->data_len] = '\0';
+	return true;
+
+out_fail:
+	gbt_txns_free(txns);
+	return false;
+}
+
+void gbt_txns_free(struct gbt_txns *txns)
+{
+	free(txns->txids);
+	free(txns->hashes);
+	free(txns->data);
+	memset(txns, 0, sizeof(*txns));
+}
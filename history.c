@@ -0,0 +1,208 @@
+/*
+ * Copyright 2026 Andrew Smith
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 3 of the License, or (at your option)
+ * any later version.  See COPYING for more details.
+ */
+
+/* Per device and per pool history.
+ *
+ * Every opt_history_interval seconds the first hashmeter() call past the
+ * boundary wins a compare and swap and, as the only writer, takes the
+ * difference of each device's and pool's running totals since the last
+ * interval into a fixed size ring. Each of the HISTORY_TIERS rings after
+ * the first holds the sum of a number of samples of the one below, so a week
+ * of hourly history costs no more than two hours by the minute. Readers never
+ * lock: the writer publishes the ring's count after filling a slot, and a
+ * reader copies the ring then rereads the count to drop any slots that may
+ * have been reused while it was copying. Memory for a device or pool is
+ * allocated the first time it is seen and never grows. */
+
+#include "miner.h"
+#include "history.h"
+
+int opt_history_interval = HISTORY_INTERVAL;
+
+/* Intervals per sample and samples kept, so 2 hours, 1 day and 1 week at
+ * the default interval */
+static const int history_mult[HISTORY_TIERS] = { 1, 15, 60 };
+static const int history_slots[HISTORY_TIERS] = { 120, 96, 168 };
+
+struct history_tier {
+	struct history_sample *slots;
+	uint64_t count;			// Samples ever written, published last
+	struct history_sample sum;	// Samples from the tier below so far
+	int summed;
+};
+
+struct history {
+	struct history_tier tier[HISTORY_TIERS];
+	struct history_sample last;	// Running totals at the last interval
+};
+
+static time_t history_next;
+
+int history_tier_interval(int tier)
+{
+	return opt_history_interval * history_mult[tier];
+}
+
+int history_tier_slots(int tier)
+{
+	return history_slots[tier];
+}
+
+static struct history *history_new(const struct history_sample *totals)
+{
+	struct history *hist = cgcalloc(1, sizeof(*hist));
+	int t;
+
+	for (t = 0; t < HISTORY_TIERS; t++)
+		hist->tier[t].slots = cgcalloc(history_slots[t], sizeof(struct history_sample));
+	hist->last = *totals;
+
+	return hist;
+}
+
+static void history_push(struct history *hist, int t, const struct history_sample *sample)
+{
+	struct history_tier *tier = &hist->tier[t], *up;
+
+	tier->slots[tier->count % history_slots[t]] = *sample;
+	__atomic_store_n(&tier->count, tier->count + 1, __ATOMIC_RELEASE);
+
+	if (t + 1 >= HISTORY_TIERS)
+		return;
+
+	up = &hist->tier[t + 1];
+	up->sum.mhashes += sample->mhashes;
+	up->sum.diff1 += sample->diff1;
+	up->sum.diff_accepted += sample->diff_accepted;
+	up->sum.diff_rejected += sample->diff_rejected;
+	up->sum.diff_stale += sample->diff_stale;
+	up->sum.hw_errors += sample->hw_errors;
+	up->sum.temp += sample->temp;
+	if (++up->summed < history_mult[t + 1] / history_mult[t])
+		return;
+
+	up->sum.when = sample->when;
+	up->sum.temp /= up->summed;
+	history_push(hist, t + 1, &up->sum);
+	memset(&up->sum, 0, sizeof(up->sum));
+	up->summed = 0;
+}
+
+/* A total that went down was zeroed, so all of it is new */
+static double history_delta(double now, double last)
+{
+	return now >= last ? now - last : now;
+}
+
+static void history_add(struct history **histp, const struct history_sample *totals, time_t when)
+{
+	struct history *hist = *histp;
+	struct history_sample sample;
+
+	if (unlikely(!hist)) {
+		__atomic_store_n(histp, history_new(totals), __ATOMIC_RELEASE);
+		return;
+	}
+
+	sample.when = when;
+	sample.mhashes = history_delta(totals->mhashes, hist->last.mhashes);
+	sample.diff1 = history_delta(totals->diff1, hist->last.diff1);
+	sample.diff_accepted = history_delta(totals->diff_accepted, hist->last.diff_accepted);
+	sample.diff_rejected = history_delta(totals->diff_rejected, hist->last.diff_rejected);
+	sample.diff_stale = history_delta(totals->diff_stale, hist->last.diff_stale);
+	sample.hw_errors = history_delta(totals->hw_errors, hist->last.hw_errors);
+	sample.temp = totals->temp;
+	hist->last = *totals;
+
+	history_push(hist, 0, &sample);
+}
+
+static void history_sample_all(void)
+{
+	struct history_sample totals;
+	time_t when = time(NULL);
+	struct cgpu_info *cgpu;
+	struct pool *pool;
+	int i;
+
+	memset(&totals, 0, sizeof(totals));
+	for (i = 0; i < total_devices; i++) {
+		cgpu = get_a_device(i);
+		totals.mhashes = cgpu->total_mhashes;
+		totals.diff1 = cgpu->diff1;
+		totals.diff_accepted = cgpu->diff_accepted;
+		totals.diff_rejected = cgpu->diff_rejected;
+		totals.hw_errors = cgpu->hw_errors;
+		totals.temp = cgpu->temp;
+		history_add(&cgpu->history, &totals, when);
+	}
+
+	memset(&totals, 0, sizeof(totals));
+	for (i = 0; i < total_pools; i++) {
+		pool = pools[i];
+		totals.diff1 = pool->diff1;
+		totals.diff_accepted = pool->diff_accepted;
+		totals.diff_rejected = pool->diff_rejected;
+		totals.diff_stale = pool->diff_stale;
+		history_add(&pool->history, &totals, when);
+	}
+}
+
+/* Called from hashmeter() with its current time. Costs one load until an
+ * interval ends. */
+void history_update(const struct timeval *now)
+{
+	time_t next = __atomic_load_n(&history_next, __ATOMIC_RELAXED);
+
+	if (!opt_history_interval || now->tv_sec < next)
+		return;
+	if (!__atomic_compare_exchange_n(&history_next, &next, now->tv_sec + opt_history_interval,
+					 false, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+		return;
+
+	history_sample_all();
+}
+
+/* Copy the samples in a tier that ended after since, oldest first, into
+ * *samples, which the caller frees. Returns how many there are. */
+int history_read(struct history **histp, int tier, time_t since, struct history_sample **samples)
+{
+	struct history *hist = __atomic_load_n(histp, __ATOMIC_ACQUIRE);
+	uint64_t base, first, last, count, i;
+	struct history_tier *ring;
+	int slots, n;
+
+	*samples = NULL;
+	if (!hist)
+		return 0;
+
+	ring = &hist->tier[tier];
+	slots = history_slots[tier];
+	last = __atomic_load_n(&ring->count, __ATOMIC_ACQUIRE);
+	base = last > (uint64_t)slots ? last - slots : 0;
+	*samples = cgcalloc(last - base + 1, sizeof(**samples));
+	for (i = base; i < last; i++)
+		(*samples)[i - base] = ring->slots[i % slots];
+
+	/* Drop the oldest ones if the writer has reused their slots since, it
+	 * may be part way through filling the one after count */
+	__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	count = __atomic_load_n(&ring->count, __ATOMIC_RELAXED);
+	first = base;
+	if (count + 1 > first + slots)
+		first = count + 1 - slots;
+
+	while (first < last && (*samples)[first - base].when <= since)
+		first++;
+
+	n = first < last ? last - first : 0;
+	memmove(*samples, &(*samples)[first - base], n * sizeof(**samples));
+
+	return n;
+}
@@ -0,0 +1,40 @@
+/*
+ * Copyright 2026 Andrew Smith
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 3 of the License, or (at your option)
+ * any later version.  See COPYING for more details.
+ */
+
+#ifndef HISTORY_H
+#define HISTORY_H
+
+#include "miner.h"
+
+#define HISTORY_INTERVAL 60
+#define HISTORY_TIERS 3
+
+/* What happened in one interval. Temperature is the device's reading when a
+ * tier 0 interval ended, and the mean of those readings in the higher tiers.
+ * It is only kept for devices, hashes and hardware errors are also only for
+ * devices and stale diff only for pools */
+struct history_sample {
+	time_t when;		// Wall clock time the interval ended
+	double mhashes;
+	double diff1;
+	double diff_accepted;
+	double diff_rejected;
+	double diff_stale;
+	double hw_errors;
+	double temp;
+};
+
+extern int opt_history_interval;
+
+extern void history_update(const struct timeval *now);
+extern int history_tier_interval(int tier);
+extern int history_tier_slots(int tier);
+extern int history_read(struct history **histp, int tier, time_t since, struct history_sample **samples);
+
+#endif /* HISTORY_H */
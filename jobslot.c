@@ -0,0 +1,253 @@
+/*
+ * Copyright 2026 Andrew Smith
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 3 of the License, or (at your option)
+ * any later version.  See COPYING for more details.
+ */
+
+/* Job slot table for drivers that address work by a small device job id.
+ *
+ * Each slot holds the work currently loaded under that id and the one it
+ * replaced, so a nonce that turns up just after a job is replaced or flushed
+ * can still be matched to its work. Changes are serialised by a mutex but
+ * lookups take no lock: readers announce themselves in a counter and work
+ * that falls out of a slot is only freed once a writer sees no readers
+ * active, since any reader that could still hold it started before it was
+ * unlinked. */
+
+#include "miner.h"
+#include "jobslot.h"
+
+struct job_slots {
+	struct cgpu_info *cgpu;
+	bool queued;		// Work came from get_queued so work_completed it
+	int size;
+	void *base;
+	struct job_slot *slots;
+	int readers;
+	pthread_mutex_t lock;	// Writers and everything below
+	struct work **retired;
+	int retired_count;
+	int retired_size;
+	int retired_max;
+	uint64_t sets;
+	uint64_t reuses;
+	uint64_t clears;
+	/* Updated by readers with atomics */
+	uint64_t lookups;
+	uint64_t misses;
+	uint64_t recovered;
+};
+
+static void js_release(struct job_slots *js, struct work *work)
+{
+	if (js->queued)
+		work_completed(js->cgpu, work);
+	else
+		free_work(work);
+}
+
+/* Must be called with js->lock held */
+static void js_retire(struct job_slots *js, struct work *work)
+{
+	int i;
+
+	if (work) {
+		if (js->retired_count >= js->retired_size) {
+			js->retired_size = js->retired_size ? js->retired_size * 2 : 16;
+			js->retired = cgrealloc(js->retired, js->retired_size * sizeof(*js->retired));
+		}
+		js->retired[js->retired_count++] = work;
+		if (js->retired_count > js->retired_max)
+			js->retired_max = js->retired_count;
+	}
+
+	if (__atomic_load_n(&js->readers, __ATOMIC_SEQ_CST))
+		return;
+	for (i = 0; i < js->retired_count; i++)
+		js_release(js, js->retired[i]);
+	js->retired_count = 0;
+}
+
+void job_slots_alloc(struct cgpu_info *cgpu, int size, bool queued)
+{
+	struct job_slots *js;
+
+	js = cgcalloc(1, sizeof(*js));
+	js->cgpu = cgpu;
+	js->queued = queued;
+	js->size = size;
+	js->base = cgcalloc(1, size * sizeof(struct job_slot) + JOB_SLOT_ALIGN - 1);
+	js->slots = (struct job_slot *)(((uintptr_t)js->base + JOB_SLOT_ALIGN - 1) &
+					~(uintptr_t)(JOB_SLOT_ALIGN - 1));
+	mutex_init(&js->lock);
+
+	cgpu->job_slots = js;
+}
+
+/* Releases all work still held, so the device must be stopped */
+void job_slots_free(struct cgpu_info *cgpu)
+{
+	struct job_slots *js = cgpu->job_slots;
+	int i;
+
+	if (!js)
+		return;
+
+	cgpu->job_slots = NULL;
+	for (i = 0; i < js->size; i++) {
+		if (js->slots[i].work)
+			js_release(js, js->slots[i].work);
+		if (js->slots[i].prev)
+			js_release(js, js->slots[i].prev);
+	}
+	for (i = 0; i < js->retired_count; i++)
+		js_release(js, js->retired[i]);
+	free(js->retired);
+	mutex_destroy(&js->lock);
+	free(js->base);
+	free(js);
+}
+
+/* Load work into slot id, which the table then owns. Returns true if it
+ * replaced work still in the slot. */
+bool job_slots_set(struct cgpu_info *cgpu, int id, struct work *work)
+{
+	struct job_slots *js = cgpu->job_slots;
+	struct job_slot *slot = &js->slots[id];
+	struct work *old;
+	bool reused;
+
+	mutex_lock(&js->lock);
+	old = slot->prev;
+	reused = (slot->work != NULL);
+	__atomic_store_n(&slot->prev, slot->work, __ATOMIC_SEQ_CST);
+	__atomic_store_n(&slot->work, work, __ATOMIC_SEQ_CST);
+	__atomic_add_fetch(&slot->gen, 1, __ATOMIC_SEQ_CST);
+	js->sets++;
+	if (reused)
+		js->reuses++;
+	js_retire(js, old);
+	mutex_unlock(&js->lock);
+
+	return reused;
+}
+
+/* Empty slot id, e.g. when the device has finished or flushed it. The work is
+ * kept as the previous occupant in case it still has nonces to come. Returns
+ * true if there was work in the slot. */
+bool job_slots_clear(struct cgpu_info *cgpu, int id)
+{
+	struct job_slots *js = cgpu->job_slots;
+	struct job_slot *slot = &js->slots[id];
+	struct work *old;
+	bool had;
+
+	mutex_lock(&js->lock);
+	had = (slot->work != NULL);
+	if (had) {
+		old = slot->prev;
+		__atomic_store_n(&slot->prev, slot->work, __ATOMIC_SEQ_CST);
+		__atomic_store_n(&slot->work, NULL, __ATOMIC_SEQ_CST);
+		__atomic_add_fetch(&slot->gen, 1, __ATOMIC_SEQ_CST);
+		js->clears++;
+		js_retire(js, old);
+	}
+	mutex_unlock(&js->lock);
+
+	return had;
+}
+
+/* Return a copy of the work in slot id for the caller to free, or NULL if it's
+ * empty or out of range. If gen is not NULL it's set to the slot's generation
+ * at the time of the copy. */
+struct work *job_slots_get(struct cgpu_info *cgpu, int id, uint32_t *gen)
+{
+	struct job_slots *js = cgpu->job_slots;
+	struct job_slot *slot;
+	struct work *work, *ret = NULL;
+
+	__atomic_add_fetch(&js->lookups, 1, __ATOMIC_RELAXED);
+	if (unlikely(id < 0 || id >= js->size))
+		goto out_miss;
+	slot = &js->slots[id];
+
+	__atomic_add_fetch(&js->readers, 1, __ATOMIC_SEQ_CST);
+	if (gen)
+		*gen = __atomic_load_n(&slot->gen, __ATOMIC_SEQ_CST);
+	work = __atomic_load_n(&slot->work, __ATOMIC_SEQ_CST);
+	if (work)
+		ret = copy_work(work);
+	__atomic_sub_fetch(&js->readers, 1, __ATOMIC_SEQ_CST);
+
+	if (ret)
+		return ret;
+out_miss:
+	__atomic_add_fetch(&js->misses, 1, __ATOMIC_RELAXED);
+	return NULL;
+}
+
+/* For a nonce that failed against the work job_slots_get returned, try the
+ * slot's current and previous occupants in case the slot changed around it.
+ * Returns a copy of whichever the nonce is valid for, or NULL. */
+struct work *job_slots_recover(struct cgpu_info *cgpu, int id, uint32_t nonce)
+{
+	struct job_slots *js = cgpu->job_slots;
+	struct job_slot *slot;
+	struct work *work, *ret = NULL;
+	int i;
+
+	if (unlikely(id < 0 || id >= js->size))
+		return NULL;
+	slot = &js->slots[id];
+
+	__atomic_add_fetch(&js->readers, 1, __ATOMIC_SEQ_CST);
+	for (i = 0; i < 2 && !ret; i++) {
+		work = __atomic_load_n(i ? &slot->prev : &slot->work, __ATOMIC_SEQ_CST);
+		if (!work)
+			continue;
+		ret = copy_work(work);
+		if (!test_nonce(ret, nonce)) {
+			free_work(ret);
+			ret = NULL;
+		}
+	}
+	__atomic_sub_fetch(&js->readers, 1, __ATOMIC_SEQ_CST);
+
+	if (ret)
+		__atomic_add_fetch(&js->recovered, 1, __ATOMIC_RELAXED);
+	return ret;
+}
+
+struct api_data *job_slots_api_stats(struct cgpu_info *cgpu, struct api_data *root)
+{
+	struct job_slots *js = cgpu->job_slots;
+	uint64_t sets, reuses, clears, lookups, misses, recovered;
+	int retired_max;
+
+	if (!js)
+		return root;
+
+	mutex_lock(&js->lock);
+	sets = js->sets;
+	reuses = js->reuses;
+	clears = js->clears;
+	retired_max = js->retired_max;
+	mutex_unlock(&js->lock);
+	lookups = __atomic_load_n(&js->lookups, __ATOMIC_RELAXED);
+	misses = __atomic_load_n(&js->misses, __ATOMIC_RELAXED);
+	recovered = __atomic_load_n(&js->recovered, __ATOMIC_RELAXED);
+
+	root = api_add_int(root, "JS Slots", &js->size, true);
+	root = api_add_uint64(root, "JS Sets", &sets, true);
+	root = api_add_uint64(root, "JS Reuses", &reuses, true);
+	root = api_add_uint64(root, "JS Clears", &clears, true);
+	root = api_add_uint64(root, "JS Lookups", &lookups, true);
+	root = api_add_uint64(root, "JS Misses", &misses, true);
+	root = api_add_uint64(root, "JS Recovered", &recovered, true);
+	root = api_add_int(root, "JS Retired Max", &retired_max, true);
+
+	return root;
+}
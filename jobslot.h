@@ -0,0 +1,31 @@
+/*
+ * Copyright 2026 Andrew Smith
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 3 of the License, or (at your option)
+ * any later version.  See COPYING for more details.
+ */
+
+#ifndef JOBSLOT_H
+#define JOBSLOT_H
+
+#include "miner.h"
+
+#define JOB_SLOT_ALIGN 64
+
+struct job_slot {
+	struct work *work;	// Current occupant
+	struct work *prev;	// Last occupant, kept for nonce recovery
+	uint32_t gen;		// Bumped every time the slot changes
+} __attribute__((aligned(JOB_SLOT_ALIGN)));
+
+extern void job_slots_alloc(struct cgpu_info *cgpu, int size, bool queued);
+extern void job_slots_free(struct cgpu_info *cgpu);
+extern bool job_slots_set(struct cgpu_info *cgpu, int id, struct work *work);
+extern bool job_slots_clear(struct cgpu_info *cgpu, int id);
+extern struct work *job_slots_get(struct cgpu_info *cgpu, int id, uint32_t *gen);
+extern struct work *job_slots_recover(struct cgpu_info *cgpu, int id, uint32_t nonce);
+extern struct api_data *job_slots_api_stats(struct cgpu_info *cgpu, struct api_data *root);
+
+#endif
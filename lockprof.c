@@ -0,0 +1,241 @@
+/*
+ * Copyright 2026 Andrew Smith
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 3 of the License, or (at your option)
+ * any later version.  See COPYING for more details.
+ */
+
+/* Lock contention profiler.
+ *
+ * The lock wrappers in miner.h first try the lock and only come here when
+ * that fails, so an uncontended lock costs nothing extra. For each call site
+ * that has had to wait we keep a wait time histogram, and the time the lock
+ * was then held until it was released, which is the hold time that matters
+ * for a lock others are queueing on. Sites live in a fixed open addressed
+ * table that is read without a lock and only added to under one, and all
+ * counters are updated with atomics. None of this may use the lock wrappers
+ * or anything that does, such as applog. */
+
+#include "miner.h"
+#include "lockprof.h"
+
+#define LOCKPROF_SITES 1024
+#define LOCKPROF_HELD 8
+
+bool opt_lock_stats = true;
+
+struct lockprof_hold {
+	void *lock;
+	struct lockprof_site *site;
+	struct timeval tv;
+};
+
+/* Contended locks this thread currently holds, for their hold times */
+__thread int lockprof_held;
+static __thread struct lockprof_hold lockprof_holds[LOCKPROF_HELD];
+
+static struct lockprof_site lockprof_sites[LOCKPROF_SITES];
+static pthread_mutex_t lockprof_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static const char *lockprof_buckets[LOCKPROF_BUCKETS] = {
+	"<10us", "<100us", "<1ms", "<10ms", "<100ms", "<1s", ">=1s"
+};
+
+const char *lockprof_typ_str(enum lockprof_typ typ)
+{
+	switch (typ) {
+		case LOCKPROF_MUTEX:
+			return "Mutex";
+		case LOCKPROF_WRLOCK:
+			return "WrLock";
+		case LOCKPROF_RDLOCK:
+			return "RdLock";
+	}
+	return "Unknown";
+}
+
+const char *lockprof_bucket_str(int bucket)
+{
+	return lockprof_buckets[bucket];
+}
+
+static uint64_t lockprof_us(const struct timeval *start, const struct timeval *end)
+{
+	int64_t us = (int64_t)(end->tv_sec - start->tv_sec) * 1000000 +
+		     (end->tv_usec - start->tv_usec);
+
+	return us > 0 ? us : 0;
+}
+
+static bool lockprof_match(struct lockprof_site *site, const char *file, int line, enum lockprof_typ typ)
+{
+	return site->file == file && site->line == line && site->typ == typ;
+}
+
+/* Find or add the site, NULL if the table is full */
+static struct lockprof_site *lockprof_site(void *lock, enum lockprof_typ typ, const char *file,
+					   const char *func, const int line)
+{
+	unsigned int h = (((uintptr_t)file >> 3) * 31 + line * 7 + typ);
+	struct lockprof_site *site;
+	const char *f;
+	int n;
+
+	for (n = 0; n < LOCKPROF_SITES; n++) {
+		site = &lockprof_sites[(h + n) & (LOCKPROF_SITES - 1)];
+		f = __atomic_load_n(&site->file, __ATOMIC_ACQUIRE);
+		if (!f)
+			break;
+		if (lockprof_match(site, file, line, typ))
+			return site;
+	}
+
+	pthread_mutex_lock(&lockprof_lock);
+	for (n = 0; n < LOCKPROF_SITES; n++) {
+		site = &lockprof_sites[(h + n) & (LOCKPROF_SITES - 1)];
+		if (!site->file) {
+			site->func = func;
+			site->line = line;
+			site->typ = typ;
+			site->lock = lock;
+			__atomic_store_n(&site->file, file, __ATOMIC_RELEASE);
+			break;
+		}
+		if (lockprof_match(site, file, line, typ))
+			break;
+	}
+	pthread_mutex_unlock(&lockprof_lock);
+
+	return n < LOCKPROF_SITES ? site : NULL;
+}
+
+/* Called once a lock that was busy has been acquired, with the time the wait
+ * started */
+void lockprof_got(void *lock, enum lockprof_typ typ, const char *file, const char *func,
+		  const int line, const struct timeval *tv_start)
+{
+	struct lockprof_hold *hold;
+	struct lockprof_site *site;
+	struct timeval now;
+	uint64_t us, lim;
+	int b;
+
+	cgtime(&now);
+	site = lockprof_site(lock, typ, file, func, line);
+	if (unlikely(!site))
+		return;
+
+	us = lockprof_us(tv_start, &now);
+	for (b = 0, lim = 10; b < LOCKPROF_BUCKETS - 1 && us >= lim; b++)
+		lim *= 10;
+	__atomic_add_fetch(&site->contended, 1, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&site->wait_us, us, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&site->wait_hist[b], 1, __ATOMIC_RELAXED);
+	atomic_max64(&site->wait_max_us, us);
+
+	if (lockprof_held < LOCKPROF_HELD) {
+		hold = &lockprof_holds[lockprof_held++];
+		hold->lock = lock;
+		hold->site = site;
+		copy_time(&hold->tv, &now);
+	}
+}
+
+/* Called when a trylock finds the lock busy */
+void lockprof_tryfail(void *lock, enum lockprof_typ typ, const char *file, const char *func,
+		      const int line)
+{
+	struct lockprof_site *site;
+
+	site = lockprof_site(lock, typ, file, func, line);
+	if (likely(site))
+		__atomic_add_fetch(&site->tryfails, 1, __ATOMIC_RELAXED);
+}
+
+/* Called on unlock while this thread holds any lock it had to wait for */
+void lockprof_release(void *lock)
+{
+	struct lockprof_hold *hold;
+	struct timeval now;
+	uint64_t us;
+	int i;
+
+	for (i = lockprof_held - 1; i >= 0; i--) {
+		hold = &lockprof_holds[i];
+		if (hold->lock != lock)
+			continue;
+
+		cgtime(&now);
+		us = lockprof_us(&hold->tv, &now);
+		__atomic_add_fetch(&hold->site->holds, 1, __ATOMIC_RELAXED);
+		__atomic_add_fetch(&hold->site->hold_us, us, __ATOMIC_RELAXED);
+		atomic_max64(&hold->site->hold_max_us, us);
+		lockprof_holds[i] = lockprof_holds[--lockprof_held];
+		return;
+	}
+}
+
+static int lockprof_cmp(const void *a, const void *b)
+{
+	const struct lockprof_site *sa = a, *sb = b;
+
+	if (sa->wait_us != sb->wait_us)
+		return sa->wait_us < sb->wait_us ? 1 : -1;
+	return sa->tryfails < sb->tryfails ? 1 : (sa->tryfails > sb->tryfails ? -1 : 0);
+}
+
+/* Copy every site seen so far into *sites, which the caller frees, most total
+ * wait first. Returns how many there are. */
+int lockprof_snapshot(struct lockprof_site **sites)
+{
+	struct lockprof_site *site, *copy;
+	int i, b, count = 0;
+
+	*sites = cgcalloc(LOCKPROF_SITES, sizeof(**sites));
+	for (i = 0; i < LOCKPROF_SITES; i++) {
+		site = &lockprof_sites[i];
+		if (!__atomic_load_n(&site->file, __ATOMIC_ACQUIRE))
+			continue;
+
+		copy = &(*sites)[count++];
+		copy->file = site->file;
+		copy->func = site->func;
+		copy->line = site->line;
+		copy->typ = site->typ;
+		copy->lock = site->lock;
+		copy->contended = __atomic_load_n(&site->contended, __ATOMIC_RELAXED);
+		copy->tryfails = __atomic_load_n(&site->tryfails, __ATOMIC_RELAXED);
+		copy->wait_us = __atomic_load_n(&site->wait_us, __ATOMIC_RELAXED);
+		copy->wait_max_us = __atomic_load_n(&site->wait_max_us, __ATOMIC_RELAXED);
+		for (b = 0; b < LOCKPROF_BUCKETS; b++)
+			copy->wait_hist[b] = __atomic_load_n(&site->wait_hist[b], __ATOMIC_RELAXED);
+		copy->holds = __atomic_load_n(&site->holds, __ATOMIC_RELAXED);
+		copy->hold_us = __atomic_load_n(&site->hold_us, __ATOMIC_RELAXED);
+		copy->hold_max_us = __atomic_load_n(&site->hold_max_us, __ATOMIC_RELAXED);
+	}
+	qsort(*sites, count, sizeof(**sites), lockprof_cmp);
+
+	return count;
+}
+
+/* Zero the counters but keep the sites, so it races harmlessly with updates */
+void lockprof_reset(void)
+{
+	struct lockprof_site *site;
+	int i, b;
+
+	for (i = 0; i < LOCKPROF_SITES; i++) {
+		site = &lockprof_sites[i];
+		__atomic_store_n(&site->contended, 0, __ATOMIC_RELAXED);
+		__atomic_store_n(&site->tryfails, 0, __ATOMIC_RELAXED);
+		__atomic_store_n(&site->wait_us, 0, __ATOMIC_RELAXED);
+		__atomic_store_n(&site->wait_max_us, 0, __ATOMIC_RELAXED);
+		for (b = 0; b < LOCKPROF_BUCKETS; b++)
+			__atomic_store_n(&site->wait_hist[b], 0, __ATOMIC_RELAXED);
+		__atomic_store_n(&site->holds, 0, __ATOMIC_RELAXED);
+		__atomic_store_n(&site->hold_us, 0, __ATOMIC_RELAXED);
+		__atomic_store_n(&site->hold_max_us, 0, __ATOMIC_RELAXED);
+	}
+}
@@ -0,0 +1,40 @@
+/*
+ * Copyright 2026 Andrew Smith
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 3 of the License, or (at your option)
+ * any later version.  See COPYING for more details.
+ */
+
+#ifndef LOCKPROF_H
+#define LOCKPROF_H
+
+#include "miner.h"
+
+/* Wait histogram buckets, <10us <100us <1ms <10ms <100ms <1s >=1s */
+#define LOCKPROF_BUCKETS 7
+
+/* Stats for one call site that has had to wait for a lock */
+struct lockprof_site {
+	const char *file;	// NULL if the slot is free, published last
+	const char *func;
+	int line;
+	enum lockprof_typ typ;
+	void *lock;		// The first lock seen contended at this site
+	uint64_t contended;
+	uint64_t tryfails;
+	uint64_t wait_us;
+	uint64_t wait_max_us;
+	uint64_t wait_hist[LOCKPROF_BUCKETS];
+	uint64_t holds;
+	uint64_t hold_us;
+	uint64_t hold_max_us;
+};
+
+extern const char *lockprof_typ_str(enum lockprof_typ typ);
+extern const char *lockprof_bucket_str(int bucket);
+extern int lockprof_snapshot(struct lockprof_site **sites);
+extern void lockprof_reset(void);
+
+#endif /* LOCKPROF_H */
@@ -285,7 +285,8 @@ static inline int fsync (int fd)
 	DRIVER_ADD_COMMAND(minion) \
 	DRIVER_ADD_COMMAND(sp10) \
 	DRIVER_ADD_COMMAND(sp30) \
-	DRIVER_ADD_COMMAND(bitmain_soc)
+	DRIVER_ADD_COMMAND(bitmain_soc) \
+	DRIVER_ADD_COMMAND(stratsrv)
 
 #define DRIVER_PARSE_COMMANDS(DRIVER_ADD_COMMAND) \
 	FPGA_PARSE_COMMANDS(DRIVER_ADD_COMMAND) \
@@ -318,15 +319,18 @@ enum pool_strategy {
 	POOL_ROTATE,
 	POOL_LOADBALANCE,
 	POOL_BALANCE,
+	POOL_WEIGHTED,
 };
 
-#define TOP_STRATEGY (POOL_BALANCE)
+#define TOP_STRATEGY (POOL_WEIGHTED)
 
 struct strategies {
 	const char *s;
 };
 
 struct cgpu_info;
+struct history;
+struct chip_stats;
 
 extern void blank_get_statline_before(char *buf, size_t bufsiz, struct cgpu_info __maybe_unused *cgpu);
 
@@ -394,6 +398,9 @@ struct device_drv {
 
 	/* Does this device generate work itself and not require stratum work generation? */
 	bool genwork;
+
+	/* Does the device roll nonce2 itself from the pool's coinbase? */
+	bool rollnonce2;
 };
 
 extern struct device_drv *copy_drv(struct device_drv*);
@@ -472,6 +479,8 @@ struct cgpu_info {
 	char *device_path;
 	void *device_data;
 	void *dup_data;
+	void *nonce_pipe;
+	void *job_slots;
 	char *unique_id;
 #ifdef USE_USBUTILS
 	struct cg_usb_device *usbdev;
@@ -545,6 +554,9 @@ struct cgpu_info {
 	double last_share_diff;
 	time_t last_device_valid_work;
 	uint32_t last_nonce;
+	uint64_t best_diff;		// Updated with atomic_max64
+	struct history *history;
+	struct chip_stats *chip_stats;	// Per chip telemetry tables
 
 	time_t device_last_well;
 	time_t device_last_not_well;
@@ -579,13 +591,38 @@ struct cgpu_info {
 
 extern bool add_cgpu(struct cgpu_info*);
 
+/* Bounded lock free multi producer multi consumer queue. Each cell's seq says
+ * whose turn it is: pos for the producer claiming enqueue position pos, pos + 1
+ * for the consumer claiming dequeue position pos. */
+#define TQ_SIZE 4096
+
+struct tq_cell {
+	size_t			seq;
+	void			*data;
+};
+
 struct thread_q {
-	struct list_head	q;
+	struct tq_cell		*cells;
+	size_t			mask;
+	size_t			enqueue_pos __attribute__((aligned(64)));
+	size_t			dequeue_pos __attribute__((aligned(64)));
+
+	/* Bumped on every push and freeze/thaw, idle consumers wait on it */
+	int			wake_seq __attribute__((aligned(64)));
+	int			waiters;
 
 	bool frozen;
 
+	/* The getq also uses these directly as the staged work lock */
 	pthread_mutex_t		mutex;
 	pthread_cond_t		cond;
+
+	/* Stats */
+	uint64_t		pushes;
+	uint64_t		pops;
+	int			depth_max;
+	uint64_t		waits;
+	uint64_t		wait_us;
 };
 
 struct thr_info {
@@ -748,45 +785,63 @@ extern void __quit(int status, bool clean);
 extern void _quit(int status);
 
 /*
- * Set this to non-zero to enable lock tracking
- * Use the API lockstats command to see the locking status on stderr
- *  i.e. in your log file if you 2> log.log - but not on the screen
- * API lockstats is privilidged but will always exist and will return
- *	success if LOCK_TRACKING is enabled and warning if disabled
- * In production code, this should never be enabled since it will slow down all locking
- * So, e.g. use it to track down a deadlock - after a reproducable deadlock occurs
- * ... Of course if the API code itself deadlocks, it wont help :)
+ * Allocation profiling, see allocprof.c
+ * With --alloc-stats or the API allocstats command, cgmalloc, cgcalloc and
+ * cgrealloc record each allocation against their call site, and free() is
+ * wrapped so frees can be matched back to it. Off, it costs one test each.
  */
-#define LOCK_TRACKING 0
+extern bool opt_alloc_stats;
+extern void allocprof_add(void *ptr, size_t size, const char *file, const char *func, const int line);
+extern void allocprof_del(void *ptr);
 
-#if LOCK_TRACKING
-enum cglock_typ {
-	CGLOCK_MUTEX,
-	CGLOCK_RW,
-	CGLOCK_UNKNOWN
+static inline void cgfree(void *ptr)
+{
+	if (unlikely(opt_alloc_stats) && ptr)
+		allocprof_del(ptr);
+	free(ptr);
+}
+
+#define free(_ptr) cgfree(_ptr)
+
+/*
+ * Lock contention profiling, see lockprof.c
+ * Every lock is tried first and only if it's busy is the wait timed and
+ * recorded against the call site, along with how long it's then held, so
+ * uncontended locking costs no more than before. It can be turned off with
+ * --no-lock-stats or at runtime with the API lockstats command.
+ */
+enum lockprof_typ {
+	LOCKPROF_MUTEX,
+	LOCKPROF_WRLOCK,
+	LOCKPROF_RDLOCK
 };
 
-extern uint64_t api_getlock(void *lock, const char *file, const char *func, const int line);
-extern void api_gotlock(uint64_t id, void *lock, const char *file, const char *func, const int line);
-extern uint64_t api_trylock(void *lock, const char *file, const char *func, const int line);
-extern void api_didlock(uint64_t id, int ret, void *lock, const char *file, const char *func, const int line);
-extern void api_gunlock(void *lock, const char *file, const char *func, const int line);
-extern void api_initlock(void *lock, enum cglock_typ typ, const char *file, const char *func, const int line);
-
-#define GETLOCK(_lock, _file, _func, _line) uint64_t _id1 = api_getlock((void *)(_lock), _file, _func, _line)
-#define GOTLOCK(_lock, _file, _func, _line) api_gotlock(_id1, (void *)(_lock), _file, _func, _line)
-#define TRYLOCK(_lock, _file, _func, _line) uint64_t _id2 = api_trylock((void *)(_lock), _file, _func, _line)
-#define DIDLOCK(_ret, _lock, _file, _func, _line) api_didlock(_id2, _ret, (void *)(_lock), _file, _func, _line)
-#define GUNLOCK(_lock, _file, _func, _line) api_gunlock((void *)(_lock), _file, _func, _line)
-#define INITLOCK(_lock, _typ, _file, _func, _line) api_initlock((void *)(_lock), _typ, _file, _func, _line)
-#else
-#define GETLOCK(_lock, _file, _func, _line)
-#define GOTLOCK(_lock, _file, _func, _line)
-#define TRYLOCK(_lock, _file, _func, _line)
-#define DIDLOCK(_ret, _lock, _file, _func, _line)
-#define GUNLOCK(_lock, _file, _func, _line)
-#define INITLOCK(_typ, _lock, _file, _func, _line)
-#endif
+extern bool opt_lock_stats;
+extern __thread int lockprof_held;
+extern void lockprof_got(void *lock, enum lockprof_typ typ, const char *file, const char *func,
+			 const int line, const struct timeval *tv_start);
+extern void lockprof_tryfail(void *lock, enum lockprof_typ typ, const char *file, const char *func,
+			     const int line);
+extern void lockprof_release(void *lock);
+
+/* Start timing the wait for a lock the trylock found busy */
+static inline bool lockprof_start(struct timeval *tv_start)
+{
+	if (!opt_lock_stats)
+		return false;
+	cgtime(tv_start);
+	return true;
+}
+
+#define LOCKPROF_TRY(_ret, _lock, _typ, _file, _func, _line) do { \
+		if (unlikely(_ret) && opt_lock_stats) \
+			lockprof_tryfail((void *)(_lock), _typ, _file, _func, _line); \
+	} while (0)
+
+#define LOCKPROF_UNLOCK(_lock) do { \
+		if (unlikely(lockprof_held)) \
+			lockprof_release((void *)(_lock)); \
+	} while (0)
 
 #define mutex_lock(_lock) _mutex_lock(_lock, __FILE__, __func__, __LINE__)
 #define mutex_unlock_noyield(_lock) _mutex_unlock_noyield(_lock, __FILE__, __func__, __LINE__)
@@ -817,17 +872,23 @@ extern void api_initlock(void *lock, enum cglock_typ typ, const char *file, cons
 
 static inline void _mutex_lock(pthread_mutex_t *lock, const char *file, const char *func, const int line)
 {
-	GETLOCK(lock, file, func, line);
+	struct timeval tv_start;
+	bool prof;
+
+	if (likely(!pthread_mutex_trylock(lock)))
+		return;
+	prof = lockprof_start(&tv_start);
 	if (unlikely(pthread_mutex_lock(lock)))
 		quitfrom(1, file, func, line, "WTF MUTEX ERROR ON LOCK! errno=%d", errno);
-	GOTLOCK(lock, file, func, line);
+	if (prof)
+		lockprof_got(lock, LOCKPROF_MUTEX, file, func, line, &tv_start);
 }
 
 static inline void _mutex_unlock_noyield(pthread_mutex_t *lock, const char *file, const char *func, const int line)
 {
+	LOCKPROF_UNLOCK(lock);
 	if (unlikely(pthread_mutex_unlock(lock)))
 		quitfrom(1, file, func, line, "WTF MUTEX ERROR ON UNLOCK! errno=%d", errno);
-	GUNLOCK(lock, file, func, line);
 }
 
 static inline void _mutex_unlock(pthread_mutex_t *lock, const char *file, const char *func, const int line)
@@ -838,41 +899,53 @@ static inline void _mutex_unlock(pthread_mutex_t *lock, const char *file, const
 
 static inline int _mutex_trylock(pthread_mutex_t *lock, __maybe_unused const char *file, __maybe_unused const char *func, __maybe_unused const int line)
 {
-	TRYLOCK(lock, file, func, line);
 	int ret = pthread_mutex_trylock(lock);
-	DIDLOCK(ret, lock, file, func, line);
+
+	LOCKPROF_TRY(ret, lock, LOCKPROF_MUTEX, file, func, line);
 	return ret;
 }
 
 static inline void _wr_lock(pthread_rwlock_t *lock, const char *file, const char *func, const int line)
 {
-	GETLOCK(lock, file, func, line);
+	struct timeval tv_start;
+	bool prof;
+
+	if (likely(!pthread_rwlock_trywrlock(lock)))
+		return;
+	prof = lockprof_start(&tv_start);
 	if (unlikely(pthread_rwlock_wrlock(lock)))
 		quitfrom(1, file, func, line, "WTF WRLOCK ERROR ON LOCK! errno=%d", errno);
-	GOTLOCK(lock, file, func, line);
+	if (prof)
+		lockprof_got(lock, LOCKPROF_WRLOCK, file, func, line, &tv_start);
 }
 
 static inline int _wr_trylock(pthread_rwlock_t *lock, __maybe_unused const char *file, __maybe_unused const char *func, __maybe_unused const int line)
 {
-	TRYLOCK(lock, file, func, line);
 	int ret = pthread_rwlock_trywrlock(lock);
-	DIDLOCK(ret, lock, file, func, line);
+
+	LOCKPROF_TRY(ret, lock, LOCKPROF_WRLOCK, file, func, line);
 	return ret;
 }
 
 static inline void _rd_lock(pthread_rwlock_t *lock, const char *file, const char *func, const int line)
 {
-	GETLOCK(lock, file, func, line);
+	struct timeval tv_start;
+	bool prof;
+
+	if (likely(!pthread_rwlock_tryrdlock(lock)))
+		return;
+	prof = lockprof_start(&tv_start);
 	if (unlikely(pthread_rwlock_rdlock(lock)))
 		quitfrom(1, file, func, line, "WTF RDLOCK ERROR ON LOCK! errno=%d", errno);
-	GOTLOCK(lock, file, func, line);
+	if (prof)
+		lockprof_got(lock, LOCKPROF_RDLOCK, file, func, line, &tv_start);
 }
 
 static inline void _rw_unlock(pthread_rwlock_t *lock, const char *file, const char *func, const int line)
 {
+	LOCKPROF_UNLOCK(lock);
 	if (unlikely(pthread_rwlock_unlock(lock)))
 		quitfrom(1, file, func, line, "WTF RWLOCK ERROR ON UNLOCK! errno=%d", errno);
-	GUNLOCK(lock, file, func, line);
 }
 
 static inline void _rd_unlock_noyield(pthread_rwlock_t *lock, const char *file, const char *func, const int line)
@@ -901,7 +974,6 @@ static inline void _mutex_init(pthread_mutex_t *lock, const char *file, const ch
 {
 	if (unlikely(pthread_mutex_init(lock, NULL)))
 		quitfrom(1, file, func, line, "Failed to pthread_mutex_init errno=%d", errno);
-	INITLOCK(lock, CGLOCK_MUTEX, file, func, line);
 }
 
 static inline void mutex_destroy(pthread_mutex_t *lock)
@@ -915,7 +987,6 @@ static inline void _rwlock_init(pthread_rwlock_t *lock, const char *file, const
 {
 	if (unlikely(pthread_rwlock_init(lock, NULL)))
 		quitfrom(1, file, func, line, "Failed to pthread_rwlock_init errno=%d", errno);
-	INITLOCK(lock, CGLOCK_RW, file, func, line);
 }
 
 static inline void rwlock_destroy(pthread_rwlock_t *lock)
@@ -1009,6 +1080,20 @@ static inline void _cg_wunlock(cglock_t *lock, const char *file, const char *fun
 	_mutex_unlock(&lock->mutex, file, func, line);
 }
 
+/* Raise *dest to val if val is larger, without a lock. Returns true if this
+ * call raised it. */
+static inline bool atomic_max64(uint64_t *dest, uint64_t val)
+{
+	uint64_t cur = __atomic_load_n(dest, __ATOMIC_RELAXED);
+
+	while (cur < val) {
+		if (__atomic_compare_exchange_n(dest, &cur, val, true,
+						__ATOMIC_RELAXED, __ATOMIC_RELAXED))
+			return true;
+	}
+	return false;
+}
+
 struct pool;
 
 #define API_LISTEN_ADDR "0.0.0.0"
@@ -1041,6 +1126,8 @@ extern char *opt_api_host;
 extern bool opt_api_listen;
 extern bool opt_api_network;
 extern bool opt_delaynet;
+#define NONCE_PIPE_THREADS 2
+extern int opt_nonce_threads;
 extern time_t last_getwork;
 extern bool opt_restart;
 #ifdef USE_ICARUS
@@ -1172,10 +1259,6 @@ extern bool opt_bfl_noncerange;
 #endif
 extern int swork_id;
 
-#if LOCK_TRACKING
-extern pthread_mutex_t lockstat_lock;
-#endif
-
 extern pthread_rwlock_t netacc_lock;
 
 extern const uint32_t sha256_init_state[];
@@ -1184,6 +1267,10 @@ extern json_t *json_web_config(const char *url);
 extern json_t *json_rpc_call(CURL *curl, const char *url, const char *userpass,
 			     const char *rpc_req, bool, bool, int *,
 			     struct pool *pool, bool);
+struct gbt_txns;
+extern json_t *json_rpc_call_gbt(CURL *curl, const char *url, const char *userpass,
+				 const char *rpc_req, bool, bool, int *,
+				 struct pool *pool, struct gbt_txns *txns);
 struct pool;
 extern struct pool *opt_btcd;
 #endif
@@ -1218,7 +1305,17 @@ extern pthread_cond_t restart_cond;
 extern void clear_stratum_shares(struct pool *pool);
 extern void clear_pool_work(struct pool *pool);
 extern void set_target(unsigned char *dest_target, double diff);
+struct stratum_job;
+extern struct stratum_job *stratum_job_get(struct pool *pool);
+extern void stratum_job_put(struct stratum_job *job);
+extern const char *stratum_job_id(const struct stratum_job *job);
+extern void __stratum_job_clear(struct pool *pool);
+extern void stratum_job_work(struct stratum_job *job, struct work *work, uint64_t nonce2);
+extern struct work *stratum_job_new_work(struct stratum_job *job, uint64_t nonce2);
+extern json_t *stratum_job_notify(struct stratum_job *job, const char *job_id);
 #if defined (USE_AVALON2) || defined (USE_AVALON4) || defined (USE_AVALON7) || defined (USE_AVALON8) || defined (USE_AVALON_MINER) || defined (USE_HASHRATIO)
+bool submit_job_nonce(struct thr_info *thr, struct stratum_job *job, struct pool *real_pool,
+		      uint32_t nonce2, uint32_t nonce, uint32_t ntime);
 bool submit_nonce2_nonce(struct thr_info *thr, struct pool *pool, struct pool *real_pool,
 			 uint32_t nonce2, uint32_t nonce, uint32_t ntime);
 #endif
@@ -1270,6 +1367,9 @@ extern struct pool **pools;
 extern struct strategies strategies[];
 extern enum pool_strategy pool_strategy;
 extern int opt_rotate_period;
+extern int opt_standby_pools;
+extern bool pool_standby(struct pool *pool);
+extern double pool_weight_target(struct pool *pool);
 extern double rolling1, rolling5, rolling15;
 extern double total_rolling;
 extern double total_mhashes_done;
@@ -1277,6 +1377,8 @@ extern unsigned int new_blocks;
 extern unsigned int found_blocks;
 extern int64_t total_accepted, total_rejected, total_diff1;
 extern int64_t total_getworks, total_stale, total_discarded;
+extern uint64_t failovers;
+extern double failover_gap_last, failover_gap_max, failover_gap_total;
 extern double total_diff_accepted, total_diff_rejected, total_diff_stale;
 extern unsigned int local_work;
 extern unsigned int total_go, total_ro;
@@ -1286,6 +1388,7 @@ extern uint64_t global_hashrate;
 extern char current_hash[68];
 extern double current_diff;
 extern uint64_t best_diff;
+extern void best_share_str(char *buf, size_t siz);
 extern struct timeval block_timeval;
 extern char *workpadding;
 
@@ -1344,6 +1447,10 @@ struct pool {
 	int quota_used;
 	int works;
 
+	/* Weighted balance credit and diff1 at last accounting */
+	double sw_current;
+	int64_t sw_diff1;
+
 	double diff_accepted;
 	double diff_rejected;
 	double diff_stale;
@@ -1401,6 +1508,7 @@ struct pool {
 	double last_share_diff;
 	uint64_t best_diff;
 	uint64_t bad_work;
+	struct history *history;
 
 	struct cgminer_stats cgminer_stats;
 	struct cgminer_pool_stats cgminer_pool_stats;
@@ -1428,6 +1536,7 @@ struct pool {
 	bool stratum_init;
 	bool stratum_notify;
 	struct stratum_work swork;
+	struct stratum_job *sjob; /* Snapshot of swork, protected by data_lock */
 	pthread_t stratum_sthread;
 	pthread_t stratum_rthread;
 	pthread_mutex_t stratum_lock;
@@ -1451,7 +1560,7 @@ struct pool {
 	int height;
 
 	bool gbt_solo;
-	unsigned char merklebin[16 * 32];
+	unsigned char *merklebin;
 	int transactions;
 	char *txn_data;
 	unsigned char scriptsig_base[100];
@@ -1460,6 +1569,16 @@ struct pool {
 	CURL *gbt_curl;
 	bool gbt_curl_inuse;
 
+	/* Background template refresh */
+	pthread_t gbt_refresh_thread;
+	cgsem_t gbt_refresh_sem;
+	bool gbt_refresh_started;
+	bool gbt_refresh_wanted; /* Accessed with atomics */
+	uint64_t gbt_refreshes;
+	double gbt_refresh_last; /* ms */
+	double gbt_refresh_max;
+	double gbt_refresh_total;
+
 	/* Shared by both stratum & GBT */
 	size_t n1_len;
 	unsigned char *coinbase;
@@ -1492,43 +1611,62 @@ struct pool {
 #define GETWORK_MODE_GBT 'G'
 #define GETWORK_MODE_SOLO 'C'
 
+/* Everything touched to queue, look up, hash and verify work comes first and
+ * fits in WORK_HOT_BYTES, so those paths only pull in the first few cache
+ * lines. Timestamps, strings and bookkeeping follow in the cold part. */
+#define WORK_HOT_BYTES 320
+
 struct work {
 	unsigned char	data[128];
 	unsigned char	midstate[32];
-	unsigned char   midstate1[32];
-	unsigned char   midstate2[32];
-	unsigned char   midstate3[32];
 	unsigned char	target[32];
 	unsigned char	hash[32];
 
-	uint16_t        micro_job_id;
-	bool		direct_vmask;
-	unsigned char	base_bv[4];
+	uint32_t	id;
+	uint32_t	nonce; /* For devices that hash sole work */
 
 	/* This is the diff the device is currently aiming for and must be
 	 * the minimum of work_difficulty & drv->max_diff */
 	double		device_diff;
+	struct pool	*pool;
+	unsigned int	work_block;
+
+	// Allow devices to identify work if multiple sub-devices
+	int		subid;
+	UT_hash_handle	hh;
+
+	uint16_t        micro_job_id;
+	bool		direct_vmask;
+	bool		stratum;
+	bool		gbt;
+	bool		stale;
+	bool		mandatory;
+	bool		block;
+
+	/* Cold from here on */
+
+	/* Version rolled midstates, only set when pool->vmask is, use
+	 * work_midstate() to get at them */
+	unsigned char	vmidstate[3][32];
+	unsigned char	base_bv[4];
+
+	/* This is the diff work we're aiming to submit and should match the
+	 * work->target binary */
+	double		work_difficulty;
 	uint64_t	share_diff;
 
 	int		rolls;
 	int		drv_rolllimit; /* How much the driver can roll ntime */
-	uint32_t	nonce; /* For devices that hash sole work */
 
 	struct thr_info	*thr;
 	int		thr_id;
-	struct pool	*pool;
-	struct timeval	tv_staged;
 
 	bool		mined;
 	bool		clone;
 	bool		cloned;
 	int		rolltime;
 	bool		longpoll;
-	bool		stale;
-	bool		mandatory;
-	bool		block;
 
-	bool		stratum;
 	char 		*job_id;
 	uint64_t	nonce2;
 	size_t		nonce2_len;
@@ -1536,25 +1674,15 @@ struct work {
 	double		sdiff;
 	char		*nonce1;
 
-	bool		gbt;
 	char		*coinbase;
 	int		gbt_txns;
 
-	unsigned int	work_block;
-	uint32_t	id;
-	UT_hash_handle	hh;
-
-	/* This is the diff work we're aiming to submit and should match the
-	 * work->target binary */
-	double		work_difficulty;
-
-	// Allow devices to identify work if multiple sub-devices
-	int		subid;
 	// Allow devices to flag work for their own purposes
 	bool		devflag;
 	// Allow devices to timestamp work for their own purposes
 	struct timeval	tv_stamp;
 
+	struct timeval	tv_staged;
 	struct timeval	tv_getwork;
 	struct timeval	tv_getwork_reply;
 	struct timeval	tv_cloned;
@@ -1566,6 +1694,12 @@ struct work {
 #endif
 };
 
+/* Midstate n of work, 0 being work->midstate and 1-3 the version rolled ones */
+static inline unsigned char *work_midstate(struct work *work, int n)
+{
+	return n ? work->vmidstate[n - 1] : work->midstate;
+}
+
 // enable grossly global stratum work stats
 #define STRATUM_WORK_TIMING 1
 
@@ -1675,6 +1809,7 @@ extern bool tq_push(struct thread_q *tq, void *data);
 extern void *tq_pop(struct thread_q *tq);
 extern void tq_freeze(struct thread_q *tq);
 extern void tq_thaw(struct thread_q *tq);
+extern void tq_stats(struct thread_q *tq, int *depth, int *depth_max, uint64_t *waits, double *wait_avg);
 extern bool successful_connect;
 extern void adl(void);
 extern void app_restart(void);
@@ -1766,4 +1901,33 @@ extern void dupalloc(struct cgpu_info *cgpu, int timelimit);
 extern void dupcounters(struct cgpu_info *cgpu, uint64_t *checked, uint64_t *dups);
 extern bool isdupnonce(struct cgpu_info *cgpu, struct work *work, uint32_t nonce);
 
+/* Transactions of a getblocktemplate, txids and wtxids already hex decoded
+ * and byte swapped ready for merkle hashing */
+struct gbt_txns {
+	int count;
+	int size;
+	unsigned char *txids;	/* count * 32 */
+	unsigned char *hashes;	/* count * 32, only valid if have_hashes */
+	bool have_hashes;
+	char *data;		/* hex of all transactions concatenated */
+	size_t data_len;
+};
+
+extern bool gbt_stream_txns(char *buf, struct gbt_txns *txns);
+extern bool gbt_json_txns(json_t *transaction_arr, struct gbt_txns *txns);
+extern void gbt_txns_free(struct gbt_txns *txns);
+
+#ifdef CGMINER_BENCH
+/* Entry points into static parts of cgminer.c and api.c for cgminer-bench */
+extern void bench_init_core(void);
+extern struct work *bench_make_work(void);
+extern void bench_calc_midstate(struct pool *pool, struct work *work);
+extern void bench_gen_stratum_work(struct pool *pool, struct work *work);
+extern bool bench_hash_push(struct work *work);
+extern struct work *bench_hash_pop(bool blocking);
+extern void bench_gbt_merkle(struct pool *pool, struct gbt_txns *txns, unsigned char *merkle_root,
+			     unsigned char *witness_root, int threads);
+extern const char *api_bench_reply(const char *cmd, char *param, bool isjson);
+#endif
+
 #endif /* __MINER_H__ */
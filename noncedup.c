@@ -65,7 +65,7 @@ bool isdupnonce(struct cgpu_info *cgpu, struct work *work, uint32_t nonce)
 	if (!dup)
 		return false;
 
-	cgtime(&now);
+	cgtime_coarse(&now);
 	dup->checked++;
 	K_WLOCK(dup->nfree_list);
 	item = dup->nonce_list->tail;
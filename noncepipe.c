@@ -0,0 +1,340 @@
+/*
+ * Copyright 2026 Andrew Smith
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 3 of the License, or (at your option)
+ * any later version.  See COPYING for more details.
+ */
+
+/* Common nonce processing for queued work drivers.
+ *
+ * The driver's I/O thread pushes each result it reads: it is decoded, its job
+ * id is mapped to a copy of the work it belongs to while the driver's job
+ * table is still as the device saw it, and the pair goes on a ring shared by
+ * all devices. A small pool of threads takes batches off the ring and does the
+ * sha256d verification and share submission, keeping per chip tallies of good,
+ * bad and stale results in the device's "NP" chip stats table. If there are no threads, or the ring is full, the
+ * result is verified on the pushing thread instead, so nothing is dropped. */
+
+#include "miner.h"
+#include "noncepipe.h"
+#include "chipstat.h"
+
+#define NONCE_PIPE_RING 4096
+#define NONCE_PIPE_BATCH 32
+
+int opt_nonce_threads = NONCE_PIPE_THREADS;
+
+struct nonce_pipe {
+	struct cgpu_info *cgpu;
+	struct nonce_pipe_ops ops;
+	struct chip_stats *chip_stats;
+	pthread_mutex_t lock;		// Everything below
+	struct np_chip_stats total;
+	int64_t hashes;
+	uint64_t inline_verified;
+	int pending;
+};
+
+enum np_chip_col {
+	NP_CHIP_GOOD,
+	NP_CHIP_BAD,
+	NP_CHIP_STALE,
+	NP_CHIP_COLS
+};
+
+static const struct chip_stat_col np_chip_cols[NP_CHIP_COLS] = {
+	{ "Good", CHIP_COUNTER },
+	{ "Bad", CHIP_COUNTER },
+	{ "Stale", CHIP_COUNTER },
+};
+
+struct np_entry {
+	struct nonce_pipe *np;
+	struct work *work;
+	struct np_result res;
+};
+
+static pthread_mutex_t np_qlock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t np_qcond = PTHREAD_COND_INITIALIZER;
+static struct np_entry *np_ring;
+static int np_head, np_count, np_count_max;
+static int np_threads;
+
+static void np_stale(struct nonce_pipe *np, const struct np_result *res)
+{
+	struct cgpu_info *cgpu = np->cgpu;
+
+	applog(LOG_DEBUG, "%s%d: chip %d job %u stale nonce 0x%08x",
+	       cgpu->drv->name, cgpu->device_id, res->chip,
+	       res->job_id, res->nonce);
+	chip_stat_inc(np->chip_stats, NP_CHIP_STALE, 0, res->chip);
+	mutex_lock(&np->lock);
+	np->total.stale++;
+	mutex_unlock(&np->lock);
+}
+
+/* work is NULL if the lookup missed but the driver can try to recover it */
+static void np_verify(struct nonce_pipe *np, struct work *work, const struct np_result *res)
+{
+	struct cgpu_info *cgpu = np->cgpu;
+	struct work *alt;
+	bool ok;
+
+	/* The job may have moved on between the result and its lookup */
+	if (np->ops.recover && (!work || !test_nonce(work, res->nonce))) {
+		alt = np->ops.recover(cgpu, res);
+		if (alt) {
+			if (work)
+				free_work(work);
+			work = alt;
+		}
+	}
+
+	if (!work) {
+		np_stale(np, res);
+		mutex_lock(&np->lock);
+		np->pending--;
+		mutex_unlock(&np->lock);
+		return;
+	}
+
+	ok = submit_nonce(cgpu->thr[0], work, res->nonce);
+	if (!ok) {
+		applog(LOG_INFO, "%s%d: chip %d core %d job %u invalid nonce 0x%08x",
+		       cgpu->drv->name, cgpu->device_id, res->chip, res->core,
+		       res->job_id, res->nonce);
+	}
+
+	chip_stat_inc(np->chip_stats, ok ? NP_CHIP_GOOD : NP_CHIP_BAD, 0, res->chip);
+	mutex_lock(&np->lock);
+	if (ok) {
+		np->total.good++;
+		np->hashes += (int64_t)(work->device_diff * 4294967296.0);
+	} else
+		np->total.bad++;
+	np->pending--;
+	mutex_unlock(&np->lock);
+
+	free_work(work);
+}
+
+static void *nonce_pipe_thread(void __maybe_unused *userdata)
+{
+	struct np_entry batch[NONCE_PIPE_BATCH];
+	int i, n;
+
+	pthread_detach(pthread_self());
+
+	RenameThread("NoncePipe");
+
+	while (42) {
+		mutex_lock(&np_qlock);
+		while (!np_count)
+			pthread_cond_wait(&np_qcond, &np_qlock);
+		for (n = 0; n < NONCE_PIPE_BATCH && np_count; n++) {
+			batch[n] = np_ring[np_head];
+			np_head = (np_head + 1) % NONCE_PIPE_RING;
+			np_count--;
+		}
+		mutex_unlock(&np_qlock);
+
+		for (i = 0; i < n; i++)
+			np_verify(batch[i].np, batch[i].work, &batch[i].res);
+	}
+
+	return NULL;
+}
+
+static void np_start_threads(void)
+{
+	pthread_t pth;
+	int i;
+
+	mutex_lock(&np_qlock);
+	if (np_ring || opt_nonce_threads < 1)
+		goto out_unlock;
+
+	np_ring = cgcalloc(NONCE_PIPE_RING, sizeof(*np_ring));
+	for (i = 0; i < opt_nonce_threads; i++) {
+		if (unlikely(pthread_create(&pth, NULL, nonce_pipe_thread, NULL))) {
+			applog(LOG_ERR, "Failed to create nonce pipe thread %d", i);
+			break;
+		}
+	}
+	np_threads = i;
+	applog(LOG_DEBUG, "Started %d nonce pipe threads", np_threads);
+out_unlock:
+	mutex_unlock(&np_qlock);
+}
+
+/* Set up the pipeline for cgpu with its results spread over chips counters.
+ * ops may be NULL for a driver that only pushes decoded results with work
+ * ids from the standard queued work table. */
+void nonce_pipe_alloc(struct cgpu_info *cgpu, const struct nonce_pipe_ops *ops, int chips)
+{
+	struct nonce_pipe *np;
+
+	np = cgcalloc(1, sizeof(*np));
+	np->cgpu = cgpu;
+	if (ops)
+		np->ops = *ops;
+	np->chip_stats = chip_stats_new(cgpu, "NP", 1, chips, np_chip_cols, NP_CHIP_COLS);
+	mutex_init(&np->lock);
+
+	np_start_threads();
+
+	cgpu->nonce_pipe = np;
+}
+
+/* Wait for any of cgpu's results still on the ring before freeing it */
+void nonce_pipe_free(struct cgpu_info *cgpu)
+{
+	struct nonce_pipe *np = cgpu->nonce_pipe;
+	int pending;
+
+	if (!np)
+		return;
+
+	while (42) {
+		mutex_lock(&np->lock);
+		pending = np->pending;
+		mutex_unlock(&np->lock);
+		if (!pending)
+			break;
+		cgsleep_ms(1);
+	}
+
+	cgpu->nonce_pipe = NULL;
+	mutex_destroy(&np->lock);
+	free(np);
+}
+
+/* Queue work, which the pipeline now owns, for verification against
+ * res->nonce. For drivers that already have a copy of the work in hand.
+ * work may only be NULL if the driver has a recover op. */
+void nonce_pipe_push_work(struct cgpu_info *cgpu, const struct np_result *res, struct work *work)
+{
+	struct nonce_pipe *np = cgpu->nonce_pipe;
+	struct np_entry *ent;
+
+	mutex_lock(&np->lock);
+	np->pending++;
+	mutex_unlock(&np->lock);
+
+	if (np_threads) {
+		mutex_lock(&np_qlock);
+		if (np_count < NONCE_PIPE_RING) {
+			ent = &np_ring[(np_head + np_count) % NONCE_PIPE_RING];
+			ent->np = np;
+			ent->work = work;
+			ent->res = *res;
+			if (++np_count > np_count_max)
+				np_count_max = np_count;
+			pthread_cond_signal(&np_qcond);
+			mutex_unlock(&np_qlock);
+			return;
+		}
+		mutex_unlock(&np_qlock);
+	}
+
+	mutex_lock(&np->lock);
+	np->inline_verified++;
+	mutex_unlock(&np->lock);
+	np_verify(np, work, res);
+}
+
+/* Map res to its work and queue it. Returns false if the job was stale.
+ * A miss is still queued if the driver can try to recover it. */
+bool nonce_pipe_push(struct cgpu_info *cgpu, const struct np_result *res)
+{
+	struct nonce_pipe *np = cgpu->nonce_pipe;
+	struct work *work;
+
+	if (np->ops.lookup)
+		work = np->ops.lookup(cgpu, res);
+	else
+		work = clone_queued_work_byid(cgpu, res->job_id);
+
+	if (!work && !np->ops.recover) {
+		np_stale(np, res);
+		return false;
+	}
+
+	nonce_pipe_push_work(cgpu, res, work);
+	return true;
+}
+
+/* Decode raw with the driver's decode op then push it. Returns false if it
+ * wasn't a nonce or was stale. */
+bool nonce_pipe_push_raw(struct cgpu_info *cgpu, const uint8_t *raw)
+{
+	struct nonce_pipe *np = cgpu->nonce_pipe;
+	struct np_result res;
+
+	memset(&res, 0, sizeof(res));
+	if (!np->ops.decode(cgpu, raw, &res))
+		return false;
+	return nonce_pipe_push(cgpu, &res);
+}
+
+/* Hashes done, going by the difficulty of the valid nonces verified since
+ * the last call, for drivers that report hashrate from nonces */
+int64_t nonce_pipe_hashes(struct cgpu_info *cgpu)
+{
+	struct nonce_pipe *np = cgpu->nonce_pipe;
+	int64_t hashes;
+
+	mutex_lock(&np->lock);
+	hashes = np->hashes;
+	np->hashes = 0;
+	mutex_unlock(&np->lock);
+
+	return hashes;
+}
+
+void nonce_pipe_chip_stats(struct cgpu_info *cgpu, int chip, struct np_chip_stats *stats)
+{
+	struct nonce_pipe *np = cgpu->nonce_pipe;
+
+	if (!np || chip < 0 || chip >= np->chip_stats->chips) {
+		memset(stats, 0, sizeof(*stats));
+		return;
+	}
+
+	stats->good = chip_stat_get(np->chip_stats, NP_CHIP_GOOD, 0, chip);
+	stats->bad = chip_stat_get(np->chip_stats, NP_CHIP_BAD, 0, chip);
+	stats->stale = chip_stat_get(np->chip_stats, NP_CHIP_STALE, 0, chip);
+}
+
+/* Totals, the per chip tallies are in 'chips' */
+struct api_data *nonce_pipe_api_stats(struct cgpu_info *cgpu, struct api_data *root)
+{
+	struct nonce_pipe *np = cgpu->nonce_pipe;
+	struct np_chip_stats total;
+	uint64_t inline_verified;
+	int pending, qmax;
+
+	if (!np)
+		return root;
+
+	mutex_lock(&np->lock);
+	total = np->total;
+	inline_verified = np->inline_verified;
+	pending = np->pending;
+	mutex_unlock(&np->lock);
+
+	mutex_lock(&np_qlock);
+	qmax = np_count_max;
+	mutex_unlock(&np_qlock);
+
+	root = api_add_uint64(root, "NP Good", &total.good, true);
+	root = api_add_uint64(root, "NP Bad", &total.bad, true);
+	root = api_add_uint64(root, "NP Stale", &total.stale, true);
+	root = api_add_uint64(root, "NP Inline", &inline_verified, true);
+	root = api_add_int(root, "NP Pending", &pending, true);
+	root = api_add_int(root, "NP Queue Max", &qmax, true);
+
+	return root;
+}
@@ -0,0 +1,56 @@
+/*
+ * Copyright 2026 Andrew Smith
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 3 of the License, or (at your option)
+ * any later version.  See COPYING for more details.
+ */
+
+#ifndef NONCEPIPE_H
+#define NONCEPIPE_H
+
+#include "miner.h"
+
+/* Size of the raw result buffer nonce_pipe_push_raw() hands to decode */
+#define NONCE_PIPE_RAW_SIZE 32
+
+/* One result reported by a device, in device terms */
+struct np_result {
+	int chip;		// 0 .. chips-1, anything else is counted as chip 0
+	int core;
+	uint32_t job_id;
+	uint32_t nonce;
+};
+
+struct nonce_pipe_ops {
+	/* Decode a raw device reply into res. Return false if it isn't a
+	 * nonce (e.g. an empty result slot) so it's silently dropped. */
+	bool (*decode)(struct cgpu_info *cgpu, const uint8_t *raw, struct np_result *res);
+	/* Return a copy of the work res->job_id refers to for the pipeline to
+	 * own, or NULL if the job is gone. Called on the pushing thread so it
+	 * sees the job table as it was when the result was read. Defaults to
+	 * clone_queued_work_byid(cgpu, res->job_id). */
+	struct work *(*lookup)(struct cgpu_info *cgpu, const struct np_result *res);
+	/* Optional, called on a worker thread when lookup missed or the nonce
+	 * is invalid for the work it returned. Return a copy of other work the
+	 * nonce is valid for, e.g. from job_slots_recover(), or NULL. */
+	struct work *(*recover)(struct cgpu_info *cgpu, const struct np_result *res);
+};
+
+struct np_chip_stats {
+	uint64_t good;
+	uint64_t bad;
+	uint64_t stale;
+};
+
+extern void nonce_pipe_alloc(struct cgpu_info *cgpu, const struct nonce_pipe_ops *ops, int chips);
+extern void nonce_pipe_free(struct cgpu_info *cgpu);
+extern bool nonce_pipe_push(struct cgpu_info *cgpu, const struct np_result *res);
+extern bool nonce_pipe_push_raw(struct cgpu_info *cgpu, const uint8_t *raw);
+extern void nonce_pipe_push_work(struct cgpu_info *cgpu, const struct np_result *res, struct work *work);
+extern int64_t nonce_pipe_hashes(struct cgpu_info *cgpu);
+extern void nonce_pipe_chip_stats(struct cgpu_info *cgpu, int chip, struct np_chip_stats *stats);
+extern struct api_data *nonce_pipe_api_stats(struct cgpu_info *cgpu, struct api_data *root);
+
+#endif
@@ -46,7 +46,7 @@ struct spi_ctx *spi_init(struct spi_config *config)
 		return NULL;
 	}
 
-	ctx = malloc(sizeof(*ctx));
+	ctx = calloc(1, sizeof(*ctx));
 	assert(ctx != NULL);
 
 	ctx->fd = fd;
@@ -57,38 +57,149 @@ struct spi_ctx *spi_init(struct spi_config *config)
 	return ctx;
 }
 
+struct spi_ctx *spi_init_sim(struct spi_config *config, spi_sim_fn sim,
+			     void *sim_data)
+{
+	struct spi_ctx *ctx;
+
+	if (config == NULL)
+		return NULL;
+
+	ctx = calloc(1, sizeof(*ctx));
+	assert(ctx != NULL);
+
+	ctx->fd = -1;
+	ctx->config = *config;
+	ctx->sim = sim ? sim : spi_loopback_sim;
+	ctx->sim_data = sim_data;
+	applog(LOG_WARNING, "SPI %d.%d: simulated, speed=%u",
+	       config->bus, config->cs_line, config->speed);
+	return ctx;
+}
+
+bool spi_loopback_sim(struct spi_ctx __maybe_unused *ctx,
+		      struct spi_ioc_transfer *xfrs, int count)
+{
+	int i;
+
+	for (i = 0; i < count; i++) {
+		uint8_t *tx = (uint8_t *)(unsigned long)xfrs[i].tx_buf;
+		uint8_t *rx = (uint8_t *)(unsigned long)xfrs[i].rx_buf;
+
+		if (rx == NULL)
+			continue;
+		if (tx != NULL)
+			memmove(rx, tx, xfrs[i].len);
+		else
+			memset(rx, 0, xfrs[i].len);
+	}
+	return true;
+}
+
 extern void spi_exit(struct spi_ctx *ctx)
 {
 	if (NULL == ctx)
 		return;
 
-	close(ctx->fd);
+	if (ctx->fd >= 0)
+		close(ctx->fd);
 	free(ctx);
 }
 
+static bool spi_message(struct spi_ctx *ctx, struct spi_ioc_transfer *xfrs,
+			int count)
+{
+	int i, ret;
+
+	ctx->messages++;
+	ctx->transfers += count;
+	for (i = 0; i < count; i++)
+		ctx->bytes += xfrs[i].len;
+
+	if (ctx->sim != NULL)
+		return ctx->sim(ctx, xfrs, count);
+
+	ret = ioctl(ctx->fd, SPI_IOC_MESSAGE(count), xfrs);
+	if (ret < 1)
+		applog(LOG_ERR, "SPI: ioctl error on SPI device: %d", ret);
+
+	return ret > 0;
+}
+
+static void spi_fill_xfr(struct spi_ctx *ctx, struct spi_ioc_transfer *xfr,
+			 uint8_t *txbuf, uint8_t *rxbuf, int len,
+			 bool cs_change, uint16_t delay_usecs)
+{
+	if (rxbuf != NULL)
+		memset(rxbuf, 0xff, len);
+
+	memset(xfr, 0, sizeof(*xfr));
+	xfr->tx_buf = (unsigned long)txbuf;
+	xfr->rx_buf = (unsigned long)rxbuf;
+	xfr->len = len;
+	xfr->speed_hz = ctx->config.speed;
+	xfr->delay_usecs = delay_usecs;
+	xfr->bits_per_word = ctx->config.bits;
+	xfr->cs_change = cs_change;
+}
+
 extern bool spi_transfer(struct spi_ctx *ctx, uint8_t *txbuf,
 			 uint8_t *rxbuf, int len)
 {
 	struct spi_ioc_transfer xfr;
-	int ret;
 
-	if (rxbuf != NULL)
-		memset(rxbuf, 0xff, len);
+	spi_fill_xfr(ctx, &xfr, txbuf, rxbuf, len, false, ctx->config.delay);
+	return spi_message(ctx, &xfr, 1);
+}
 
-	ret = len;
+void spi_batch_init(struct spi_batch *batch, struct spi_ctx *ctx)
+{
+	memset(batch, 0, sizeof(*batch));
+	batch->ctx = ctx;
+}
 
-	xfr.tx_buf = (unsigned long)txbuf;
-	xfr.rx_buf = (unsigned long)rxbuf;
-	xfr.len = len;
-	xfr.speed_hz = ctx->config.speed;
-	xfr.delay_usecs = ctx->config.delay;
-	xfr.bits_per_word = ctx->config.bits;
-	xfr.cs_change = 0;
-	xfr.pad = 0;
+void spi_batch_add(struct spi_batch *batch, uint8_t *txbuf, uint8_t *rxbuf,
+		   int len, bool cs_change, uint16_t delay_usecs)
+{
+	if (batch->count >= batch->size) {
+		batch->size = batch->size ? batch->size * 2 : 16;
+		batch->xfrs = realloc(batch->xfrs,
+				      batch->size * sizeof(*batch->xfrs));
+		assert(batch->xfrs != NULL);
+	}
+	spi_fill_xfr(batch->ctx, &batch->xfrs[batch->count++], txbuf, rxbuf,
+		     len, cs_change, delay_usecs);
+}
 
-	ret = ioctl(ctx->fd, SPI_IOC_MESSAGE(1), &xfr);
-	if (ret < 1)
-		applog(LOG_ERR, "SPI: ioctl error on SPI device: %d", ret);
+/* Split the queue into messages at segment boundaries so that none exceeds
+ * what spidev will accept. The last segment of each message leaves chip
+ * select deasserted as any single transfer would. */
+bool spi_batch_submit(struct spi_batch *batch)
+{
+	struct spi_ioc_transfer *xfrs = batch->xfrs;
+	bool ret = true;
+	int start, i;
+
+	for (start = 0; start < batch->count; start = i) {
+		unsigned int len = xfrs[start].len;
+
+		for (i = start + 1; i < batch->count; i++) {
+			if (i - start >= SPI_BATCH_MAX_XFERS ||
+			    len + xfrs[i].len > SPI_BATCH_BUFSIZ)
+				break;
+			len += xfrs[i].len;
+		}
+		xfrs[i - 1].cs_change = 0;
+		if (!spi_message(batch->ctx, xfrs + start, i - start))
+			ret = false;
+	}
+	batch->count = 0;
+	return ret;
+}
 
-	return ret > 0;
+void spi_batch_free(struct spi_batch *batch)
+{
+	free(batch->xfrs);
+	batch->xfrs = NULL;
+	batch->count = batch->size = 0;
 }
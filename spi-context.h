@@ -32,17 +32,65 @@ static const struct spi_config default_spi_config = {
 	.delay		= DEFAULT_SPI_DELAY_USECS,
 };
 
+struct spi_ctx;
+
+/* Userspace stand-in for a SPI device, handed each message in place of the
+ * SPI_IOC_MESSAGE ioctl. It must fill every rx_buf and return false on
+ * failure. */
+typedef bool (*spi_sim_fn)(struct spi_ctx *ctx, struct spi_ioc_transfer *xfrs,
+			   int count);
+
 struct spi_ctx {
 	int fd;
 	struct spi_config config;
+	spi_sim_fn sim;
+	void *sim_data;
+	/* Usage counters, messages being ioctls on a real device */
+	uint64_t messages;
+	uint64_t transfers;
+	uint64_t bytes;
+};
+
+/* spidev rejects messages larger than its bufsiz module parameter, which
+ * defaults to a page, and SPI_IOC_MESSAGE can't encode many more transfers
+ * than this */
+#define SPI_BATCH_BUFSIZ		4096
+#define SPI_BATCH_MAX_XFERS		500
+
+/* A queue of transfers submitted with as few SPI_IOC_MESSAGE ioctls as
+ * possible. Each segment may deassert chip select after itself (cs_change)
+ * and delay before the next, so a batch of separate commands is electrically
+ * the same as sending them one at a time. */
+struct spi_batch {
+	struct spi_ctx *ctx;
+	struct spi_ioc_transfer *xfrs;
+	int count;
+	int size;
 };
 
 /* create SPI context with given configuration, returns NULL on failure */
 extern struct spi_ctx *spi_init(struct spi_config *config);
 /* close descriptor and free resources */
 extern void spi_exit(struct spi_ctx *ctx);
+/* create SPI context that sends everything to sim instead of a device, with
+ * spi_loopback_sim used if sim is NULL */
+extern struct spi_ctx *spi_init_sim(struct spi_config *config, spi_sim_fn sim,
+				    void *sim_data);
+/* simulator that wires MOSI to MISO so every byte sent is read back */
+extern bool spi_loopback_sim(struct spi_ctx *ctx, struct spi_ioc_transfer *xfrs,
+			     int count);
 /* process RX/TX transfer, ensure buffers are long enough */
 extern bool spi_transfer(struct spi_ctx *ctx, uint8_t *txbuf,
 			 uint8_t *rxbuf, int len);
 
+extern void spi_batch_init(struct spi_batch *batch, struct spi_ctx *ctx);
+/* queue a segment, either buffer may be NULL, buffers must stay valid until
+ * the batch is submitted */
+extern void spi_batch_add(struct spi_batch *batch, uint8_t *txbuf,
+			  uint8_t *rxbuf, int len, bool cs_change,
+			  uint16_t delay_usecs);
+/* send and empty the queue, returns false if any message failed */
+extern bool spi_batch_submit(struct spi_batch *batch);
+extern void spi_batch_free(struct spi_batch *batch);
+
 #endif /* SPI_CONTEXT_H */
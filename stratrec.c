@@ -0,0 +1,935 @@
+/*
+ * Copyright 2026 Andrew Smith
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 3 of the License, or (at your option)
+ * any later version.  See COPYING for more details.
+ */
+
+/* Stratum capture and replay.
+ *
+ * With --stratum-record every line sent to or received from a stratum pool,
+ * and every connect and close, is appended to a binary capture with its time
+ * in microseconds since the capture started. The file is an 8 byte header,
+ * "CGSR" then a little endian version, followed by records of a 16 byte
+ * little endian header, time (8), pool number (2), type (1), unused (1) and
+ * length (4), then length bytes of the line without its \n.
+ *
+ * --stratum-replay loads a capture and serves the first pool in it as a
+ * stratum pool on 127.0.0.1, one connection at a time. Each connection plays
+ * the next connection of the capture: the notifications the pool sent are
+ * sent again at their recorded times after the authorise response, divided
+ * by --stratum-replay-speed, and the connection is closed where the pool
+ * closed it. Requests are answered with the recorded response to the same
+ * method, with the client's id and after the recorded response time.
+ * Submitted shares are checked against the replayed jobs and difficulty and
+ * answered with the recorded submit response times. client.reconnect is not
+ * replayed since it would point at the real pool. */
+
+#include "config.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "miner.h"
+#include "sha2.h"
+#include "uint256.h"
+#include "stratrec.h"
+
+char *opt_stratum_record;
+char *opt_stratum_replay;
+int opt_stratum_replay_port = STRATREC_REPLAY_PORT;
+float opt_stratum_replay_speed = 1.0;
+bool stratrec_active;
+
+#define STRATREC_MAGIC "CGSR"
+#define STRATREC_VERSION 1
+#define STRATREC_FILEHDR 8
+#define STRATREC_HDR 16
+
+static pthread_mutex_t stratrec_lock = PTHREAD_MUTEX_INITIALIZER;
+static FILE *stratrec_file;
+static struct timeval stratrec_start, stratrec_flushed;
+
+static void put_le(unsigned char *p, uint64_t val, int len)
+{
+	int i;
+
+	for (i = 0; i < len; i++)
+		p[i] = val >> (8 * i);
+}
+
+static uint64_t get_le(const unsigned char *p, int len)
+{
+	uint64_t val = 0;
+	int i;
+
+	for (i = len - 1; i >= 0; i--)
+		val = (val << 8) | p[i];
+	return val;
+}
+
+void stratrec_open(void)
+{
+	unsigned char hdr[STRATREC_FILEHDR];
+
+	if (!opt_stratum_record)
+		return;
+
+	stratrec_file = fopen(opt_stratum_record, "wb");
+	if (!stratrec_file)
+		quit(1, "Failed to open stratum record file %s (%s)",
+		     opt_stratum_record, strerror(errno));
+
+	memcpy(hdr, STRATREC_MAGIC, 4);
+	put_le(hdr + 4, STRATREC_VERSION, 4);
+	if (fwrite(hdr, sizeof(hdr), 1, stratrec_file) != 1)
+		quit(1, "Failed to write stratum record file %s", opt_stratum_record);
+
+	cgtime(&stratrec_start);
+	copy_time(&stratrec_flushed, &stratrec_start);
+	stratrec_active = true;
+	applog(LOG_NOTICE, "Recording stratum traffic to %s", opt_stratum_record);
+}
+
+void stratrec_close(void)
+{
+	mutex_lock(&stratrec_lock);
+	stratrec_active = false;
+	if (stratrec_file) {
+		fclose(stratrec_file);
+		stratrec_file = NULL;
+	}
+	mutex_unlock(&stratrec_lock);
+}
+
+/* Called with the pool's stratum_lock held when sending, so the time is taken
+ * under stratrec_lock to keep the file in order. Flushes at most once a
+ * second. */
+void _stratrec_add(struct pool *pool, enum stratrec_type type, const char *line, size_t len)
+{
+	unsigned char hdr[STRATREC_HDR];
+	struct timeval now;
+
+	mutex_lock(&stratrec_lock);
+	if (unlikely(!stratrec_file))
+		goto out;
+
+	cgtime(&now);
+	put_le(hdr, (uint64_t)us_tdiff(&now, &stratrec_start), 8);
+	put_le(hdr + 8, pool->pool_no, 2);
+	hdr[10] = type;
+	hdr[11] = 0;
+	put_le(hdr + 12, len, 4);
+
+	if (fwrite(hdr, sizeof(hdr), 1, stratrec_file) != 1 ||
+	    (len && fwrite(line, len, 1, stratrec_file) != 1)) {
+		applog(LOG_ERR, "Failed to write stratum record file %s, stopped recording",
+		       opt_stratum_record);
+		fclose(stratrec_file);
+		stratrec_file = NULL;
+		stratrec_active = false;
+		goto out;
+	}
+
+	if (ms_tdiff(&now, &stratrec_flushed) >= 1000) {
+		fflush(stratrec_file);
+		copy_time(&stratrec_flushed, &now);
+	}
+out:
+	mutex_unlock(&stratrec_lock);
+}
+
+/* A line the pool sent that is replayed at its time from the start of the
+ * connection's clock */
+struct replay_line {
+	int64_t us;
+	char *line;
+};
+
+/* One connection of the capture */
+struct replay_seg {
+	struct replay_line *lines;
+	int count;
+	bool closed;		// The pool side closed at close_us
+	int64_t close_us;
+	int64_t base;		// When the authorise response was sent
+	bool authorized;
+};
+
+/* The responses to one request method, used in order then the last reused */
+struct replay_resp {
+	char *method;
+	char **lines;
+	int64_t *delay;
+	int count;
+	int used;
+};
+
+/* A replayed job to check submits against */
+struct replay_job {
+	struct replay_job *next;
+	char *job_id;
+	char *prev_hash;
+	char *coinbase1;
+	char *coinbase2;
+	unsigned char (*merkle)[32];
+	int merkles;
+	char version[9];
+	char nbit[9];
+	double diff;
+	struct replay_share *shares;
+};
+
+struct replay_share {
+	UT_hash_handle hh;
+	char key[1];
+};
+
+#define REPLAY_JOBS 64
+
+static struct replay_seg *replay_segs;
+static int replay_seg_count, replay_seg_next;
+static struct replay_resp *replay_resps;
+static int replay_resp_count;
+static int64_t *replay_submit_delay;
+static int replay_submit_count, replay_submit_used;
+static int replay_pool_no = -1;
+
+static SOCKETTYPE replay_listen = INVSOCK;
+static struct thr_info replay_thr;
+
+/* State of the current replay connection */
+static struct {
+	SOCKETTYPE sock;
+	char buf[RBUFSIZE];
+	size_t buflen;
+	struct replay_seg *seg;
+	int next;
+	bool clock_started;
+	struct timeval clock;
+	struct replay_pending *pending;
+	char *nonce1;
+	int n2size;
+	double diff;
+	struct replay_job *jobs;
+	int accepted, rejected;
+} rconn = { .sock = INVSOCK };
+
+/* A response waiting for its recorded response time */
+struct replay_pending {
+	struct replay_pending *next;
+	struct timeval due;
+	char *line;
+	bool authorize;		// Starts the connection's clock
+};
+
+static struct replay_resp *replay_resp_get(const char *method, bool add)
+{
+	struct replay_resp *resp;
+	int i;
+
+	for (i = 0; i < replay_resp_count; i++) {
+		if (!strcmp(replay_resps[i].method, method))
+			return &replay_resps[i];
+	}
+	if (!add)
+		return NULL;
+
+	replay_resps = cgrealloc(replay_resps, sizeof(*replay_resps) * (replay_resp_count + 1));
+	resp = &replay_resps[replay_resp_count++];
+	memset(resp, 0, sizeof(*resp));
+	resp->method = strdup(method);
+	return resp;
+}
+
+/* A request sent in the capture that hasn't had its response yet */
+struct replay_req {
+	json_int_t id;
+	char *method;
+	int64_t us;
+};
+
+static void replay_add_response(struct replay_req *req, const char *line, int64_t us)
+{
+	struct replay_resp *resp;
+	int64_t delay = us - req->us;
+
+	if (delay < 0)
+		delay = 0;
+	if (!strcmp(req->method, "mining.submit")) {
+		replay_submit_delay = cgrealloc(replay_submit_delay,
+						sizeof(int64_t) * (replay_submit_count + 1));
+		replay_submit_delay[replay_submit_count++] = delay;
+		return;
+	}
+
+	resp = replay_resp_get(req->method, true);
+	resp->lines = cgrealloc(resp->lines, sizeof(char *) * (resp->count + 1));
+	resp->delay = cgrealloc(resp->delay, sizeof(int64_t) * (resp->count + 1));
+	resp->lines[resp->count] = strdup(line);
+	resp->delay[resp->count++] = delay;
+}
+
+static struct replay_seg *replay_new_seg(void)
+{
+	struct replay_seg *seg;
+
+	replay_segs = cgrealloc(replay_segs, sizeof(*replay_segs) * (replay_seg_count + 1));
+	seg = &replay_segs[replay_seg_count++];
+	memset(seg, 0, sizeof(*seg));
+	return seg;
+}
+
+/* Sort the capture of the replayed pool into connections of timed lines and
+ * responses by method */
+static void replay_load(void)
+{
+	struct replay_req *reqs = NULL;
+	int nreqs = 0, lines = 0, i;
+	int64_t us;
+	struct replay_seg *seg = NULL;
+	unsigned char *data, *ptr, *end;
+	json_error_t err;
+	json_t *val, *id, *method;
+	FILE *fp;
+	long size;
+	char *line;
+	size_t len;
+	int type, pool_no;
+
+	fp = fopen(opt_stratum_replay, "rb");
+	if (!fp)
+		quit(1, "Failed to open stratum replay file %s (%s)", opt_stratum_replay, strerror(errno));
+	fseek(fp, 0, SEEK_END);
+	size = ftell(fp);
+	fseek(fp, 0, SEEK_SET);
+	data = cgmalloc(size + 1);
+	if (size < STRATREC_FILEHDR || fread(data, size, 1, fp) != 1 ||
+	    memcmp(data, STRATREC_MAGIC, 4) || get_le(data + 4, 4) != STRATREC_VERSION)
+		quit(1, "Stratum replay file %s is not a version %d capture", opt_stratum_replay,
+		     STRATREC_VERSION);
+	fclose(fp);
+
+	end = data + size;
+	for (ptr = data + STRATREC_FILEHDR; ptr + STRATREC_HDR <= end; ptr += STRATREC_HDR + len) {
+		us = get_le(ptr, 8);
+		pool_no = get_le(ptr + 8, 2);
+		type = ptr[10];
+		len = get_le(ptr + 12, 4);
+		if (ptr + STRATREC_HDR + len > end) {
+			applog(LOG_WARNING, "Stratum replay file %s is truncated", opt_stratum_replay);
+			break;
+		}
+		if (replay_pool_no < 0)
+			replay_pool_no = pool_no;
+		if (pool_no != replay_pool_no)
+			continue;
+
+		if (type == STRATREC_CONNECT) {
+			seg = replay_new_seg();
+			seg->base = us;
+			continue;
+		}
+		if (!seg) {
+			seg = replay_new_seg();
+			seg->base = us;
+		}
+		if (type == STRATREC_CLOSE) {
+			seg->closed = true;
+			seg->close_us = us;
+			seg = NULL;
+			continue;
+		}
+		if (type != STRATREC_SENT && type != STRATREC_RECV)
+			continue;
+
+		line = cgmalloc(len + 1);
+		memcpy(line, ptr + STRATREC_HDR, len);
+		line[len] = '\0';
+		val = JSON_LOADS(line, &err);
+		if (!val)
+			goto next;
+		id = json_object_get(val, "id");
+		method = json_object_get(val, "method");
+
+		if (type == STRATREC_SENT) {
+			if (json_is_integer(id) && json_is_string(method)) {
+				reqs = cgrealloc(reqs, sizeof(*reqs) * (nreqs + 1));
+				reqs[nreqs].id = json_integer_value(id);
+				reqs[nreqs].method = strdup(json_string_value(method));
+				reqs[nreqs++].us = us;
+			}
+		} else if (json_is_string(method)) {
+			if (strcmp(json_string_value(method), "client.reconnect")) {
+				seg->lines = cgrealloc(seg->lines, sizeof(*seg->lines) * (seg->count + 1));
+				seg->lines[seg->count].us = us;
+				seg->lines[seg->count++].line = line;
+				line = NULL;
+				lines++;
+			}
+		} else if (json_is_integer(id)) {
+			for (i = nreqs - 1; i >= 0; i--) {
+				if (reqs[i].id != json_integer_value(id))
+					continue;
+				replay_add_response(&reqs[i], line, us);
+				if (!seg->authorized && !strcmp(reqs[i].method, "mining.authorize")) {
+					seg->authorized = true;
+					seg->base = us;
+				}
+				free(reqs[i].method);
+				reqs[i] = reqs[--nreqs];
+				break;
+			}
+		}
+		json_decref(val);
+next:
+		free(line);
+	}
+
+	/* Times are from the authorise response, which starts the
+	 * connection's clock, so anything the pool sent before it goes out at
+	 * once */
+	for (i = 0; i < replay_seg_count; i++) {
+		int j;
+
+		seg = &replay_segs[i];
+		for (j = 0; j < seg->count; j++) {
+			seg->lines[j].us -= seg->base;
+			if (seg->lines[j].us < 0)
+				seg->lines[j].us = 0;
+		}
+		seg->close_us -= seg->base;
+		if (seg->close_us < 0)
+			seg->close_us = 0;
+	}
+
+	for (i = 0; i < nreqs; i++)
+		free(reqs[i].method);
+	free(reqs);
+	free(data);
+
+	if (!replay_seg_count)
+		quit(1, "Stratum replay file %s has no stratum traffic", opt_stratum_replay);
+	applog(LOG_NOTICE, "Stratum replay loaded %d lines of pool %d in %d connections from %s",
+	       lines, replay_pool_no, replay_seg_count, opt_stratum_replay);
+}
+
+static int64_t replay_scale(int64_t us)
+{
+	if (opt_stratum_replay_speed <= 0)
+		return 0;
+	return us / opt_stratum_replay_speed;
+}
+
+static void replay_due(struct timeval *due, const struct timeval *from, int64_t us)
+{
+	us = replay_scale(us);
+	due->tv_sec = from->tv_sec + us / 1000000;
+	due->tv_usec = from->tv_usec + us % 1000000;
+	if (due->tv_usec >= 1000000) {
+		due->tv_sec++;
+		due->tv_usec -= 1000000;
+	}
+}
+
+static void replay_free_job(struct replay_job *job)
+{
+	struct replay_share *share, *tmp;
+
+	HASH_ITER(hh, job->shares, share, tmp) {
+		HASH_DEL(job->shares, share);
+		free(share);
+	}
+	free(job->job_id);
+	free(job->prev_hash);
+	free(job->coinbase1);
+	free(job->coinbase2);
+	free(job->merkle);
+	free(job);
+}
+
+static void replay_clear_jobs(void)
+{
+	struct replay_job *job;
+
+	while ((job = rconn.jobs)) {
+		rconn.jobs = job->next;
+		replay_free_job(job);
+	}
+}
+
+static void replay_close(void)
+{
+	struct replay_pending *pend;
+
+	if (rconn.sock == INVSOCK)
+		return;
+
+	CLOSESOCKET(rconn.sock);
+	rconn.sock = INVSOCK;
+	while ((pend = rconn.pending)) {
+		rconn.pending = pend->next;
+		free(pend->line);
+		free(pend);
+	}
+	replay_clear_jobs();
+	free(rconn.nonce1);
+	rconn.nonce1 = NULL;
+	applog(LOG_NOTICE, "Stratum replay connection closed, %d shares accepted %d rejected",
+	       rconn.accepted, rconn.rejected);
+}
+
+static void replay_send(const char *line)
+{
+	size_t len = strlen(line);
+	char *s = cgmalloc(len + 2);
+	ssize_t sent, ssent = 0;
+
+	memcpy(s, line, len);
+	s[len++] = '\n';
+	while ((size_t)ssent < len) {
+#ifdef __APPLE__
+		sent = send(rconn.sock, s + ssent, len - ssent, SO_NOSIGPIPE);
+#elif WIN32
+		sent = send(rconn.sock, s + ssent, len - ssent, 0);
+#else
+		sent = send(rconn.sock, s + ssent, len - ssent, MSG_NOSIGNAL);
+#endif
+		if (sent <= 0) {
+			if (sent < 0 && sock_blocks())
+				continue;
+			applog(LOG_INFO, "Stratum replay send failed");
+			free(s);
+			replay_close();
+			return;
+		}
+		ssent += sent;
+	}
+	free(s);
+}
+
+/* Track what the client needs to hash with so its shares can be checked */
+static void replay_track(const char *line)
+{
+	struct replay_job *job, **prev;
+	json_t *val, *params, *arr;
+	const char *method;
+	json_error_t err;
+	int i, n;
+
+	val = JSON_LOADS(line, &err);
+	if (!val)
+		return;
+	method = json_string_value(json_object_get(val, "method"));
+	params = json_object_get(val, "params");
+	if (!method || !json_is_array(params))
+		goto out;
+
+	if (!strcmp(method, "mining.set_difficulty")) {
+		rconn.diff = json_number_value(json_array_get(params, 0));
+	} else if (!strcmp(method, "mining.set_extranonce")) {
+		if (json_is_string(json_array_get(params, 0))) {
+			free(rconn.nonce1);
+			rconn.nonce1 = strdup(json_string_value(json_array_get(params, 0)));
+			rconn.n2size = json_integer_value(json_array_get(params, 1));
+		}
+	} else if (!strcmp(method, "mining.notify") && json_array_size(params) >= 9) {
+		arr = json_array_get(params, 4);
+		for (i = 0; i < 8; i++) {
+			if (i != 4 && !json_is_string(json_array_get(params, i)))
+				goto out;
+		}
+		if (!json_is_array(arr))
+			goto out;
+
+		/* Like a pool, a clean job retires all the others */
+		if (json_is_true(json_array_get(params, 8)))
+			replay_clear_jobs();
+
+		job = cgcalloc(1, sizeof(*job));
+		job->job_id = strdup(json_string_value(json_array_get(params, 0)));
+		job->prev_hash = strdup(json_string_value(json_array_get(params, 1)));
+		job->coinbase1 = strdup(json_string_value(json_array_get(params, 2)));
+		job->coinbase2 = strdup(json_string_value(json_array_get(params, 3)));
+		snprintf(job->version, sizeof(job->version), "%s", json_string_value(json_array_get(params, 5)));
+		snprintf(job->nbit, sizeof(job->nbit), "%s", json_string_value(json_array_get(params, 6)));
+		job->merkles = json_array_size(arr);
+		job->merkle = cgcalloc(job->merkles + 1, 32);
+		for (i = 0; i < job->merkles; i++) {
+			const char *merkle = json_string_value(json_array_get(arr, i));
+
+			if (!merkle || !hex2bin(job->merkle[i], merkle, 32)) {
+				replay_free_job(job);
+				goto out;
+			}
+		}
+		job->diff = rconn.diff;
+		job->next = rconn.jobs;
+		rconn.jobs = job;
+
+		for (n = 1, prev = &rconn.jobs->next; *prev; n++) {
+			if (n < REPLAY_JOBS) {
+				prev = &(*prev)->next;
+				continue;
+			}
+			job = *prev;
+			*prev = job->next;
+			replay_free_job(job);
+		}
+	}
+out:
+	json_decref(val);
+}
+
+/* Returns NULL if the share is good or the stratum error */
+static const char *replay_check_share(json_t *params)
+{
+	const char *job_id, *nonce2, *ntime, *nonce, *vbits;
+	unsigned char data[80], swap[80], hash1[32], hash[32];
+	unsigned char merkle_root[32], merkle_sha[64], *coinbase;
+	char header[161], *cbhex, *key;
+	struct replay_share *share;
+	struct replay_job *job;
+	size_t cblen;
+	int i;
+
+	job_id = json_string_value(json_array_get(params, 1));
+	nonce2 = json_string_value(json_array_get(params, 2));
+	ntime = json_string_value(json_array_get(params, 3));
+	nonce = json_string_value(json_array_get(params, 4));
+	vbits = json_string_value(json_array_get(params, 5));
+	if (!job_id || !nonce2 || !ntime || !nonce)
+		return "[20,\"Invalid submit parameters\",null]";
+
+	for (job = rconn.jobs; job; job = job->next) {
+		if (!strcmp(job->job_id, job_id))
+			break;
+	}
+	if (!job)
+		return "[21,\"Job not found\",null]";
+	if (!rconn.nonce1 || (int)strlen(nonce2) != rconn.n2size * 2)
+		return "[20,\"Invalid extranonce2 size\",null]";
+	if (strlen(ntime) != 8 || strlen(nonce) != 8 || (vbits && strlen(vbits) != 8))
+		return "[20,\"Invalid ntime or nonce\",null]";
+
+	snprintf(header, sizeof(header), "%s%s%064d%s%s%s", job->version, job->prev_hash, 0,
+		 ntime, job->nbit, nonce);
+	if (strlen(header) != 160 || !hex2bin(data, header, 80))
+		return "[20,\"Invalid ntime or nonce\",null]";
+	if (vbits) {
+		unsigned char vb[4];
+
+		if (!hex2bin(vb, vbits, 4))
+			return "[20,\"Invalid version bits\",null]";
+		for (i = 0; i < 4; i++)
+			data[i] |= vb[i];
+	}
+
+	cblen = strlen(job->coinbase1) + strlen(rconn.nonce1) + strlen(nonce2) + strlen(job->coinbase2);
+	cbhex = cgmalloc(cblen + 1);
+	snprintf(cbhex, cblen + 1, "%s%s%s%s", job->coinbase1, rconn.nonce1, nonce2, job->coinbase2);
+	coinbase = cgmalloc(cblen / 2 + 1);
+	if (!hex2bin(coinbase, cbhex, cblen / 2)) {
+		free(coinbase);
+		free(cbhex);
+		return "[20,\"Invalid extranonce2\",null]";
+	}
+	free(cbhex);
+
+	/* The same merkle root and header as gen_stratum_work() */
+	sha256(coinbase, cblen / 2, hash1);
+	sha256(hash1, 32, merkle_root);
+	free(coinbase);
+	cg_memcpy(merkle_sha, merkle_root, 32);
+	for (i = 0; i < job->merkles; i++) {
+		cg_memcpy(merkle_sha + 32, job->merkle[i], 32);
+		sha256(merkle_sha, 64, hash1);
+		sha256(hash1, 32, merkle_root);
+		cg_memcpy(merkle_sha, merkle_root, 32);
+	}
+	flip32(merkle_root, merkle_sha);
+	cg_memcpy(data + 36, merkle_root, 32);
+
+	flip80(swap, data);
+	sha256(swap, 80, hash1);
+	sha256(hash1, 32, hash);
+
+	i = strlen(nonce2) + strlen(ntime) + strlen(nonce) + (vbits ? strlen(vbits) : 0);
+	key = alloca(i + 1);
+	snprintf(key, i + 1, "%s%s%s%s", nonce2, ntime, nonce, vbits ? vbits : "");
+	HASH_FIND_STR(job->shares, key, share);
+	if (share)
+		return "[22,\"Duplicate share\",null]";
+	share = cgcalloc(1, sizeof(*share) + i);
+	strcpy(share->key, key);
+	HASH_ADD_STR(job->shares, key, share);
+
+	if (le256_diff(hash) < job->diff)
+		return "[23,\"Low difficulty share\",null]";
+	return NULL;
+}
+
+static void replay_pend(char *line, int64_t delay, bool authorize)
+{
+	struct replay_pending *pend = cgcalloc(1, sizeof(*pend)), **prev;
+	struct timeval now;
+
+	cgtime(&now);
+	replay_due(&pend->due, &now, delay);
+	pend->line = line;
+	pend->authorize = authorize;
+	for (prev = &rconn.pending; *prev && !time_less(&pend->due, &(*prev)->due); prev = &(*prev)->next)
+		;
+	pend->next = *prev;
+	*prev = pend;
+}
+
+static void replay_request(const char *line)
+{
+	json_t *val, *id, *params, *resp = NULL;
+	struct replay_resp *rresp;
+	const char *method, *err;
+	int64_t delay = 0;
+	json_error_t jerr;
+	char *reply;
+
+	val = JSON_LOADS(line, &jerr);
+	if (!val)
+		return;
+	id = json_object_get(val, "id");
+	method = json_string_value(json_object_get(val, "method"));
+	/* Replies to the client.get_version etc. that were replayed */
+	if (!method || !id || json_is_null(id))
+		goto out;
+
+	params = json_object_get(val, "params");
+	if (!strcmp(method, "mining.submit")) {
+		err = json_is_array(params) ? replay_check_share(params) : "[20,\"Invalid submit parameters\",null]";
+		if (replay_submit_used < replay_submit_count)
+			delay = replay_submit_delay[replay_submit_used++];
+		if (err) {
+			rconn.rejected++;
+			applog(LOG_INFO, "Stratum replay rejected share %s", err);
+			resp = json_pack("{s:O,s:b,s:o}", "id", id, "result", false,
+					 "error", JSON_LOADS(err, &jerr));
+		} else {
+			rconn.accepted++;
+			resp = json_pack("{s:O,s:b,s:n}", "id", id, "result", true, "error");
+		}
+	} else if ((rresp = replay_resp_get(method, false))) {
+		int i = rresp->used < rresp->count ? rresp->used++ : rresp->count - 1;
+
+		resp = JSON_LOADS(rresp->lines[i], &jerr);
+		if (resp)
+			json_object_set(resp, "id", id);
+		delay = rresp->delay[i];
+	}
+	if (!resp) {
+		if (!strcmp(method, "mining.subscribe"))
+			resp = json_pack("{s:O,s:[[[ss]]si],s:n}", "id", id, "result",
+					 "mining.notify", "replay", "00000000", 4, "error");
+		else
+			resp = json_pack("{s:O,s:b,s:n}", "id", id, "result", true, "error");
+	}
+	if (!resp)
+		goto out;
+
+	if (!strcmp(method, "mining.subscribe")) {
+		json_t *res = json_object_get(resp, "result");
+
+		if (json_is_string(json_array_get(res, 1))) {
+			free(rconn.nonce1);
+			rconn.nonce1 = strdup(json_string_value(json_array_get(res, 1)));
+			rconn.n2size = json_integer_value(json_array_get(res, 2));
+		}
+	}
+
+	reply = json_dumps(resp, JSON_COMPACT);
+	json_decref(resp);
+	replay_pend(reply, delay, !strcmp(method, "mining.authorize"));
+out:
+	json_decref(val);
+}
+
+static void replay_accept(void)
+{
+	struct sockaddr_storage cli;
+	socklen_t clisiz = sizeof(cli);
+	SOCKETTYPE sock;
+
+	sock = accept(replay_listen, (struct sockaddr *)&cli, &clisiz);
+	if (SOCKETFAIL(sock))
+		return;
+
+	/* A client that reconnects has given up on the old connection */
+	replay_close();
+
+	memset(&rconn, 0, sizeof(rconn));
+	rconn.sock = sock;
+	if (replay_seg_next < replay_seg_count) {
+		rconn.seg = &replay_segs[replay_seg_next++];
+		applog(LOG_NOTICE, "Stratum replay connection %d of %d accepted",
+		       replay_seg_next, replay_seg_count);
+	} else
+		applog(LOG_NOTICE, "Stratum replay connection accepted, the capture has finished");
+}
+
+/* Handle every complete line the client has sent */
+static void replay_read(void)
+{
+	char *line, *eol;
+	ssize_t n;
+
+	n = recv(rconn.sock, rconn.buf + rconn.buflen, sizeof(rconn.buf) - rconn.buflen - 1, 0);
+	if (n <= 0) {
+		if (n < 0 && sock_blocks())
+			return;
+		replay_close();
+		return;
+	}
+	rconn.buflen += n;
+	rconn.buf[rconn.buflen] = '\0';
+
+	line = rconn.buf;
+	while ((eol = strchr(line, '\n'))) {
+		*eol = '\0';
+		if (*line)
+			replay_request(line);
+		if (rconn.sock == INVSOCK)
+			return;
+		line = eol + 1;
+	}
+	rconn.buflen -= line - rconn.buf;
+	memmove(rconn.buf, line, rconn.buflen + 1);
+
+	/* Nothing stratum sends is this long */
+	if (rconn.buflen >= sizeof(rconn.buf) - 1) {
+		applog(LOG_INFO, "Stratum replay line too long, discarded");
+		rconn.buflen = 0;
+	}
+}
+
+/* Send whatever is due and return the ms until something else is */
+static int replay_send_due(void)
+{
+	struct replay_pending *pend;
+	struct timeval now, due;
+	int ms = 1000;
+
+	cgtime(&now);
+	while ((pend = rconn.pending) && !time_more(&pend->due, &now)) {
+		rconn.pending = pend->next;
+		replay_send(pend->line);
+		if (pend->authorize && !rconn.clock_started) {
+			rconn.clock_started = true;
+			copy_time(&rconn.clock, &now);
+		}
+		free(pend->line);
+		free(pend);
+		if (rconn.sock == INVSOCK)
+			return ms;
+	}
+	if (pend)
+		ms = MIN(ms, ms_tdiff(&pend->due, &now) + 1);
+
+	if (!rconn.seg || !rconn.clock_started)
+		return ms;
+
+	while (rconn.next < rconn.seg->count) {
+		struct replay_line *rline = &rconn.seg->lines[rconn.next];
+
+		replay_due(&due, &rconn.clock, rline->us);
+		if (time_more(&due, &now)) {
+			ms = MIN(ms, ms_tdiff(&due, &now) + 1);
+			return ms;
+		}
+		replay_track(rline->line);
+		replay_send(rline->line);
+		rconn.next++;
+		if (rconn.sock == INVSOCK)
+			return ms;
+	}
+
+	if (rconn.seg->closed) {
+		replay_due(&due, &rconn.clock, rconn.seg->close_us);
+		if (time_more(&due, &now))
+			return MIN(ms, ms_tdiff(&due, &now) + 1);
+		applog(LOG_NOTICE, "Stratum replay closing the connection as the pool did");
+		replay_close();
+	}
+	return ms;
+}
+
+static void *replay_thread(void __maybe_unused *userdata)
+{
+	struct timeval timeout;
+	SOCKETTYPE maxsock;
+	fd_set rd;
+	int ms;
+
+	pthread_detach(pthread_self());
+	RenameThread("StratumReplay");
+
+	while (42) {
+		ms = rconn.sock != INVSOCK ? replay_send_due() : 1000;
+
+		FD_ZERO(&rd);
+		FD_SET(replay_listen, &rd);
+		maxsock = replay_listen;
+		if (rconn.sock != INVSOCK) {
+			FD_SET(rconn.sock, &rd);
+			if (rconn.sock > maxsock)
+				maxsock = rconn.sock;
+		}
+		timeout.tv_sec = ms / 1000;
+		timeout.tv_usec = (ms % 1000) * 1000;
+		if (select(maxsock + 1, &rd, NULL, NULL, &timeout) < 1)
+			continue;
+
+		if (rconn.sock != INVSOCK && FD_ISSET(rconn.sock, &rd))
+			replay_read();
+		if (FD_ISSET(replay_listen, &rd))
+			replay_accept();
+	}
+
+	return NULL;
+}
+
+/* Load the capture and listen before any pool is connected to, so a pool
+ * pointed at the replay port finds it */
+void stratum_replay_start(void)
+{
+	struct sockaddr_in addr;
+	int optval = 1;
+
+	if (!opt_stratum_replay)
+		return;
+
+	replay_load();
+
+	replay_listen = socket(AF_INET, SOCK_STREAM, 0);
+	if (replay_listen == INVSOCK)
+		quit(1, "Stratum replay socket failed (%s)", SOCKERRMSG);
+#ifndef WIN32
+	if (SOCKETFAIL(setsockopt(replay_listen, SOL_SOCKET, SO_REUSEADDR, (void *)(&optval), sizeof(optval))))
+		applog(LOG_DEBUG, "Stratum replay setsockopt SO_REUSEADDR failed (ignored): %s", SOCKERRMSG);
+#endif
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	addr.sin_port = htons(opt_stratum_replay_port);
+	if (SOCKETFAIL(bind(replay_listen, (struct sockaddr *)&addr, sizeof(addr))))
+		quit(1, "Stratum replay bind to port %d failed (%s)", opt_stratum_replay_port, SOCKERRMSG);
+	if (SOCKETFAIL(listen(replay_listen, 4)))
+		quit(1, "Stratum replay listen failed (%s)", SOCKERRMSG);
+
+	if (thr_info_create(&replay_thr, NULL, replay_thread, NULL))
+		quit(1, "Stratum replay thread create failed");
+
+	applog(LOG_NOTICE, "Stratum replay listening on stratum+tcp://127.0.0.1:%d at %.3gx speed",
+	       opt_stratum_replay_port, opt_stratum_replay_speed);
+}
@@ -0,0 +1,42 @@
+/*
+ * Copyright 2026 Andrew Smith
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 3 of the License, or (at your option)
+ * any later version.  See COPYING for more details.
+ */
+
+#ifndef STRATREC_H
+#define STRATREC_H
+
+#include "miner.h"
+
+#define STRATREC_REPLAY_PORT 3340
+
+/* What a record in a capture is, stored as one byte */
+enum stratrec_type {
+	STRATREC_SENT,		// A line sent to the pool
+	STRATREC_RECV,		// A line received from the pool
+	STRATREC_CONNECT,	// The socket connected
+	STRATREC_CLOSE,		// The socket was closed
+};
+
+extern char *opt_stratum_record;
+extern char *opt_stratum_replay;
+extern int opt_stratum_replay_port;
+extern float opt_stratum_replay_speed;
+extern bool stratrec_active;
+
+extern void stratrec_open(void);
+extern void stratrec_close(void);
+extern void _stratrec_add(struct pool *pool, enum stratrec_type type, const char *line, size_t len);
+extern void stratum_replay_start(void);
+
+static inline void stratrec_add(struct pool *pool, enum stratrec_type type, const char *line, size_t len)
+{
+	if (unlikely(stratrec_active))
+		_stratrec_add(pool, type, line, len);
+}
+
+#endif /* STRATREC_H */
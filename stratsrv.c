@@ -0,0 +1,1028 @@
+/*
+ * Copyright 2026 Andrew Smith
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 3 of the License, or (at your option)
+ * any later version.  See COPYING for more details.
+ */
+
+/* Stratum server.
+ *
+ * With --stratum-server cgminer passes the current pool's jobs on to other
+ * miners connected to it, so a farm of them needs only one pool connection.
+ * It runs as a device, SRV, on one thread with epoll, so the shares of its
+ * miners are counted, submitted and reported like any device's.
+ *
+ * The first STRATSRV_PREFIX bytes of the pool's nonce2 are split between the
+ * miners: each gets the pool's nonce1 plus its own prefix as its nonce1, and
+ * the rest of the pool's nonce2 as its own. Prefix 0 is cgminer's own work.
+ * Each job is turned into one mining.notify line when the pool sends it and
+ * that same line goes to every miner. Submitted shares are rebuilt from the
+ * pinned job snapshot and tested with the normal nonce testing code, then
+ * shares that meet the pool's difficulty are submitted to the pool.
+ *
+ * Each miner's difficulty is adjusted to give --stratum-server-rate shares a
+ * minute, no lower than --stratum-server-diff and no higher than the pool's.
+ * If the pool changes, or its nonce1 does, the miners are disconnected since
+ * their nonce1 no longer fits, and reconnect to get the new one.
+ *
+ * Miner sockets are moved above FD_SETSIZE, so the pool, API and other code
+ * still using select() keep the low descriptors however many miners connect. */
+
+#include "config.h"
+
+#include <errno.h>
+#include <math.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#ifdef __linux
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/resource.h>
+#include <sys/select.h>
+#include <fcntl.h>
+#include <arpa/inet.h>
+#include <netinet/tcp.h>
+#endif
+
+#include "miner.h"
+#include "stratsrv.h"
+
+int opt_stratum_server;
+int opt_stratum_server_diff = STRATSRV_DIFF;
+int opt_stratum_server_rate = STRATSRV_RATE;
+
+#ifdef __linux
+
+#define STRATSRV_CLIENTS ((1 << (STRATSRV_PREFIX * 8)) - 1)
+#define STRATSRV_JOBS 16
+#define STRATSRV_EVENTS 256
+#define STRATSRV_WAIT_MS 100
+#define STRATSRV_LINE 4096		// Longest line a miner may send
+#define STRATSRV_OUTMAX (256 * 1024)	// Most to buffer for a slow miner
+#define STRATSRV_SUBSCRIBE_SECS 60	// To subscribe and authorise
+#define STRATSRV_VARDIFF_SECS 30
+#define STRATSRV_NTIME_ROLL 7200
+#define STRATSRV_KEY 20			// nonce2, ntime, nonce, version
+#define STRATSRV_FD_SPARE 64		// Low descriptors always left for select()
+
+struct srv_share {
+	UT_hash_handle hh;
+	unsigned char key[STRATSRV_KEY];
+};
+
+/* A job as sent to the miners */
+struct srv_job {
+	struct srv_job *next;		// Older
+	uint32_t id;
+	struct stratum_job *sjob;
+	double diff;			// The pool's
+	uint32_t ntime;
+	char *notify;
+	size_t notify_len;
+	char *notify_clean;		// For a miner's first job
+	size_t clean_len;
+	struct srv_share *shares;
+};
+
+struct srv_client {
+	int fd;
+	int index;			// In info->clients
+	bool dead;
+	struct srv_client *next_dead;
+	char addr[INET_ADDRSTRLEN + 8];
+	time_t connected;
+
+	uint16_t prefix;		// 0 until subscribed
+	bool authorised;
+	uint32_t vmask;			// Version bits it may roll
+
+	double diff;
+	double old_diff;		// For jobs before diff_job
+	uint32_t diff_job;
+	struct timeval window;
+	double window_diff;
+	int window_shares;
+
+	uint64_t accepted, rejected;
+
+	char in[STRATSRV_LINE];
+	size_t inlen;
+	char *out;
+	size_t outlen, outsiz;
+};
+
+struct stratsrv_info {
+	int listen_fd;
+	int epoll_fd;
+	int event_fd;
+	bool listening;			// listen_fd is in the epoll set
+
+	struct srv_client **clients;
+	int count;
+	struct srv_client *dead;	// Closed, freed after the events
+	uint64_t prefix_used[(STRATSRV_CLIENTS + 64) / 64];
+	int next_prefix;
+
+	struct pool *pool;		// Being served
+	char *nonce1;
+	int n2size;
+	bool n2size_warned;
+	struct srv_job *jobs;
+	uint32_t job_id;
+
+	double hashes;
+	time_t last_check;
+	uint64_t connections, accepted, rejected, forwarded;
+};
+
+static int srv_event_fd = -1;
+static bool srv_notified;
+
+void _stratsrv_notify(struct pool *pool)
+{
+	uint64_t one = 1;
+	int fd;
+
+	fd = __atomic_load_n(&srv_event_fd, __ATOMIC_ACQUIRE);
+	if (fd < 0 || pool != current_pool())
+		return;
+	__atomic_store_n(&srv_notified, true, __ATOMIC_RELEASE);
+	if (write(fd, &one, sizeof(one)) < 0)
+		applog(LOG_DEBUG, "Stratum server notify failed (%s)", strerror(errno));
+}
+
+static int srv_prefix_get(struct stratsrv_info *info)
+{
+	int i, prefix;
+
+	for (i = 0; i < STRATSRV_CLIENTS; i++) {
+		prefix = info->next_prefix++;
+		if (info->next_prefix > STRATSRV_CLIENTS)
+			info->next_prefix = 1;
+		if (!(info->prefix_used[prefix / 64] & (1ULL << (prefix % 64)))) {
+			info->prefix_used[prefix / 64] |= 1ULL << (prefix % 64);
+			return prefix;
+		}
+	}
+	return 0;
+}
+
+static void srv_prefix_put(struct stratsrv_info *info, int prefix)
+{
+	if (prefix)
+		info->prefix_used[prefix / 64] &= ~(1ULL << (prefix % 64));
+}
+
+/* The fd is closed now and the client freed once the events that may still
+ * point to it are done with */
+static void srv_drop(struct stratsrv_info *info, struct srv_client *client, const char *why)
+{
+	struct srv_client *last;
+
+	if (client->dead)
+		return;
+
+	applog(LOG_INFO, "Stratum server %s %s, %"PRIu64" shares accepted %"PRIu64" rejected",
+	       client->addr, why, client->accepted, client->rejected);
+	client->dead = true;
+	close(client->fd);
+	srv_prefix_put(info, client->prefix);
+
+	last = info->clients[--info->count];
+	info->clients[client->index] = last;
+	last->index = client->index;
+
+	client->next_dead = info->dead;
+	info->dead = client;
+
+	/* Out of fds stopped accepting */
+	if (!info->listening) {
+		struct epoll_event ev = { .events = EPOLLIN, .data.ptr = &info->listen_fd };
+
+		if (!epoll_ctl(info->epoll_fd, EPOLL_CTL_ADD, info->listen_fd, &ev))
+			info->listening = true;
+	}
+}
+
+static void srv_reap(struct stratsrv_info *info)
+{
+	struct srv_client *client;
+
+	while ((client = info->dead)) {
+		info->dead = client->next_dead;
+		free(client->out);
+		free(client);
+	}
+}
+
+static void srv_flush(struct stratsrv_info *info, struct srv_client *client)
+{
+	struct epoll_event ev = { .events = EPOLLIN, .data.ptr = client };
+	ssize_t sent;
+
+	sent = send(client->fd, client->out, client->outlen, MSG_NOSIGNAL);
+	if (sent < 0) {
+		if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+			srv_drop(info, client, "send failed");
+		return;
+	}
+	client->outlen -= sent;
+	memmove(client->out, client->out + sent, client->outlen);
+	if (!client->outlen)
+		epoll_ctl(info->epoll_fd, EPOLL_CTL_MOD, client->fd, &ev);
+}
+
+/* Send directly unless the socket is backed up, then queue what's left */
+static void srv_send(struct stratsrv_info *info, struct srv_client *client, const char *buf, size_t len)
+{
+	struct epoll_event ev = { .events = EPOLLIN | EPOLLOUT, .data.ptr = client };
+	ssize_t sent;
+
+	if (client->dead)
+		return;
+
+	if (!client->outlen) {
+		sent = send(client->fd, buf, len, MSG_NOSIGNAL);
+		if (sent < 0) {
+			if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+				srv_drop(info, client, "send failed");
+				return;
+			}
+			sent = 0;
+		}
+		if ((size_t)sent == len)
+			return;
+		buf += sent;
+		len -= sent;
+		epoll_ctl(info->epoll_fd, EPOLL_CTL_MOD, client->fd, &ev);
+	}
+
+	if (client->outlen + len > STRATSRV_OUTMAX) {
+		srv_drop(info, client, "is not keeping up");
+		return;
+	}
+	if (client->outlen + len > client->outsiz) {
+		client->outsiz = client->outlen + len + 1024;
+		client->out = cgrealloc(client->out, client->outsiz);
+	}
+	cg_memcpy(client->out + client->outlen, buf, len);
+	client->outlen += len;
+}
+
+static void srv_reply(struct stratsrv_info *info, struct srv_client *client, json_t *id,
+		      const char *result, const char *error)
+{
+	char buf[1024], *idstr;
+	int len;
+
+	idstr = json_dumps(id, JSON_COMPACT | JSON_ENCODE_ANY);
+	len = snprintf(buf, sizeof(buf), "{\"id\":%s,\"result\":%s,\"error\":%s}\n",
+		       idstr ? idstr : "null", result, error ? error : "null");
+	free(idstr);
+	if (len < (int)sizeof(buf))
+		srv_send(info, client, buf, len);
+}
+
+/* Applies from job first_job, the next job if it's a change for vardiff or
+ * the one about to be sent */
+static void srv_set_diff(struct stratsrv_info *info, struct srv_client *client, double diff,
+			 uint32_t first_job)
+{
+	char buf[128];
+	int len;
+
+	if (client->diff_job <= info->job_id)
+		client->old_diff = client->diff;
+	client->diff = diff;
+	client->diff_job = first_job;
+
+	len = snprintf(buf, sizeof(buf),
+		       "{\"id\":null,\"method\":\"mining.set_difficulty\",\"params\":[%.8g]}\n", diff);
+	srv_send(info, client, buf, len);
+}
+
+/* The diff to give a miner, as wanted but within the limits */
+static double srv_diff(struct stratsrv_info *info, double diff)
+{
+	if (diff < opt_stratum_server_diff)
+		diff = opt_stratum_server_diff;
+	diff = floor(diff);
+	if (info->jobs && diff > info->jobs->diff)
+		diff = info->jobs->diff;
+	return diff;
+}
+
+static void srv_vardiff(struct stratsrv_info *info, struct srv_client *client, struct timeval *now)
+{
+	double secs = tdiff(now, &client->window), diff;
+
+	/* Retarget each window, or early once there's a minute of shares */
+	if (secs < 1 || (secs < STRATSRV_VARDIFF_SECS && client->window_shares < opt_stratum_server_rate))
+		return;
+
+	diff = client->window_diff / secs * 60 / opt_stratum_server_rate;
+	diff = srv_diff(info, MAX(diff, client->diff / 4));
+	copy_time(&client->window, now);
+	client->window_diff = 0;
+	client->window_shares = 0;
+
+	/* Not for noise */
+	if (diff * 1.5 > client->diff && diff < client->diff * 1.5)
+		return;
+	applog(LOG_DEBUG, "Stratum server %s diff %.0f -> %.0f", client->addr, client->diff, diff);
+	srv_set_diff(info, client, diff, info->job_id + 1);
+}
+
+static void srv_free_job(struct srv_job *job)
+{
+	struct srv_share *share, *tmp;
+
+	HASH_ITER(hh, job->shares, share, tmp) {
+		HASH_DEL(job->shares, share);
+		free(share);
+	}
+	stratum_job_put(job->sjob);
+	free(job->notify);
+	free(job->notify_clean);
+	free(job);
+}
+
+static void srv_clear_jobs(struct srv_job **jobs)
+{
+	struct srv_job *job;
+
+	while ((job = *jobs)) {
+		*jobs = job->next;
+		srv_free_job(job);
+	}
+}
+
+static char *srv_notify_line(json_t *params, size_t *len)
+{
+	json_t *val = json_pack("{s:n,s:s,s:O}", "id", "method", "mining.notify", "params", params);
+	char *line, *dump;
+
+	dump = json_dumps(val, JSON_COMPACT);
+	json_decref(val);
+	*len = strlen(dump) + 1;
+	line = cgmalloc(*len + 1);
+	sprintf(line, "%s\n", dump);
+	free(dump);
+	return line;
+}
+
+/* Takes the reference to sjob. work is nonce2 0 work for it. */
+static void srv_add_job(struct stratsrv_info *info, struct stratum_job *sjob, struct work *work)
+{
+	struct srv_job *job = cgcalloc(1, sizeof(*job)), **prev;
+	struct srv_client *client;
+	json_t *params;
+	char id[12];
+	bool clean;
+	int i, n;
+
+	job->id = ++info->job_id;
+	job->sjob = sjob;
+	job->diff = work->sdiff;
+	job->ntime = be32toh(*(uint32_t *)(work->data + 68));
+
+	snprintf(id, sizeof(id), "%x", job->id);
+	params = stratum_job_notify(sjob, id);
+	clean = json_is_true(json_array_get(params, 8));
+	job->notify = srv_notify_line(params, &job->notify_len);
+	json_array_set(params, 8, json_true());
+	job->notify_clean = srv_notify_line(params, &job->clean_len);
+	json_decref(params);
+
+	/* Shares for a job before a clean one can only be stale */
+	if (clean)
+		srv_clear_jobs(&info->jobs);
+	job->next = info->jobs;
+	info->jobs = job;
+	for (n = 1, prev = &job->next; *prev; n++) {
+		if (n < STRATSRV_JOBS) {
+			prev = &(*prev)->next;
+			continue;
+		}
+		srv_clear_jobs(prev);
+	}
+
+	/* Down since a failed send swaps the last miner into its place */
+	for (i = info->count - 1; i >= 0; i--) {
+		client = info->clients[i];
+		if (!client->authorised)
+			continue;
+		if (client->diff > job->diff)
+			srv_set_diff(info, client, job->diff, job->id);
+		srv_send(info, client, job->notify, job->notify_len);
+	}
+}
+
+/* The miners' nonce1 is the pool's, so they all go when it changes */
+static void srv_new_pool(struct stratsrv_info *info, struct pool *pool, struct work *work)
+{
+	int dropped = info->count;
+
+	while (info->count)
+		srv_drop(info, info->clients[0], "disconnected for a pool change");
+	srv_clear_jobs(&info->jobs);
+
+	info->pool = pool;
+	free(info->nonce1);
+	info->nonce1 = work ? strdup(work->nonce1) : NULL;
+	info->n2size = work ? (int)work->nonce2_len : 0;
+	info->n2size_warned = false;
+
+	if (dropped)
+		applog(LOG_NOTICE, "Stratum server disconnected %d miners for a new pool %d session",
+		       dropped, pool->pool_no);
+}
+
+/* Pick up a new job or pool */
+static void srv_update(struct stratsrv_info *info)
+{
+	struct pool *pool = current_pool();
+	struct stratum_job *sjob;
+	struct work *work;
+
+	sjob = stratum_job_get(pool);
+	if (!sjob) {
+		if (pool != info->pool)
+			srv_new_pool(info, pool, NULL);
+		return;
+	}
+	if (info->jobs && info->jobs->sjob == sjob) {
+		stratum_job_put(sjob);
+		return;
+	}
+
+	work = stratum_job_new_work(sjob, 0);
+	if (pool != info->pool || !info->nonce1 || strcmp(work->nonce1, info->nonce1) ||
+	    (int)work->nonce2_len != info->n2size)
+		srv_new_pool(info, pool, work);
+
+	/* The pool's nonce2 also has to fit in 8 bytes to be submitted */
+	if (info->n2size < STRATSRV_MIN_N2SIZE || info->n2size > 8) {
+		if (!info->n2size_warned) {
+			applog(LOG_WARNING, "Stratum server can't serve pool %d with nonce2 size %d, it needs %d to 8",
+			       pool->pool_no, info->n2size, STRATSRV_MIN_N2SIZE);
+			info->n2size_warned = true;
+		}
+		stratum_job_put(sjob);
+	} else
+		srv_add_job(info, sjob, work);
+	free_work(work);
+}
+
+static void srv_subscribe(struct stratsrv_info *info, struct srv_client *client, json_t *id)
+{
+	char result[256];
+
+	if (!info->jobs) {
+		srv_reply(info, client, id, "null", "[20,\"No work to serve yet\",null]");
+		return;
+	}
+	if (!client->prefix)
+		client->prefix = srv_prefix_get(info);
+	if (!client->prefix) {
+		srv_reply(info, client, id, "null", "[20,\"Server full\",null]");
+		srv_drop(info, client, "refused, the server is full");
+		return;
+	}
+
+	snprintf(result, sizeof(result),
+		 "[[[\"mining.set_difficulty\",\"%x\"],[\"mining.notify\",\"%x\"]],\"%s%02x%02x\",%d]",
+		 client->prefix, client->prefix, info->nonce1, client->prefix & 0xff,
+		 client->prefix >> 8, info->n2size - STRATSRV_PREFIX);
+	srv_reply(info, client, id, result, NULL);
+}
+
+static void srv_authorise(struct stratsrv_info *info, struct srv_client *client, json_t *id,
+			  json_t *params)
+{
+	const char *user = json_string_value(json_array_get(params, 0));
+
+	if (!client->prefix) {
+		srv_reply(info, client, id, "false", "[25,\"Not subscribed\",null]");
+		return;
+	}
+	srv_reply(info, client, id, "true", NULL);
+	if (client->authorised)
+		return;
+
+	applog(LOG_INFO, "Stratum server %s authorised as %s", client->addr, user ? user : "(none)");
+	client->authorised = true;
+	cgtime(&client->window);
+	if (!client->diff)
+		client->diff = srv_diff(info, opt_stratum_server_diff);
+	if (info->jobs) {
+		srv_set_diff(info, client, client->diff, info->jobs->id);
+		srv_send(info, client, info->jobs->notify_clean, info->jobs->clean_len);
+	}
+}
+
+/* Version rolling if the pool allows it, nothing else */
+static void srv_configure(struct stratsrv_info *info, struct srv_client *client, json_t *id,
+			  json_t *params)
+{
+	json_t *exts = json_array_get(params, 0), *opts = json_array_get(params, 1), *res;
+	const char *ext, *mask;
+	char *result, hex[9];
+	size_t i;
+
+	res = json_object();
+	for (i = 0; i < json_array_size(exts); i++) {
+		ext = json_string_value(json_array_get(exts, i));
+		if (!ext)
+			continue;
+		if (strcmp(ext, "version-rolling") || !info->pool || !info->pool->vmask) {
+			json_object_set_new(res, ext, json_false());
+			continue;
+		}
+		client->vmask = info->pool->vmask_003[0];
+		mask = json_string_value(json_object_get(opts, "version-rolling.mask"));
+		if (mask)
+			client->vmask &= strtoul(mask, NULL, 16);
+		snprintf(hex, sizeof(hex), "%08x", client->vmask);
+		json_object_set_new(res, ext, json_true());
+		json_object_set_new(res, "version-rolling.mask", json_string(hex));
+	}
+	result = json_dumps(res, JSON_COMPACT);
+	json_decref(res);
+	srv_reply(info, client, id, result, NULL);
+	free(result);
+}
+
+static bool srv_hex32(const char *hex, unsigned char *bin)
+{
+	return hex && strlen(hex) == 8 && hex2bin(bin, hex, 4);
+}
+
+/* Returns NULL if the share is good or the stratum error */
+static const char *srv_check_share(struct thr_info *thr, struct stratsrv_info *info,
+				   struct srv_client *client, json_t *params)
+{
+	const char *job_hex, *nonce2_hex, *ntime_hex, *vbits_hex;
+	unsigned char key[STRATSRV_KEY] = {0};
+	uint32_t job_id, ntime, nonce, bits, version;
+	struct srv_share *share;
+	struct srv_job *job;
+	struct work *work;
+	uint64_t nonce2;
+	double required, diff;
+	int n2size;
+	char *end;
+
+	if (!client->authorised)
+		return "[24,\"Unauthorized worker\",null]";
+
+	job_hex = json_string_value(json_array_get(params, 1));
+	nonce2_hex = json_string_value(json_array_get(params, 2));
+	ntime_hex = json_string_value(json_array_get(params, 3));
+	vbits_hex = json_string_value(json_array_get(params, 5));
+	if (!job_hex || !nonce2_hex)
+		return "[20,\"Invalid submit parameters\",null]";
+
+	job_id = strtoul(job_hex, &end, 16);
+	if (*end)
+		return "[21,\"Job not found\",null]";
+	for (job = info->jobs; job && job->id != job_id; job = job->next)
+		;
+	if (!job)
+		return "[21,\"Job not found\",null]";
+
+	/* The key is the pool's nonce2, LE, then ntime, nonce and version bits
+	 * as sent */
+	n2size = info->n2size - STRATSRV_PREFIX;
+	key[0] = client->prefix & 0xff;
+	key[1] = client->prefix >> 8;
+	if ((int)strlen(nonce2_hex) != n2size * 2 || !hex2bin(key + STRATSRV_PREFIX, nonce2_hex, n2size))
+		return "[20,\"Invalid extranonce2 size\",null]";
+	if (!srv_hex32(ntime_hex, key + 8) || !srv_hex32(json_string_value(json_array_get(params, 4)), key + 12))
+		return "[20,\"Invalid ntime or nonce\",null]";
+	if (vbits_hex && !srv_hex32(vbits_hex, key + 16))
+		return "[20,\"Invalid version bits\",null]";
+
+	ntime = be32toh(*(uint32_t *)(key + 8));
+	if (ntime < job->ntime || ntime > job->ntime + STRATSRV_NTIME_ROLL)
+		return "[20,\"Ntime out of range\",null]";
+	bits = be32toh(*(uint32_t *)(key + 16));
+	if (bits & ~client->vmask)
+		return "[20,\"Invalid version bits\",null]";
+
+	HASH_FIND(hh, job->shares, key, STRATSRV_KEY, share);
+	if (share)
+		return "[22,\"Duplicate share\",null]";
+
+	nonce2 = le64toh(*(uint64_t *)key);
+	nonce = le32toh(*(uint32_t *)(key + 12));
+	work = stratum_job_new_work(job->sjob, nonce2);
+	if (ntime != job->ntime) {
+		cg_memcpy(work->data + 68, key + 8, 4);
+		free(work->ntime);
+		work->ntime = strdup(ntime_hex);
+	}
+	if (vbits_hex) {
+		cg_memcpy(work->base_bv, work->data, 4);
+		version = be32toh(*(uint32_t *)work->data);
+		version = (version & ~client->vmask) | bits;
+		*(uint32_t *)work->data = htobe32(version);
+		work->direct_vmask = true;
+	}
+
+	/* Many miners apply a new diff to the job they're already on, so for
+	 * jobs before the change either diff will do */
+	if (job->id >= client->diff_job)
+		required = client->diff;
+	else
+		required = MIN(client->diff, client->old_diff);
+	diff = test_nonce_value(work, nonce);
+	if (diff < required) {
+		free_work(work);
+		return "[23,\"Low difficulty share\",null]";
+	}
+
+	share = cgmalloc(sizeof(*share));
+	cg_memcpy(share->key, key, STRATSRV_KEY);
+	HASH_ADD(hh, job->shares, key, STRATSRV_KEY, share);
+
+	work->thr_id = thr->id;
+	work->mined = true;
+	work->device_diff = required;
+	work->pool->works++;
+	if (submit_tested_work(thr, work)) {
+		info->forwarded++;
+		applog(LOG_INFO, "Stratum server %s share diff %.0f submitted to pool %d",
+		       client->addr, diff, work->pool->pool_no);
+	}
+	free_work(work);
+
+	info->hashes += required * 4294967296.0;
+	client->window_diff += required;
+	client->window_shares++;
+	return NULL;
+}
+
+static void srv_submit(struct thr_info *thr, struct stratsrv_info *info, struct srv_client *client,
+		       json_t *id, json_t *params)
+{
+	const char *err = srv_check_share(thr, info, client, params);
+	struct timeval now;
+
+	if (err) {
+		info->rejected++;
+		client->rejected++;
+		applog(LOG_DEBUG, "Stratum server %s share rejected %s", client->addr, err);
+		srv_reply(info, client, id, "false", err);
+		return;
+	}
+	info->accepted++;
+	client->accepted++;
+	srv_reply(info, client, id, "true", NULL);
+
+	cgtime(&now);
+	srv_vardiff(info, client, &now);
+}
+
+static void srv_request(struct thr_info *thr, struct stratsrv_info *info, struct srv_client *client,
+			const char *line)
+{
+	json_t *val, *id, *params;
+	const char *method;
+	json_error_t err;
+
+	val = JSON_LOADS(line, &err);
+	if (!val) {
+		srv_drop(info, client, "sent invalid JSON");
+		return;
+	}
+	id = json_object_get(val, "id");
+	method = json_string_value(json_object_get(val, "method"));
+	params = json_object_get(val, "params");
+	/* Notifications and replies need nothing */
+	if (!method || !id || json_is_null(id))
+		goto out;
+	if (!json_is_array(params))
+		params = NULL;
+
+	if (!strcmp(method, "mining.submit") && params)
+		srv_submit(thr, info, client, id, params);
+	else if (!strcmp(method, "mining.subscribe"))
+		srv_subscribe(info, client, id);
+	else if (!strcmp(method, "mining.authorize"))
+		srv_authorise(info, client, id, params);
+	else if (!strcmp(method, "mining.configure") && params)
+		srv_configure(info, client, id, params);
+	else if (!strcmp(method, "mining.suggest_difficulty") && params) {
+		double diff = json_number_value(json_array_get(params, 0));
+
+		srv_reply(info, client, id, "true", NULL);
+		if (diff > 0 && client->authorised) {
+			srv_set_diff(info, client, srv_diff(info, diff), info->job_id + 1);
+			cgtime(&client->window);
+			client->window_diff = 0;
+			client->window_shares = 0;
+		} else if (diff > 0)
+			client->diff = srv_diff(info, diff);
+	} else if (!strcmp(method, "mining.extranonce.subscribe"))
+		srv_reply(info, client, id, "false", NULL);
+	else
+		srv_reply(info, client, id, "null", "[20,\"Unsupported method\",null]");
+out:
+	json_decref(val);
+}
+
+/* Handle every complete line the miner has sent */
+static void srv_read(struct thr_info *thr, struct stratsrv_info *info, struct srv_client *client)
+{
+	char *line, *eol;
+	ssize_t n;
+
+	n = recv(client->fd, client->in + client->inlen, sizeof(client->in) - client->inlen - 1, 0);
+	if (n <= 0) {
+		if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+			return;
+		srv_drop(info, client, "disconnected");
+		return;
+	}
+	client->inlen += n;
+	client->in[client->inlen] = '\0';
+
+	line = client->in;
+	while ((eol = strchr(line, '\n'))) {
+		*eol = '\0';
+		if (*line && *line != '\r')
+			srv_request(thr, info, client, line);
+		if (client->dead)
+			return;
+		line = eol + 1;
+	}
+	client->inlen -= line - client->in;
+	memmove(client->in, line, client->inlen + 1);
+
+	if (client->inlen >= sizeof(client->in) - 1)
+		srv_drop(info, client, "sent a line too long");
+}
+
+static void srv_accept(struct stratsrv_info *info)
+{
+	const int one = 1, idle = 45, intvl = 30;
+	struct sockaddr_in addr;
+	socklen_t addrlen;
+	struct srv_client *client;
+	struct epoll_event ev;
+	char ip[INET_ADDRSTRLEN];
+	int fd;
+
+	while (42) {
+		addrlen = sizeof(addr);
+		fd = accept4(info->listen_fd, (struct sockaddr *)&addr, &addrlen, SOCK_NONBLOCK | SOCK_CLOEXEC);
+		if (fd < 0) {
+			if (errno == EMFILE || errno == ENFILE) {
+				applog(LOG_WARNING, "Stratum server is out of file descriptors with %d miners, "
+				       "not accepting more until one goes", info->count);
+				epoll_ctl(info->epoll_fd, EPOLL_CTL_DEL, info->listen_fd, NULL);
+				info->listening = false;
+			}
+			return;
+		}
+		if (info->count >= STRATSRV_CLIENTS) {
+			close(fd);
+			continue;
+		}
+		if (fd < FD_SETSIZE) {
+			int hifd = fcntl(fd, F_DUPFD_CLOEXEC, FD_SETSIZE);
+
+			if (hifd >= 0) {
+				close(fd);
+				fd = hifd;
+			} else if (fd >= FD_SETSIZE - STRATSRV_FD_SPARE) {
+				applog(LOG_INFO, "Stratum server refused a miner, no file descriptors "
+				       "above %d with %d miners", FD_SETSIZE, info->count);
+				close(fd);
+				continue;
+			}
+		}
+
+		setsockopt(fd, SOL_TCP, TCP_NODELAY, &one, sizeof(one));
+		setsockopt(fd, SOL_SOCKET, SO_KEEPALIVE, &one, sizeof(one));
+		setsockopt(fd, SOL_TCP, TCP_KEEPIDLE, &idle, sizeof(idle));
+		setsockopt(fd, SOL_TCP, TCP_KEEPINTVL, &intvl, sizeof(intvl));
+
+		client = cgcalloc(1, sizeof(*client));
+		client->fd = fd;
+		client->connected = time(NULL);
+		inet_ntop(AF_INET, &addr.sin_addr, ip, sizeof(ip));
+		snprintf(client->addr, sizeof(client->addr), "%s:%d", ip, ntohs(addr.sin_port));
+
+		ev.events = EPOLLIN;
+		ev.data.ptr = client;
+		if (epoll_ctl(info->epoll_fd, EPOLL_CTL_ADD, fd, &ev)) {
+			close(fd);
+			free(client);
+			continue;
+		}
+		client->index = info->count;
+		info->clients[info->count++] = client;
+		info->connections++;
+		applog(LOG_INFO, "Stratum server %s connected", client->addr);
+	}
+}
+
+/* Once a second, drop miners that never authorised and retarget any that
+ * have gone quiet */
+static void srv_check(struct stratsrv_info *info, time_t now)
+{
+	struct srv_client *client;
+	struct timeval tv;
+	int i;
+
+	cgtime(&tv);
+	for (i = info->count - 1; i >= 0; i--) {
+		client = info->clients[i];
+		if (!client->authorised) {
+			if (now - client->connected > STRATSRV_SUBSCRIBE_SECS)
+				srv_drop(info, client, "did not authorise");
+			continue;
+		}
+		if (!client->window_shares)
+			srv_vardiff(info, client, &tv);
+	}
+}
+
+static int64_t stratsrv_scanwork(struct thr_info *thr)
+{
+	struct stratsrv_info *info = thr->cgpu->device_data;
+	struct epoll_event ev[STRATSRV_EVENTS];
+	struct srv_client *client;
+	bool update = false;
+	uint64_t count;
+	int64_t hashes;
+	time_t now;
+	int i, n;
+
+	/* Never idle as far as the watchdog cares */
+	cgtime_coarse(&thr->last);
+
+	n = epoll_wait(info->epoll_fd, ev, STRATSRV_EVENTS, STRATSRV_WAIT_MS);
+	for (i = 0; i < n; i++) {
+		if (ev[i].data.ptr == &info->event_fd) {
+			if (read(info->event_fd, &count, sizeof(count)) < 0)
+				applog(LOG_DEBUG, "Stratum server event read failed");
+			update = true;
+		} else if (ev[i].data.ptr == &info->listen_fd)
+			srv_accept(info);
+		else {
+			client = ev[i].data.ptr;
+			if (client->dead)
+				continue;
+			if (ev[i].events & EPOLLOUT)
+				srv_flush(info, client);
+			if (!client->dead && (ev[i].events & (EPOLLIN | EPOLLERR | EPOLLHUP)))
+				srv_read(thr, info, client);
+		}
+	}
+
+	now = time(NULL);
+	if (now != info->last_check) {
+		info->last_check = now;
+		srv_check(info, now);
+		update = true;
+	}
+	if (__atomic_exchange_n(&srv_notified, false, __ATOMIC_ACQ_REL) || update ||
+	    current_pool() != info->pool)
+		srv_update(info);
+	srv_reap(info);
+
+	hashes = info->hashes;
+	info->hashes = 0;
+	return hashes;
+}
+
+static void stratsrv_shutdown(struct thr_info *thr)
+{
+	struct stratsrv_info *info = thr->cgpu->device_data;
+
+	__atomic_store_n(&srv_event_fd, -1, __ATOMIC_RELEASE);
+	while (info->count)
+		srv_drop(info, info->clients[0], "closed on shutdown");
+	srv_reap(info);
+	srv_clear_jobs(&info->jobs);
+	close(info->listen_fd);
+	close(info->event_fd);
+	close(info->epoll_fd);
+}
+
+static struct api_data *stratsrv_api_stats(struct cgpu_info *cgpu)
+{
+	struct stratsrv_info *info = cgpu->device_data;
+	struct api_data *root = NULL;
+
+	root = api_add_int(root, "Port", &opt_stratum_server, false);
+	root = api_add_int(root, "Miners", &info->count, true);
+	root = api_add_uint64(root, "Connections", &info->connections, true);
+	root = api_add_uint64(root, "Shares Accepted", &info->accepted, true);
+	root = api_add_uint64(root, "Shares Rejected", &info->rejected, true);
+	root = api_add_uint64(root, "Shares Submitted", &info->forwarded, true);
+	root = api_add_uint32(root, "Job", &info->job_id, true);
+	root = api_add_int(root, "Min Diff", &opt_stratum_server_diff, false);
+	root = api_add_int(root, "Share Rate", &opt_stratum_server_rate, false);
+
+	return root;
+}
+
+static void stratsrv_detect(bool hotplug)
+{
+	struct stratsrv_info *info;
+	struct cgpu_info *cgpu;
+	struct sockaddr_in addr;
+	struct epoll_event ev;
+	struct rlimit rlim;
+	int one = 1;
+
+	if (hotplug || !opt_stratum_server)
+		return;
+
+	info = cgcalloc(1, sizeof(*info));
+	info->clients = cgcalloc(STRATSRV_CLIENTS, sizeof(*info->clients));
+	info->next_prefix = 1;
+
+	/* Room for miners above FD_SETSIZE */
+	if (!getrlimit(RLIMIT_NOFILE, &rlim) && rlim.rlim_cur < rlim.rlim_max) {
+		rlim.rlim_cur = rlim.rlim_max;
+		if (setrlimit(RLIMIT_NOFILE, &rlim))
+			applog(LOG_DEBUG, "Stratum server setrlimit failed (ignored): %s", strerror(errno));
+	}
+
+	info->listen_fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (info->listen_fd < 0)
+		quit(1, "Stratum server socket failed (%s)", strerror(errno));
+	if (setsockopt(info->listen_fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one)))
+		applog(LOG_DEBUG, "Stratum server setsockopt SO_REUSEADDR failed (ignored): %s", strerror(errno));
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_ANY);
+	addr.sin_port = htons(opt_stratum_server);
+	if (bind(info->listen_fd, (struct sockaddr *)&addr, sizeof(addr)))
+		quit(1, "Stratum server bind to port %d failed (%s)", opt_stratum_server, strerror(errno));
+	if (listen(info->listen_fd, SOMAXCONN))
+		quit(1, "Stratum server listen failed (%s)", strerror(errno));
+
+	info->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+	info->event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (info->epoll_fd < 0 || info->event_fd < 0)
+		quit(1, "Stratum server epoll setup failed (%s)", strerror(errno));
+	ev.events = EPOLLIN;
+	ev.data.ptr = &info->listen_fd;
+	epoll_ctl(info->epoll_fd, EPOLL_CTL_ADD, info->listen_fd, &ev);
+	info->listening = true;
+	ev.data.ptr = &info->event_fd;
+	epoll_ctl(info->epoll_fd, EPOLL_CTL_ADD, info->event_fd, &ev);
+	__atomic_store_n(&srv_event_fd, info->event_fd, __ATOMIC_RELEASE);
+
+	cgpu = cgcalloc(1, sizeof(*cgpu));
+	cgpu->drv = &stratsrv_drv;
+	cgpu->deven = DEV_ENABLED;
+	cgpu->threads = 1;
+	cgpu->device_data = info;
+	add_cgpu(cgpu);
+
+	applog(LOG_NOTICE, "Stratum server listening on port %d", opt_stratum_server);
+}
+
+struct device_drv stratsrv_drv = {
+	.drv_id = DRIVER_stratsrv,
+	.dname = "StratumServer",
+	.name = "SRV",
+	.drv_detect = stratsrv_detect,
+	.hash_work = hash_driver_work,
+	.scanwork = stratsrv_scanwork,
+	.get_api_stats = stratsrv_api_stats,
+	.thread_shutdown = stratsrv_shutdown,
+	.genwork = true,
+};
+
+#else /* __linux */
+
+void _stratsrv_notify(struct pool __maybe_unused *pool)
+{
+}
+
+static void stratsrv_detect(bool hotplug)
+{
+	if (!hotplug && opt_stratum_server)
+		quit(1, "--stratum-server is only supported on Linux");
+}
+
+struct device_drv stratsrv_drv = {
+	.drv_id = DRIVER_stratsrv,
+	.dname = "StratumServer",
+	.name = "SRV",
+	.drv_detect = stratsrv_detect,
+};
+
+#endif /* __linux */
@@ -0,0 +1,47 @@
+/*
+ * Copyright 2026 Andrew Smith
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 3 of the License, or (at your option)
+ * any later version.  See COPYING for more details.
+ */
+
+#ifndef STRATSRV_H
+#define STRATSRV_H
+
+#include "miner.h"
+
+/* Bytes at the start of the pool's nonce2 that pick a client, with 0 kept for
+ * the work cgminer generates itself */
+#define STRATSRV_PREFIX 2
+/* The pool's nonce2 has to leave clients at least 4 bytes of their own, since
+ * miners roll nonce2 fast enough to run through 2 bytes within a job */
+#define STRATSRV_MIN_N2SIZE (STRATSRV_PREFIX + 4)
+
+#define STRATSRV_DIFF 1024
+#define STRATSRV_RATE 20
+
+extern int opt_stratum_server;
+extern int opt_stratum_server_diff;
+extern int opt_stratum_server_rate;
+
+extern void _stratsrv_notify(struct pool *pool);
+
+/* A pool has a new job */
+static inline void stratsrv_notify(struct pool *pool)
+{
+	if (unlikely(opt_stratum_server))
+		_stratsrv_notify(pool);
+}
+
+/* The nonce2 for cgminer's own nth work from a pool, with the client prefix
+ * left 0 while serving */
+static inline uint64_t stratsrv_nonce2(struct pool *pool, uint64_t nonce2)
+{
+	if (unlikely(opt_stratum_server) && pool->n2size >= STRATSRV_MIN_N2SIZE)
+		return nonce2 << (STRATSRV_PREFIX * 8);
+	return nonce2;
+}
+
+#endif /* STRATSRV_H */
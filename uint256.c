@@ -0,0 +1,208 @@
+/*
+ * Copyright 2026 Andrew Smith
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 3 of the License, or (at your option)
+ * any later version.  See COPYING for more details.
+ */
+
+/* Exact 256 bit target and difficulty arithmetic.
+ *
+ * A difficulty is a double, so it is exactly m * 2^e for some integer m of at
+ * most 53 bits. The target for it is floor(diffone / (m * 2^e)), which is
+ * worked out with shifts and a single division by m, so unlike cutting the
+ * double quotient into 64 bit pieces the low words are exact. Most pool
+ * difficulties have an m that fits in 32 bits once its trailing zero bits are
+ * moved into e, and those divide a 32 bit half word at a time. Going the other
+ * way the hash is rounded to a double once, rather than summing four partial
+ * products. */
+
+#include <math.h>
+
+#include "miner.h"
+#include "uint256.h"
+
+/* Number of significant bits in a */
+static int u256_bits(const u256 *a)
+{
+	int i;
+
+	for (i = 3; i >= 0; i--) {
+		if (a->w[i])
+			return i * 64 + 64 - __builtin_clzll(a->w[i]);
+	}
+	return 0;
+}
+
+/* a <<= s, returning false if any set bits would be shifted out */
+static bool u256_shl(u256 *a, int s)
+{
+	int i, words = s / 64, bits = s % 64;
+
+	if (!s)
+		return true;
+	if (u256_bits(a) + s > 256)
+		return false;
+
+	for (i = 3; i >= 0; i--) {
+		uint64_t w = 0;
+
+		if (i - words >= 0) {
+			w = a->w[i - words] << bits;
+			if (bits && i - words - 1 >= 0)
+				w |= a->w[i - words - 1] >> (64 - bits);
+		}
+		a->w[i] = w;
+	}
+	return true;
+}
+
+static void u256_shr(u256 *a, int s)
+{
+	int i, words = s / 64, bits = s % 64;
+
+	if (s >= 256) {
+		memset(a, 0, sizeof(*a));
+		return;
+	}
+
+	for (i = 0; i < 4; i++) {
+		uint64_t w = 0;
+
+		if (i + words < 4) {
+			w = a->w[i + words] >> bits;
+			if (bits && i + words + 1 < 4)
+				w |= a->w[i + words + 1] << (64 - bits);
+		}
+		a->w[i] = w;
+	}
+}
+
+/* a = floor(a * 2^s / d) for 0 < d < 2^63, without needing a * 2^s to fit.
+ * Long division a bit at a time, rem < d so rem << 1 can't overflow. Returns
+ * false, leaving a unchanged, if the quotient doesn't fit. */
+static bool u256_div_shl(u256 *a, int s, uint64_t d)
+{
+	uint64_t rem = 0, bit;
+	u256 q;
+	int i;
+
+	memset(&q, 0, sizeof(q));
+	for (i = u256_bits(a) - 1 + s; i >= 0; i--) {
+		bit = 0;
+		if (i >= s)
+			bit = (a->w[(i - s) / 64] >> ((i - s) % 64)) & 1;
+		rem = (rem << 1) | bit;
+		if (rem >= d) {
+			if (i >= 256)
+				return false;
+			rem -= d;
+			q.w[i / 64] |= 1ULL << (i % 64);
+		}
+	}
+	*a = q;
+	return true;
+}
+
+/* a = floor(a / d) for 0 < d < 2^63 */
+static void u256_div64(u256 *a, uint64_t d)
+{
+	uint64_t rem = 0, cur, qhi, qlo;
+	int i;
+
+	if (d < 0x100000000ULL) {
+		for (i = 3; i >= 0; i--) {
+			cur = (rem << 32) | (a->w[i] >> 32);
+			qhi = cur / d;
+			rem = cur % d;
+			cur = (rem << 32) | (a->w[i] & 0xffffffffULL);
+			qlo = cur / d;
+			rem = cur % d;
+			a->w[i] = (qhi << 32) | qlo;
+		}
+		return;
+	}
+
+	u256_div_shl(a, 0, d);
+}
+
+/* The largest target that meets diff, i.e. floor(diffone / diff), saturating
+ * at 2^256-1 for difficulties too small to represent. A zero, negative or NaN
+ * diff gets the diff 1 target. */
+void u256_target_from_diff(u256 *target, double diff)
+{
+	uint64_t m;
+	int exp, e, tz;
+
+	memset(target, 0, sizeof(*target));
+	target->w[3] = U256_DIFFONE_TOP;
+
+	if (unlikely(!(diff > 0.0)))
+		return;
+	if (unlikely(isinf(diff))) {
+		memset(target, 0, sizeof(*target));
+		return;
+	}
+
+	/* diff == m * 2^e exactly */
+	m = (uint64_t)ldexp(frexp(diff, &exp), 53);
+	e = exp - 53;
+	tz = __builtin_ctzll(m);
+	m >>= tz;
+	e += tz;
+
+	if (e >= 0 || u256_shl(target, -e)) {
+		u256_div64(target, m);
+		if (e > 0)
+			u256_shr(target, e);
+	} else if (!u256_div_shl(target, -e, m))
+		memset(target, 0xff, sizeof(*target));
+}
+
+/* a rounded to the nearest double */
+double u256_to_double(const u256 *a)
+{
+	int i, shift;
+	uint64_t m;
+
+	for (i = 3; i >= 0 && !a->w[i]; i--)
+		;
+	if (i < 0)
+		return 0.0;
+
+	/* Top 64 significant bits, with any below them folded into the lowest
+	 * bit so the conversion to 53 bits rounds as though they were there */
+	shift = __builtin_clzll(a->w[i]);
+	m = a->w[i] << shift;
+	if (i > 0) {
+		if (shift)
+			m |= a->w[i - 1] >> (64 - shift);
+		if ((shift && (a->w[i - 1] << shift)) || (!shift && a->w[i - 1]))
+			m |= 1;
+		if (i > 1 && (a->w[i - 2] || a->w[0]))
+			m |= 1;
+	}
+
+	return ldexp((double)m, i * 64 - shift);
+}
+
+/* The difficulty a hash (or target) represents, diffone / hash, with a zero
+ * hash treated as 1 */
+double u256_diff(const u256 *hash)
+{
+	u256 diffone = {{ 0, 0, 0, U256_DIFFONE_TOP }};
+	double d = u256_to_double(hash);
+
+	if (unlikely(!d))
+		d = 1.0;
+	return u256_to_double(&diffone) / d;
+}
+
+double le256_diff(const void *hash)
+{
+	u256 h;
+
+	u256_from_le(&h, hash);
+	return u256_diff(&h);
+}
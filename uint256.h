@@ -0,0 +1,81 @@
+/*
+ * Copyright 2026 Andrew Smith
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 3 of the License, or (at your option)
+ * any later version.  See COPYING for more details.
+ */
+
+#ifndef UINT256_H
+#define UINT256_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "miner.h"
+
+/* A 256 bit unsigned integer as four 64 bit words, least significant first,
+ * the same order as the little endian hashes and targets it's loaded from */
+typedef struct u256 {
+	uint64_t w[4];
+} u256;
+
+/* Difficulty 1 target, 0x00000000FFFF0000000000000000000000000000000000000000000000000000 */
+#define U256_DIFFONE_TOP 0x00000000FFFF0000ULL
+
+static inline void u256_from_le(u256 *r, const void *le)
+{
+	uint64_t w[4];
+	int i;
+
+	memcpy(w, le, 32);
+	for (i = 0; i < 4; i++)
+		r->w[i] = le64toh(w[i]);
+}
+
+static inline void u256_to_le(void *le, const u256 *a)
+{
+	uint64_t w[4];
+	int i;
+
+	for (i = 0; i < 4; i++)
+		w[i] = htole64(a->w[i]);
+	memcpy(le, w, 32);
+}
+
+static inline bool u256_is_zero(const u256 *a)
+{
+	return !(a->w[0] | a->w[1] | a->w[2] | a->w[3]);
+}
+
+/* a <= b, worked out as the borrow out of b - a so there's no early exit */
+static inline bool u256_le(const u256 *a, const u256 *b)
+{
+	uint64_t borrow = 0, t;
+	int i;
+
+	for (i = 0; i < 4; i++) {
+		t = b->w[i] - a->w[i];
+		borrow = (b->w[i] < a->w[i]) | (t < borrow);
+	}
+	return !borrow;
+}
+
+/* Little endian hash <= little endian target, as fulltest() without logging */
+static inline bool le256_le(const void *hash, const void *target)
+{
+	u256 h, t;
+
+	u256_from_le(&h, hash);
+	u256_from_le(&t, target);
+	return u256_le(&h, &t);
+}
+
+extern void u256_target_from_diff(u256 *target, double diff);
+extern double u256_to_double(const u256 *a);
+extern double u256_diff(const u256 *hash);
+extern double le256_diff(const void *hash);
+
+#endif /* UINT256_H */
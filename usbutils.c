@@ -17,6 +17,7 @@
 #include "logging.h"
 #include "miner.h"
 #include "usbutils.h"
+#include "chipstat.h"
 
 static pthread_mutex_t cgusb_lock;
 static pthread_mutex_t cgusbres_lock;
@@ -2288,7 +2289,7 @@ static bool __release_cgpu(struct cgpu_info *cgpu)
 
 	cgpu->usbinfo.nodev = true;
 	cgpu->usbinfo.nodev_count++;
-	cgtime(&cgpu->usbinfo.last_nodev);
+	cgtime_coarse(&cgpu->usbinfo.last_nodev);
 
 	// Any devices sharing the same USB device should be marked also
 	for (i = 0; i < total_devices; i++) {
@@ -2403,6 +2404,8 @@ struct cgpu_info *usb_free_cgpu(struct cgpu_info *cgpu)
 
 	free(cgpu->device_path);
 
+	chip_stats_free(cgpu);
+
 	free(cgpu);
 
 	return NULL;
@@ -2895,13 +2898,80 @@ static struct usb_find_devices *usb_check(__maybe_unused struct device_drv *drv,
 	return NULL;
 }
 
+/* Detection is done a pass at a time. Each driver's drv_detect asks for its
+ * devices with usb_detect(), which only records the request while a pass is
+ * open. Ending the pass enumerates the bus once, gives each unused device the
+ * requests that match it, in the order they were made, and probes the devices
+ * on up to opt_usb_detect_threads threads at once. Each device tries its
+ * matching requests in turn until one claims it, as it would have serially,
+ * and add_cgpu() waits for usb_detect_turn() so devices are still added in
+ * the order serial detection would have added them.
+ * Drivers that step a static --*-options offset per device get it from
+ * usb_detect_option(), which waits until every earlier device that could go
+ * to the same driver has taken its offset or finished probing, so each
+ * device still gets the options serial detection would have given it while
+ * the rest of the probes, even of the same driver, run at once. Detect code
+ * must otherwise be re-entrant. */
+
+#define USB_DETECT_REQS 64
+#define USB_DETECT_MATCHES 8
+
+struct usb_detect_req {
+	struct device_drv *drv;
+	struct cgpu_info *(*device_detect)(struct libusb_device *, struct usb_find_devices *);
+	bool single;
+	bool claimed;
+};
+
+struct usb_detect_dev {
+	libusb_device *dev;
+	int index;		// Position on the bus
+	int first_req;		// First request it matched
+	int order;		// Order its devices are added in
+	int matches;
+	struct usb_detect_req *req[USB_DETECT_MATCHES];
+	struct usb_find_devices *found[USB_DETECT_MATCHES];
+	// The last earlier device matching the same driver, or NULL
+	struct usb_detect_dev *after[USB_DETECT_MATCHES];
+	bool passed[USB_DETECT_MATCHES];	// Taken its option offset
+	int cur;		// Request being probed
+	bool turn;
+	bool done;
+	double wait_ms;		// Time spent waiting for its turn or options
+};
+
+static pthread_mutex_t usb_detect_pass_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct usb_detect_req usb_detect_reqs[USB_DETECT_REQS];
+static int usb_detect_nreqs;
+static bool usb_detect_open;
+
+static pthread_mutex_t usb_detect_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t usb_detect_cond = PTHREAD_COND_INITIALIZER;
+static struct usb_detect_dev *usb_detect_devs;
+static int usb_detect_ndevs, usb_detect_taken, usb_detect_next, usb_detect_added;
+static __thread struct usb_detect_dev *usb_detect_mine;
+
+int opt_usb_detect_threads = USB_DETECT_THREADS;
+
+void usb_detect_begin(void)
+{
+	mutex_lock(&usb_detect_pass_lock);
+	usb_detect_nreqs = 0;
+	usb_detect_open = true;
+}
+
 void __usb_detect(struct device_drv *drv, struct cgpu_info *(*device_detect)(struct libusb_device *, struct usb_find_devices *),
 		  bool single)
 {
-	libusb_device **list;
-	ssize_t count, i;
-	struct usb_find_devices *found;
-	struct cgpu_info *cgpu;
+	struct usb_detect_req *req;
+
+	/* A detect outside of a pass is a pass on its own */
+	if (!usb_detect_open) {
+		usb_detect_begin();
+		__usb_detect(drv, device_detect, single);
+		usb_detect_end();
+		return;
+	}
 
 	applog(LOG_DEBUG, "USB scan devices: checking for %s devices", drv->name);
 
@@ -2917,54 +2987,542 @@ void __usb_detect(struct device_drv *drv, struct cgpu_info *(*device_detect)(str
 		return;
 	}
 
-	count = libusb_get_device_list(NULL, &list);
-	if (count < 0) {
-		applog(LOG_DEBUG, "USB scan devices: failed, err %d", (int)count);
+	if (unlikely(usb_detect_nreqs >= USB_DETECT_REQS)) {
+		applog(LOG_ERR, "USB scan devices: too many detect requests, ignoring %s", drv->dname);
+		return;
+	}
+
+	req = &usb_detect_reqs[usb_detect_nreqs++];
+	req->drv = drv;
+	req->device_detect = device_detect;
+	req->single = single;
+	req->claimed = false;
+}
+
+/* Count the device against its driver's limits before probing it, so probes
+ * running at the same time can't take the count past them */
+static bool usb_detect_reserve(struct usb_detect_req *req)
+{
+	int id = req->drv->drv_id;
+	bool ret = false;
+
+	mutex_lock(&usb_detect_lock);
+	if (total_count < total_limit && drv_count[id].count < drv_count[id].limit &&
+	    !(req->single && req->claimed)) {
+		total_count++;
+		drv_count[id].count++;
+		req->claimed = true;
+		ret = true;
+	}
+	mutex_unlock(&usb_detect_lock);
+
+	return ret;
+}
+
+static void usb_detect_unreserve(struct usb_detect_req *req)
+{
+	mutex_lock(&usb_detect_lock);
+	total_count--;
+	drv_count[req->drv->drv_id].count--;
+	req->claimed = false;
+	mutex_unlock(&usb_detect_lock);
+}
+
+/* Called by add_cgpu() so that a probe only adds its devices once every
+ * device ordered before it has been probed */
+void usb_detect_turn(void)
+{
+	struct usb_detect_dev *udev = usb_detect_mine;
+	struct timeval tv_start, tv_end;
+
+	if (!udev || udev->turn)
 		return;
+
+	cgtime(&tv_start);
+	mutex_lock(&usb_detect_lock);
+	while (usb_detect_next != udev->order)
+		pthread_cond_wait(&usb_detect_cond, &usb_detect_lock);
+	mutex_unlock(&usb_detect_lock);
+	cgtime(&tv_end);
+
+	udev->turn = true;
+	udev->wait_ms += us_tdiff(&tv_end, &tv_start) / 1000.0;
+}
+
+/* The request udev matched for drv */
+static int usb_detect_match(struct usb_detect_dev *udev, struct device_drv *drv)
+{
+	int i;
+
+	for (i = 0; i < udev->matches; i++) {
+		if (udev->req[i]->drv == drv)
+			break;
 	}
+	return i;
+}
+
+/* Must be called with usb_detect_lock held */
+static bool usb_detect_passed(struct usb_detect_dev *udev, struct device_drv *drv)
+{
+	int i;
+
+	if (udev->done)
+		return true;
+	for (i = 0; i < udev->matches; i++) {
+		if (udev->req[i]->drv == drv && udev->passed[i])
+			return true;
+	}
+	return false;
+}
+
+/* Returns ++*option_offset, for the device being probed once every earlier
+ * device that could go to the same driver has taken its own, so offsets are
+ * handed out in the order serial detection would have */
+int usb_detect_option(int *option_offset)
+{
+	struct usb_detect_dev *udev = usb_detect_mine, *prev;
+	struct timeval tv_start, tv_end;
+	struct device_drv *drv;
+	int ret;
+
+	if (!udev)
+		return ++*option_offset;
+
+	drv = udev->req[udev->cur]->drv;
+	cgtime(&tv_start);
+	mutex_lock(&usb_detect_lock);
+	for (prev = udev->after[udev->cur]; prev; prev = prev->after[usb_detect_match(prev, drv)]) {
+		while (!usb_detect_passed(prev, drv))
+			pthread_cond_wait(&usb_detect_cond, &usb_detect_lock);
+	}
+	ret = ++*option_offset;
+	udev->passed[udev->cur] = true;
+	pthread_cond_broadcast(&usb_detect_cond);
+	mutex_unlock(&usb_detect_lock);
+	cgtime(&tv_end);
+
+	udev->wait_ms += us_tdiff(&tv_end, &tv_start) / 1000.0;
+	return ret;
+}
+
+static void usb_detect_probe(struct usb_detect_dev *udev)
+{
+	struct timeval tv_start, tv_end;
+	struct usb_detect_req *req;
+	struct cgpu_info *cgpu = NULL;
+	int i;
+
+	usb_detect_mine = udev;
+
+	for (i = 0; i < udev->matches && !cgpu; i++) {
+		req = udev->req[i];
+		if (!usb_detect_reserve(req))
+			continue;
+		if (is_in_use(udev->dev) || cgminer_usb_lock(req->drv, udev->dev) == false) {
+			usb_detect_unreserve(req);
+			continue;
+		}
+
+		udev->cur = i;
+		udev->wait_ms = 0;
+		cgtime(&tv_start);
+		cgpu = req->device_detect(udev->dev, udev->found[i]);
+		cgtime(&tv_end);
+		if (!cgpu) {
+			cgminer_usb_unlock(req->drv, udev->dev);
+			usb_detect_unreserve(req);
+			continue;
+		}
+		cgpu->usbinfo.initialised = true;
+		cgpu->usbinfo.detect_ms = us_tdiff(&tv_end, &tv_start) / 1000.0 - udev->wait_ms;
+	}
+
+	/* Let the devices after this one have their turn */
+	usb_detect_turn();
+	mutex_lock(&usb_detect_lock);
+	usb_detect_next++;
+	udev->done = true;
+	if (cgpu)
+		usb_detect_added++;
+	pthread_cond_broadcast(&usb_detect_cond);
+	mutex_unlock(&usb_detect_lock);
+
+	usb_detect_mine = NULL;
+}
+
+static void usb_detect_work(void)
+{
+	struct usb_detect_dev *udev;
+
+	while (42) {
+		mutex_lock(&usb_detect_lock);
+		if (usb_detect_taken >= usb_detect_ndevs) {
+			mutex_unlock(&usb_detect_lock);
+			break;
+		}
+		udev = &usb_detect_devs[usb_detect_taken++];
+		mutex_unlock(&usb_detect_lock);
+
+		usb_detect_probe(udev);
+	}
+}
+
+static void *usb_detect_thread(void __maybe_unused *userdata)
+{
+	RenameThread("USBDetect");
+
+	usb_detect_work();
+
+	return NULL;
+}
+
+/* Serial detection probed every device for the first request before moving
+ * on to the next one */
+static int usb_detect_cmp(const void *a, const void *b)
+{
+	const struct usb_detect_dev *da = a, *db = b;
+
+	if (da->first_req != db->first_req)
+		return da->first_req - db->first_req;
+	return da->index - db->index;
+}
+
+/* The last device before udevs[j] that any request from drv matched */
+static struct usb_detect_dev *usb_detect_prev(struct usb_detect_dev *udevs, int j, struct device_drv *drv)
+{
+	int k, r;
+
+	for (k = j - 1; k >= 0; k--) {
+		for (r = 0; r < udevs[k].matches; r++) {
+			if (udevs[k].req[r]->drv == drv)
+				return &udevs[k];
+		}
+	}
+	return NULL;
+}
+
+/* Probe the devices in list for the requests made during the pass */
+static void usb_detect_list(libusb_device **list, ssize_t count)
+{
+	struct usb_detect_dev *udevs, *udev;
+	struct usb_find_devices *found;
+	struct timeval tv_start, tv_end;
+	ssize_t i;
+	pthread_t *pth;
+	int r, j, ndevs, nthr, started;
 
 	if (count == 0)
 		applog(LOG_DEBUG, "USB scan devices: found no devices");
 	else
 		cgsleep_ms(166);
 
+	udevs = cgcalloc(count + 1, sizeof(*udevs));
+	ndevs = 0;
 	for (i = 0; i < count; i++) {
-		if (total_count >= total_limit) {
-			applog(LOG_DEBUG, "USB scan devices2: total limit %d reached", total_limit);
-			break;
+		if (is_in_use(list[i]))
+			continue;
+
+		udev = &udevs[ndevs];
+		for (r = 0; r < usb_detect_nreqs && udev->matches < USB_DETECT_MATCHES; r++) {
+			found = usb_check(usb_detect_reqs[r].drv, list[i]);
+			if (!found)
+				continue;
+			if (!udev->matches)
+				udev->first_req = r;
+			udev->req[udev->matches] = &usb_detect_reqs[r];
+			udev->found[udev->matches++] = found;
 		}
+		if (udev->matches) {
+			udev->dev = list[i];
+			udev->index = i;
+			ndevs++;
+		}
+	}
+	qsort(udevs, ndevs, sizeof(*udevs), usb_detect_cmp);
+	for (j = 0; j < ndevs; j++) {
+		udevs[j].order = j;
+		for (r = 0; r < udevs[j].matches; r++)
+			udevs[j].after[r] = usb_detect_prev(udevs, j, udevs[j].req[r]->drv);
+	}
 
-		if (drv_count[drv->drv_id].count >= drv_count[drv->drv_id].limit) {
-			applog(LOG_DEBUG,
-				"USB scan devices2: %s limit %d reached",
-				drv->dname, drv_count[drv->drv_id].limit);
-			break;
+	mutex_lock(&usb_detect_lock);
+	usb_detect_devs = udevs;
+	usb_detect_ndevs = ndevs;
+	usb_detect_taken = usb_detect_next = usb_detect_added = 0;
+	mutex_unlock(&usb_detect_lock);
+
+	/* This thread probes too, alongside nthr - 1 others */
+	nthr = MIN(opt_usb_detect_threads, ndevs);
+	pth = NULL;
+	started = 0;
+	cgtime(&tv_start);
+	if (nthr > 1) {
+		pth = cgcalloc(nthr - 1, sizeof(*pth));
+		for (started = 0; started < nthr - 1; started++) {
+			if (unlikely(pthread_create(&pth[started], NULL, usb_detect_thread, NULL))) {
+				applog(LOG_ERR, "USB scan devices: failed to create detect thread %d", started);
+				break;
+			}
 		}
+	}
+	usb_detect_work();
+	for (j = 0; j < started; j++)
+		pthread_join(pth[j], NULL);
+	free(pth);
+	cgtime(&tv_end);
+
+	if (ndevs) {
+		applog(LOG_INFO, "USB scan devices: %d of %d candidate devices added in %.0fms by %d thread%s",
+		       usb_detect_added, ndevs, us_tdiff(&tv_end, &tv_start) / 1000.0,
+		       started + 1, started ? "s" : "");
+	}
 
-		found = usb_check(drv, list[i]);
-		if (found != NULL) {
-			bool new_dev = false;
+	mutex_lock(&usb_detect_lock);
+	usb_detect_devs = NULL;
+	usb_detect_ndevs = 0;
+	mutex_unlock(&usb_detect_lock);
 
-			if (is_in_use(list[i]) || cgminer_usb_lock(drv, list[i]) == false)
-				free(found);
-			else {
-				cgpu = device_detect(list[i], found);
-				if (!cgpu)
-					cgminer_usb_unlock(drv, list[i]);
-				else {
-					new_dev = true;
-					cgpu->usbinfo.initialised = true;
-					total_count++;
-					drv_count[drv->drv_id].count++;
-				}
-				free(found);
-			}
-			if (single && new_dev)
+	for (j = 0; j < ndevs; j++) {
+		for (r = 0; r < udevs[j].matches; r++)
+			free(udevs[j].found[r]);
+	}
+	free(udevs);
+}
+
+void usb_detect_end(void)
+{
+	libusb_device **list;
+	ssize_t count;
+
+	usb_detect_open = false;
+	if (usb_detect_nreqs) {
+		count = libusb_get_device_list(NULL, &list);
+		if (count < 0)
+			applog(LOG_DEBUG, "USB scan devices: failed, err %d", (int)count);
+		else {
+			usb_detect_list(list, count);
+			libusb_free_device_list(list, 1);
+		}
+	}
+	mutex_unlock(&usb_detect_pass_lock);
+}
+
+/* Where libusb can report devices arriving and leaving, the hotplug thread
+ * waits for those reports instead of rescanning the bus every hotplug_time
+ * seconds. The callbacks run on the libusb event thread, where they mustn't
+ * block or open devices, so they only queue the event. usb_hotplug_wait()
+ * then releases devices that left straight away, and the hotplug thread ends
+ * its detection pass with usb_hotplug_end() to probe only the devices that
+ * arrived. usb_hotplug_inject() queues the same events by hand, so all of
+ * this can be tested without replugging anything. */
+
+struct usb_hotplug_event {
+	struct usb_hotplug_event *next;
+	libusb_device *dev;	// Referenced, only for an arrival
+	uint8_t bus_number;
+	uint8_t device_address;
+	bool arrived;
+};
+
+static pthread_mutex_t usb_hotplug_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t usb_hotplug_cond = PTHREAD_COND_INITIALIZER;
+static struct usb_hotplug_event *usb_hotplug_head, *usb_hotplug_tail;
+
+/* Arrivals waiting for usb_hotplug_end(), only used by the hotplug thread */
+static struct usb_hotplug_event *usb_hotplug_arrived, *usb_hotplug_arrived_tail;
+static int usb_hotplug_narrived;
+
+bool usb_hotplug_events;
+
+static void usb_hotplug_queue(libusb_device *dev, uint8_t bus, uint8_t address, bool arrived)
+{
+	struct usb_hotplug_event *event = cgcalloc(1, sizeof(*event));
+
+	if (arrived)
+		event->dev = libusb_ref_device(dev);
+	event->bus_number = bus;
+	event->device_address = address;
+	event->arrived = arrived;
+
+	mutex_lock(&usb_hotplug_lock);
+	if (usb_hotplug_tail)
+		usb_hotplug_tail->next = event;
+	else
+		usb_hotplug_head = event;
+	usb_hotplug_tail = event;
+	pthread_cond_signal(&usb_hotplug_cond);
+	mutex_unlock(&usb_hotplug_lock);
+}
+
+#ifdef LIBUSB_HOTPLUG_MATCH_ANY
+static int LIBUSB_CALL usb_hotplug_cb(libusb_context __maybe_unused *ctx, libusb_device *dev,
+				      libusb_hotplug_event event, void __maybe_unused *user_data)
+{
+	usb_hotplug_queue(dev, libusb_get_bus_number(dev), libusb_get_device_address(dev),
+			  event == LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED);
+	return 0;
+}
+#endif
+
+/* Returns true if libusb will report hotplug events from now on */
+bool usb_hotplug_register(void)
+{
+#ifdef LIBUSB_HOTPLUG_MATCH_ANY
+	libusb_hotplug_callback_handle handle;
+	int err;
+
+	if (!libusb_has_capability(LIBUSB_CAP_HAS_HOTPLUG)) {
+		applog(LOG_DEBUG, "USB hotplug: events not supported, polling instead");
+		return false;
+	}
+
+	err = libusb_hotplug_register_callback(NULL, LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED |
+					       LIBUSB_HOTPLUG_EVENT_DEVICE_LEFT, 0,
+					       LIBUSB_HOTPLUG_MATCH_ANY, LIBUSB_HOTPLUG_MATCH_ANY,
+					       LIBUSB_HOTPLUG_MATCH_ANY, usb_hotplug_cb, NULL, &handle);
+	if (err) {
+		applog(LOG_WARNING, "USB hotplug: event registration failed, err %d %s, polling instead",
+		       err, libusb_error_name(err));
+		return false;
+	}
+
+	applog(LOG_DEBUG, "USB hotplug: using events");
+	usb_hotplug_events = true;
+	return true;
+#else
+	return false;
+#endif
+}
+
+/* Release every device at the address straight away, rather than waiting
+ * for its driver to notice it has gone */
+static void usb_hotplug_left(uint8_t bus, uint8_t address)
+{
+	struct cgpu_info *cgpu;
+	int i;
+
+	for (i = 0; i < total_devices; i++) {
+		cgpu = get_a_device(i);
+		if (!cgpu->usbdev || cgpu->usbinfo.nodev || cgpu->usbinfo.bus_number != bus ||
+		    cgpu->usbinfo.device_address != address)
+			continue;
+
+		applog(LOG_WARNING, "Hotplug: %s removed %s %i",
+		       cgpu->drv->dname, cgpu->drv->name, cgpu->device_id);
+		usb_nodev(cgpu);
+	}
+}
+
+/* Wait up to ms for devices to arrive, releasing any that leave meanwhile.
+ * Arrivals are kept for usb_hotplug_end() if keep is set, otherwise they are
+ * dropped. Returns true if there are arrivals to probe. */
+bool usb_hotplug_wait(int ms, bool keep)
+{
+	struct usb_hotplug_event *event;
+	struct timespec abstime, tdiff;
+
+	cgcond_time(&abstime);
+	ms_to_timespec(&tdiff, ms);
+	timeraddspec(&abstime, &tdiff);
+
+	while (42) {
+		mutex_lock(&usb_hotplug_lock);
+		/* Once something has arrived only take what is already queued */
+		while (!usb_hotplug_head && !(keep && usb_hotplug_narrived)) {
+			if (pthread_cond_timedwait(&usb_hotplug_cond, &usb_hotplug_lock, &abstime))
 				break;
 		}
+		event = usb_hotplug_head;
+		if (event) {
+			usb_hotplug_head = event->next;
+			if (!usb_hotplug_head)
+				usb_hotplug_tail = NULL;
+		}
+		mutex_unlock(&usb_hotplug_lock);
+
+		if (!event)
+			break;
+
+		if (!event->arrived) {
+			usb_hotplug_left(event->bus_number, event->device_address);
+			free(event);
+		} else if (!keep) {
+			libusb_unref_device(event->dev);
+			free(event);
+		} else {
+			applog(LOG_DEBUG, "USB hotplug: device %d:%d arrived",
+			       (int)event->bus_number, (int)event->device_address);
+			event->next = NULL;
+			if (usb_hotplug_arrived_tail)
+				usb_hotplug_arrived_tail->next = event;
+			else
+				usb_hotplug_arrived = event;
+			usb_hotplug_arrived_tail = event;
+			usb_hotplug_narrived++;
+		}
 	}
 
+	return usb_hotplug_narrived > 0;
+}
+
+/* As usb_detect_end() but only probing the devices usb_hotplug_wait() saw
+ * arrive */
+void usb_hotplug_end(void)
+{
+	struct usb_hotplug_event *event;
+	libusb_device **list;
+	int count = 0, i;
+
+	usb_detect_open = false;
+
+	list = cgcalloc(usb_hotplug_narrived + 1, sizeof(*list));
+	while ((event = usb_hotplug_arrived)) {
+		usb_hotplug_arrived = event->next;
+		list[count++] = event->dev;
+		free(event);
+	}
+	usb_hotplug_arrived_tail = NULL;
+	usb_hotplug_narrived = 0;
+
+	if (usb_detect_nreqs && count)
+		usb_detect_list(list, count);
+
+	for (i = 0; i < count; i++)
+		libusb_unref_device(list[i]);
+	free(list);
+
+	mutex_unlock(&usb_detect_pass_lock);
+}
+
+/* Queue a hotplug event as though libusb had reported it. Only a device
+ * that is on the bus can arrive. */
+bool usb_hotplug_inject(uint8_t bus, uint8_t address, bool arrived)
+{
+	libusb_device **list, *dev = NULL;
+	ssize_t count, i;
+
+	if (!usb_hotplug_events)
+		return false;
+
+	if (!arrived) {
+		usb_hotplug_queue(NULL, bus, address, false);
+		return true;
+	}
+
+	count = libusb_get_device_list(NULL, &list);
+	if (count < 0)
+		return false;
+	for (i = 0; i < count; i++) {
+		if (libusb_get_bus_number(list[i]) == bus &&
+		    libusb_get_device_address(list[i]) == address) {
+			dev = list[i];
+			usb_hotplug_queue(dev, bus, address, true);
+			break;
+		}
+	}
 	libusb_free_device_list(list, 1);
+
+	return dev != NULL;
 }
 
 #if DO_USB_STATS
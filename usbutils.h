@@ -392,6 +392,8 @@ struct cg_usb_info {
 
 	uint64_t tmo_count;
 	struct cg_usb_tmo usb_tmo[USB_TMOS];
+
+	double detect_ms;	// Time its driver took to probe and initialise it
 };
 
 #define ENUMERATION(a,b) a,
@@ -608,6 +610,17 @@ struct cgpu_info *usb_alloc_cgpu(struct device_drv *drv, int threads);
 struct cgpu_info *usb_free_cgpu(struct cgpu_info *cgpu);
 void usb_uninit(struct cgpu_info *cgpu);
 bool usb_init(struct cgpu_info *cgpu, struct libusb_device *dev, struct usb_find_devices *found);
+#define USB_DETECT_THREADS 4
+extern int opt_usb_detect_threads;
+void usb_detect_begin(void);
+void usb_detect_end(void);
+void usb_detect_turn(void);
+int usb_detect_option(int *option_offset);
+extern bool usb_hotplug_events;
+bool usb_hotplug_register(void);
+bool usb_hotplug_wait(int ms, bool keep);
+void usb_hotplug_end(void);
+bool usb_hotplug_inject(uint8_t bus, uint8_t address, bool arrived);
 void __usb_detect(struct device_drv *drv, struct cgpu_info *(*device_detect)(struct libusb_device *, struct usb_find_devices *),
 		  bool single);
 #define usb_detect(drv, cgpu) __usb_detect(drv, cgpu, false)
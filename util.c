@@ -22,12 +22,15 @@
 #endif
 #include <time.h>
 #include <errno.h>
+#include <limits.h>
 #include <unistd.h>
 #include <sys/types.h>
 #ifndef WIN32
 #include <fcntl.h>
 # ifdef __linux
 #  include <sys/prctl.h>
+#  include <sys/syscall.h>
+#  include <linux/futex.h>
 # endif
 # include <sys/socket.h>
 # include <netinet/in.h>
@@ -44,6 +47,9 @@
 #include "elist.h"
 #include "compat.h"
 #include "util.h"
+#include "uint256.h"
+#include "stratrec.h"
+#include "stratsrv.h"
 
 #define DEFAULT_SOCKWAIT 60
 #ifndef STRATUM_USER_AGENT
@@ -272,6 +278,8 @@ void *_cgmalloc(size_t size, const char *file, const char *func, const int line)
 	ret = malloc(size);
 	if (unlikely(!ret))
 		quit(1, "Failed to malloc size %d from %s %s:%d", (int)size, file, func, line);
+	if (unlikely(opt_alloc_stats))
+		allocprof_add(ret, size, file, func, line);
 	return ret;
 }
 
@@ -283,6 +291,8 @@ void *_cgcalloc(const size_t memb, size_t size, const char *file, const char *fu
 	ret = calloc(memb, size);
 	if (unlikely(!ret))
 		quit(1, "Failed to calloc memb %d size %d from %s %s:%d", (int)memb, (int)size, file, func, line);
+	if (unlikely(opt_alloc_stats))
+		allocprof_add(ret, memb * size, file, func, line);
 	return ret;
 }
 
@@ -291,17 +301,17 @@ void *_cgrealloc(void *ptr, size_t size, const char *file, const char *func, con
 	void *ret;
 
 	align_len(&size);
+	/* Forget ptr first since once it's been freed another thread may get it */
+	if (unlikely(opt_alloc_stats) && ptr)
+		allocprof_del(ptr);
 	ret = realloc(ptr, size);
 	if (unlikely(!ret))
 		quit(1, "Failed to realloc size %d from %s %s:%d", (int)size, file, func, line);
+	if (unlikely(opt_alloc_stats))
+		allocprof_add(ret, size, file, func, line);
 	return ret;
 }
 
-struct tq_ent {
-	void			*data;
-	struct list_head	q_node;
-};
-
 #ifdef HAVE_LIBCURL
 struct timeval nettime;
 
@@ -562,10 +572,10 @@ c_out:
 	return val;
 }
 
-json_t *json_rpc_call(CURL *curl, const char *url,
-		      const char *userpass, const char *rpc_req,
-		      bool probe, bool longpoll, int *rolltime,
-		      struct pool *pool, bool share)
+static json_t *__json_rpc_call(CURL *curl, const char *url,
+			       const char *userpass, const char *rpc_req,
+			       bool probe, bool longpoll, int *rolltime,
+			       struct pool *pool, bool share, struct gbt_txns *txns)
 {
 	long timeout = longpoll ? (60 * 60) : 60;
 	struct data_buffer all_data = {NULL, 0};
@@ -574,8 +584,8 @@ json_t *json_rpc_call(CURL *curl, const char *url,
 	char curl_err_str[CURL_ERROR_SIZE];
 	struct curl_slist *headers = NULL;
 	struct upload_buffer upload_data;
-	json_t *val, *err_val, *res_val;
-	bool probing = false;
+	json_t *val = NULL, *err_val, *res_val;
+	bool probing = false, streamed = false;
 	double byte_count;
 	json_error_t err;
 	int rc;
@@ -724,6 +734,12 @@ json_t *json_rpc_call(CURL *curl, const char *url,
 	pool->cgminer_pool_stats.canroll = hi.canroll;
 	pool->cgminer_pool_stats.hadexpire = hi.hadexpire;
 
+	/* Pull the transactions out of a block template before the parse so
+	 * that jansson doesn't build a tree for them. Don't when logging the
+	 * protocol since the response would be logged without them. */
+	if (txns && !opt_protocol)
+		streamed = gbt_stream_txns(all_data.buf, txns);
+
 	val = JSON_LOADS(all_data.buf, &err);
 	if (!val) {
 		applog(LOG_INFO, "JSON decode failed(%d): %s", err.line, err.text);
@@ -762,6 +778,10 @@ json_t *json_rpc_call(CURL *curl, const char *url,
 		goto err_out;
 	}
 
+	if (txns && !streamed &&
+	    !gbt_json_txns(json_object_get(res_val, "transactions"), txns))
+		goto err_out;
+
 	if (hi.reason) {
 		json_object_set_new(val, "reject-reason", json_string(hi.reason));
 		free(hi.reason);
@@ -774,6 +794,10 @@ json_t *json_rpc_call(CURL *curl, const char *url,
 	return val;
 
 err_out:
+	if (txns)
+		gbt_txns_free(txns);
+	if (val)
+		json_decref(val);
 	databuf_free(&all_data);
 	curl_slist_free_all(headers);
 	curl_easy_reset(curl);
@@ -782,6 +806,28 @@ err_out:
 	curl_easy_setopt(curl, CURLOPT_FRESH_CONNECT, 1);
 	return NULL;
 }
+
+json_t *json_rpc_call(CURL *curl, const char *url,
+		      const char *userpass, const char *rpc_req,
+		      bool probe, bool longpoll, int *rolltime,
+		      struct pool *pool, bool share)
+{
+	return __json_rpc_call(curl, url, userpass, rpc_req, probe, longpoll,
+			       rolltime, pool, share, NULL);
+}
+
+/* As json_rpc_call for getblocktemplate requests, returning the decoded
+ * transactions separately in txns, which the caller must gbt_txns_free. The
+ * "transactions" array of the returned json will usually be empty. */
+json_t *json_rpc_call_gbt(CURL *curl, const char *url,
+			  const char *userpass, const char *rpc_req,
+			  bool probe, bool longpoll, int *rolltime,
+			  struct pool *pool, struct gbt_txns *txns)
+{
+	memset(txns, 0, sizeof(*txns));
+	return __json_rpc_call(curl, url, userpass, rpc_req, probe, longpoll,
+			       rolltime, pool, false, txns);
+}
 #define PROXY_HTTP	CURLPROXY_HTTP
 #define PROXY_HTTP_1_0	CURLPROXY_HTTP_1_0
 #define PROXY_SOCKS4	CURLPROXY_SOCKS4
@@ -1086,26 +1132,9 @@ unsigned char *ser_string(char *s, int *slen)
 
 bool fulltest(const unsigned char *hash, const unsigned char *target)
 {
-	uint32_t *hash32 = (uint32_t *)hash;
-	uint32_t *target32 = (uint32_t *)target;
-	bool rc = true;
-	int i;
-
-	for (i = 28 / 4; i >= 0; i--) {
-		uint32_t h32tmp = le32toh(hash32[i]);
-		uint32_t t32tmp = le32toh(target32[i]);
+	bool rc = le256_le(hash, target);
 
-		if (h32tmp > t32tmp) {
-			rc = false;
-			break;
-		}
-		if (h32tmp < t32tmp) {
-			rc = true;
-			break;
-		}
-	}
-
-	if (opt_debug) {
+	if (unlikely(opt_debug)) {
 		unsigned char hash_swap[32], target_swap[32];
 		char *hash_str, *target_str;
 
@@ -1130,9 +1159,13 @@ bool fulltest(const unsigned char *hash, const unsigned char *target)
 struct thread_q *tq_new(void)
 {
 	struct thread_q *tq;
+	size_t i;
 
 	tq = cgcalloc(1, sizeof(*tq));
-	INIT_LIST_HEAD(&tq->q);
+	tq->cells = cgcalloc(TQ_SIZE, sizeof(*tq->cells));
+	tq->mask = TQ_SIZE - 1;
+	for (i = 0; i < TQ_SIZE; i++)
+		tq->cells[i].seq = i;
 	pthread_mutex_init(&tq->mutex, NULL);
 	pthread_cond_init(&tq->cond, NULL);
 
@@ -1141,29 +1174,63 @@ struct thread_q *tq_new(void)
 
 void tq_free(struct thread_q *tq)
 {
-	struct tq_ent *ent, *iter;
-
 	if (!tq)
 		return;
 
-	list_for_each_entry_safe(ent, iter, &tq->q, q_node) {
-		list_del(&ent->q_node);
-		free(ent);
-	}
-
 	pthread_cond_destroy(&tq->cond);
 	pthread_mutex_destroy(&tq->mutex);
 
+	free(tq->cells);
 	memset(tq, 0, sizeof(*tq));	/* poison */
 	free(tq);
 }
 
+#ifdef __linux
+static void tq_wait(struct thread_q *tq, int seq)
+{
+	while (__atomic_load_n(&tq->wake_seq, __ATOMIC_SEQ_CST) == seq)
+		syscall(SYS_futex, &tq->wake_seq, FUTEX_WAIT_PRIVATE, seq, NULL, NULL, 0);
+}
+
+static void tq_wake(struct thread_q *tq, bool all)
+{
+	syscall(SYS_futex, &tq->wake_seq, FUTEX_WAKE_PRIVATE, all ? INT_MAX : 1, NULL, NULL, 0);
+}
+#else /* __linux */
+static void tq_wait(struct thread_q *tq, int seq)
+{
+	mutex_lock(&tq->mutex);
+	while (__atomic_load_n(&tq->wake_seq, __ATOMIC_SEQ_CST) == seq)
+		pthread_cond_wait(&tq->cond, &tq->mutex);
+	mutex_unlock(&tq->mutex);
+}
+
+static void tq_wake(struct thread_q *tq, bool all)
+{
+	mutex_lock(&tq->mutex);
+	if (all)
+		pthread_cond_broadcast(&tq->cond);
+	else
+		pthread_cond_signal(&tq->cond);
+	mutex_unlock(&tq->mutex);
+}
+#endif /* __linux */
+
+/* Wake idle consumers after anything they may be waiting for has changed */
+static void tq_kick(struct thread_q *tq, bool all)
+{
+	__atomic_add_fetch(&tq->wake_seq, 1, __ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&tq->waiters, __ATOMIC_SEQ_CST))
+		tq_wake(tq, all);
+}
+
 static void tq_freezethaw(struct thread_q *tq, bool frozen)
 {
 	mutex_lock(&tq->mutex);
-	tq->frozen = frozen;
+	__atomic_store_n(&tq->frozen, frozen, __ATOMIC_SEQ_CST);
 	pthread_cond_signal(&tq->cond);
 	mutex_unlock(&tq->mutex);
+	tq_kick(tq, true);
 }
 
 void tq_freeze(struct thread_q *tq)
@@ -1176,55 +1243,136 @@ void tq_thaw(struct thread_q *tq)
 	tq_freezethaw(tq, false);
 }
 
-bool tq_push(struct thread_q *tq, void *data)
+static bool tq_enqueue(struct thread_q *tq, void *data)
 {
-	struct tq_ent *ent;
-	bool rc = true;
+	size_t pos = __atomic_load_n(&tq->enqueue_pos, __ATOMIC_RELAXED);
+	struct tq_cell *cell;
+	intptr_t dif;
 
-	ent = cgcalloc(1, sizeof(*ent));
-	ent->data = data;
-	INIT_LIST_HEAD(&ent->q_node);
+	while (42) {
+		cell = &tq->cells[pos & tq->mask];
+		dif = (intptr_t)__atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE) - (intptr_t)pos;
+		if (!dif) {
+			if (__atomic_compare_exchange_n(&tq->enqueue_pos, &pos, pos + 1, true,
+							__ATOMIC_RELAXED, __ATOMIC_RELAXED))
+				break;
+		} else if (dif < 0)
+			return false;
+		else
+			pos = __atomic_load_n(&tq->enqueue_pos, __ATOMIC_RELAXED);
+	}
+	cell->data = data;
+	__atomic_store_n(&cell->seq, pos + 1, __ATOMIC_RELEASE);
 
-	mutex_lock(&tq->mutex);
-	if (!tq->frozen) {
-		list_add_tail(&ent->q_node, &tq->q);
-	} else {
-		free(ent);
-		rc = false;
+	return true;
+}
+
+static void *tq_dequeue(struct thread_q *tq)
+{
+	size_t pos = __atomic_load_n(&tq->dequeue_pos, __ATOMIC_RELAXED);
+	struct tq_cell *cell;
+	intptr_t dif;
+	void *data;
+
+	while (42) {
+		cell = &tq->cells[pos & tq->mask];
+		dif = (intptr_t)__atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE) - (intptr_t)(pos + 1);
+		if (!dif) {
+			if (__atomic_compare_exchange_n(&tq->dequeue_pos, &pos, pos + 1, true,
+							__ATOMIC_RELAXED, __ATOMIC_RELAXED))
+				break;
+		} else if (dif < 0)
+			return NULL;
+		else
+			pos = __atomic_load_n(&tq->dequeue_pos, __ATOMIC_RELAXED);
 	}
-	pthread_cond_signal(&tq->cond);
-	mutex_unlock(&tq->mutex);
+	data = cell->data;
+	__atomic_store_n(&cell->seq, pos + tq->mask + 1, __ATOMIC_RELEASE);
 
-	return rc;
+	return data;
 }
 
-void *tq_pop(struct thread_q *tq)
+static int tq_depth(struct thread_q *tq)
 {
-	struct tq_ent *ent;
-	void *rval = NULL;
-	int rc;
+	return (int)(__atomic_load_n(&tq->enqueue_pos, __ATOMIC_RELAXED) -
+		     __atomic_load_n(&tq->dequeue_pos, __ATOMIC_RELAXED));
+}
 
-	mutex_lock(&tq->mutex);
-	if (!list_empty(&tq->q))
-		goto pop;
+/* Returns false only if the queue is frozen. A full queue makes the producer
+ * wait for a consumer to make space. */
+bool tq_push(struct thread_q *tq, void *data)
+{
+	int depth, max;
 
-	rc = pthread_cond_wait(&tq->cond, &tq->mutex);
-	if (rc)
-		goto out;
-	if (list_empty(&tq->q))
+	while (42) {
+		if (unlikely(__atomic_load_n(&tq->frozen, __ATOMIC_RELAXED)))
+			return false;
+		if (likely(tq_enqueue(tq, data)))
+			break;
+		cgsleep_ms(1);
+	}
+
+	__atomic_add_fetch(&tq->pushes, 1, __ATOMIC_RELAXED);
+	depth = tq_depth(tq);
+	max = __atomic_load_n(&tq->depth_max, __ATOMIC_RELAXED);
+	while (depth > max && !__atomic_compare_exchange_n(&tq->depth_max, &max, depth, true,
+							    __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+		;
+
+	tq_kick(tq, false);
+
+	return true;
+}
+
+/* Waits for an item if the queue is empty, and only returns NULL once the
+ * queue is frozen. A wakeup can arrive for an item whose producer hasn't
+ * finished publishing it, or for another consumer's item, so it waits again
+ * until it actually dequeues one. */
+void *tq_pop(struct thread_q *tq)
+{
+	struct timeval tv_start, tv_end;
+	void *rval;
+	int seq;
+
+	rval = tq_dequeue(tq);
+	if (rval)
 		goto out;
-pop:
-	ent = list_entry(tq->q.next, struct tq_ent, q_node);
-	rval = ent->data;
 
-	list_del(&ent->q_node);
-	free(ent);
+	__atomic_add_fetch(&tq->waiters, 1, __ATOMIC_SEQ_CST);
+	cgtime(&tv_start);
+	while (42) {
+		seq = __atomic_load_n(&tq->wake_seq, __ATOMIC_SEQ_CST);
+		/* Something may have been pushed before we were counted as
+		 * waiting or read the wake sequence */
+		rval = tq_dequeue(tq);
+		if (rval || __atomic_load_n(&tq->frozen, __ATOMIC_SEQ_CST))
+			break;
+		tq_wait(tq, seq);
+	}
+	cgtime(&tv_end);
+	__atomic_sub_fetch(&tq->waiters, 1, __ATOMIC_SEQ_CST);
+	__atomic_add_fetch(&tq->waits, 1, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&tq->wait_us, (uint64_t)us_tdiff(&tv_end, &tv_start), __ATOMIC_RELAXED);
 out:
-	mutex_unlock(&tq->mutex);
+	if (rval)
+		__atomic_add_fetch(&tq->pops, 1, __ATOMIC_RELAXED);
 
 	return rval;
 }
 
+/* Current and peak depth, how often a consumer had to wait and its average
+ * wait in ms */
+void tq_stats(struct thread_q *tq, int *depth, int *depth_max, uint64_t *waits, double *wait_avg)
+{
+	uint64_t wait_us;
+
+	*depth = tq_depth(tq);
+	*depth_max = __atomic_load_n(&tq->depth_max, __ATOMIC_RELAXED);
+	*waits = __atomic_load_n(&tq->waits, __ATOMIC_RELAXED);
+	wait_us = __atomic_load_n(&tq->wait_us, __ATOMIC_RELAXED);
+	*wait_avg = *waits ? (double)wait_us / (double)(*waits) / 1000.0 : 0;
+}
+
 int thr_info_create(struct thr_info *thr, pthread_attr_t *attr, void *(*start) (void *), void *arg)
 {
 	cgsem_init(&thr->sem);
@@ -1491,6 +1639,22 @@ void cgtimer_time(cgtimer_t *ts_start)
 	clock_gettime(CLOCK_MONOTONIC, ts_start);
 }
 
+#ifdef CLOCK_MONOTONIC_COARSE
+/* The monotonic time as of the last kernel tick. It's read straight from the
+ * vDSO data page without touching the clocksource so it's much cheaper than
+ * cgtime(), but only as accurate as the tick (1-10ms). It has the same base as
+ * cgtime() so the two can be compared, bearing in mind a coarse time can be up
+ * to a tick behind a precise one taken earlier. */
+void cgtime_coarse(struct timeval *tv)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+	timespec_to_val(tv, &ts);
+}
+#define HAVE_CGTIME_COARSE
+#endif
+
 static void nanosleep_abstime(struct timespec *ts_end)
 {
 	int ret;
@@ -1582,6 +1746,13 @@ void cgtimer_time(cgtimer_t *ts_start)
 }
 #endif /* __MACH__ */
 
+#ifndef HAVE_CGTIME_COARSE
+void cgtime_coarse(struct timeval *tv)
+{
+	cgtime(tv);
+}
+#endif
+
 #ifdef WIN32
 /* For windows we use the SystemTime stored as a LARGE_INTEGER as the cgtimer_t
  * typedef, allowing us to have sub-microsecond resolution for times, do simple
@@ -1840,6 +2011,7 @@ retry:
 		len -= sent;
 	}
 
+	stratrec_add(pool, STRATREC_SENT, s, ssent - 1);
 	pool->cgminer_pool_stats.times_sent++;
 	pool->cgminer_pool_stats.bytes_sent += ssent;
 	pool->cgminer_pool_stats.net_bytes_sent += ssent;
@@ -2008,6 +2180,7 @@ char *recv_line(struct pool *pool)
 	}
 	sret = strdup(tok);
 	len = strlen(sret);
+	stratrec_add(pool, STRATREC_RECV, sret, len);
 
 	/* Copy what's left in the buffer after the \n, including the
 	 * terminating \0 */
@@ -2350,6 +2523,7 @@ static bool parse_notify(struct pool *pool, json_t *val)
 	}
 
 	cg_wlock(&pool->data_lock);
+	__stratum_job_clear(pool);
 	free(pool->swork.job_id);
 	pool->swork.job_id = job_id;
 	if (memcmp(pool->prev_hash, prev_hash, 64)) {
@@ -2467,6 +2641,8 @@ out_unlock:
 	total_getworks++;
 	if (pool == current_pool())
 		opt_work_update = true;
+	if (ret)
+		stratsrv_notify(pool);
 out:
 	return ret;
 }
@@ -2509,8 +2685,10 @@ static void __suspend_stratum(struct pool *pool)
 {
 	clear_sockbuf(pool);
 	pool->stratum_active = pool->stratum_notify = false;
-	if (pool->sock)
+	if (pool->sock) {
 		CLOSESOCKET(pool->sock);
+		stratrec_add(pool, STRATREC_CLOSE, NULL, 0);
+	}
 	pool->sock = 0;
 }
 
@@ -3034,8 +3212,10 @@ static bool setup_stratum_socket(struct pool *pool)
 
 	mutex_lock(&pool->stratum_lock);
 	pool->stratum_active = false;
-	if (pool->sock)
+	if (pool->sock) {
 		CLOSESOCKET(pool->sock);
+		stratrec_add(pool, STRATREC_CLOSE, NULL, 0);
+	}
 	pool->sock = 0;
 	mutex_unlock(&pool->stratum_lock);
 
@@ -3162,6 +3342,7 @@ retry:
 
 	pool->sock = sockd;
 	keep_sockalive(sockd);
+	stratrec_add(pool, STRATREC_CONNECT, NULL, 0);
 	return true;
 }
 
@@ -3330,6 +3511,7 @@ rereceive:
 	}
 
 	cg_wlock(&pool->data_lock);
+	__stratum_job_clear(pool);
 	tmp = pool->sessionid;
 	pool->sessionid = sessionid;
 	free(tmp);
@@ -3364,6 +3546,7 @@ out:
 			* does not support it, or does not know how to respond to the
 			* presence of the sessionid parameter. */
 			cg_wlock(&pool->data_lock);
+			__stratum_job_clear(pool);
 			free(pool->sessionid);
 			free(pool->nonce1);
 			pool->sessionid = pool->nonce1 = NULL;
@@ -124,6 +124,7 @@ void thr_info_cancel(struct thr_info *thr);
 void cgcond_time(struct timespec *abstime);
 void cgtime_real(struct timeval *tv);
 void cgtime(struct timeval *tv);
+void cgtime_coarse(struct timeval *tv);
 void subtime(struct timeval *a, struct timeval *b);
 void addtime(struct timeval *a, struct timeval *b);
 bool time_more(struct timeval *a, struct timeval *b);